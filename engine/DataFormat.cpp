@@ -24,6 +24,26 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#ifdef _WINDOWS
+#define DATA_ATOMIC_INC(x) ::InterlockedIncrement((LONG volatile*)&(x))
+#define DATA_ATOMIC_DEC(x) ::InterlockedDecrement((LONG volatile*)&(x))
+#define DATA_BARRIER() MemoryBarrier()
+#else
+#define DATA_ATOMIC_INC(x) __sync_add_and_fetch(&(x),1)
+#define DATA_ATOMIC_DEC(x) __sync_sub_and_fetch(&(x),1)
+#define DATA_BARRIER() __sync_synchronize()
+#endif
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 1))
+#include <xmmintrin.h>
+#define RESAMP_SSE
+#endif
 
 namespace TelEngine {
 
@@ -42,6 +62,9 @@ static const FormatInfo s_formats[] = {
     FormatInfo("2*slin/32000", 1280, 10000, "audio", 32000, 2),
     FormatInfo("2*alaw", 160, 10000, "audio", 8000, 2),
     FormatInfo("2*mulaw", 160, 10000, "audio", 8000, 2),
+    FormatInfo("slin/11025", 882, 40000, "audio", 11025, 1, true),
+    FormatInfo("slin/22050", 882, 20000, "audio", 22050, 1, true),
+    FormatInfo("slin/44100", 882, 10000, "audio", 44100, 1, true),
     FormatInfo("gsm", 33, 20000),
     FormatInfo("ilbc20", 38, 20000),
     FormatInfo("ilbc30", 50, 30000),
@@ -89,13 +112,45 @@ static TranslatorCaps s_simpleCaps32k[] = {
     { 0, 0, 0 }
 };
 
+// costs are roughly proportional to the multiply-accumulate rate of the
+//  default quality filter, relative to the G.711 table conversions
 static TranslatorCaps s_resampCaps[] = {
     { s_formats+0, s_formats+3, 2 },
-    { s_formats+0, s_formats+6, 2 },
+    { s_formats+0, s_formats+6, 3 },
     { s_formats+3, s_formats+0, 2 },
-    { s_formats+3, s_formats+6, 2 },
-    { s_formats+6, s_formats+0, 2 },
-    { s_formats+6, s_formats+3, 2 },
+    { s_formats+3, s_formats+6, 3 },
+    { s_formats+6, s_formats+0, 4 },
+    { s_formats+6, s_formats+3, 3 },
+    { s_formats+9, s_formats+10, 4 },
+    { s_formats+9, s_formats+11, 6 },
+    { s_formats+10, s_formats+9, 4 },
+    { s_formats+10, s_formats+11, 6 },
+    { s_formats+11, s_formats+9, 8 },
+    { s_formats+11, s_formats+10, 6 },
+    { s_formats+0, s_formats+14, 3 },
+    { s_formats+0, s_formats+15, 3 },
+    { s_formats+0, s_formats+16, 5 },
+    { s_formats+3, s_formats+14, 3 },
+    { s_formats+3, s_formats+15, 3 },
+    { s_formats+3, s_formats+16, 5 },
+    { s_formats+6, s_formats+14, 4 },
+    { s_formats+6, s_formats+15, 4 },
+    { s_formats+6, s_formats+16, 5 },
+    { s_formats+14, s_formats+0, 3 },
+    { s_formats+14, s_formats+3, 3 },
+    { s_formats+14, s_formats+6, 4 },
+    { s_formats+14, s_formats+15, 3 },
+    { s_formats+14, s_formats+16, 5 },
+    { s_formats+15, s_formats+0, 4 },
+    { s_formats+15, s_formats+3, 3 },
+    { s_formats+15, s_formats+6, 4 },
+    { s_formats+15, s_formats+14, 3 },
+    { s_formats+15, s_formats+16, 5 },
+    { s_formats+16, s_formats+0, 6 },
+    { s_formats+16, s_formats+3, 5 },
+    { s_formats+16, s_formats+6, 5 },
+    { s_formats+16, s_formats+14, 5 },
+    { s_formats+16, s_formats+15, 5 },
     { 0, 0, 0 }
 };
 
@@ -140,6 +195,223 @@ private:
     ThreadedSource* m_source;
 };
 
+// Resolution in usec and size of the media clock timer wheel
+#define CLOCK_RES 1000
+#define CLOCK_SLOTS 128
+// Longest sleep of an idle media clock, in wheel slots
+#define CLOCK_IDLE 5
+// Maximum number of late ticks executed in one burst
+#define CLOCK_CATCHUP 5
+// Maximum number of shared media clock threads
+#define CLOCK_MAX 16
+
+class MediaClock;
+
+// Registration of a ThreadedSource on one of the media clocks
+class MediaTicker
+{
+public:
+    inline MediaTicker(ThreadedSource* source, MediaClock* clock, u_int64_t due)
+	: m_source(source), m_clock(clock), m_due(due), m_period(source->m_period),
+	  m_busy(false), m_slot(0), m_prev(0), m_next(0)
+	{ }
+    bool process(u_int64_t now);
+    void finish();
+    ThreadedSource* volatile m_source;
+    MediaClock* m_clock;
+    u_int64_t m_due;
+    unsigned int m_period;
+    bool m_busy;
+    unsigned int m_slot;
+    MediaTicker* m_prev;
+    MediaTicker* m_next;
+};
+
+// Thread that paces a set of data sources using a timer wheel
+class MediaClock : public Thread
+{
+public:
+    inline MediaClock()
+	: Thread("MediaClock",Thread::High), m_count(0),
+	  m_slot(Time::now() / CLOCK_RES)
+	{ ::memset(m_wheel,0,sizeof(m_wheel)); }
+    virtual void run();
+    void insert(MediaTicker* ticker);
+    void remove(MediaTicker* ticker);
+    static MediaClock* get(int maxClocks);
+    unsigned int m_count;
+private:
+    void runSlot(u_int64_t now);
+    MediaTicker* m_wheel[CLOCK_SLOTS];
+    u_int64_t m_slot;
+};
+
+// Protects all media clocks and tickers, never lock it before the refMutex
+static Mutex s_clockMutex;
+static MediaClock* s_clocks[CLOCK_MAX];
+static int s_clockCount = 0;
+
+// Run the ticks that are due, catch up if late
+bool MediaTicker::process(u_int64_t now)
+{
+    // hold a reference while ticking so the source is never destroyed under
+    //  us and stopping it never has to wait for the clock
+    RefObject::refMutex().lock();
+    ThreadedSource* src = m_source;
+    bool alive = src && src->refInternal();
+    RefObject::refMutex().unlock();
+    if (!src)
+	return true;
+    if (!alive)
+	return false;
+    bool ok = true;
+    unsigned int n = 0;
+    do {
+	if (n++ >= CLOCK_CATCHUP) {
+	    // too far behind - skip whole periods but keep the phase
+	    m_due += ((now - m_due) / m_period + 1) * m_period;
+	    DDebug(DebugMild,"MediaTicker skipped late ticks of source %p",src);
+	    break;
+	}
+	if (!src->tick(m_due)) {
+	    ok = false;
+	    break;
+	}
+	m_due += m_period;
+    } while (m_due <= now);
+    src->deref();
+    return ok;
+}
+
+// Detach from the source after the last tick
+void MediaTicker::finish()
+{
+    RefObject::refMutex().lock();
+    s_clockMutex.lock();
+    ThreadedSource* source = m_source;
+    m_source = 0;
+    s_clockMutex.unlock();
+    RefObject::refMutex().unlock();
+    // the source still points to us so it can't be destroyed before this
+    if (source)
+	source->cleanup();
+}
+
+// Add a ticker to the wheel, caller must hold the clock mutex
+void MediaClock::insert(MediaTicker* ticker)
+{
+    u_int64_t slot = ticker->m_due / CLOCK_RES;
+    if (slot < m_slot)
+	slot = m_slot;
+    ticker->m_slot = (unsigned int)(slot % CLOCK_SLOTS);
+    ticker->m_prev = 0;
+    ticker->m_next = m_wheel[ticker->m_slot];
+    if (ticker->m_next)
+	ticker->m_next->m_prev = ticker;
+    m_wheel[ticker->m_slot] = ticker;
+}
+
+// Remove a ticker from the wheel, caller must hold the clock mutex
+void MediaClock::remove(MediaTicker* ticker)
+{
+    if (ticker->m_prev)
+	ticker->m_prev->m_next = ticker->m_next;
+    else
+	m_wheel[ticker->m_slot] = ticker->m_next;
+    if (ticker->m_next)
+	ticker->m_next->m_prev = ticker->m_prev;
+    ticker->m_prev = ticker->m_next = 0;
+}
+
+// Pick the least loaded clock, start a new one if allowed, hold the clock mutex
+MediaClock* MediaClock::get(int maxClocks)
+{
+    if (maxClocks > CLOCK_MAX)
+	maxClocks = CLOCK_MAX;
+    MediaClock* clock = 0;
+    for (int i = 0; i < s_clockCount; i++) {
+	if (!clock || (s_clocks[i]->m_count < clock->m_count))
+	    clock = s_clocks[i];
+    }
+    if ((s_clockCount < maxClocks) && !(clock && !clock->m_count)) {
+	MediaClock* tmp = new MediaClock;
+	if (tmp->startup()) {
+	    s_clocks[s_clockCount++] = tmp;
+	    Debug(DebugInfo,"Started media clock %d of %d [%p]",s_clockCount,maxClocks,tmp);
+	    clock = tmp;
+	}
+	else
+	    delete tmp;
+    }
+    return clock;
+}
+
+void MediaClock::run()
+{
+    for (;;) {
+	u_int64_t now = Time::now();
+	u_int64_t last = now / CLOCK_RES;
+	s_clockMutex.lock();
+	// after a long stall don't walk the wheel more than once
+	if (last >= m_slot + CLOCK_SLOTS)
+	    m_slot = last - CLOCK_SLOTS + 1;
+	s_clockMutex.unlock();
+	while (m_slot <= last)
+	    runSlot(now);
+	// sleep until the next slot holding work but not too long
+	u_int64_t next = m_slot;
+	s_clockMutex.lock();
+	while ((next < m_slot + CLOCK_IDLE) && !m_wheel[next % CLOCK_SLOTS])
+	    next++;
+	s_clockMutex.unlock();
+	int64_t dly = next * CLOCK_RES - Time::now();
+	if (dly > 0)
+	    Thread::usleep((unsigned long)dly,true);
+	else
+	    Thread::check();
+    }
+}
+
+// Run all tickers due in the current slot
+void MediaClock::runSlot(u_int64_t now)
+{
+    MediaTicker* due = 0;
+    s_clockMutex.lock();
+    u_int64_t slot = m_slot++;
+    MediaTicker* t = m_wheel[slot % CLOCK_SLOTS];
+    while (t) {
+	MediaTicker* n = t->m_next;
+	// a ticker may be more than one wheel turn ahead
+	if (t->m_due / CLOCK_RES <= slot) {
+	    remove(t);
+	    t->m_busy = true;
+	    t->m_next = due;
+	    due = t;
+	}
+	t = n;
+    }
+    s_clockMutex.unlock();
+    if (!due)
+	return;
+    for (t = due; t; t = t->m_next) {
+	if (!t->process(now))
+	    t->finish();
+    }
+    s_clockMutex.lock();
+    while (due) {
+	t = due;
+	due = t->m_next;
+	t->m_busy = false;
+	if (t->m_source)
+	    insert(t);
+	else {
+	    m_count--;
+	    delete t;
+	}
+    }
+    s_clockMutex.unlock();
+}
+
 // slin/alaw/mulaw converter
 class SimpleTranslator : public DataTranslator
 {
@@ -161,6 +433,13 @@ public:
 		    sFmt >> "*";
 		    dFmt >> "*";
 		}
+		// both formats have the same rate, get rid of the rate suffix
+		int pos = sFmt.find('/');
+		if (pos > 0)
+		    sFmt = sFmt.substr(0,pos);
+		pos = dFmt.find('/');
+		if (pos > 0)
+		    dFmt = dFmt.substr(0,pos);
 		DataBlock oblock;
 		if (oblock.convert(data, sFmt, dFmt)) {
 		    if (tStamp == (unsigned long)-1) {
@@ -178,67 +457,51 @@ public:
 	}
 };
 
-// slin basic mono resampler
-class ResampTranslator : public DataTranslator
+// Polyphase windowed sinc filter bank, shared by all resamplers
+//  converting between the same pair of rates with the same quality
+class ResampFilter : public RefObject
 {
+public:
+    enum Quality {
+	Low = 0,
+	Medium = 1,
+	High = 2
+    };
+    virtual ~ResampFilter();
+    inline unsigned int interp() const
+	{ return m_interp; }
+    inline unsigned int decim() const
+	{ return m_decim; }
+    inline unsigned int taps() const
+	{ return m_taps; }
+    inline const float* phase(unsigned int p) const
+	{ return m_coefs + (p * m_taps); }
+    static ResampFilter* get(int sRate, int dRate, int quality);
+protected:
+    ResampFilter(unsigned int interp, unsigned int decim, int quality);
+    virtual void destroyed();
 private:
-    int m_sRate, m_dRate;
+    unsigned int m_interp;
+    unsigned int m_decim;
+    unsigned int m_taps;
+    int m_quality;
+    float* m_coefs;
+};
+
+// slin polyphase resampler for any rational ratio, any number of channels
+class ResampTranslator : public DataTranslator
+{
 public:
-    ResampTranslator(const DataFormat& sFormat, const DataFormat& dFormat)
-	: DataTranslator(sFormat,dFormat),
-	m_sRate(sFormat.sampleRate()), m_dRate(dFormat.sampleRate())
-	{ }
-    virtual void Consume(const DataBlock& data, unsigned long tStamp)
-	{
-	    unsigned int n = data.length();
-	    if (!n || (n & 1) || !m_sRate || !m_dRate || !ref())
-		return;
-	    n /= 2;
-	    DataSource* src = getTransSource();
-	    if (src) {
-		long delta = tStamp - m_timestamp;
-		short* s = (short*) data.data();
-		DataBlock oblock;
-		if (m_dRate > m_sRate) {
-		    int mul = m_dRate / m_sRate;
-		    // repeat the sample an integer number of times
-		    delta *= mul;
-		    oblock.assign(0,2*n*mul);
-		    short* d = (short*) oblock.data();
-		    while (n--) {
-			// TODO: smooth the data a little
-			short v = *s++;
-			for (int i = 0; i < mul; i++)
-			    *d++ = v;
-		    }
-		}
-		else {
-		    int div = m_sRate / m_dRate;
-		    // average an integer number of samples
-		    delta /= div;
-		    n /= div;
-		    oblock.assign(0,2*n);
-		    short* d = (short*) oblock.data();
-		    while (n--) {
-			// TODO: interpolate
-			int v = 0;
-			for (int i = 0; i < div; i++)
-			    v += *s++;
-			v /= div;
-			// saturate average result
-			if (v > 32767)
-			    v = 32767;
-			if (v < -32767)
-			    v = -32767;
-			*d++ = v;
-		    }
-		}
-		if (src->timeStamp() != invalidStamp())
-		    delta += src->timeStamp();
-		src->Forward(oblock, delta);
-	    }
-	    deref();
-	}
+    ResampTranslator(const DataFormat& sFormat, const DataFormat& dFormat);
+    virtual ~ResampTranslator();
+    virtual void Consume(const DataBlock& data, unsigned long tStamp);
+private:
+    ResampFilter* m_filter;
+    unsigned int m_chans;
+    unsigned int m_pos;
+    int64_t m_tsRest;
+    float* m_buf;
+    unsigned int m_bufLen;
 };
 
 // slin simple mono-stereo converter
@@ -346,6 +609,53 @@ private:
     const TranslatorCaps* m_capabilities;
 };
 
+// Immutable snapshot of the best conversion between any two known formats
+//  each reader holds a reference so it lives as long as anyone uses it
+class TranslatorTable : public RefObject
+{
+public:
+    enum {
+	MaxLength = 4
+    };
+    struct Entry {
+	TranslatorFactory* factory;
+	int cost;
+	int lenCost[MaxLength];
+    };
+    TranslatorTable(const ObjList& factories);
+    virtual ~TranslatorTable();
+    int index(const FormatInfo* info) const;
+    inline unsigned int count() const
+	{ return m_count; }
+    inline const FormatInfo* format(unsigned int idx) const
+	{ return m_formats[idx]; }
+    inline const Entry& entry(unsigned int src, unsigned int dest) const
+	{ return m_entries[src * m_count + dest]; }
+    bool matches(unsigned int src, unsigned int dest, int maxCost, unsigned int maxLen) const;
+private:
+    unsigned int m_count;
+    const FormatInfo** m_formats;
+    unsigned int* m_sorted;
+    Entry* m_entries;
+};
+
+// Immutable list of the consumers of a source, kept by each Forward using it
+class DataFanout
+{
+public:
+    DataFanout(const ObjList& consumers);
+    ~DataFanout();
+    inline void ref()
+	{ DATA_ATOMIC_INC(m_refs); }
+    inline void deref()
+	{ if (!DATA_ATOMIC_DEC(m_refs)) delete this; }
+    inline DataConsumer** consumers() const
+	{ return m_consumers; }
+private:
+    DataConsumer** m_consumers;
+    volatile int m_refs;
+};
+
 };
 
 using namespace TelEngine;
@@ -454,17 +764,23 @@ void* DataConsumer::getObject(const String& name) const
 }
 
 void DataConsumer::Consume(const DataBlock& data, unsigned long tStamp, DataSource* source)
+{
+    if (!adjustStamp(tStamp,source))
+	return;
+    u_int64_t tsTime = Time::now();
+    Consume(data,tStamp);
+    consumed(tStamp,tsTime);
+}
+
+bool DataConsumer::adjustStamp(unsigned long& tStamp, const DataSource* source) const
 {
     if (source == m_override)
 	tStamp += m_overrideTsDelta;
     else if (m_override || (source != m_source))
-	return;
+	return false;
     else
 	tStamp += m_regularTsDelta;
-    u_int64_t tsTime = Time::now();
-    Consume(data,tStamp);
-    m_timestamp = tStamp;
-    m_lastTsTime = tsTime;
+    return true;
 }
 
 bool DataConsumer::synchronize(DataSource* source)
@@ -504,19 +820,68 @@ bool DataConsumer::synchronize(DataSource* source)
 }
 
 
+DataFanout::DataFanout(const ObjList& consumers)
+    : m_refs(1)
+{
+    m_consumers = new DataConsumer*[consumers.count()+1];
+    unsigned int n = 0;
+    for (ObjList* l = consumers.skipNull(); l; l = l->skipNext()) {
+	DataConsumer* c = static_cast<DataConsumer*>(l->get());
+	if (c->ref())
+	    m_consumers[n++] = c;
+    }
+    m_consumers[n] = 0;
+}
+
+DataFanout::~DataFanout()
+{
+    for (DataConsumer** c = m_consumers; *c; c++)
+	(*c)->deref();
+    delete[] m_consumers;
+}
+
+
+static volatile int s_dropped = 0;
+
+unsigned int DataSource::dropped()
+{
+    return s_dropped;
+}
+
 void DataSource::Forward(const DataBlock& data, unsigned long tStamp)
 {
-    Lock lock(m_mutex,100000);
-    // we DON'T refcount here, we rely on the mutex to keep us safe
-    if (!(lock.mutex() && alive())) {
+    if (!alive()) {
+	DATA_ATOMIC_INC(s_dropped);
 	DDebug(DebugInfo,"Forwarding on a dead DataSource! [%p]",this);
 	return;
     }
+    // only the timestamps and taking a reference to the consumer list are
+    //  locked, consumers are called without any lock held
+    m_fanoutMutex.lock();
+    tStamp = advanceInternal(data.length(),tStamp);
+    DataFanout* fanout = m_fanout;
+    if (fanout)
+	fanout->ref();
+    m_fanoutMutex.unlock();
+    if (!fanout)
+	return;
+    for (DataConsumer** c = fanout->consumers(); *c; c++)
+	(*c)->Consume(data,tStamp,this);
+    fanout->deref();
+}
 
+unsigned long DataSource::advance(unsigned int len, unsigned long tStamp)
+{
+    Lock lock(m_fanoutMutex);
+    return advanceInternal(len,tStamp);
+}
+
+// Update the timestamps for a data block, caller must hold the fanout mutex
+unsigned long DataSource::advanceInternal(unsigned int len, unsigned long tStamp)
+{
     // try to evaluate amount of samples in this packet
     const FormatInfo* f = m_format.getInfo();
-    unsigned long nSamp = f ? f->guessSamples(data.length()) : 0;
-
+    unsigned long nSamp = f ? f->guessSamples(len) : 0;
     // if no timestamp provided - try to use next expected
     if (tStamp == invalidStamp())
 	tStamp = m_nextStamp;
@@ -526,13 +891,22 @@ void DataSource::Forward(const DataBlock& data, unsigned long tStamp)
 	    m_timestamp,nSamp,this);
 	tStamp = m_timestamp + nSamp;
     }
-    ObjList *l = m_consumers.skipNull();
-    for (; l; l=l->skipNext()) {
-	DataConsumer *c = static_cast<DataConsumer *>(l->get());
-	c->Consume(data,tStamp,this);
-    }
     m_timestamp = tStamp;
     m_nextStamp = nSamp ? (tStamp + nSamp) : invalidStamp();
+    return tStamp;
+}
+
+// Replace the consumer list used by Forward, caller must hold the mutex
+//  the old list is freed by whoever drops the last reference to it
+void DataSource::publish()
+{
+    DataFanout* fanout = m_consumers.skipNull() ? new DataFanout(m_consumers) : 0;
+    m_fanoutMutex.lock();
+    DataFanout* old = m_fanout;
+    m_fanout = fanout;
+    m_fanoutMutex.unlock();
+    if (old)
+	old->deref();
 }
 
 bool DataSource::attach(DataConsumer* consumer, bool override)
@@ -558,6 +932,9 @@ bool DataSource::attach(DataConsumer* consumer, bool override)
     }
     consumer->synchronize(this);
     m_consumers.append(consumer);
+    publish();
+    consumer->attached(true);
+    attached(true);
     return true;
 }
 
@@ -570,9 +947,10 @@ bool DataSource::detach(DataConsumer* consumer)
 	return false;
     }
     DDebug(DebugAll,"DataSource [%p] detaching consumer [%p]",this,consumer);
-    // lock the source to prevent races with the Forward method
     m_mutex.lock();
     bool ok = detachInternal(consumer);
+    if (ok)
+	publish();
     m_mutex.unlock();
     deref();
     return ok;
@@ -588,6 +966,8 @@ bool DataSource::detachInternal(DataConsumer* consumer)
 	    temp->m_source = 0;
 	if (temp->m_override == this)
 	    temp->m_override = 0;
+	temp->attached(false);
+	attached(false);
 	temp->deref();
 	return true;
     }
@@ -603,10 +983,10 @@ void DataSource::destroyed()
 
 void DataSource::clear()
 {
-    // keep the source locked to prevent races with the Forward method
     m_mutex.lock();
     while (detachInternal(static_cast<DataConsumer*>(m_consumers.get())))
 	;
+    publish();
     m_mutex.unlock();
 }
 
@@ -617,8 +997,10 @@ void DataSource::synchronize(unsigned long tStamp)
 	DDebug(DebugInfo,"Synchronizing on a dead DataSource! [%p]",this);
 	return;
     }
+    m_fanoutMutex.lock();
     m_timestamp = tStamp;
     m_nextStamp = invalidStamp();
+    m_fanoutMutex.unlock();
     ObjList *l = m_consumers.skipNull();
     for (; l; l=l->skipNext()) {
 	DataConsumer *c = static_cast<DataConsumer *>(l->get());
@@ -946,7 +1328,7 @@ void ThreadedSource::destroyed()
     if (m_asyncDelete && m_thread)
 	Debug(DebugFail,"ThreadedSource destroyed holding thread %p [%p]",m_thread,this);
     m_asyncDelete = false;
-    if (m_thread)
+    if (m_thread || m_ticker)
 	stop();
     DataSource::destroyed();
 }
@@ -954,6 +1336,8 @@ void ThreadedSource::destroyed()
 bool ThreadedSource::start(const char* name, Thread::Priority prio)
 {
     Lock lock(mutex());
+    if (m_ticker)
+	return true;
     if (!m_thread) {
 	ThreadedSourcePrivate* thread = new ThreadedSourcePrivate(this,name,prio);
 	if (thread->startup()) {
@@ -966,8 +1350,53 @@ bool ThreadedSource::start(const char* name, Thread::Priority prio)
     return m_thread->running();
 }
 
+bool ThreadedSource::startClock(unsigned int period, const char* name)
+{
+    if (!period)
+	return false;
+    int clocks = Engine::config().getIntValue("general","mediaclocks",2);
+    if (clocks <= 0) {
+	m_period = period;
+	return start(name,Thread::High);
+    }
+    Lock lock(mutex());
+    if (m_thread)
+	return m_thread->running();
+    if (m_ticker)
+	return true;
+    m_period = period;
+    Lock lck(RefObject::refMutex());
+    Lock lck2(s_clockMutex);
+    MediaClock* clock = MediaClock::get(clocks);
+    if (!clock)
+	return false;
+    m_ticker = new MediaTicker(this,clock,Time::now());
+    clock->m_count++;
+    clock->insert(m_ticker);
+    return true;
+}
+
 void ThreadedSource::stop()
 {
+    if (m_ticker) {
+	RefObject::refMutex().lock();
+	s_clockMutex.lock();
+	MediaTicker* tmp = m_ticker;
+	m_ticker = 0;
+	if (tmp) {
+	    if (tmp->m_source == this)
+		tmp->m_source = 0;
+	    // a busy ticker holds a reference for its tick so it can't be
+	    //  ticking us now, its clock frees it when the batch is done
+	    if (!tmp->m_busy) {
+		tmp->m_clock->remove(tmp);
+		tmp->m_clock->m_count--;
+		delete tmp;
+	    }
+	}
+	s_clockMutex.unlock();
+	RefObject::refMutex().unlock();
+    }
     Lock lock(mutex());
     if (!m_thread)
 	return;
@@ -989,6 +1418,7 @@ void ThreadedSource::cleanup()
 {
     Lock lock(RefObject::refMutex());
     m_thread = 0;
+    m_ticker = 0;
     if (m_asyncDelete && !alive()) {
 	lock.drop();
 	zeroRefs();
@@ -1002,11 +1432,32 @@ bool ThreadedSource::zeroRefsTest()
 	m_thread = 0;
 	return false;
     }
+    // a clocked source is destroyed by the clock thread after its last tick
+    if (m_asyncDelete && m_ticker)
+	return false;
     // if async not possible make sure we are set up for synchronous destruction
     m_asyncDelete = false;
     return DataSource::zeroRefsTest();
 }
 
+void ThreadedSource::run()
+{
+    u_int64_t tpos = Time::now();
+    while (alive() && tick(tpos)) {
+	tpos += m_period;
+	int64_t dly = tpos - Time::now();
+	if (dly > 0)
+	    Thread::usleep((unsigned long)dly,true);
+	else
+	    Thread::check();
+    }
+}
+
+bool ThreadedSource::tick(u_int64_t when)
+{
+    return false;
+}
+
 Thread* ThreadedSource::thread() const
 {
     return m_thread;
@@ -1015,7 +1466,7 @@ Thread* ThreadedSource::thread() const
 bool ThreadedSource::running() const
 {
     Lock lock(RefObject::refMutex());
-    return m_thread && m_thread->running();
+    return m_ticker || (m_thread && m_thread->running());
 }
 
 
@@ -1083,10 +1534,13 @@ Mutex DataTranslator::s_mutex(true);
 ObjList DataTranslator::s_factories;
 unsigned int DataTranslator::s_maxChain = 3;
 static ObjList s_compose;
+// current snapshot, replaced when factories are installed or removed
+static TranslatorTable* s_table = 0;
+// protects only the s_table pointer and taking references to it
+static Mutex s_tableMutex;
 static SimpleFactory s_sFactory(s_simpleCaps);
 static SimpleFactory s_sFactory16k(s_simpleCaps16k);
 static SimpleFactory s_sFactory32k(s_simpleCaps32k);
-// FIXME
 static ResampFactory s_rFactory;
 static StereoFactory s_stereoFactory;
 
@@ -1099,6 +1553,25 @@ void DataTranslator::setMaxChain(unsigned int maxChain)
     s_maxChain = maxChain;
 }
 
+// Drop the current conversion table, caller must hold DataTranslator::s_mutex
+//  the table is destroyed when the last reader releases it
+static void retireTable()
+{
+    s_tableMutex.lock();
+    TranslatorTable* t = s_table;
+    s_table = 0;
+    s_tableMutex.unlock();
+    if (t)
+	t->deref();
+}
+
+// Get a reference to the current conversion table, if any
+static void currentTable(RefPointer<TranslatorTable>& table)
+{
+    Lock lock(s_tableMutex);
+    table = s_table;
+}
+
 void DataTranslator::install(TranslatorFactory* factory)
 {
     if (!factory)
@@ -1108,6 +1581,7 @@ void DataTranslator::install(TranslatorFactory* factory)
 	return;
     s_factories.append(factory)->setDelete(false);
     s_compose.append(factory)->setDelete(false);
+    retireTable();
 }
 
 void DataTranslator::compose()
@@ -1118,6 +1592,13 @@ void DataTranslator::compose()
 	    break;
 	compose(factory);
     }
+    if (s_table)
+	return;
+    // fully built before the mutex release makes it visible to readers
+    TranslatorTable* t = new TranslatorTable(s_factories);
+    s_tableMutex.lock();
+    s_table = t;
+    s_tableMutex.unlock();
 }
 
 void DataTranslator::compose(TranslatorFactory* factory)
@@ -1200,35 +1681,39 @@ void DataTranslator::uninstall(TranslatorFactory* factory)
     ListIterator iter(s_factories);
     while (TranslatorFactory* f = static_cast<TranslatorFactory*>(iter.get()))
 	f->removed(factory);
+    retireTable();
     s_mutex.unlock();
 }
 
+// Retrieve the current conversion table, composing factories if needed
+#define GET_TABLE(t) \
+    RefPointer<TranslatorTable> t; \
+    currentTable(t); \
+    if (!t) { \
+	Lock lck(s_mutex); \
+	compose(); \
+	currentTable(t); \
+    }
+
 ObjList* DataTranslator::srcFormats(const DataFormat& dFormat, int maxCost, unsigned int maxLen, ObjList* lst)
 {
     const FormatInfo* fi = dFormat.getInfo();
     if (!fi)
 	return lst;
-    s_mutex.lock();
-    compose();
-    ObjList* l = s_factories.skipNull();
-    for (; l; l=l->skipNext()) {
-	TranslatorFactory* f = static_cast<TranslatorFactory*>(l->get());
-	if (maxLen && (f->length() > maxLen))
+    GET_TABLE(t);
+    int dest = t->index(fi);
+    if (dest < 0)
+	return lst;
+    for (unsigned int src = 0; src < t->count(); src++) {
+	if (!t->matches(src,dest,maxCost,maxLen))
 	    continue;
-	const TranslatorCaps* caps = f->getCapabilities();
-	for (; caps && caps->src && caps->dest; caps++) {
-	    if (caps->dest == fi) {
-		if ((maxCost >= 0) && (caps->cost > maxCost))
-		    continue;
-		if (!lst)
-		    lst = new ObjList;
-		else if (lst->find(caps->src->name))
-		    continue;
-		lst->append(new String(caps->src->name));
-	    }
-	}
+	const char* name = t->format(src)->name;
+	if (!lst)
+	    lst = new ObjList;
+	else if (lst->find(name))
+	    continue;
+	lst->append(new String(name));
     }
-    s_mutex.unlock();
     return lst;
 }
 
@@ -1237,52 +1722,44 @@ ObjList* DataTranslator::destFormats(const DataFormat& sFormat, int maxCost, uns
     const FormatInfo* fi = sFormat.getInfo();
     if (!fi)
 	return lst;
-    s_mutex.lock();
-    compose();
-    ObjList* l = s_factories.skipNull();
-    for (; l; l=l->skipNext()) {
-	TranslatorFactory* f = static_cast<TranslatorFactory*>(l->get());
-	if (maxLen && (f->length() > maxLen))
+    GET_TABLE(t);
+    int src = t->index(fi);
+    if (src < 0)
+	return lst;
+    for (unsigned int dest = 0; dest < t->count(); dest++) {
+	if (!t->matches(src,dest,maxCost,maxLen))
 	    continue;
-	const TranslatorCaps* caps = f->getCapabilities();
-	for (; caps && caps->src && caps->dest; caps++) {
-	    if (caps->src == fi) {
-		if ((maxCost >= 0) && (caps->cost > maxCost))
-		    continue;
-		if (!lst)
-		    lst = new ObjList;
-		else if (lst->find(caps->dest->name))
-		    continue;
-		lst->append(new String(caps->dest->name));
-	    }
-	}
+	const char* name = t->format(dest)->name;
+	if (!lst)
+	    lst = new ObjList;
+	else if (lst->find(name))
+	    continue;
+	lst->append(new String(name));
     }
-    s_mutex.unlock();
     return lst;
 }
 
 // helper function to avoid duplicating large amounts of code
-static void mergeOne(ObjList*& lst, const ObjList* formats, const DataFormat& fmt, const FormatInfo* fi, bool sameRate, bool sameChans)
+static void mergeOne(ObjList*& lst, const ObjList* formats, const TranslatorTable* t, const FormatInfo* fo, int io, const FormatInfo* fi, bool sameRate, bool sameChans)
 {
-    if (!fi)
+    if (!fi || (fo == fi))
 	return;
-    const DataFormat fmti(fi);
-    if (lst && lst->find(fmti))
+    if (sameRate && (fo->sampleRate != fi->sampleRate))
 	return;
-    if (formats->find(fmti))
+    if (sameChans && (fo->numChannels != fi->numChannels))
 	return;
-    const FormatInfo* fo = fmt.getInfo();
-    if (fo == fi)
+    // check the table first, it's much cheaper than searching the lists
+    int ii = t->index(fi);
+    if ((ii < 0) || (t->entry(io,ii).cost < 0) || (t->entry(ii,io).cost < 0))
 	return;
-    if (sameRate && (fo->sampleRate != fi->sampleRate))
+    const String name(fi->name);
+    if (lst && lst->find(name))
 	return;
-    if (sameChans && (fo->numChannels != fi->numChannels))
+    if (formats->find(name))
 	return;
-    if (DataTranslator::canConvert(fmt,fmti)) {
-	if (!lst)
-	    lst = new ObjList;
-	lst->append(new String(fmti));
-    }
+    if (!lst)
+	lst = new ObjList;
+    lst->append(new String(name));
 }
 
 ObjList* DataTranslator::allFormats(const ObjList* formats, bool existing, bool sameRate, bool sameChans)
@@ -1290,8 +1767,7 @@ ObjList* DataTranslator::allFormats(const ObjList* formats, bool existing, bool
     if (!formats)
 	return 0;
     ObjList* lst = 0;
-    s_mutex.lock();
-    compose();
+    GET_TABLE(t);
     const ObjList* fmts;
     if (existing) {
 	// put existing formats first
@@ -1314,16 +1790,17 @@ ObjList* DataTranslator::allFormats(const ObjList* formats, bool existing, bool
 	const FormatInfo* fo = FormatRepository::getFormat(*fmt);
 	if (!fo)
 	    continue;
-	const DataFormat fmto(fo);
+	int io = t->index(fo);
+	if (io < 0)
+	    continue;
 
 	// search in the static list first
 	for (unsigned int i = 0; i < (sizeof(s_formats)/sizeof(FormatInfo)); i++)
-	    mergeOne(lst,formats,fmto,s_formats+i,sameRate,sameChans);
+	    mergeOne(lst,formats,t,fo,io,s_formats+i,sameRate,sameChans);
 	// then try the installed formats
 	for (flist* l = s_flist; l; l = l->next)
-	    mergeOne(lst,formats,fmto,l->info,sameRate,sameChans);
+	    mergeOne(lst,formats,t,fo,io,l->info,sameRate,sameChans);
     }
-    s_mutex.unlock();
     return lst;
 }
 
@@ -1345,9 +1822,12 @@ bool DataTranslator::canConvert(const DataFormat& fmt1, const DataFormat& fmt2)
     const FormatInfo* fi2 = fmt2.getInfo();
     if (!(fi1 && fi2))
 	return false;
-    Lock lock(s_mutex);
-    compose();
-    return canConvert(fi1,fi2);
+    GET_TABLE(t);
+    int i1 = t->index(fi1);
+    int i2 = t->index(fi2);
+    if ((i1 < 0) || (i2 < 0))
+	return false;
+    return (t->entry(i1,i2).cost >= 0) && (t->entry(i2,i1).cost >= 0);
 }
 
 bool DataTranslator::canConvert(const FormatInfo* fmt1, const FormatInfo* fmt2)
@@ -1373,26 +1853,16 @@ bool DataTranslator::canConvert(const FormatInfo* fmt1, const FormatInfo* fmt2)
 
 int DataTranslator::cost(const DataFormat& sFormat, const DataFormat& dFormat)
 {
-    int c = -1;
     const FormatInfo* src = sFormat.getInfo();
     const FormatInfo* dest = dFormat.getInfo();
     if (!(src && dest))
-	return c;
-    s_mutex.lock();
-    compose();
-    ObjList* l = s_factories.skipNull();
-    for (; l; l=l->skipNext()) {
-	TranslatorFactory* f = static_cast<TranslatorFactory*>(l->get());
-	const TranslatorCaps* caps = f->getCapabilities();
-	for (; caps && caps->src && caps->dest; caps++) {
-	    if ((c == -1) || (c > caps->cost)) {
-		if ((caps->src == src) && (caps->dest == dest))
-		    c = caps->cost;
-	    }
-	}
-    }
-    s_mutex.unlock();
-    return c;
+	return -1;
+    GET_TABLE(t);
+    int i1 = t->index(src);
+    int i2 = t->index(dest);
+    if ((i1 < 0) || (i2 < 0))
+	return -1;
+    return t->entry(i1,i2).cost;
 }
 
 DataTranslator* DataTranslator::create(const DataFormat& sFormat, const DataFormat& dFormat)
@@ -1403,19 +1873,32 @@ DataTranslator* DataTranslator::create(const DataFormat& sFormat, const DataForm
     }
 
     DataTranslator *trans = 0;
+    TranslatorFactory* f = 0;
 
+    // hold the lock while using factories as they can be removed anytime
     s_mutex.lock();
     compose();
-    ObjList *l = s_factories.skipNull();
-    for (; l; l=l->skipNext()) {
-	TranslatorFactory* f = static_cast<TranslatorFactory*>(l->get());
-	trans = f->create(sFormat,dFormat);
-	if (trans) {
-	    Debug(DebugAll,"Created DataTranslator %p for '%s' -> '%s' by factory %p (len=%u)",
-		trans,sFormat.c_str(),dFormat.c_str(),f,f->length());
-	    break;
+    const TranslatorTable* t = s_table;
+    int i1 = t->index(sFormat.getInfo());
+    int i2 = t->index(dFormat.getInfo());
+    if ((i1 >= 0) && (i2 >= 0)) {
+	f = t->entry(i1,i2).factory;
+	if (f)
+	    trans = f->create(sFormat,dFormat);
+	if (f && !trans) {
+	    // the best factory failed, try any other that can do it
+	    ObjList *l = s_factories.skipNull();
+	    for (; l; l=l->skipNext()) {
+		f = static_cast<TranslatorFactory*>(l->get());
+		trans = f->create(sFormat,dFormat);
+		if (trans)
+		    break;
+	    }
 	}
     }
+    if (trans)
+	Debug(DebugAll,"Created DataTranslator %p for '%s' -> '%s' by factory %p (len=%u)",
+	    trans,sFormat.c_str(),dFormat.c_str(),f,f->length());
     s_mutex.unlock();
 
     if (!trans)
@@ -1634,4 +2117,343 @@ DataTranslator* ChainedFactory::create(const DataFormat& sFormat, const DataForm
     return trans2;
 }
 
+TranslatorTable::TranslatorTable(const ObjList& factories)
+    : m_count(0), m_formats(0), m_sorted(0), m_entries(0)
+{
+    // collect distinct formats in order of their first appearance
+    unsigned int max = 0;
+    const ObjList* l = factories.skipNull();
+    for (; l; l = l->skipNext()) {
+	const TranslatorCaps* caps = static_cast<TranslatorFactory*>(l->get())->getCapabilities();
+	for (; caps && caps->src && caps->dest; caps++)
+	    max += 2;
+    }
+    m_formats = new const FormatInfo*[max ? max : 1];
+    for (l = factories.skipNull(); l; l = l->skipNext()) {
+	const TranslatorCaps* caps = static_cast<TranslatorFactory*>(l->get())->getCapabilities();
+	for (; caps && caps->src && caps->dest; caps++) {
+	    const FormatInfo* fmts[2] = { caps->src, caps->dest };
+	    for (int j = 0; j < 2; j++) {
+		unsigned int i = 0;
+		while ((i < m_count) && (m_formats[i] != fmts[j]))
+		    i++;
+		if (i == m_count)
+		    m_formats[m_count++] = fmts[j];
+	    }
+	}
+    }
+    // index sorted by address for fast lookups
+    m_sorted = new unsigned int[m_count ? m_count : 1];
+    unsigned int i;
+    for (i = 0; i < m_count; i++) {
+	unsigned int j = i;
+	for (; j && (m_formats[m_sorted[j-1]] > m_formats[i]); j--)
+	    m_sorted[j] = m_sorted[j-1];
+	m_sorted[j] = i;
+    }
+    unsigned int n = m_count * m_count;
+    m_entries = new Entry[n ? n : 1];
+    for (i = 0; i < n; i++) {
+	m_entries[i].factory = 0;
+	m_entries[i].cost = -1;
+	for (int j = 0; j < MaxLength; j++)
+	    m_entries[i].lenCost[j] = -1;
+    }
+    // keep the cheapest factory for each pair, first one wins on equal cost
+    for (l = factories.skipNull(); l; l = l->skipNext()) {
+	TranslatorFactory* f = static_cast<TranslatorFactory*>(l->get());
+	unsigned int len = f->length();
+	if (len < 1)
+	    len = 1;
+	if (len > MaxLength)
+	    len = MaxLength;
+	const TranslatorCaps* caps = f->getCapabilities();
+	for (; caps && caps->src && caps->dest; caps++) {
+	    Entry& e = m_entries[index(caps->src) * m_count + index(caps->dest)];
+	    if ((e.cost < 0) || (caps->cost < e.cost)) {
+		e.cost = caps->cost;
+		e.factory = f;
+	    }
+	    int& c = e.lenCost[len-1];
+	    if ((c < 0) || (caps->cost < c))
+		c = caps->cost;
+	}
+    }
+    DDebug(DebugAll,"Built translator table with %u formats [%p]",m_count,this);
+}
+
+TranslatorTable::~TranslatorTable()
+{
+    delete[] m_entries;
+    delete[] m_sorted;
+    delete[] m_formats;
+}
+
+int TranslatorTable::index(const FormatInfo* info) const
+{
+    if (!info)
+	return -1;
+    unsigned int lo = 0;
+    unsigned int hi = m_count;
+    while (lo < hi) {
+	unsigned int mid = (lo + hi) / 2;
+	const FormatInfo* f = m_formats[m_sorted[mid]];
+	if (f == info)
+	    return m_sorted[mid];
+	if (f < info)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return -1;
+}
+
+bool TranslatorTable::matches(unsigned int src, unsigned int dest, int maxCost, unsigned int maxLen) const
+{
+    const Entry& e = entry(src,dest);
+    if (e.cost < 0)
+	return false;
+    if ((maxLen == 0) || (maxLen > MaxLength))
+	maxLen = MaxLength;
+    for (unsigned int i = 0; i < maxLen; i++) {
+	int c = e.lenCost[i];
+	if ((c >= 0) && ((maxCost < 0) || (c <= maxCost)))
+	    return true;
+    }
+    return false;
+}
+
+
+static const TokenDict s_resampQuality[] = {
+    { "low", ResampFilter::Low },
+    { "medium", ResampFilter::Medium },
+    { "high", ResampFilter::High },
+    { 0, 0 }
+};
+
+// taps per phase, Kaiser window beta and passband fraction for each quality
+static const struct {
+    unsigned int taps;
+    double beta;
+    double rolloff;
+} s_resampParams[] = {
+    { 8, 5.0, 0.85 },
+    { 16, 7.0, 0.90 },
+    { 32, 9.0, 0.94 }
+};
+
+static Mutex s_resampMutex;
+static ObjList s_resampFilters;
+
+// Zero order modified Bessel function of the first kind
+static double besselI0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+    for (int k = 1; k < 50; k++) {
+	double t = x / (2.0 * k);
+	term *= t * t;
+	sum += term;
+	if (term < (sum * 1e-12))
+	    break;
+    }
+    return sum;
+}
+
+static unsigned int greatestDivisor(unsigned int a, unsigned int b)
+{
+    while (b) {
+	unsigned int t = a % b;
+	a = b;
+	b = t;
+    }
+    return a;
+}
+
+// Dot product of a filter phase with the input history, n is a multiple of 8
+static inline float resampDot(const float* c, const float* x, unsigned int n)
+{
+#ifdef RESAMP_SSE
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    for (; n; n -= 8, c += 8, x += 8) {
+	acc0 = _mm_add_ps(acc0,_mm_mul_ps(_mm_loadu_ps(c),_mm_loadu_ps(x)));
+	acc1 = _mm_add_ps(acc1,_mm_mul_ps(_mm_loadu_ps(c+4),_mm_loadu_ps(x+4)));
+    }
+    acc0 = _mm_add_ps(acc0,acc1);
+    acc0 = _mm_add_ps(acc0,_mm_movehl_ps(acc0,acc0));
+    acc0 = _mm_add_ss(acc0,_mm_shuffle_ps(acc0,acc0,1));
+    return _mm_cvtss_f32(acc0);
+#else
+    float a0 = 0, a1 = 0, a2 = 0, a3 = 0;
+    for (; n; n -= 4, c += 4, x += 4) {
+	a0 += c[0] * x[0];
+	a1 += c[1] * x[1];
+	a2 += c[2] * x[2];
+	a3 += c[3] * x[3];
+    }
+    return (a0 + a1) + (a2 + a3);
+#endif
+}
+
+static int resampQuality()
+{
+    return lookup(Engine::config().getValue("general","resampquality"),
+	s_resampQuality,ResampFilter::Medium);
+}
+
+
+ResampFilter::ResampFilter(unsigned int interp, unsigned int decim, int quality)
+    : m_interp(interp), m_decim(decim), m_taps(0), m_quality(quality), m_coefs(0)
+{
+    // when decimating the filter must span more input samples
+    unsigned int ratio = (decim + interp - 1) / interp;
+    m_taps = s_resampParams[quality].taps * ratio;
+    unsigned int len = m_taps * interp;
+    double* proto = new double[len];
+    // cutoff relative to the upsampled rate, below the lowest Nyquist
+    double fc = s_resampParams[quality].rolloff * 0.5 / ((interp > decim) ? interp : decim);
+    double beta = s_resampParams[quality].beta;
+    double i0b = besselI0(beta);
+    double mid = 0.5 * (len - 1);
+    unsigned int i;
+    for (i = 0; i < len; i++) {
+	double t = i - mid;
+	double x = 2.0 * M_PI * fc * t;
+	double h = (t == 0.0) ? 2.0 * fc : ::sin(x) / (M_PI * t);
+	double w = t / mid;
+	w = 1.0 - w * w;
+	proto[i] = h * besselI0(beta * ::sqrt((w > 0.0) ? w : 0.0)) / i0b;
+    }
+    // split in phases with reversed coefficients, each with unity DC gain
+    m_coefs = new float[len];
+    for (unsigned int p = 0; p < interp; p++) {
+	float* c = m_coefs + (p * m_taps);
+	double sum = 0.0;
+	for (i = 0; i < m_taps; i++)
+	    sum += proto[i * interp + p];
+	if (sum == 0.0)
+	    sum = 1.0;
+	for (i = 0; i < m_taps; i++)
+	    c[m_taps - 1 - i] = (float)(proto[i * interp + p] / sum);
+    }
+    delete[] proto;
+    DDebug(DebugAll,"ResampFilter %u/%u quality %d taps=%u [%p]",
+	interp,decim,quality,m_taps,this);
+}
+
+ResampFilter::~ResampFilter()
+{
+    delete[] m_coefs;
+}
+
+void ResampFilter::destroyed()
+{
+    s_resampMutex.lock();
+    s_resampFilters.remove(this,false);
+    s_resampMutex.unlock();
+    RefObject::destroyed();
+}
+
+ResampFilter* ResampFilter::get(int sRate, int dRate, int quality)
+{
+    if ((sRate <= 0) || (dRate <= 0))
+	return 0;
+    if ((quality < Low) || (quality > High))
+	quality = Medium;
+    unsigned int g = greatestDivisor(sRate,dRate);
+    unsigned int interp = dRate / g;
+    unsigned int decim = sRate / g;
+    Lock lock(s_resampMutex);
+    for (ObjList* l = s_resampFilters.skipNull(); l; l = l->skipNext()) {
+	ResampFilter* f = static_cast<ResampFilter*>(l->get());
+	if ((f->m_interp == interp) && (f->m_decim == decim) &&
+	    (f->m_quality == quality) && f->ref())
+	    return f;
+    }
+    ResampFilter* f = new ResampFilter(interp,decim,quality);
+    s_resampFilters.append(f)->setDelete(false);
+    return f;
+}
+
+
+ResampTranslator::ResampTranslator(const DataFormat& sFormat, const DataFormat& dFormat)
+    : DataTranslator(sFormat,dFormat),
+      m_filter(0), m_chans(sFormat.numChannels()), m_pos(0), m_tsRest(0),
+      m_buf(0), m_bufLen(0)
+{
+    if (!m_chans)
+	m_chans = 1;
+    m_filter = ResampFilter::get(sFormat.sampleRate(),dFormat.sampleRate(),resampQuality());
+}
+
+ResampTranslator::~ResampTranslator()
+{
+    TelEngine::destruct(m_filter);
+    delete[] m_buf;
+}
+
+void ResampTranslator::Consume(const DataBlock& data, unsigned long tStamp)
+{
+    unsigned int n = data.length();
+    unsigned int frame = 2 * m_chans;
+    if (!n || (n % frame) || !m_filter || !ref())
+	return;
+    n /= frame;
+    DataSource* src = getTransSource();
+    if (src) {
+	unsigned int taps = m_filter->taps();
+	unsigned int hist = taps - 1;
+	unsigned int interp = m_filter->interp();
+	unsigned int decim = m_filter->decim();
+	// each channel keeps its filter history in front of the new samples
+	if (hist + n > m_bufLen) {
+	    unsigned int len = hist + n;
+	    float* buf = new float[len * m_chans];
+	    for (unsigned int c = 0; c < m_chans; c++) {
+		if (m_buf)
+		    ::memcpy(buf + (c * len),m_buf + (c * m_bufLen),hist * sizeof(float));
+		else
+		    ::memset(buf + (c * len),0,hist * sizeof(float));
+	    }
+	    delete[] m_buf;
+	    m_buf = buf;
+	    m_bufLen = len;
+	}
+	unsigned int end = n * interp;
+	unsigned int out = (m_pos < end) ? ((end - m_pos + decim - 1) / decim) : 0;
+	DataBlock oblock(0,2 * out * m_chans);
+	const short* s = (const short*) data.data();
+	short* d = (short*) oblock.data();
+	for (unsigned int c = 0; c < m_chans; c++) {
+	    float* b = m_buf + (c * m_bufLen);
+	    unsigned int i;
+	    for (i = 0; i < n; i++)
+		b[hist + i] = s[i * m_chans + c];
+	    unsigned int pos = m_pos;
+	    for (i = 0; i < out; i++, pos += decim) {
+		float v = resampDot(m_filter->phase(pos % interp),b + (pos / interp),taps);
+		// round and saturate the result
+		int r = (int)((v >= 0.0f) ? (v + 0.5f) : (v - 0.5f));
+		if (r > 32767)
+		    r = 32767;
+		if (r < -32767)
+		    r = -32767;
+		d[i * m_chans + c] = r;
+	    }
+	    ::memmove(b,b + n,hist * sizeof(float));
+	}
+	m_pos = m_pos + (out * decim) - end;
+	// scale the timestamp increment keeping the fractional part
+	int64_t delta = (int64_t)(long)(tStamp - m_timestamp) * interp + m_tsRest;
+	m_tsRest = delta % decim;
+	delta /= decim;
+	if (src->timeStamp() != invalidStamp())
+	    delta += src->timeStamp();
+	if (out)
+	    src->Forward(oblock,(unsigned long)delta);
+    }
+    deref();
+}
+
 /* vi: set ts=8 sw=4 sts=4 noet: */
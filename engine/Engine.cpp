@@ -20,7 +20,7 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
  */
 
-#include "yatengine.h"
+#include "yatephone.h"
 #include "yateversn.h"
 
 #ifdef _WINDOWS
@@ -244,6 +244,7 @@ bool EngineStatusHandler::received(Message &msg)
     msg.retValue() << ",workers=" << EnginePrivate::count;
     msg.retValue() << ",mutexes=" << Mutex::count();
     msg.retValue() << ",locks=" << Mutex::locks();
+    msg.retValue() << ",mediadrops=" << DataSource::dropped();
     msg.retValue() << "\r\n";
     return false;
 }
@@ -25,10 +25,14 @@
 #ifdef _WINDOWS
 
 typedef HANDLE HMUTEX;
+typedef HANDLE HSEMAPHORE;
 
 #else
 
 #include <pthread.h>
+#include <semaphore.h>
+#include <sys/time.h>
+#include <errno.h>
 
 #ifdef MUTEX_HACK
 extern "C" {
@@ -42,6 +46,7 @@ extern int pthread_mutexattr_settype(pthread_mutexattr_t *__attr, int __kind) __
 #endif
 
 typedef pthread_mutex_t HMUTEX;
+typedef sem_t HSEMAPHORE;
 
 #endif /* ! _WINDOWS */
 
@@ -71,6 +76,19 @@ private:
     const char* m_owner;
 };
 
+class SemaphorePrivate {
+public:
+    SemaphorePrivate(unsigned int maxcount);
+    ~SemaphorePrivate();
+    inline unsigned int maxcount() const
+	{ return m_maxcount; }
+    bool lock(long maxwait);
+    bool unlock();
+private:
+    HSEMAPHORE m_semaphore;
+    unsigned int m_maxcount;
+};
+
 class GlobalMutex {
 public:
     GlobalMutex();
@@ -375,6 +393,105 @@ void Mutex::wait(unsigned long maxwait)
 }
 
 
+SemaphorePrivate::SemaphorePrivate(unsigned int maxcount)
+    : m_maxcount(maxcount ? maxcount : 1)
+{
+#ifdef _WINDOWS
+    m_semaphore = ::CreateSemaphore(NULL,0,m_maxcount,NULL);
+#else
+    ::sem_init(&m_semaphore,0,0);
+#endif
+}
+
+SemaphorePrivate::~SemaphorePrivate()
+{
+#ifdef _WINDOWS
+    ::CloseHandle(m_semaphore);
+    m_semaphore = 0;
+#else
+    ::sem_destroy(&m_semaphore);
+#endif
+}
+
+bool SemaphorePrivate::lock(long maxwait)
+{
+#ifdef _WINDOWS
+    DWORD ms = 0;
+    if (maxwait < 0)
+	ms = INFINITE;
+    else if (maxwait > 0)
+	ms = (DWORD)(maxwait / 1000);
+    return (::WaitForSingleObject(m_semaphore,ms) == WAIT_OBJECT_0);
+#else
+    if (!maxwait)
+	return !::sem_trywait(&m_semaphore);
+    if (maxwait < 0) {
+	while (::sem_wait(&m_semaphore))
+	    if (errno != EINTR)
+		return false;
+	return true;
+    }
+    // the timeout is an absolute time of the realtime clock
+    struct timeval tv;
+    ::gettimeofday(&tv,0);
+    u_int64_t t = 1000000 * (u_int64_t)tv.tv_sec + tv.tv_usec + maxwait;
+    struct timespec ts;
+    ts.tv_sec = (time_t)(t / 1000000);
+    ts.tv_nsec = 1000 * (long)(t % 1000000);
+    while (::sem_timedwait(&m_semaphore,&ts))
+	if (errno != EINTR)
+	    return false;
+    return true;
+#endif
+}
+
+bool SemaphorePrivate::unlock()
+{
+#ifdef _WINDOWS
+    return ::ReleaseSemaphore(m_semaphore,1,NULL) ||
+	(::GetLastError() == ERROR_TOO_MANY_POSTS);
+#else
+    // serialize posting so the count never goes above the maximum
+    GlobalMutex::lock();
+    int val = 0;
+    bool ok = !::sem_getvalue(&m_semaphore,&val);
+    if (ok && (val < (int)m_maxcount))
+	ok = !::sem_post(&m_semaphore);
+    GlobalMutex::unlock();
+    return ok;
+#endif
+}
+
+
+Semaphore::Semaphore(unsigned int maxcount)
+    : m_private(0)
+{
+    m_private = new SemaphorePrivate(maxcount);
+}
+
+Semaphore::~Semaphore()
+{
+    SemaphorePrivate* priv = m_private;
+    m_private = 0;
+    delete priv;
+}
+
+bool Semaphore::lock(long maxwait)
+{
+    return m_private ? m_private->lock(maxwait) : false;
+}
+
+bool Semaphore::unlock()
+{
+    return m_private ? m_private->unlock() : false;
+}
+
+unsigned int Semaphore::maxcount() const
+{
+    return m_private ? m_private->maxcount() : 0;
+}
+
+
 bool Lock2::lock(Mutex* mx1, Mutex* mx2, long maxwait)
 {
     // if we got only one mutex it must be mx1
@@ -0,0 +1,481 @@
+/**
+ * Spectrum.cpp
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2006 Null Team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include "yatephone.h"
+
+#include <string.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 1))
+#include <xmmintrin.h>
+#define FFT_SSE
+#endif
+
+// Largest transform accepted, in samples
+#define FFT_MAX_LENGTH 65536
+// Longest wait of the idle spectrum thread for a job in msec
+#define SPECTRUM_IDLE 100
+
+namespace TelEngine {
+
+// Tables shared by all the transforms of the same length
+class FFTTables : public GenObject
+{
+public:
+    FFTTables(unsigned int length);
+    virtual ~FFTTables();
+    static FFTTables* get(unsigned int length);
+    void release();
+    // real samples and complex points of the half length transform
+    unsigned int m_length;
+    unsigned int m_points;
+    // bit reversed index of each complex point
+    unsigned int* m_rev;
+    // twiddles of each stage, stage of half size h starts at index h-1
+    float* m_twRe;
+    float* m_twIm;
+    // twiddles splitting the half length result into the real spectrum
+    float* m_postRe;
+    float* m_postIm;
+    unsigned int m_users;
+};
+
+// Thread computing all the queued spectrum jobs in batches
+class SpectrumWorker : public Thread
+{
+public:
+    inline SpectrumWorker()
+	: Thread("Spectrum",Thread::Low)
+	{ }
+    virtual ~SpectrumWorker();
+    virtual void run();
+    static void process(SpectrumJob* job);
+};
+
+static Mutex s_fftMutex;
+static ObjList s_fftTables;
+
+// Protects the spectrum job queue and worker
+static Mutex s_specMutex;
+static ObjList s_specQueue;
+// Signaled when jobs are queued, wakes up the idle worker
+static Semaphore s_specSemaphore;
+static SpectrumWorker* s_specWorker = 0;
+static unsigned int s_specCount = 0;
+
+static const TokenDict s_windows[] = {
+    { "rectangle", SpectrumJob::Rectangle },
+    { "no",        SpectrumJob::Rectangle },
+    { "none",      SpectrumJob::Rectangle },
+    { "triangle",  SpectrumJob::Triangle },
+    { "bartlett",  SpectrumJob::Triangle },
+    { "hanning",   SpectrumJob::Hanning },
+    { "hamming",   SpectrumJob::Hamming },
+    { "blackman",  SpectrumJob::Blackman },
+    { "flattop",   SpectrumJob::FlatTop },
+    { 0, 0 }
+};
+
+
+FFTTables::FFTTables(unsigned int length)
+    : m_length(length), m_points(length >> 1), m_users(1)
+{
+    unsigned int bits = 0;
+    while ((1U << bits) < m_points)
+	bits++;
+    m_rev = new unsigned int[m_points];
+    for (unsigned int i = 0; i < m_points; i++) {
+	unsigned int r = 0;
+	unsigned int idx = i;
+	for (unsigned int b = 0; b < bits; b++) {
+	    r = (r << 1) | (idx & 1);
+	    idx >>= 1;
+	}
+	m_rev[i] = r;
+    }
+    m_twRe = new float[m_points];
+    m_twIm = new float[m_points];
+    for (unsigned int h = 1; h < m_points; h <<= 1) {
+	for (unsigned int j = 0; j < h; j++) {
+	    double a = -M_PI * j / h;
+	    m_twRe[h - 1 + j] = (float)::cos(a);
+	    m_twIm[h - 1 + j] = (float)::sin(a);
+	}
+    }
+    unsigned int n = (m_points >> 1) + 1;
+    m_postRe = new float[n];
+    m_postIm = new float[n];
+    for (unsigned int k = 0; k < n; k++) {
+	double a = -2.0 * M_PI * k / m_length;
+	m_postRe[k] = (float)::cos(a);
+	m_postIm[k] = (float)::sin(a);
+    }
+}
+
+FFTTables::~FFTTables()
+{
+    delete[] m_rev;
+    delete[] m_twRe;
+    delete[] m_twIm;
+    delete[] m_postRe;
+    delete[] m_postIm;
+}
+
+// Find or build the tables of a length, takes a reference
+FFTTables* FFTTables::get(unsigned int length)
+{
+    Lock lock(s_fftMutex);
+    for (ObjList* l = s_fftTables.skipNull(); l; l = l->skipNext()) {
+	FFTTables* t = static_cast<FFTTables*>(l->get());
+	if (t->m_length == length) {
+	    t->m_users++;
+	    return t;
+	}
+    }
+    FFTTables* t = new FFTTables(length);
+    s_fftTables.append(t);
+    return t;
+}
+
+void FFTTables::release()
+{
+    Lock lock(s_fftMutex);
+    if (--m_users)
+	return;
+    s_fftTables.remove(this);
+}
+
+
+RealFFT::RealFFT(unsigned int length)
+    : m_length(0), m_tables(0), m_work(0)
+{
+    // power of two, at least one butterfly in the half length transform
+    if ((length < 4) || (length > FFT_MAX_LENGTH) || (length & (length - 1)))
+	return;
+    m_length = length;
+    m_tables = FFTTables::get(length);
+    // real and imaginary parts of the half length complex transform
+    //  followed by the imaginary output of magnitude()
+    m_work = new float[length + bins()];
+}
+
+RealFFT::~RealFFT()
+{
+    if (m_tables)
+	m_tables->release();
+    delete[] m_work;
+}
+
+bool RealFFT::transform(const float* input, float* real, float* imag)
+{
+    if (!(m_tables && input && real && imag))
+	return false;
+    const FFTTables* t = m_tables;
+    unsigned int m = t->m_points;
+    float* zr = m_work;
+    float* zi = m_work + m;
+    // pack even samples as real, odd as imaginary, in bit reversed order
+    unsigned int i;
+    for (i = 0; i < m; i++) {
+	unsigned int j = t->m_rev[i] << 1;
+	zr[i] = input[j];
+	zi[i] = input[j + 1];
+    }
+    // first stage needs no multiplication
+    for (i = 0; i < m; i += 2) {
+	float r = zr[i + 1];
+	float q = zi[i + 1];
+	zr[i + 1] = zr[i] - r;
+	zi[i + 1] = zi[i] - q;
+	zr[i] += r;
+	zi[i] += q;
+    }
+    for (unsigned int h = 2; h < m; h <<= 1) {
+	const float* wr = t->m_twRe + h - 1;
+	const float* wi = t->m_twIm + h - 1;
+	for (i = 0; i < m; i += (h << 1)) {
+	    float* ar = zr + i;
+	    float* ai = zi + i;
+	    float* br = ar + h;
+	    float* bi = ai + h;
+	    unsigned int j = 0;
+#ifdef FFT_SSE
+	    // four butterflies at once, the stage twiddles are contiguous
+	    for (; j + 4 <= h; j += 4) {
+		__m128 cr = _mm_loadu_ps(wr + j);
+		__m128 ci = _mm_loadu_ps(wi + j);
+		__m128 xr = _mm_loadu_ps(br + j);
+		__m128 xi = _mm_loadu_ps(bi + j);
+		__m128 tr = _mm_sub_ps(_mm_mul_ps(cr,xr),_mm_mul_ps(ci,xi));
+		__m128 ti = _mm_add_ps(_mm_mul_ps(cr,xi),_mm_mul_ps(ci,xr));
+		__m128 yr = _mm_loadu_ps(ar + j);
+		__m128 yi = _mm_loadu_ps(ai + j);
+		_mm_storeu_ps(br + j,_mm_sub_ps(yr,tr));
+		_mm_storeu_ps(bi + j,_mm_sub_ps(yi,ti));
+		_mm_storeu_ps(ar + j,_mm_add_ps(yr,tr));
+		_mm_storeu_ps(ai + j,_mm_add_ps(yi,ti));
+	    }
+#endif
+	    for (; j < h; j++) {
+		float tr = wr[j] * br[j] - wi[j] * bi[j];
+		float ti = wr[j] * bi[j] + wi[j] * br[j];
+		br[j] = ar[j] - tr;
+		bi[j] = ai[j] - ti;
+		ar[j] += tr;
+		ai[j] += ti;
+	    }
+	}
+    }
+    // split into the even and odd samples spectra and combine them
+    real[0] = zr[0] + zi[0];
+    imag[0] = 0.0;
+    real[m] = zr[0] - zi[0];
+    imag[m] = 0.0;
+    for (unsigned int k = 1; k <= (m >> 1); k++) {
+	unsigned int c = m - k;
+	float er = 0.5f * (zr[k] + zr[c]);
+	float ei = 0.5f * (zi[k] - zi[c]);
+	float or_ = 0.5f * (zi[k] + zi[c]);
+	float oi = 0.5f * (zr[c] - zr[k]);
+	float wr = t->m_postRe[k];
+	float wi = t->m_postIm[k];
+	float tr = wr * or_ - wi * oi;
+	float ti = wr * oi + wi * or_;
+	real[k] = er + tr;
+	imag[k] = ei + ti;
+	real[c] = er - tr;
+	imag[c] = ti - ei;
+    }
+    return true;
+}
+
+bool RealFFT::magnitude(const float* input, float* output)
+{
+    unsigned int n = bins();
+    float* im = m_work + m_length;
+    bool ok = transform(input,output,im);
+    if (ok) {
+	float scale = 2.0f / m_length;
+	unsigned int i = 0;
+#ifdef FFT_SSE
+	__m128 s = _mm_set1_ps(scale);
+	for (; i + 4 <= n; i += 4) {
+	    __m128 r = _mm_loadu_ps(output + i);
+	    __m128 q = _mm_loadu_ps(im + i);
+	    r = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(r,r),_mm_mul_ps(q,q)));
+	    _mm_storeu_ps(output + i,_mm_mul_ps(r,s));
+	}
+#endif
+	for (; i < n; i++)
+	    output[i] = scale * ::sqrtf(output[i] * output[i] + im[i] * im[i]);
+    }
+    return ok;
+}
+
+
+SpectrumJob::SpectrumJob(unsigned int length, Window window)
+    : m_fft(length), m_window(window), m_coefs(0), m_input(0), m_output(0),
+      m_busy(false), m_ready(false), m_queued(false), m_runMutex(true)
+{
+    if (!m_fft.valid())
+	return;
+    m_input = new float[length];
+    m_output = new float[m_fft.bins()];
+    if (window == Rectangle)
+	return;
+    m_coefs = new float[length];
+    unsigned int n2 = length >> 1;
+    for (unsigned int i = 0; i < length; i++) {
+	double omega = i * 2.0 * M_PI / length;
+	double w = 1.0;
+	switch (window) {
+	    case Triangle:
+		{
+		    int k = i - n2;
+		    if (k > 0)
+			k = -k;
+		    k += n2;
+		    w = k * 1.0 / n2;
+		}
+		break;
+	    case Hanning:
+		w = 0.5 - 0.5 * ::cos(omega);
+		break;
+	    case Hamming:
+		w = 0.54 - 0.46 * ::cos(omega);
+		break;
+	    case Blackman:
+		w = 0.42 - 0.5 * ::cos(omega) + 0.08 * ::cos(2 * omega);
+		break;
+	    case FlatTop:
+		w = 0.2810639 - 0.5208972 * ::cos(omega) + 0.1980399 * ::cos(2 * omega);
+		break;
+	    default:
+		break;
+	}
+	m_coefs[i] = (float)w;
+    }
+}
+
+SpectrumJob::~SpectrumJob()
+{
+    delete[] m_coefs;
+    delete[] m_input;
+    delete[] m_output;
+}
+
+const TokenDict* SpectrumJob::windows()
+{
+    return s_windows;
+}
+
+unsigned int SpectrumJob::computedCount()
+{
+    Lock lock(s_specMutex);
+    return s_specCount;
+}
+
+float SpectrumJob::at(int index) const
+{
+    if ((index < 0) || ((unsigned int)index > length()))
+	return 0.0;
+    Lock lock(m_mutex);
+    if (!m_ready)
+	return 0.0;
+    return m_output[index];
+}
+
+bool SpectrumJob::submit(const short* samp)
+{
+    if (m_busy || !(samp && m_input))
+	return false;
+    unsigned int n = samples();
+    if (m_coefs) {
+	for (unsigned int i = 0; i < n; i++)
+	    m_input[i] = m_coefs[i] * samp[i];
+    }
+    else {
+	for (unsigned int i = 0; i < n; i++)
+	    m_input[i] = samp[i];
+    }
+    // the queue holds a reference until the spectrum is computed
+    if (!ref())
+	return false;
+    Lock lock(s_specMutex);
+    m_busy = true;
+    m_queued = true;
+    s_specQueue.append(this)->setDelete(false);
+    if (!s_specWorker) {
+	s_specWorker = new SpectrumWorker;
+	if (!s_specWorker->startup()) {
+	    Debug(DebugGoOn,"Could not start the spectrum thread!");
+	    delete s_specWorker;
+	    s_specWorker = 0;
+	    s_specQueue.remove(this,false);
+	    m_busy = m_queued = false;
+	    lock.drop();
+	    deref();
+	    return false;
+	}
+    }
+    s_specSemaphore.unlock();
+    return true;
+}
+
+void SpectrumJob::cancel()
+{
+    s_specMutex.lock();
+    bool queued = m_queued;
+    if (queued) {
+	s_specQueue.remove(this,false);
+	m_queued = false;
+	m_busy = false;
+    }
+    s_specMutex.unlock();
+    if (queued)
+	deref();
+    // the worker takes this lock before it releases the queue so if it got
+    //  the job we wait here until the job was computed and notified
+    m_runMutex.lock();
+    m_runMutex.unlock();
+}
+
+void SpectrumJob::computed()
+{
+}
+
+
+SpectrumWorker::~SpectrumWorker()
+{
+    Lock lock(s_specMutex);
+    if (s_specWorker == this)
+	s_specWorker = 0;
+}
+
+// Compute one job, notify and drop the queue's reference
+void SpectrumWorker::process(SpectrumJob* job)
+{
+    job->m_mutex.lock();
+    job->m_fft.magnitude(job->m_input,job->m_output);
+    job->m_ready = true;
+    job->m_mutex.unlock();
+    job->m_busy = false;
+    job->computed();
+}
+
+// Drain the queue on each wakeup, jobs stay queued until taken so they can be cancelled
+void SpectrumWorker::run()
+{
+    for (;;) {
+	unsigned int batch = 0;
+	for (;;) {
+	    s_specMutex.lock();
+	    SpectrumJob* job = static_cast<SpectrumJob*>(s_specQueue.remove(false));
+	    if (job) {
+		job->m_queued = false;
+		job->m_runMutex.lock();
+	    }
+	    s_specMutex.unlock();
+	    if (!job)
+		break;
+	    process(job);
+	    s_specMutex.lock();
+	    s_specCount++;
+	    s_specMutex.unlock();
+	    job->m_runMutex.unlock();
+	    job->deref();
+	    batch++;
+	}
+	// block until signaled, a signal posted while draining returns at once
+	if (!batch)
+	    s_specSemaphore.lock(1000 * SPECTRUM_IDLE);
+	Thread::check();
+    }
+}
+
+}; // namespace TelEngine
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
@@ -39,7 +39,8 @@ void AbsQuantW(
     float *syntOut;
     float syntOutBuf[LPC_FILTERORDER+STATE_SHORT_LEN_30MS];
     float toQ, xq;
-    int n;
+    float prod[LPC_FILTERORDER+1];
+    int n, k;
     int index;
 
     /* initialization of buffer for filtering */
@@ -87,25 +88,31 @@ void AbsQuantW(
             
         }
         
-        /* prediction of synthesized and weighted input */
+        /* prediction of synthesized and weighted input, the
+           products are kept for the filter update below */
 
-        syntOut[n] = 0.0;
-        AllPoleFilter (&syntOut[n], weightDenum, 1, 
-            LPC_FILTERORDER);
+        xq = 0.0;
+        for (k=1; k<=LPC_FILTERORDER; k++) {
+            prod[k] = weightDenum[k]*syntOut[n-k];
+            xq -= prod[k];
+        }
+        syntOut[n] = xq;
         
         /* quantization */      
 
         toQ = in[n]-syntOut[n];
         sort_sq(&xq, &index, toQ, state_sq3Tbl, 8);
         out[n]=index;
-        syntOut[n] = state_sq3Tbl[out[n]];
+        xq = state_sq3Tbl[out[n]];
 
         /* update of the prediction filter */
 
 
 
-        AllPoleFilter(&syntOut[n], weightDenum, 1, 
-            LPC_FILTERORDER);
+        for (k=1; k<=LPC_FILTERORDER; k++) {
+            xq -= prod[k];
+        }
+        syntOut[n] = xq;
     }
 }
 
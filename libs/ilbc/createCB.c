@@ -15,6 +15,7 @@
 #include "iLBC_define.h"
 #include "createCB.h"
 #include "constants.h"
+#include "simdfun.h"
 #include <string.h>
 #include <math.h>
 
@@ -31,10 +32,9 @@ void filteredCBvecs(
                                vector from */
     int lMem        /* (i) Length of buffer */
 ){
-    int j, k;
-    float *pp, *pp1;
+    int j;
     float tempbuff2[CB_MEML+CB_FILTERLEN];
-    float *pos;
+    float revfilter[CB_FILTERLEN];
 
     memset(tempbuff2, 0, (CB_HALFFILTERLEN-1)*sizeof(float));
     memcpy(&tempbuff2[CB_HALFFILTERLEN-1], mem, lMem*sizeof(float));
@@ -44,16 +44,11 @@ void filteredCBvecs(
     /* Create codebook vector for higher section by filtering */
 
     /* do filtering */
-    pos=cbvectors;
-    memset(pos, 0, lMem*sizeof(float));
-    for (k=0; k<lMem; k++) {
-        pp=&tempbuff2[k];
-        pp1=&cbfiltersTbl[CB_FILTERLEN-1];
-        for (j=0;j<CB_FILTERLEN;j++) {
-            (*pos)+=(*pp++)*(*pp1--);
-        }
-        pos++;
+    for (j=0;j<CB_FILTERLEN;j++) {
+        revfilter[j]=cbfiltersTbl[CB_FILTERLEN-1-j];
     }
+    memset(cbvectors, 0, lMem*sizeof(float));
+    accFilter(cbvectors, tempbuff2, revfilter, CB_FILTERLEN, 1, lMem);
 }
 
 
@@ -84,6 +79,11 @@ void searchAugmentedCB(
     float *pp, *ppo, *ppi, *ppe, crossDot, alfa; 
     float weighted, measure, nrjRecursive;
     float ftmp;
+    float crossDotBuf[SUBL];
+
+    /* Cross dot products for the (low-4) samples that are
+       not interpolated in any of the searched vectors */
+    crossDots(crossDotBuf, 0, target, buffer-low, low-4, high-low+1);
 
     /* Compute the energy for the first (low-5) 
        noninterpolated samples */
@@ -111,11 +111,11 @@ void searchAugmentedCB(
 
         /* Compute cross dot product for the first (low-5) 
            samples */
-        crossDot = (float) 0.0;
+        crossDot = crossDotBuf[icount-low];
 
 
-        pp = buffer-icount;
-        for (j=0; j<ilow; j++) {
+        pp = buffer-icount+low-4;
+        for (j=low-4; j<ilow; j++) {
             crossDot += target[j]*(*pp++);
         }
 
@@ -14,6 +14,7 @@
 
 #include "iLBC_define.h"
 #include "filter.h"
+#include "simdfun.h"
 
 /*----------------------------------------------------------------*
  *  all-pole filter
@@ -34,12 +35,16 @@ void AllPoleFilter(
     int orderCoef   /* (i) number of filter coefficients */
 ){  
     int n,k;
+    float o;
     
+    /* accumulate in a local, the taps never read the sample
+       being computed so this only saves the memory round trips */
     for(n=0;n<lengthInOut;n++){
+        o = *InOut;
         for(k=1;k<=orderCoef;k++){
-            *InOut -= Coef[k]*InOut[-k];
+            o -= Coef[k]*InOut[-k];
         }
-        InOut++;
+        *InOut++ = o;
     }
 }
 
@@ -59,18 +64,12 @@ void AllZeroFilter(
                            to Out[lengthInOut-1] contain filtered
                            samples */
 ){  
-    int n,k;
+    int n;
     
     for(n=0;n<lengthInOut;n++){
-        *Out = Coef[0]*In[0];
-        for(k=1;k<=orderCoef;k++){
-            *Out += Coef[k]*In[-k];
-        }
-
-
-        Out++;
-        In++;
+        Out[n] = Coef[0]*In[n];
     }
+    accFilter(Out,In-1,Coef+1,orderCoef,-1,lengthInOut);
 }
 
 /*----------------------------------------------------------------*
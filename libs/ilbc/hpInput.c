@@ -24,37 +24,40 @@ void hpInput(
     float *mem  /* (i/o) the filter state */
 ){
     int i;
-    float *pi, *po;
+    float m0, m1, m2, m3, o;
 
-    /* all-zero section*/
+    /* all-zero section, the filter state is kept in locals so 
+       it is not reloaded after each store to the output */
 
-    pi = &In[0];
-    po = &Out[0];
+    m0 = mem[0];
+    m1 = mem[1];
     for (i=0; i<len; i++) {
-        *po = hpi_zero_coefsTbl[0] * (*pi);
-        *po += hpi_zero_coefsTbl[1] * mem[0];
-        *po += hpi_zero_coefsTbl[2] * mem[1];
-
-        mem[1] = mem[0];
-        mem[0] = *pi;
-        po++;
-
-
-        pi++;
+        o = hpi_zero_coefsTbl[0] * In[i];
+        o += hpi_zero_coefsTbl[1] * m0;
+        o += hpi_zero_coefsTbl[2] * m1;
 
+        m1 = m0;
+        m0 = In[i];
+        Out[i] = o;
     }
+    mem[0] = m0;
+    mem[1] = m1;
 
     /* all-pole section*/
 
-    po = &Out[0];
+    m2 = mem[2];
+    m3 = mem[3];
     for (i=0; i<len; i++) {
-        *po -= hpi_pole_coefsTbl[1] * mem[2];
-        *po -= hpi_pole_coefsTbl[2] * mem[3];
+        o = Out[i];
+        o -= hpi_pole_coefsTbl[1] * m2;
+        o -= hpi_pole_coefsTbl[2] * m3;
 
-        mem[3] = mem[2];
-        mem[2] = *po;
-        po++;
+        m3 = m2;
+        m2 = o;
+        Out[i] = o;
     }
+    mem[2] = m2;
+    mem[3] = m3;
 }
 
 
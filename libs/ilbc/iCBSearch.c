@@ -19,6 +19,7 @@
 #include "createCB.h"
 #include "filter.h"
 #include "constants.h"
+#include "simdfun.h"
 
 /*----------------------------------------------------------------*
  *  Search routine for codebook encoding and gain quantization.
@@ -48,6 +49,7 @@ void iCBSearch(
 
 
     float invenergy[CB_EXPAND*128], energy[CB_EXPAND*128];
+    float crossDotBuf[CB_EXPAND*128];
     float *pp, *ppi=0, *ppo=0, *ppe=0;
     float cbvectors[CB_MEML];
     float tene, cene, cvec[SUBL];
@@ -100,16 +102,12 @@ void iCBSearch(
         gain = (float)0.0;
         best_index = 0;
 
-        /* Compute cross dot product between the target 
+        /* Compute cross dot products between the target 
+           and the CB memory for the whole first section */
 
-
-           and the CB memory */
-
-        crossDot=0.0;
-        pp=buf+LPC_FILTERORDER+lMem-lTarget;
-        for (j=0; j<lTarget; j++) {
-            crossDot += target[j]*(*pp++);
-        }       
+        crossDots(crossDotBuf, 0, target, 
+            buf+LPC_FILTERORDER+lMem-lTarget, lTarget, range);
+        crossDot=crossDotBuf[0];
         
         if (stage==0) {
 
@@ -159,14 +157,7 @@ void iCBSearch(
 
             /* calculate measure */
 
-
-
-            crossDot=0.0;
-            pp = buf+LPC_FILTERORDER+lMem-lTarget-icount;
-
-            for (j=0; j<lTarget; j++) {
-                crossDot += target[j]*(*pp++);
-            }
+            crossDot=crossDotBuf[icount];
             
             if (stage==0) {
                 *ppe++ = energy[icount-1] + (*ppi)*(*ppi) - 
@@ -322,18 +313,16 @@ void iCBSearch(
 
         /* loop over search range */
 
+        if (eInd>sInd) {
+            crossDots(crossDotBuf, 0, target, 
+                cbvectors+lMem-counter-lTarget, lTarget, eInd-sInd);
+        }
+
         for (icount=sInd; icount<eInd; icount++) {
 
             /* calculate measure */
 
-            crossDot=0.0;
-
-
-            pp=cbvectors + lMem - (counter++) - lTarget;
-
-            for (j=0;j<lTarget;j++) {
-                crossDot += target[j]*(*pp++);
-            }
+            crossDot=crossDotBuf[icount-sInd];
             
             if (energy[icount]>0.0) {
                 invenergy[icount] =(float)1.0/(energy[icount]+EPS);
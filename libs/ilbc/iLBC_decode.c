@@ -26,6 +26,7 @@
 #include "enhancer.h"
 #include "hpOutput.h"
 #include "syntFilter.h"
+#include "simdfun.h"
 
 /*----------------------------------------------------------------*
  *  Initiation of decoder instance.
@@ -302,6 +303,23 @@ static void Decode(
     }
 }
 
+/*----------------------------------------------------------------*
+ *  normalized correlation of a lag, same as xCorrCoef() but 
+ *  from dot products computed for all lags at once
+ *---------------------------------------------------------------*/
+
+static float lagCorr(
+    float cross,    /* (i) cross dot product with the target */
+    float energy    /* (i) energy of the lagged vector */
+){
+    if (cross > 0.0) {
+        return (float)(cross*cross/energy);
+    }
+    else {
+        return (float)0.0;
+    }
+}
+
 /*----------------------------------------------------------------*
  *  main decoder function 
  *---------------------------------------------------------------*/
@@ -319,8 +337,9 @@ void iLBC_decode(
     float PLCresidual[BLOCKL_MAX], PLClpc[LPC_FILTERORDER + 1];
     float zeros[BLOCKL_MAX], one[LPC_FILTERORDER + 1];
     int k, i, start, idxForMax, pos, lastpart, ulp;
-    int lag, ilag;
-    float cc, maxcc;
+    int lag, ilag, cclen, nlags;
+    float cc, maxcc, *target;
+    float ccbuf[100], enbuf[100];
     int idxVec[STATE_LEN];
     int check;
     int gain_index[NASUB_MAX*CB_NSTAGES], 
@@ -567,19 +586,28 @@ void iLBC_decode(
 
     } else {
 
-        /* Find last lag */
+        /* Find last lag, the 20 ms block is too short to search
+           all lags over the enhancer block so use a shorter
+           vector and fewer lags instead of reading past it */
+        if (iLBCdec_inst->mode==20) {
+            cclen = 60;
+            nlags = 80;
+        } else {
+            cclen = ENH_BLOCKL;
+            nlags = 100;
+        }
+        target = &decresidual[iLBCdec_inst->blockl-cclen];
+        crossDots(ccbuf, enbuf, target, target-20, cclen, nlags);
+
         lag = 20;
-        maxcc = xCorrCoef(&decresidual[BLOCKL_MAX-ENH_BLOCKL], 
-            &decresidual[BLOCKL_MAX-ENH_BLOCKL-lag], ENH_BLOCKL);
+        maxcc = lagCorr(ccbuf[0], enbuf[0]);
         
-        for (ilag=21; ilag<120; ilag++) {
-            cc = xCorrCoef(&decresidual[BLOCKL_MAX-ENH_BLOCKL], 
-                &decresidual[BLOCKL_MAX-ENH_BLOCKL-ilag], 
-                ENH_BLOCKL);
+        for (ilag=1; ilag<nlags; ilag++) {
+            cc = lagCorr(ccbuf[ilag], enbuf[ilag]);
         
             if (cc > maxcc) {
                 maxcc = cc;
-                lag = ilag;
+                lag = ilag+20;
             }
         }
         iLBCdec_inst->last_lag = lag;
@@ -0,0 +1,319 @@
+
+/******************************************************************
+
+    iLBC Speech Coder ANSI-C Source Code
+
+    simdfun.c
+
+    Vectorized kernels for the correlation and filtering loops.
+    Each lane computes one output with the very same sequence
+    of single precision operations as the scalar code so the
+    vectors only change speed, never the result.
+
+******************************************************************/
+
+#include "iLBC_define.h"
+#include "simdfun.h"
+
+/* Only where scalar float math already runs in SSE registers, the
+   x87 unit of 32 bit builds would round differently */
+#ifndef ILBC_NO_SIMD
+#if defined(__x86_64__) || defined(_M_X64)
+#define SIMD_SSE
+#include <xmmintrin.h>
+#if defined(__GNUC__) && !defined(__clang__) && \
+    ((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+/* AVX code is built anyway and selected at runtime */
+#define SIMD_AVX __attribute__((target("avx")))
+#include <immintrin.h>
+#endif
+#endif
+#endif
+
+/*----------------------------------------------------------------*
+ *  scalar cross dot products, also used for the leftovers
+ *---------------------------------------------------------------*/
+
+static void crossDotsC(
+    float *cc,      /* (o) cross dot products */
+    float *energy,  /* (o) regressor energies, may be 0 */
+    const float *target,/* (i) target vector */
+    const float *buf,   /* (i) first regressor */
+    int len,        /* (i) length of vectors */
+    int first,      /* (i) first regressor to compute */
+    int count       /* (i) number of regressors */
+){
+    int i, j;
+    float c, e;
+
+    for (i=first; i<count; i++) {
+        c = 0.0;
+        if (energy) {
+            e = 0.0;
+            for (j=0; j<len; j++) {
+                c += target[j]*buf[j-i];
+                e += buf[j-i]*buf[j-i];
+            }
+            energy[i] = e;
+        } else {
+            for (j=0; j<len; j++) {
+                c += target[j]*buf[j-i];
+            }
+        }
+        cc[i] = c;
+    }
+}
+
+/*----------------------------------------------------------------*
+ *  scalar filter accumulation, also used for the leftovers
+ *---------------------------------------------------------------*/
+
+static void accFilterC(
+    float *out,     /* (i/o) accumulated output */
+    const float *in,/* (i) filter input */
+    const float *coef,  /* (i) filter coefficients */
+    int taps,       /* (i) number of coefficients */
+    int step,       /* (i) input stride between taps */
+    int first,      /* (i) first output to compute */
+    int len         /* (i) number of output samples */
+){
+    int n, k;
+    float o;
+
+    for (n=first; n<len; n++) {
+        o = out[n];
+        for (k=0; k<taps; k++) {
+            o += coef[k]*in[n+k*step];
+        }
+        out[n] = o;
+    }
+}
+
+#ifdef SIMD_SSE
+
+/* Regressors for consecutive outputs start one sample earlier so
+   a plain load holds them backwards, lanes are swapped on store */
+#define SSE_REVERSE(x) _mm_shuffle_ps(x,x,_MM_SHUFFLE(0,1,2,3))
+
+static int crossDotsSSE(
+    float *cc, float *energy, const float *target,
+    const float *buf, int len, int first, int count
+){
+    int i, j;
+    const float *p;
+    __m128 t, x0, x1, c0, c1, e0, e1;
+
+    for (i=first; i+8<=count; i+=8) {
+        p = buf-i-7;
+        c0 = c1 = e0 = e1 = _mm_setzero_ps();
+        if (energy) {
+            for (j=0; j<len; j++) {
+                t = _mm_set1_ps(target[j]);
+                x0 = _mm_loadu_ps(p+j+4);
+                x1 = _mm_loadu_ps(p+j);
+                c0 = _mm_add_ps(c0, _mm_mul_ps(t, x0));
+                c1 = _mm_add_ps(c1, _mm_mul_ps(t, x1));
+                e0 = _mm_add_ps(e0, _mm_mul_ps(x0, x0));
+                e1 = _mm_add_ps(e1, _mm_mul_ps(x1, x1));
+            }
+            _mm_storeu_ps(energy+i, SSE_REVERSE(e0));
+            _mm_storeu_ps(energy+i+4, SSE_REVERSE(e1));
+        } else {
+            for (j=0; j<len; j++) {
+                t = _mm_set1_ps(target[j]);
+                c0 = _mm_add_ps(c0, _mm_mul_ps(t, _mm_loadu_ps(p+j+4)));
+                c1 = _mm_add_ps(c1, _mm_mul_ps(t, _mm_loadu_ps(p+j)));
+            }
+        }
+        _mm_storeu_ps(cc+i, SSE_REVERSE(c0));
+        _mm_storeu_ps(cc+i+4, SSE_REVERSE(c1));
+    }
+    return i;
+}
+
+static int accFilterSSE(
+    float *out, const float *in, const float *coef,
+    int taps, int step, int first, int len
+){
+    int n, k;
+    const float *p;
+    __m128 c, a0, a1;
+
+    for (n=first; n+8<=len; n+=8) {
+        a0 = _mm_loadu_ps(out+n);
+        a1 = _mm_loadu_ps(out+n+4);
+        p = in+n;
+        for (k=0; k<taps; k++) {
+            c = _mm_set1_ps(coef[k]);
+            a0 = _mm_add_ps(a0, _mm_mul_ps(c, _mm_loadu_ps(p)));
+            a1 = _mm_add_ps(a1, _mm_mul_ps(c, _mm_loadu_ps(p+4)));
+            p += step;
+        }
+        _mm_storeu_ps(out+n, a0);
+        _mm_storeu_ps(out+n+4, a1);
+    }
+    return n;
+}
+
+#endif /* SIMD_SSE */
+
+#ifdef SIMD_AVX
+
+SIMD_AVX static __m256 avxReverse(__m256 x)
+{
+    x = _mm256_permute_ps(x, _MM_SHUFFLE(0,1,2,3));
+    return _mm256_permute2f128_ps(x, x, 1);
+}
+
+SIMD_AVX static int crossDotsAVX(
+    float *cc, float *energy, const float *target,
+    const float *buf, int len, int first, int count
+){
+    int i, j;
+    const float *p;
+    __m256 t, x0, x1, c0, c1, e0, e1;
+
+    for (i=first; i+16<=count; i+=16) {
+        p = buf-i-15;
+        c0 = c1 = e0 = e1 = _mm256_setzero_ps();
+        if (energy) {
+            for (j=0; j<len; j++) {
+                t = _mm256_set1_ps(target[j]);
+                x0 = _mm256_loadu_ps(p+j+8);
+                x1 = _mm256_loadu_ps(p+j);
+                c0 = _mm256_add_ps(c0, _mm256_mul_ps(t, x0));
+                c1 = _mm256_add_ps(c1, _mm256_mul_ps(t, x1));
+                e0 = _mm256_add_ps(e0, _mm256_mul_ps(x0, x0));
+                e1 = _mm256_add_ps(e1, _mm256_mul_ps(x1, x1));
+            }
+            _mm256_storeu_ps(energy+i, avxReverse(e0));
+            _mm256_storeu_ps(energy+i+8, avxReverse(e1));
+        } else {
+            for (j=0; j<len; j++) {
+                t = _mm256_set1_ps(target[j]);
+                c0 = _mm256_add_ps(c0,
+                    _mm256_mul_ps(t, _mm256_loadu_ps(p+j+8)));
+                c1 = _mm256_add_ps(c1,
+                    _mm256_mul_ps(t, _mm256_loadu_ps(p+j)));
+            }
+        }
+        _mm256_storeu_ps(cc+i, avxReverse(c0));
+        _mm256_storeu_ps(cc+i+8, avxReverse(c1));
+    }
+    return i;
+}
+
+SIMD_AVX static int accFilterAVX(
+    float *out, const float *in, const float *coef,
+    int taps, int step, int first, int len
+){
+    int n, k;
+    const float *p;
+    __m256 c, a0, a1;
+
+    for (n=first; n+16<=len; n+=16) {
+        a0 = _mm256_loadu_ps(out+n);
+        a1 = _mm256_loadu_ps(out+n+8);
+        p = in+n;
+        for (k=0; k<taps; k++) {
+            c = _mm256_set1_ps(coef[k]);
+            a0 = _mm256_add_ps(a0, _mm256_mul_ps(c, _mm256_loadu_ps(p)));
+            a1 = _mm256_add_ps(a1,
+                _mm256_mul_ps(c, _mm256_loadu_ps(p+8)));
+            p += step;
+        }
+        _mm256_storeu_ps(out+n, a0);
+        _mm256_storeu_ps(out+n+8, a1);
+    }
+    return n;
+}
+
+/*----------------------------------------------------------------*
+ *  check once if the processor and OS can run AVX code
+ *---------------------------------------------------------------*/
+
+static int hasAVX(void)
+{
+    static int avx = -1;
+
+    if (avx < 0) {
+        __builtin_cpu_init();
+        avx = __builtin_cpu_supports("avx") ? 1 : 0;
+    }
+    return avx;
+}
+
+#endif /* SIMD_AVX */
+
+/*----------------------------------------------------------------*
+ *  cross dot products of a target with backwards shifted
+ *  regressors, optionally with the energy of each regressor
+ *---------------------------------------------------------------*/
+
+void crossDots(
+    float *cc,      /* (o) cc[i] = sum of target[j]*buf[j-i] */
+    float *energy,  /* (o) sum of buf[j-i]*buf[j-i], may be 0 */
+    const float *target,/* (i) target vector */
+    const float *buf,   /* (i) regressor for i=0, regressors
+                               for higher i start before it */
+    int len,        /* (i) length of target and regressors */
+    int count       /* (i) number of regressors */
+){
+    int i = 0;
+
+#ifdef SIMD_AVX
+    if (hasAVX()) {
+        i = crossDotsAVX(cc, energy, target, buf, len, i, count);
+    }
+#endif
+#ifdef SIMD_SSE
+    i = crossDotsSSE(cc, energy, target, buf, len, i, count);
+#endif
+    crossDotsC(cc, energy, target, buf, len, i, count);
+}
+
+/*----------------------------------------------------------------*
+ *  accumulate the output of a FIR filter, the taps are summed
+ *  in coefficient order
+ *---------------------------------------------------------------*/
+
+void accFilter(
+    float *out,     /* (i/o) out[n] += sum of
+                               coef[k]*in[n+k*step] */
+    const float *in,/* (i) filter input */
+    const float *coef,  /* (i) filter coefficients */
+    int taps,       /* (i) number of coefficients */
+    int step,       /* (i) input stride between taps */
+    int len         /* (i) number of output samples */
+){
+    int n = 0;
+
+#ifdef SIMD_AVX
+    if (hasAVX()) {
+        n = accFilterAVX(out, in, coef, taps, step, n, len);
+    }
+#endif
+#ifdef SIMD_SSE
+    n = accFilterSSE(out, in, coef, taps, step, n, len);
+#endif
+    accFilterC(out, in, coef, taps, step, n, len);
+}
+
+/*----------------------------------------------------------------*
+ *  name of the kernels used on this machine
+ *---------------------------------------------------------------*/
+
+const char* simdName(void)
+{
+#ifdef SIMD_AVX
+    if (hasAVX()) {
+        return "avx";
+    }
+#endif
+#ifdef SIMD_SSE
+    return "sse";
+#else
+    return "scalar";
+#endif
+}
+
@@ -0,0 +1,40 @@
+
+/******************************************************************
+
+    iLBC Speech Coder ANSI-C Source Code
+
+    simdfun.h
+
+    Vectorized kernels for the correlation and filtering loops.
+    Each output keeps the summation order of the reference code
+    so results are bit exact with the scalar implementation.
+
+******************************************************************/
+
+#ifndef __iLBC_SIMDFUN_H
+#define __iLBC_SIMDFUN_H
+
+void crossDots(
+    float *cc,      /* (o) cc[i] = sum of target[j]*buf[j-i] */
+    float *energy,  /* (o) sum of buf[j-i]*buf[j-i], may be 0 */
+    const float *target,/* (i) target vector */
+    const float *buf,   /* (i) regressor for i=0, regressors
+                               for higher i start before it */
+    int len,        /* (i) length of target and regressors */
+    int count       /* (i) number of regressors */
+);
+
+void accFilter(
+    float *out,     /* (i/o) out[n] += sum of
+                               coef[k]*in[n+k*step] */
+    const float *in,/* (i) filter input */
+    const float *coef,  /* (i) filter coefficients */
+    int taps,       /* (i) number of coefficients */
+    int step,       /* (i) input stride between taps */
+    int len         /* (i) number of output samples */
+);
+
+const char* simdName(void); /* name of the kernels in use */
+
+#endif
+
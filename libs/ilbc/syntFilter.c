@@ -25,6 +25,7 @@ void syntFilter(
 ){
     int i, j;
     float *po, *pi, *pa, *pm;
+    float o;
 
     po=Out;
 
@@ -34,13 +35,14 @@ void syntFilter(
         pi=&Out[i-1];
         pa=&a[1];
         pm=&mem[LPC_FILTERORDER-1];
+        o=*po;
         for (j=1; j<=i; j++) {
-            *po-=(*pa++)*(*pi--);
+            o-=(*pa++)*(*pi--);
         }
         for (j=i+1; j<LPC_FILTERORDER+1; j++) {
-            *po-=(*pa++)*(*pm--);
+            o-=(*pa++)*(*pm--);
         }
-        po++;
+        *po++=o;
     }
 
     /* Filter last part where the state is entierly in 
@@ -51,10 +53,11 @@ void syntFilter(
 
         pi=&Out[i-1];
         pa=&a[1];
+        o=*po;
         for (j=1; j<LPC_FILTERORDER+1; j++) {
-            *po-=(*pa++)*(*pi--);
+            o-=(*pa++)*(*pi--);
         }
-        po++;
+        *po++=o;
     }
 
     /* Update state vector */
@@ -29,6 +29,42 @@
 using namespace TelEngine;
 
 #define INF_TIMEOUT ((u_int64_t)(int64_t)-1)
+// packets up to this size are built without allocating memory
+#define SEND_SIZE 1500
+// room for a compound RTCP report with the longest CNAME
+#define RTCP_SIZE 512
+// default average interval between RTCP reports in usec
+#define REPORT_INTERVAL 5000000
+// seconds from the NTP epoch in 1900 to the UNIX one in 1970
+#define NTP_OFFSET 2208988800U
+
+// RTCP packet types
+#define RTCP_SR   200
+#define RTCP_RR   201
+#define RTCP_SDES 202
+
+static inline u_int32_t getU32(const unsigned char* pc)
+{
+    return ((u_int32_t)pc[0] << 24) | ((u_int32_t)pc[1] << 16) |
+	((u_int32_t)pc[2] << 8) | pc[3];
+}
+
+static inline unsigned char* putU32(unsigned char* pc, u_int32_t val)
+{
+    *pc++ = (unsigned char)(val >> 24);
+    *pc++ = (unsigned char)(val >> 16);
+    *pc++ = (unsigned char)(val >> 8);
+    *pc++ = (unsigned char)(val & 0xff);
+    return pc;
+}
+
+// Middle 32 bits of the NTP timestamp of a time, 16.16 fixed point seconds
+static inline u_int32_t ntpShort(u_int64_t when)
+{
+    u_int32_t sec = (u_int32_t)(when / 1000000) + NTP_OFFSET;
+    u_int32_t frac = (u_int32_t)(((when % 1000000) << 16) / 1000000);
+    return (sec << 16) | frac;
+}
 
 bool RTPBaseIO::dataPayload(int type)
 {
@@ -123,6 +159,7 @@ void RTPReceiver::rtpData(const void* data, int len)
 	m_ts = ts - m_tsLast;
 	m_seq = seq-1;
 	m_warn = true;
+	resetStats(seq);
     }
 
     if (ss != m_ssrc) {
@@ -140,18 +177,42 @@ void RTPReceiver::rtpData(const void* data, int len)
 	m_seq = seq;
 	// resync the timestamps, next packet will come in correctly
 	m_ts = ts - m_tsLast;
+	resetStats(seq+1);
+	return;
     }
 
     // substraction with overflow
     int16_t ds = seq - m_seq;
+    // statistics are kept by the receiving thread alone, no locking
+    m_packets++;
+    if (ds > 0)
+	m_seqMax += ds;
+    if (typ == dataPayload()) {
+	// RFC 3550 interarrival jitter, all in timestamp units
+	unsigned int rate = m_session ? m_session->clockRate() : 8000;
+	u_int32_t transit = (u_int32_t)((Time::now() - m_start) * rate / 1000000) - ts;
+	if (m_transit) {
+	    int d = (int)(transit - m_transit);
+	    if (d < 0)
+		d = -d;
+	    m_jitter += d - ((m_jitter + 8) >> 4);
+	}
+	// zero is used as not set, an off by one transit makes no difference
+	m_transit = transit ? transit : 1;
+    }
     // received duplicate or delayed packet?
     if (ds <= 0) {
-	DDebug(DebugMild,"RTP received SEQ %u while current is %u [%p]",seq,m_seq,this);
-	return;
+	// only the dejitter buffer can still put a data packet in order
+	if (!(m_dejitter && (typ == dataPayload()))) {
+	    DDebug(DebugMild,"RTP received SEQ %u while current is %u [%p]",seq,m_seq,this);
+	    return;
+	}
+    }
+    else {
+	// keep track of the last sequence number and timestamp we have seen
+	m_seq = seq;
+	m_tsLast = ts - m_ts;
     }
-    // keep track of the last sequence number and timestamp we have seen
-    m_seq = seq;
-    m_tsLast = ts - m_ts;
 
     // skip over header and any CSRC
     pc += 12+(4*cc);
@@ -166,13 +227,54 @@ void RTPReceiver::rtpData(const void* data, int len)
     }
     if (len < 0)
 	return;
+    m_octets += len;
     if (!len)
 	pc = 0;
-    rtpRecv(marker,typ,m_tsLast,pc,len);
+    if (ds <= 0)
+	m_dejitter->rtpRecvData(marker,seq,ts - m_ts,pc,len);
+    else
+	rtpRecv(marker,typ,m_tsLast,pc,len);
 }
 
 void RTPReceiver::rtcpData(const void* data, int len)
 {
+    const unsigned char* pc = (const unsigned char*)data;
+    RTPSender* sender = m_session ? m_session->sender() : 0;
+    u_int64_t now = Time::now();
+    // walk the packets of a compound RTCP packet
+    while (pc && (len >= 8)) {
+	if ((pc[0] & 0xc0) != 0x80)
+	    return;
+	int rc = pc[0] & 0x1f;
+	int plen = 4 * ((((int)pc[2] << 8) | pc[3]) + 1);
+	if (plen > len)
+	    return;
+	const unsigned char* blk = 0;
+	switch (pc[1]) {
+	    case RTCP_SR:
+		if (plen < 28 + 24 * rc)
+		    break;
+		// remember when the report of the source we receive was sent
+		if (m_packets && (getU32(pc + 4) == m_ssrc)) {
+		    m_lsr = getU32(pc + 10);
+		    m_lsrTime = now;
+		}
+		blk = pc + 28;
+		break;
+	    case RTCP_RR:
+		if (plen < 8 + 24 * rc)
+		    break;
+		blk = pc + 8;
+		break;
+	}
+	// only the report about what we send is interesting
+	for (; blk && sender && rc; rc--, blk += 24) {
+	    if (getU32(blk) == sender->ssrc())
+		sender->rtcpReport(blk,now);
+	}
+	pc += plen;
+	len -= plen;
+    }
 }
 
 bool RTPReceiver::rtpRecv(bool marker, int payload, unsigned int timestamp, const void* data, int len)
@@ -185,13 +287,10 @@ bool RTPReceiver::rtpRecv(bool marker, int payload, unsigned int timestamp, cons
 	return decodeSilence(marker,timestamp,data,len);
     finishEvent(timestamp);
     if (payload == dataPayload()) {
-#if 0
-// dejitter is broken - don't use it
+	// packets are called here in order so the last sequence is theirs
 	if (m_dejitter)
-	    return m_dejitter->rtpRecvData(marker,timestamp,data,len);
-	else
-#endif
-	    return rtpRecvData(marker,timestamp,data,len);
+	    return m_dejitter->rtpRecvData(marker,m_seq,timestamp,data,len);
+	return rtpRecvData(marker,timestamp,data,len);
     }
     return false;
 }
@@ -201,6 +300,11 @@ bool RTPReceiver::rtpRecvData(bool marker, unsigned int timestamp, const void* d
     return m_session && m_session->rtpRecvData(marker,timestamp,data,len);
 }
 
+bool RTPReceiver::rtpRecvGap(unsigned int timestamp, unsigned int duration, int lost)
+{
+    return m_session && m_session->rtpRecvGap(timestamp,duration,lost);
+}
+
 bool RTPReceiver::rtpRecvEvent(int event, char key, int duration, int volume, unsigned int timestamp)
 {
     return m_session && m_session->rtpRecvEvent(event,key,duration,volume,timestamp);
@@ -275,9 +379,58 @@ void RTPReceiver::timerTick(const Time& when)
 {
 }
 
+// Restart the statistics for a new source, seq is the first packet expected
+void RTPReceiver::resetStats(u_int32_t seq)
+{
+    m_packets = 0;
+    m_octets = 0;
+    m_seqBase = seq;
+    m_seqMax = seq - 1;
+    m_expectedPrior = 0;
+    m_receivedPrior = 0;
+    m_start = Time::now();
+    m_transit = 0;
+    m_jitter = 0;
+    m_lsr = 0;
+    m_lsrTime = 0;
+}
+
+// Build the reception report block of a RTCP SR or RR
+int RTPReceiver::rtcpBlock(unsigned char* buf, u_int64_t when)
+{
+    if (!m_packets)
+	return 0;
+    u_int32_t exp = expected();
+    u_int32_t interval = exp - m_expectedPrior;
+    int lostInterval = (int)(interval - (m_packets - m_receivedPrior));
+    m_expectedPrior = exp;
+    m_receivedPrior = m_packets;
+    unsigned int fraction = 0;
+    if (interval && (lostInterval > 0))
+	fraction = ((u_int32_t)lostInterval << 8) / interval;
+    if (fraction > 255)
+	fraction = 255;
+    // cumulative number lost is a signed 24 bit value
+    int cumulative = lost();
+    if (cumulative > 0x7fffff)
+	cumulative = 0x7fffff;
+    else if (cumulative < -0x800000)
+	cumulative = -0x800000;
+    unsigned char* pc = putU32(buf,m_ssrc);
+    putU32(pc,(fraction << 24) | ((u_int32_t)cumulative & 0xffffff));
+    putU32(pc + 4,m_seqMax);
+    putU32(pc + 8,jitter());
+    putU32(pc + 12,m_lsr);
+    // delay since the last SR in units of 1/65536 seconds
+    putU32(pc + 16,m_lsr ? (u_int32_t)(((when - m_lsrTime) << 16) / 1000000) : 0);
+    return 24;
+}
+
 
 RTPSender::RTPSender(RTPSession* session, bool randomTs)
-    : RTPBaseIO(session), m_evTime(0), m_tsLast(0), m_padding(0)
+    : RTPBaseIO(session), m_evTime(0), m_tsLast(0), m_padding(0),
+      m_packets(0), m_octets(0), m_tsSent(0), m_timeSent(0),
+      m_remFraction(0), m_remLost(0), m_remJitter(0), m_rtt(0)
 {
     if (randomTs)
 	m_ts = ::random() & ~1;
@@ -309,10 +462,21 @@ bool RTPSender::rtpSend(bool marker, int payload, unsigned int timestamp, const
 	}
     }
 
-    DataBlock buf(0,len+padding+12);
-    unsigned char* pc = (unsigned char*)buf.data();
-    if (padding)
-	pc[buf.length() - 1] = padding;
+    // build usual sized packets on the stack, allocate only for huge ones
+    unsigned char stack[SEND_SIZE];
+    DataBlock heap;
+    int total = len + padding + 12;
+    unsigned char* buf = stack;
+    if (total > (int)sizeof(stack)) {
+	heap.assign(0,total);
+	buf = (unsigned char*)heap.data();
+    }
+    unsigned char* pc = buf;
+    if (padding) {
+	// padding bytes must be zero, the last one holds their count
+	::memset(pc + total - padding,0,padding - 1);
+	pc[total - 1] = padding;
+    }
     *pc++ = byte1;
     *pc++ = payload;
     *pc++ = (unsigned char)(m_seq >> 8);
@@ -327,7 +491,11 @@ bool RTPSender::rtpSend(bool marker, int payload, unsigned int timestamp, const
     *pc++ = (unsigned char)(m_ssrc & 0xff);
     if (data && len)
 	::memcpy(pc,data,len);
-    static_cast<RTPProcessor*>(m_session->transport())->rtpData(buf.data(),buf.length());
+    static_cast<RTPProcessor*>(m_session->transport())->rtpData(buf,total);
+    m_packets++;
+    m_octets += len;
+    m_tsSent = timestamp;
+    m_timeSent = Time::now();
     return true;
 }
 
@@ -427,11 +595,47 @@ void RTPSender::timerTick(const Time& when)
 {
 }
 
+// Process a reception report block the remote sent about our packets
+void RTPSender::rtcpReport(const unsigned char* block, u_int64_t when)
+{
+    m_remFraction = block[4];
+    // sign extend the 24 bit cumulative number lost
+    m_remLost = (int)(getU32(block + 4) << 8) >> 8;
+    m_remJitter = getU32(block + 12);
+    u_int32_t lsr = getU32(block + 16);
+    if (!lsr)
+	return;
+    // RFC 3550 round trip time in units of 1/65536 seconds
+    u_int32_t rtt = ntpShort(when) - lsr - getU32(block + 20);
+    if ((int)rtt >= 0)
+	m_rtt = (unsigned int)(((u_int64_t)rtt * 1000000) >> 16);
+}
+
+// Fill in the sender info of a RTCP SR, return the end of it
+unsigned char* RTPSender::rtcpInfo(unsigned char* buf, u_int64_t when)
+{
+    u_int32_t sec = (u_int32_t)(when / 1000000) + NTP_OFFSET;
+    u_int32_t frac = (u_int32_t)(((when % 1000000) << 32) / 1000000);
+    // extrapolate the timestamp of the last packet sent to the report time
+    unsigned int rate = m_session ? m_session->clockRate() : 8000;
+    u_int32_t ts = m_tsSent;
+    if (when > m_timeSent)
+	ts += (u_int32_t)((when - m_timeSent) * rate / 1000000);
+    buf = putU32(buf,sec);
+    buf = putU32(buf,frac);
+    buf = putU32(buf,ts);
+    buf = putU32(buf,m_packets);
+    return putU32(buf,m_octets);
+}
+
 
 RTPSession::RTPSession()
     : m_transport(0), m_direction(FullStop),
       m_send(0), m_recv(0),
-      m_timeoutTime(0), m_timeoutInterval(0)
+      m_timeoutTime(0), m_timeoutInterval(0),
+      m_reportTime(0), m_reportInterval(REPORT_INTERVAL), m_reportSent(0),
+      m_rate(8000), m_ssrc(0),
+      m_countSent(0), m_countReceived(0), m_countLost(0)
 {
     DDebug(DebugInfo,"RTPSession::RTPSession() [%p]",this);
 }
@@ -439,6 +643,10 @@ RTPSession::RTPSession()
 RTPSession::~RTPSession()
 {
     DDebug(DebugInfo,"RTPSession::~RTPSession() [%p]",this);
+    if (m_group) {
+	Lock lock(m_group);
+	countStats();
+    }
     direction(FullStop);
     group(0);
     transport(0);
@@ -463,6 +671,96 @@ void RTPSession::timerTick(const Time& when)
 	else
 	    m_timeoutTime = when + m_timeoutInterval;
     }
+
+    if ((m_direction != FullStop) && (when >= m_reportTime)) {
+	if (m_reportTime) {
+	    if (m_reportInterval)
+		sendReport(when);
+	    countStats();
+	}
+	// randomize the interval to avoid synchronized reports
+	u_int64_t interval = m_reportInterval ? m_reportInterval : REPORT_INTERVAL;
+	m_reportTime = when + interval / 2 + (::random() % interval);
+    }
+}
+
+// Build and send a compound RTCP packet with a SR or RR and a SDES CNAME
+void RTPSession::sendReport(u_int64_t when)
+{
+    if (!m_transport)
+	return;
+    u_int32_t ssrc = 0;
+    if (m_send)
+	ssrc = m_send->ssrcInit();
+    else {
+	while (!m_ssrc)
+	    m_ssrc = ::random();
+	ssrc = m_ssrc;
+    }
+    unsigned char buf[RTCP_SIZE];
+    unsigned char* pc = buf;
+    // we are an active sender if we sent data since the last report
+    bool sr = m_send && (m_send->packets() != m_reportSent);
+    if (m_send)
+	m_reportSent = m_send->packets();
+    pc = putU32(pc + 4,ssrc);
+    if (sr)
+	pc = m_send->rtcpInfo(pc,when);
+    int blocks = 0;
+    if (m_recv && !m_recv->m_ssrcInit) {
+	int n = m_recv->rtcpBlock(pc,when);
+	if (n) {
+	    pc += n;
+	    blocks++;
+	}
+    }
+    int len = pc - buf;
+    buf[0] = 0x80 | blocks;
+    buf[1] = sr ? RTCP_SR : RTCP_RR;
+    buf[2] = (unsigned char)((len / 4 - 1) >> 8);
+    buf[3] = (unsigned char)((len / 4 - 1) & 0xff);
+
+    // SDES with a CNAME item, the item list ends with 1 to 4 zero octets
+    String cname(m_transport->localAddr().host());
+    if (cname.length() > 255)
+	cname = cname.substr(0,255);
+    unsigned char* sdes = pc;
+    pc = putU32(pc + 4,ssrc);
+    *pc++ = 1;
+    *pc++ = cname.length();
+    ::memcpy(pc,cname.c_str(),cname.length());
+    pc += cname.length();
+    do {
+	*pc++ = 0;
+    } while ((pc - sdes) & 3);
+    len = pc - sdes;
+    sdes[0] = 0x81;
+    sdes[1] = RTCP_SDES;
+    sdes[2] = (unsigned char)((len / 4 - 1) >> 8);
+    sdes[3] = (unsigned char)((len / 4 - 1) & 0xff);
+
+    static_cast<RTPProcessor*>(m_transport)->rtcpData(buf,pc - buf);
+}
+
+// Add to the counters of our group what changed since the last call
+// Must be called with the group locked, usually from the group's thread
+void RTPSession::countStats()
+{
+    if (!m_group)
+	return;
+    unsigned int sent = m_send ? m_send->packets() : 0;
+    unsigned int received = m_recv ? m_recv->packets() : 0;
+    int lost = m_recv ? m_recv->lost() : 0;
+    // a new sender, receiver or source restarts counting from zero
+    if (sent >= m_countSent)
+	m_group->m_sent += sent - m_countSent;
+    if (received >= m_countReceived) {
+	m_group->m_received += received - m_countReceived;
+	m_group->m_lost += lost - m_countLost;
+    }
+    m_countSent = sent;
+    m_countReceived = received;
+    m_countLost = lost;
 }
 
 void RTPSession::rtpData(const void* data, int len)
@@ -492,6 +790,13 @@ bool RTPSession::rtpRecvData(bool marker, unsigned int timestamp, const void* da
     return false;
 }
 
+bool RTPSession::rtpRecvGap(unsigned int timestamp, unsigned int duration, int lost)
+{
+    XDebug(DebugAll,"RTPSession::rtpRecvGap(%u,%u,%d) [%p]",
+	timestamp,duration,lost,this);
+    return false;
+}
+
 bool RTPSession::rtpRecvEvent(int event, char key, int duration, int volume, unsigned int timestamp)
 {
     XDebug(DebugAll,"RTPSession::rtpRecvEvent(%d,%02x,%d,%d,%u) [%p]",
@@ -540,6 +845,8 @@ bool RTPSession::initGroup(int msec, Thread::Priority prio)
     // try to pick the grop from the transport if it has one
     if (m_transport)
 	group(m_transport->group());
+    if (!m_group)
+	group(RTPGroup::sharedGroup(msec,prio));
     if (!m_group)
 	group(new RTPGroup(msec,prio));
     if (!m_group)
@@ -666,4 +973,19 @@ void RTPSession::setTimeout(int interval)
     m_timeoutInterval = interval * (u_int64_t)1000;
 }
 
+void RTPSession::setReports(int interval)
+{
+    if (interval) {
+	if (interval < 0)
+	    interval = 0;
+	// force sane limits: between 500ms and 60s
+	else if (interval < 500)
+	    interval = 500;
+	else if (interval > 60000)
+	    interval = 60000;
+    }
+    m_reportTime = 0;
+    m_reportInterval = interval * (u_int64_t)1000;
+}
+
 /* vi: set ts=8 sw=4 sts=4 noet: */
@@ -23,47 +23,105 @@
 
 #include <yatertp.h>
 
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#define RTP_EPOLL
+#include <sys/epoll.h>
+#include <errno.h>
+#endif
+
+#ifndef _WINDOWS
+#include <unistd.h>
+#endif
+
 #define BUF_SIZE 1500
+// room for any source address of a received packet
+#define ADDR_SIZE 128
+// maximum socket events handled at once by a shared group
+#define RTP_EVENTS 64
 
 using namespace TelEngine;
 
 static unsigned long s_sleep = 5;
+static int s_shared = -1;
+static ObjList s_groups;
+// recursive as shared groups are created while holding it
+static Mutex s_groupsMutex(true);
+// packet counters of the groups that were already destroyed
+static u_int64_t s_sent = 0;
+static u_int64_t s_received = 0;
+static int64_t s_lost = 0;
+
+// number of packets in each window of transit time statistics
+#define JITTER_WINDOW 64
+// initial room for the payload of each dejitter slot
+#define SLOT_LEN 320
+
+// compare a raw source address with a known one without building a SocketAddr
+static inline bool sameAddr(const SocketAddr& known, const void* addr, socklen_t len)
+{
+    return (known.length() == len) && known.address() && !::memcmp(known.address(),addr,len);
+}
+
+namespace TelEngine {
 
-class RTPDelayedData : public DataBlock
+// one packet position in the ring of the dejitter buffer
+class RTPJitterSlot
 {
 public:
-    inline RTPDelayedData(u_int64_t when, bool mark, unsigned int tstamp, const void* data, int len)
-	: DataBlock(const_cast<void*>(data),len), m_scheduled(when), m_marker(mark), m_timestamp(tstamp)
+    inline RTPJitterSlot()
+	: m_used(false), m_marker(false), m_seq(0), m_timestamp(0), m_media(0), m_len(0)
 	{ }
-    inline u_int64_t scheduled() const
-	{ return m_scheduled; }
-    inline bool marker() const
-	{ return m_marker; }
-    inline unsigned int timestamp() const
-	{ return m_timestamp; }
-    inline void schedule(u_int64_t when)
-	{ m_scheduled = when; }
-private:
-    u_int64_t m_scheduled;
+    bool m_used;
     bool m_marker;
+    u_int16_t m_seq;
     unsigned int m_timestamp;
+    int64_t m_media;
+    int m_len;
 };
 
+}; // namespace TelEngine
+
 
-RTPGroup::RTPGroup(int msec, Priority prio)
-    : Mutex(true), Thread("RTP Group",prio), m_listChanged(false)
+RTPGroup::RTPGroup(int msec, Priority prio, bool shared)
+    : Mutex(true), Thread("RTP Group",prio), m_listChanged(false),
+      m_shared(shared), m_load(0), m_poll(-1),
+      m_sent(0), m_received(0), m_lost(0)
 {
-    DDebug(DebugInfo,"RTPGroup::RTPGroup() [%p]",this);
+    DDebug(DebugInfo,"RTPGroup::RTPGroup(%d,%d,%s) [%p]",
+	msec,prio,String::boolText(shared),this);
     if (msec < 1)
 	msec = 1;
     if (msec > 50)
 	msec = 50;
     m_sleep = msec;
+#ifdef RTP_EPOLL
+    if (m_shared) {
+	m_poll = ::epoll_create(RTP_EVENTS);
+	if (m_poll < 0)
+	    Debug(DebugMild,"RTPGroup could not create epoll, error %d [%p]",errno,this);
+    }
+#endif
+    s_groupsMutex.lock();
+    s_groups.append(this)->setDelete(false);
+    s_groupsMutex.unlock();
 }
 
 RTPGroup::~RTPGroup()
 {
     DDebug(DebugInfo,"RTPGroup::~RTPGroup() [%p]",this);
+    s_groupsMutex.lock();
+    s_groups.remove(this,false);
+    s_sent += m_sent;
+    s_received += m_received;
+    s_lost += m_lost;
+    s_groupsMutex.unlock();
+#ifdef RTP_EPOLL
+    if (m_poll >= 0)
+	::close(m_poll);
+#endif
 }
 
 void RTPGroup::cleanup()
@@ -89,7 +147,8 @@ void RTPGroup::run()
 {
     DDebug(DebugInfo,"RTPGroup::run() [%p]",this);
     bool ok = true;
-    while (ok) {
+    // a shared group waits for new sessions even if it ran out of processors
+    while (ok || m_shared) {
 	unsigned long msec = m_sleep;
 	if (msec < s_sleep)
 	    msec = s_sleep;
@@ -110,17 +169,79 @@ void RTPGroup::run()
 	    }
 	}
 	unlock();
-	Thread::msleep(msec,true);
+	if (polled())
+	    poll(msec);
+	else
+	    Thread::msleep(msec,true);
     }
     DDebug(DebugInfo,"RTPGroup::run() ran out of processors [%p]",this);
 }
 
+// Wait for data on the sockets of the group until the next tick is due
+void RTPGroup::poll(unsigned long msec)
+{
+#ifdef RTP_EPOLL
+    struct epoll_event events[RTP_EVENTS];
+    u_int64_t until = Time::now() + 1000 * (u_int64_t)msec;
+    for (;;) {
+	Thread::check();
+	u_int64_t now = Time::now();
+	if (now >= until)
+	    break;
+	lock();
+	m_listChanged = false;
+	unlock();
+	int n = ::epoll_wait(m_poll,events,RTP_EVENTS,(int)((until - now + 999) / 1000));
+	if (n < 0) {
+	    if (errno != EINTR) {
+		Debug(DebugWarn,"RTPGroup epoll failed with error %d [%p]",errno,this);
+		Thread::msleep(msec,true);
+		break;
+	    }
+	    continue;
+	}
+	lock();
+	// if the list changed while waiting an event may belong to a
+	//  destroyed transport, the sockets will just report again
+	for (int i = 0; (i < n) && !m_listChanged; i++)
+	    static_cast<RTPTransport*>(events[i].data.ptr)->receive();
+	unlock();
+    }
+#else
+    Thread::msleep(msec,true);
+#endif
+}
+
+void RTPGroup::watch(RTPTransport* trans, bool add)
+{
+#ifdef RTP_EPOLL
+    if (m_poll < 0)
+	return;
+    Socket* socks[2] = { &trans->m_rtpSock, &trans->m_rtcpSock };
+    for (int i = 0; i < 2; i++) {
+	if (!socks[i]->valid())
+	    continue;
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = trans;
+	if (::epoll_ctl(m_poll,(add ? EPOLL_CTL_ADD : EPOLL_CTL_DEL),socks[i]->handle(),&ev)
+	    && (errno != (add ? EEXIST : ENOENT)))
+	    Debug(DebugMild,"RTPGroup could not %s socket %d, error %d [%p]",
+		(add ? "watch" : "unwatch"),socks[i]->handle(),errno,this);
+    }
+#endif
+}
+
 void RTPGroup::join(RTPProcessor* proc)
 {
     DDebug(DebugAll,"RTPGroup::join(%p) [%p]",proc,this);
     lock();
     m_listChanged = true;
     m_processors.append(proc)->setDelete(false);
+    m_load++;
+    RTPTransport* trans = YOBJECT(RTPTransport,proc);
+    if (trans)
+	watch(trans,true);
     startup();
     unlock();
 }
@@ -130,7 +251,11 @@ void RTPGroup::part(RTPProcessor* proc)
     DDebug(DebugAll,"RTPGroup::part(%p) [%p]",proc,this);
     lock();
     m_listChanged = true;
-    m_processors.remove(proc,false);
+    if (m_processors.remove(proc,false))
+	m_load--;
+    RTPTransport* trans = YOBJECT(RTPTransport,proc);
+    if (trans)
+	watch(trans,false);
     unlock();
 }
 
@@ -143,6 +268,56 @@ void RTPGroup::setMinSleep(int msec)
     s_sleep = msec;
 }
 
+void RTPGroup::setShared(int count)
+{
+    if (!count) {
+#ifdef _WINDOWS
+	SYSTEM_INFO info;
+	::GetSystemInfo(&info);
+	count = info.dwNumberOfProcessors;
+#else
+	count = ::sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (count < 1)
+	    count = 1;
+    }
+    s_shared = count;
+}
+
+RTPGroup* RTPGroup::sharedGroup(int msec, Priority prio)
+{
+    Lock lock(s_groupsMutex);
+    if (s_shared < 0)
+	return 0;
+    RTPGroup* group = 0;
+    int count = 0;
+    for (ObjList* l = s_groups.skipNull(); l; l = l->skipNext()) {
+	RTPGroup* g = static_cast<RTPGroup*>(l->get());
+	if (!g->shared())
+	    continue;
+	count++;
+	if (!group || (g->load() < group->load()))
+	    group = g;
+    }
+    if (count < s_shared)
+	group = new RTPGroup(msec,prio,true);
+    return group;
+}
+
+void RTPGroup::totals(u_int64_t& sent, u_int64_t& received, int64_t& lost)
+{
+    Lock lock(s_groupsMutex);
+    sent = s_sent;
+    received = s_received;
+    lost = s_lost;
+    for (ObjList* l = s_groups.skipNull(); l; l = l->skipNext()) {
+	const RTPGroup* g = static_cast<const RTPGroup*>(l->get());
+	sent += g->sent();
+	received += g->received();
+	lost += g->lost();
+    }
+}
+
 
 RTPProcessor::RTPProcessor()
     : m_group(0)
@@ -191,46 +366,64 @@ RTPTransport::~RTPTransport()
     group(0);
 }
 
+YCLASSIMP(RTPTransport,RTPProcessor)
+
 void RTPTransport::timerTick(const Time& when)
 {
     XDebug(DebugAll,"RTPTransport::timerTick() group=%p [%p]",group(),this);
+    // sockets of a polled group are read as soon as data arrives
+    if (!(group() && group()->polled()))
+	receive();
+    if (m_rtpSock.valid())
+	m_rtpSock.timerTick(when);
+    if (m_rtcpSock.valid())
+	m_rtcpSock.timerTick(when);
+}
+
+void RTPTransport::receive()
+{
+    char buf[BUF_SIZE];
+    u_int64_t addr[ADDR_SIZE / sizeof(u_int64_t)];
     if (m_rtpSock.valid()) {
-	char buf[BUF_SIZE];
-	SocketAddr addr;
-	int len;
-	while ((len = m_rtpSock.recvFrom(buf,sizeof(buf),addr)) >= 12) {
+	for (;;) {
+	    socklen_t alen = sizeof(addr);
+	    int len = m_rtpSock.recvFrom(buf,sizeof(buf),(struct sockaddr*)addr,&alen);
+	    if (len < 12)
+		break;
 	    if (((unsigned char)buf[0] & 0xc0) != 0x80)
 		continue;
 	    if (!m_remoteAddr.valid())
 		continue;
 	    // looks like it's RTP, at least by version
-	    if (m_autoRemote && (addr != m_remoteAddr)) {
+	    bool same = sameAddr(m_remoteAddr,addr,alen);
+	    if (m_autoRemote && !same) {
+		SocketAddr from((struct sockaddr*)addr,alen);
 		Debug(DebugInfo,"Auto changing RTP address from %s:%d to %s:%d",
 		    m_remoteAddr.host().c_str(),m_remoteAddr.port(),
-		    addr.host().c_str(),addr.port());
-		remoteAddr(addr);
+		    from.host().c_str(),from.port());
+		remoteAddr(from);
+		same = true;
 	    }
 	    m_autoRemote = false;
-	    if (addr == m_remoteAddr) {
+	    if (same) {
 		if (m_processor)
 		    m_processor->rtpData(buf,len);
 		if (m_monitor)
 		    m_monitor->rtpData(buf,len);
 	    }
 	}
-	m_rtpSock.timerTick(when);
     }
     if (m_rtcpSock.valid()) {
-	char buf[BUF_SIZE];
-	SocketAddr addr;
-	int len;
-	while (((len = m_rtcpSock.recvFrom(buf,sizeof(buf),addr)) >= 8) && (addr == m_remoteRTCP)) {
+	for (;;) {
+	    socklen_t alen = sizeof(addr);
+	    int len = m_rtcpSock.recvFrom(buf,sizeof(buf),(struct sockaddr*)addr,&alen);
+	    if ((len < 8) || !sameAddr(m_remoteRTCP,addr,alen))
+		break;
 	    if (m_processor)
 		m_processor->rtcpData(buf,len);
 	    if (m_monitor)
 		m_monitor->rtcpData(buf,len);
 	}
-	m_rtcpSock.timerTick(when);
     }
 }
 
@@ -268,6 +461,16 @@ void RTPTransport::setMonitor(RTPProcessor* monitor)
 }
 
 bool RTPTransport::localAddr(SocketAddr& addr, bool rtcp)
+{
+    if (!bindLocal(addr,rtcp))
+	return false;
+    // a polled group must start waiting on the new sockets
+    if (group())
+	group()->watch(this,true);
+    return true;
+}
+
+bool RTPTransport::bindLocal(SocketAddr& addr, bool rtcp)
 {
     // check if sockets are already created and bound
     if (m_rtpSock.valid())
@@ -349,9 +552,13 @@ bool RTPTransport::drillHole()
 }
 
 
-RTPDejitter::RTPDejitter(RTPReceiver* receiver, unsigned int mindelay, unsigned int maxdelay)
-    : m_receiver(receiver), m_mindelay(mindelay), m_maxdelay(maxdelay),
-      m_headStamp(0), m_tailStamp(0), m_headTime(0), m_tailTime(0)
+RTPDejitter::RTPDejitter(RTPReceiver* receiver, unsigned int mindelay, unsigned int maxdelay, unsigned int rate)
+    : m_receiver(receiver), m_slots(0), m_store(0), m_size(16), m_slotLen(0), m_count(0),
+      m_rate(rate), m_mindelay(mindelay), m_maxdelay(maxdelay), m_delay(0),
+      m_started(false), m_delivered(false), m_nextSeq(0), m_newSeq(0),
+      m_newStamp(0), m_lastStamp(0), m_gap(0), m_extStamp(0), m_offset(0),
+      m_lastTransit(0), m_jitter(0), m_winCount(0),
+      m_late(0), m_lost(0), m_reordered(0)
 {
     if (m_maxdelay > 2000000)
 	m_maxdelay = 2000000;
@@ -361,97 +568,231 @@ RTPDejitter::RTPDejitter(RTPReceiver* receiver, unsigned int mindelay, unsigned
 	m_mindelay = 5000;
     if (m_mindelay > m_maxdelay - 20000)
 	m_mindelay = m_maxdelay - 20000;
+    if (!m_rate)
+	m_rate = 8000;
+    m_delay = m_mindelay;
+    // enough slots to hold the longest delay of 10ms packets
+    while (m_size < 4 + m_maxdelay / 10000)
+	m_size <<= 1;
+    m_slots = new RTPJitterSlot[m_size];
+    storage(SLOT_LEN);
+    m_winMin[0] = m_winMin[1] = m_winMax[0] = m_winMax[1] = 0;
 }
 
 RTPDejitter::~RTPDejitter()
 {
-    DDebug(DebugMild,"Dejitter destroyed with %u packets [%p]",m_packets.count(),this);
+    DDebug(DebugInfo,"Dejitter destroyed with %u packets, late=%u lost=%u reordered=%u [%p]",
+	m_count,m_late,m_lost,m_reordered,this);
+    delete[] m_slots;
+    if (m_store)
+	::free(m_store);
 }
 
-bool RTPDejitter::rtpRecvData(bool marker, unsigned int timestamp, const void* data, int len)
+bool RTPDejitter::storage(int len)
 {
-    u_int64_t when = 0;
-    bool insert = false;
-
-    if (m_headStamp && (m_tailStamp != m_headStamp)) {
-	// at least one packet got out of the queue and another is waiting
-	int dTs = timestamp - m_headStamp;
-	if (dTs < 0) {
-	    DDebug(DebugMild,"Dejitter got TS %u while last delivered was %u [%p]",timestamp,m_headStamp,this);
-	    return false;
-	}
-	u_int64_t bufTime = m_tailTime - m_headTime;
-	int bufStamp = m_tailStamp - m_headStamp;
-	if (bufStamp <= 0)
-	    Debug(DebugWarn,"Oops! %d [%p]",bufStamp,this);
-	// interpolate or extrapolate the delivery time for the packet
-	// rounding down is ok - the buffer will slowly shrink as expected
-	when = dTs * bufTime / bufStamp;
-DDebug(DebugMild,"Dejitter when=" FMT64U " dTs=%d bufTime=" FMT64U " bufSTamp=%d [%p]",
-    when,dTs,bufTime,bufStamp,this);
-	when += m_headTime;
-	if (dTs > bufStamp) {
-	    bufTime = when - m_headTime;
-	    if (bufTime > m_maxdelay) {
-		// buffer has lagged behind so we must drop some old packets
-		// and also reschedule the others
-		DDebug(DebugMild,"Dejitter grew to " FMT64U " [%p]",bufTime,this);
-//		when = m_headTime - 
-	    }
+    if ((unsigned int)len <= m_slotLen)
+	return true;
+    unsigned int slotLen = (len + 63) & ~63;
+    unsigned char* store = (unsigned char*)::malloc(m_size * slotLen);
+    if (!store) {
+	Debug("RTPDejitter",DebugFail,"malloc(%u) returned NULL!",m_size * slotLen);
+	return false;
+    }
+    if (m_store) {
+	for (unsigned int i = 0; i < m_size; i++) {
+	    if (m_slots[i].m_used && m_slots[i].m_len)
+		::memcpy(store + i * slotLen,m_store + i * m_slotLen,m_slots[i].m_len);
 	}
-	else
-	    // timestamp falls inside buffer so we must insert the packet
-	    // between the already scheduled ones
-	    insert = true;
+	::free(m_store);
+    }
+    m_store = store;
+    m_slotLen = slotLen;
+    return true;
+}
+
+bool RTPDejitter::rtpRecvData(bool marker, u_int16_t seq, unsigned int timestamp, const void* data, int len)
+{
+    if ((len < 0) || (len && !data) || !storage(len))
+	return false;
+    int64_t now = Time::now();
+    // substraction with overflow
+    int16_t dn = seq - m_newSeq;
+    if (m_started && ((dn >= (int)(2 * m_size)) || (dn <= -(int)(2 * m_size)))) {
+	// sequence numbers jumped, play what we hold and start over
+	DDebug(DebugInfo,"Dejitter restarting at SEQ %u after %u [%p]",seq,m_newSeq,this);
+	flush(m_newSeq + 1);
+	m_started = false;
+    }
+    if (!m_started) {
+	m_started = true;
+	m_delivered = false;
+	m_gap = 0;
+	m_nextSeq = seq;
+	m_newSeq = seq - 1;
+	m_newStamp = timestamp;
+	m_extStamp = 0;
+	m_lastTransit = now;
+	m_winMin[0] = m_winMin[1] = m_winMax[0] = m_winMax[1] = now;
+	m_winCount = 0;
+	m_offset = now + m_delay;
+    }
+
+    int16_t ds = seq - m_nextSeq;
+    if (ds < 0) {
+	// its turn to be played has already passed
+	m_late++;
+	DDebug(DebugMild,"Dejitter dropping late SEQ %u while expecting %u [%p]",seq,m_nextSeq,this);
+	return false;
+    }
+    if ((unsigned int)ds >= m_size) {
+	// buffer has lagged behind, make room by playing the oldest packets
+	DDebug(DebugMild,"Dejitter got SEQ %u, flushing from %u [%p]",seq,m_nextSeq,this);
+	flush(seq - m_size + 1);
+    }
+    unsigned int idx = seq & (m_size - 1);
+    RTPJitterSlot& slot = m_slots[idx];
+    if (slot.m_used) {
+	DDebug(DebugMild,"Dejitter dropping duplicate SEQ %u [%p]",seq,this);
+	return false;
+    }
+
+    // map the timestamp to a media time in microseconds
+    int64_t media = 0;
+    dn = seq - m_newSeq;
+    if (dn > 0) {
+	m_extStamp += (int32_t)(timestamp - m_newStamp);
+	m_newStamp = timestamp;
+	m_newSeq = seq;
+	media = m_extStamp;
     }
     else {
-	if (m_tailStamp) {
-	    int dTs = timestamp - m_tailStamp;
-	    if (dTs < 0) {
-		// until we get some statistics don't attempt to reorder packets
-		DDebug(DebugMild,"Dejitter got TS %u while last queued was %u [%p]",timestamp,m_tailStamp,this);
-		return false;
-	    }
-	}
-	// we got no packets out yet so use a fixed interval
-	when = Time::now() + m_mindelay;
+	m_reordered++;
+	media = m_extStamp + (int32_t)(timestamp - m_newStamp);
     }
+    media = media * 1000000 / m_rate;
+
+    // track the transit time, its difference from media time to arrival
+    int64_t transit = now - media;
+    if (dn > 0) {
+	// interarrival jitter as in RFC 3550, kept scaled by 16
+	int64_t d = transit - m_lastTransit;
+	if (d < 0)
+	    d = -d;
+	m_jitter += d - ((m_jitter + 8) >> 4);
+	m_lastTransit = transit;
+    }
+    if (transit < m_winMin[0])
+	m_winMin[0] = transit;
+    if (transit > m_winMax[0])
+	m_winMax[0] = transit;
+    if (++m_winCount >= JITTER_WINDOW) {
+	m_winCount = 0;
+	m_winMin[1] = m_winMin[0];
+	m_winMax[1] = m_winMax[0];
+	m_winMin[0] = m_winMax[0] = transit;
+    }
+
+    // delay must cover the transit spread of the last two windows
+    int64_t base = (m_winMin[0] < m_winMin[1]) ? m_winMin[0] : m_winMin[1];
+    int64_t spread = ((m_winMax[0] > m_winMax[1]) ? m_winMax[0] : m_winMax[1]) - base;
+    spread += spread >> 2;
+    if (spread < m_mindelay)
+	spread = m_mindelay;
+    if (spread > m_maxdelay)
+	spread = m_maxdelay;
+    m_delay = (unsigned int)spread;
+    int64_t target = base + spread;
+    // grow at once to avoid late packets, shrink slowly unless
+    //  a new talkspurt starts in an empty buffer
+    if ((target > m_offset) || (marker && !m_count))
+	m_offset = target;
+    else
+	m_offset -= (m_offset - target) >> 4;
+
+    slot.m_used = true;
+    slot.m_marker = marker;
+    slot.m_seq = seq;
+    slot.m_timestamp = timestamp;
+    slot.m_media = media;
+    slot.m_len = len;
+    if (len)
+	::memcpy(m_store + idx * m_slotLen,data,len);
+    m_count++;
+    return true;
+}
 
-    if (when > m_tailTime) {
-	// remember the latest in the queue
-	m_tailStamp = timestamp;
-	m_tailTime = when;
+unsigned int RTPDejitter::nextStored() const
+{
+    for (unsigned int n = 1; n < m_size; n++) {
+	const RTPJitterSlot& slot = m_slots[(u_int16_t)(m_nextSeq + n) & (m_size - 1)];
+	if (slot.m_used && (slot.m_seq == (u_int16_t)(m_nextSeq + n)))
+	    return n;
     }
-    RTPDelayedData* packet = new RTPDelayedData(when,marker,timestamp,data,len);
-    if (insert) {
-	for (ObjList* l = m_packets.skipNull();l;l = l->skipNext()) {
-	    RTPDelayedData* pkt = static_cast<RTPDelayedData*>(l->get());
-	    if (pkt->scheduled() > when) {
-		DDebug(DebugMild,"Dejitter inserting packet %p before %p [%p]",packet,pkt,this);
-		l->insert(packet);
-		return true;
-	    }
+    return 0;
+}
+
+void RTPDejitter::deliver(RTPJitterSlot& slot)
+{
+    slot.m_used = false;
+    m_count--;
+    m_nextSeq = slot.m_seq + 1;
+    if (m_gap) {
+	int dTs = slot.m_timestamp - m_lastStamp;
+	if (m_receiver && m_delivered && (dTs > 0)) {
+	    // assume the lost packets were evenly spaced
+	    unsigned int step = dTs / (m_gap + 1);
+	    m_receiver->rtpRecvGap(m_lastStamp + step,dTs - step,m_gap);
 	}
+	m_gap = 0;
     }
-    m_packets.append(packet);
-    return true;
+    m_delivered = true;
+    m_lastStamp = slot.m_timestamp;
+    if (m_receiver)
+	m_receiver->rtpRecvData(slot.m_marker,slot.m_timestamp,
+	    slot.m_len ? m_store + (&slot - m_slots) * m_slotLen : 0,slot.m_len);
 }
 
-void RTPDejitter::timerTick(const Time& when)
+void RTPDejitter::flush(u_int16_t seq)
 {
-    RTPDelayedData* packet = static_cast<RTPDelayedData*>(m_packets.get());
-    if (!packet) {
-	// queue is empty - reset timestamps
-	m_headStamp = m_tailStamp = 0;
-	return;
+    while (m_count && ((int16_t)(seq - m_nextSeq) > 0)) {
+	RTPJitterSlot& slot = m_slots[m_nextSeq & (m_size - 1)];
+	if (slot.m_used && (slot.m_seq == m_nextSeq))
+	    deliver(slot);
+	else {
+	    m_lost++;
+	    m_gap++;
+	    m_nextSeq++;
+	}
     }
-    if (packet->scheduled() <= when) {
-	// remember the last delivered
-	m_headStamp = packet->timestamp();
-	m_headTime = when;
-	if (m_receiver)
-	    m_receiver->rtpRecvData(packet->marker(),packet->timestamp(),packet->data(),packet->length());
-	m_packets.remove(packet);
+    int16_t ds = seq - m_nextSeq;
+    if (ds > 0) {
+	m_lost += ds;
+	m_gap += ds;
+	m_nextSeq = seq;
+    }
+}
+
+void RTPDejitter::timerTick(const Time& when)
+{
+    int64_t now = when.usec();
+    // deliver all packets that are due, there may be several if we fell behind
+    while (m_count) {
+	RTPJitterSlot* slot = m_slots + (m_nextSeq & (m_size - 1));
+	if (!(slot->m_used && (slot->m_seq == m_nextSeq))) {
+	    // packet is missing, wait for it until the next one is due
+	    unsigned int n = nextStored();
+	    if (!n)
+		break;
+	    slot = m_slots + ((u_int16_t)(m_nextSeq + n) & (m_size - 1));
+	    if (slot->m_media + m_offset > now)
+		break;
+	    m_lost += n;
+	    m_gap += n;
+	    m_nextSeq += n;
+	}
+	else if (slot->m_media + m_offset > now)
+	    break;
+	deliver(*slot);
     }
 }
 
@@ -122,14 +122,18 @@ private:
 class YRTP_API RTPGroup : public GenObject, public Mutex, public Thread
 {
     friend class RTPProcessor;
+    friend class RTPTransport;
+    friend class RTPSession;
 
 public:
     /**
      * Constructor
      * @param msec Minimum time to sleep in loop in milliseconds
      * @param prio Thread priority to run this group
+     * @param shared True to keep the group running for many sessions, its
+     *  sockets are waited on instead of polled where supported
      */
-    RTPGroup(int msec = 0, Priority prio = Normal);
+    RTPGroup(int msec = 0, Priority prio = Normal, bool shared = false);
 
     /**
      * Group destructor, removes itself from all remaining processors
@@ -152,6 +156,72 @@ public:
      */
     static void setMinSleep(int msec);
 
+    /**
+     * Set the number of shared groups that run all the sessions
+     * @param count Number of shared groups, zero for one per CPU,
+     *  negative to run each session in its own group
+     */
+    static void setShared(int count);
+
+    /**
+     * Get the least loaded shared group, a new one is started while
+     *  there are less than the configured number
+     * @param msec Minimum time to sleep in loop of a new group
+     * @param prio Thread priority to run a new group
+     * @return Pointer to a shared group, NULL if groups are not shared
+     */
+    static RTPGroup* sharedGroup(int msec = 0, Priority prio = Normal);
+
+    /**
+     * Check if this group is shared by many sessions
+     * @return True if the group keeps running even when it has no processors
+     */
+    inline bool shared() const
+	{ return m_shared; }
+
+    /**
+     * Check if the sockets of this group are waited on rather than polled
+     * @return True if data is read as soon as it arrives on sockets
+     */
+    inline bool polled() const
+	{ return m_poll >= 0; }
+
+    /**
+     * Get the load of this group
+     * @return Number of processors in the group
+     */
+    inline unsigned int load() const
+	{ return m_load; }
+
+    /**
+     * Get the number of RTP packets sent by the sessions of this group
+     * @return Packets sent up to the last report of each session
+     */
+    inline u_int64_t sent() const
+	{ return m_sent; }
+
+    /**
+     * Get the number of RTP packets received by the sessions of this group
+     * @return Packets received up to the last report of each session
+     */
+    inline u_int64_t received() const
+	{ return m_received; }
+
+    /**
+     * Get the number of RTP packets lost on the way to the sessions of this group
+     * @return Packets expected but not received, negative if duplicates were received
+     */
+    inline int64_t lost() const
+	{ return m_lost; }
+
+    /**
+     * Get the packet counters summed over all the groups that ever ran
+     * @param sent Set to the total number of packets sent
+     * @param received Set to the total number of packets received
+     * @param lost Set to the total number of packets lost
+     */
+    static void totals(u_int64_t& sent, u_int64_t& received, int64_t& lost);
+
 protected:
     /**
      * Add a RTP processor to this group
@@ -166,9 +236,17 @@ protected:
     void part(RTPProcessor* proc);
 
 private:
+    void watch(RTPTransport* trans, bool add);
+    void poll(unsigned long msec);
     ObjList m_processors;
     bool m_listChanged;
+    bool m_shared;
     unsigned long m_sleep;
+    unsigned int m_load;
+    int m_poll;
+    u_int64_t m_sent;
+    u_int64_t m_received;
+    int64_t m_lost;
 };
 
 /**
@@ -177,6 +255,8 @@ private:
  */
 class YRTP_API RTPTransport : public RTPProcessor
 {
+    friend class RTPGroup;
+
 public:
     /**
      * Activation status of the transport
@@ -197,6 +277,13 @@ public:
      */
     virtual ~RTPTransport();
 
+    /**
+     * Get a pointer to a derived class given that class name
+     * @param name Name of the class we are asking for
+     * @return Pointer to the requested class or NULL if this object doesn't implement it
+     */
+    virtual void* getObject(const String& name) const;
+
     /**
      * Set the RTP/RTCP processor of data received by this transport
      * @param processor A pointer to the RTPProcessor for this transport
@@ -282,6 +369,8 @@ protected:
     virtual void rtcpData(const void* data, int len);
 
 private:
+    bool bindLocal(SocketAddr& addr, bool rtcp);
+    void receive();
     RTPProcessor* m_processor;
     RTPProcessor* m_monitor;
     Socket m_rtpSock;
@@ -292,10 +381,13 @@ private:
     bool m_autoRemote;
 };
 
+class RTPJitterSlot;
+
 /**
  * A dejitter buffer that can be inserted in the receive data path to
  *  absorb variations in packet arrival time. Incoming packets are stored
- *  and forwarded at fixed intervals.
+ *  in a ring of preallocated slots indexed by sequence number and are
+ *  forwarded in order after a delay that adapts to the measured jitter.
  * @short Dejitter buffer for incoming data packets
  */
 class YRTP_API RTPDejitter : public RTPProcessor
@@ -306,8 +398,10 @@ public:
      * @param receiver RTP receiver which gets the delayed packets
      * @param mindelay Minimum length of the dejitter buffer in microseconds
      * @param maxdelay Maximum length of the dejitter buffer in microseconds
+     * @param rate Clock rate of the RTP timestamps in Hz
      */
-    RTPDejitter(RTPReceiver* receiver, unsigned int mindelay, unsigned int maxdelay);
+    RTPDejitter(RTPReceiver* receiver, unsigned int mindelay, unsigned int maxdelay,
+	unsigned int rate = 8000);
 
     /**
      * Destructor - drops the packets and shows statistics
@@ -317,14 +411,69 @@ public:
     /**
      * Process and store one RTP data packet
      * @param marker True if the marker bit is set in data packet
+     * @param seq Sequence number of the packet
      * @param timestamp Sampling instant of the packet data
      * @param data Pointer to data block to process
      * @param len Length of the data block in bytes
-     * @return True if data was handled
+     * @return True if data was stored for later delivery
      */
-    virtual bool rtpRecvData(bool marker, unsigned int timestamp,
+    virtual bool rtpRecvData(bool marker, u_int16_t seq, unsigned int timestamp,
 	const void* data, int len);
 
+    /**
+     * Process and store one RTP data packet that follows the newest stored one
+     * @param marker True if the marker bit is set in data packet
+     * @param timestamp Sampling instant of the packet data
+     * @param data Pointer to data block to process
+     * @param len Length of the data block in bytes
+     * @return True if data was stored for later delivery
+     */
+    inline bool rtpRecvData(bool marker, unsigned int timestamp,
+	const void* data, int len)
+	{ return rtpRecvData(marker,m_newSeq+1,timestamp,data,len); }
+
+    /**
+     * Get the number of packets that arrived after their playout time
+     * @return Count of packets dropped for being late
+     */
+    inline unsigned int late() const
+	{ return m_late; }
+
+    /**
+     * Get the number of packets that never arrived in time to be played
+     * @return Count of packets skipped over as lost
+     */
+    inline unsigned int lost() const
+	{ return m_lost; }
+
+    /**
+     * Get the number of packets that arrived out of order but in time
+     * @return Count of packets put back in sequence
+     */
+    inline unsigned int reordered() const
+	{ return m_reordered; }
+
+    /**
+     * Get the number of packets currently held in the buffer
+     * @return Current depth of the buffer in packets
+     */
+    inline unsigned int depth() const
+	{ return m_count; }
+
+    /**
+     * Get the playout delay currently targeted by the buffer
+     * @return Current delay in microseconds
+     */
+    inline unsigned int delay() const
+	{ return m_delay; }
+
+    /**
+     * Get the interarrival jitter estimate as defined by RFC 3550
+     * @return Smoothed jitter in microseconds
+     */
+    inline unsigned int jitter() const
+	{ return (unsigned int)(m_jitter >> 4); }
+
 protected:
     /**
      * Method called periodically to keep the data flowing
@@ -333,14 +482,37 @@ protected:
     virtual void timerTick(const Time& when);
 
 private:
-    ObjList m_packets;
+    void deliver(RTPJitterSlot& slot);
+    void flush(u_int16_t seq);
+    bool storage(int len);
+    unsigned int nextStored() const;
     RTPReceiver* m_receiver;
+    RTPJitterSlot* m_slots;
+    unsigned char* m_store;
+    unsigned int m_size;
+    unsigned int m_slotLen;
+    unsigned int m_count;
+    unsigned int m_rate;
     unsigned int m_mindelay;
     unsigned int m_maxdelay;
-    unsigned int m_headStamp;
-    unsigned int m_tailStamp;
-    u_int64_t m_headTime;
-    u_int64_t m_tailTime;
+    unsigned int m_delay;
+    bool m_started;
+    bool m_delivered;
+    u_int16_t m_nextSeq;
+    u_int16_t m_newSeq;
+    unsigned int m_newStamp;
+    unsigned int m_lastStamp;
+    unsigned int m_gap;
+    int64_t m_extStamp;
+    int64_t m_offset;
+    int64_t m_lastTransit;
+    int64_t m_jitter;
+    int64_t m_winMin[2];
+    int64_t m_winMax[2];
+    unsigned int m_winCount;
+    unsigned int m_late;
+    unsigned int m_lost;
+    unsigned int m_reordered;
 };
 
 /**
@@ -468,7 +640,10 @@ public:
      * Constructor
      */
     inline RTPReceiver(RTPSession* session = 0)
-	: RTPBaseIO(session), m_dejitter(0), m_tsLast(0), m_warn(true)
+	: RTPBaseIO(session), m_dejitter(0), m_tsLast(0), m_warn(true),
+	  m_packets(0), m_octets(0), m_seqBase(0), m_seqMax(0),
+	  m_expectedPrior(0), m_receivedPrior(0), m_start(0),
+	  m_transit(0), m_jitter(0), m_lsr(0), m_lsrTime(0)
 	{ }
 
     /**
@@ -486,9 +661,52 @@ public:
      * Allocate and set a new dejitter buffer in this receiver
      * @param mindelay Minimum length of the dejitter buffer in microseconds
      * @param maxdelay Maximum length of the dejitter buffer in microseconds
+     * @param rate Clock rate of the RTP timestamps in Hz
+     */
+    inline void setDejitter(unsigned int mindelay, unsigned int maxdelay, unsigned int rate = 8000)
+	{ setDejitter(new RTPDejitter(this,mindelay,maxdelay,rate)); }
+
+    /**
+     * Get the dejitter buffer of this receiver
+     * @return Pointer to the dejitter buffer, NULL if none is set
+     */
+    inline RTPDejitter* dejitter() const
+	{ return m_dejitter; }
+
+    /**
+     * Get the number of RTP packets received from the current source
+     * @return Count of packets received, including duplicates
+     */
+    inline unsigned int packets() const
+	{ return m_packets; }
+
+    /**
+     * Get the number of payload octets received from the current source
+     * @return Count of payload octets received
+     */
+    inline unsigned int octets() const
+	{ return m_octets; }
+
+    /**
+     * Get the number of packets expected from the current source
+     * @return Difference between the highest and first sequence numbers
      */
-    inline void setDejitter(unsigned int mindelay, unsigned int maxdelay)
-	{ setDejitter(new RTPDejitter(this,mindelay,maxdelay)); }
+    inline unsigned int expected() const
+	{ return m_packets ? m_seqMax - m_seqBase + 1 : 0; }
+
+    /**
+     * Get the cumulative number of packets lost as defined by RFC 3550
+     * @return Packets expected but not received, negative if duplicates were received
+     */
+    inline int lost() const
+	{ return (int)(expected() - m_packets); }
+
+    /**
+     * Get the interarrival jitter of data packets as defined by RFC 3550
+     * @return Smoothed jitter in timestamp units
+     */
+    inline unsigned int jitter() const
+	{ return m_jitter >> 4; }
 
     /**
      * Process one RTP payload packet.
@@ -514,6 +732,17 @@ public:
     virtual bool rtpRecvData(bool marker, unsigned int timestamp,
 	const void* data, int len);
 
+    /**
+     * Method called by the dejitter buffer when packets were lost before
+     *  the one about to be delivered. This is the place to insert packet
+     *  loss concealment or comfort noise for the missing interval.
+     * @param timestamp Sampling instant where the missing data starts
+     * @param duration Length of the missing data in timestamp units
+     * @param lost Number of packets that were lost
+     * @return True if the gap was filled
+     */
+    virtual bool rtpRecvGap(unsigned int timestamp, unsigned int duration, int lost);
+
     /**
      * Process one RTP event
      * @param event Received event code
@@ -558,9 +787,22 @@ private:
     bool decodeSilence(bool marker, unsigned int timestamp, const void* data, int len);
     void finishEvent(unsigned int timestamp);
     bool pushEvent(int event, int duration, int volume, unsigned int timestamp);
+    void resetStats(u_int32_t seq);
+    int rtcpBlock(unsigned char* buf, u_int64_t when);
     RTPDejitter* m_dejitter;
     unsigned int m_tsLast;
     bool m_warn;
+    unsigned int m_packets;
+    unsigned int m_octets;
+    u_int32_t m_seqBase;
+    u_int32_t m_seqMax;
+    u_int32_t m_expectedPrior;
+    u_int32_t m_receivedPrior;
+    u_int64_t m_start;
+    u_int32_t m_transit;
+    u_int32_t m_jitter;
+    u_int32_t m_lsr;
+    u_int64_t m_lsrTime;
 };
 
 /**
@@ -569,6 +811,8 @@ private:
  */
 class YRTP_API RTPSender : public RTPBaseIO
 {
+    friend class RTPReceiver;
+    friend class RTPSession;
 public:
     /**
      * Constructor
@@ -641,6 +885,48 @@ public:
      */
     bool padding(int chunk);
 
+    /**
+     * Get the number of RTP packets sent
+     * @return Count of packets sent by this sender
+     */
+    inline unsigned int packets() const
+	{ return m_packets; }
+
+    /**
+     * Get the number of payload octets sent
+     * @return Count of payload octets sent by this sender
+     */
+    inline unsigned int octets() const
+	{ return m_octets; }
+
+    /**
+     * Get the fraction of our packets lost since the previous remote report
+     * @return Fraction lost as a fixed point number with 8 bits after the point
+     */
+    inline unsigned int remoteFraction() const
+	{ return m_remFraction; }
+
+    /**
+     * Get the cumulative number of our packets lost as seen by the remote
+     * @return Packets lost from the last RTCP report, negative if duplicated
+     */
+    inline int remoteLost() const
+	{ return m_remLost; }
+
+    /**
+     * Get the interarrival jitter of our packets as seen by the remote
+     * @return Jitter from the last RTCP report in timestamp units
+     */
+    inline unsigned int remoteJitter() const
+	{ return m_remJitter; }
+
+    /**
+     * Get the round trip time computed from the last RTCP report
+     * @return Round trip time in microseconds, zero if not known yet
+     */
+    inline unsigned int rtt() const
+	{ return m_rtt; }
+
 protected:
     /**
      * Method called periodically to send events and buffered data
@@ -652,7 +938,17 @@ private:
     int m_evTime;
     unsigned int m_tsLast;
     unsigned char m_padding;
+    unsigned int m_packets;
+    unsigned int m_octets;
+    u_int32_t m_tsSent;
+    u_int64_t m_timeSent;
+    unsigned int m_remFraction;
+    int m_remLost;
+    unsigned int m_remJitter;
+    unsigned int m_rtt;
     bool sendEventData(unsigned int timestamp);
+    void rtcpReport(const unsigned char* block, u_int64_t when);
+    unsigned char* rtcpInfo(unsigned char* buf, u_int64_t when);
 };
 
 /**
@@ -707,6 +1003,17 @@ public:
     virtual bool rtpRecvData(bool marker, unsigned int timestamp,
 	const void* data, int len);
 
+    /**
+     * Method called by the dejitter buffer when packets were lost before
+     *  the one about to be delivered. This is the place to insert packet
+     *  loss concealment or comfort noise for the missing interval.
+     * @param timestamp Sampling instant where the missing data starts
+     * @param duration Length of the missing data in timestamp units
+     * @param lost Number of packets that were lost
+     * @return True if the gap was filled
+     */
+    virtual bool rtpRecvGap(unsigned int timestamp, unsigned int duration, int lost);
+
     /**
      * Process one RTP event
      * @param event Received event code
@@ -838,9 +1145,18 @@ public:
      * Allocate and set a new dejitter buffer for the receiver in the session
      * @param mindelay Minimum length of the dejitter buffer in microseconds
      * @param maxdelay Maximum length of the dejitter buffer in microseconds
+     * @param rate Clock rate of the RTP timestamps in Hz
+     */
+    inline void setDejitter(unsigned int mindelay = 20, unsigned int maxdelay = 50,
+	unsigned int rate = 8000)
+	{ if (m_recv) m_recv->setDejitter(mindelay,maxdelay,rate); }
+
+    /**
+     * Get the dejitter buffer of the receiver in the session
+     * @return Pointer to the dejitter buffer, NULL if none is set
      */
-    inline void setDejitter(unsigned int mindelay = 20, unsigned int maxdelay = 50)
-	{ if (m_recv) m_recv->setDejitter(mindelay,maxdelay); }
+    inline RTPDejitter* dejitter() const
+	{ return m_recv ? m_recv->dejitter() : 0; }
 
     /**
      * Get the RTP/RTCP transport of data handled by this session.
@@ -981,6 +1297,26 @@ public:
      */
     void setTimeout(int interval);
 
+    /**
+     * Set the average interval between RTCP reports sent by this session
+     * @param interval Average milliseconds between reports, zero to disable
+     */
+    void setReports(int interval);
+
+    /**
+     * Get the clock rate of the RTP timestamps
+     * @return Clock rate in Hz
+     */
+    inline unsigned int clockRate() const
+	{ return m_rate; }
+
+    /**
+     * Set the clock rate of the RTP timestamps used to compute jitter
+     * @param rate Clock rate in Hz, zero to use 8000
+     */
+    inline void clockRate(unsigned int rate)
+	{ m_rate = rate ? rate : 8000; }
+
 protected:
     /**
      * Method called periodically to push any asynchronous data or statistics
@@ -995,12 +1331,22 @@ protected:
     virtual void timeout(bool initial);
 
 private:
+    void sendReport(u_int64_t when);
+    void countStats();
     RTPTransport* m_transport;
     Direction m_direction;
     RTPSender* m_send;
     RTPReceiver* m_recv;
     u_int64_t m_timeoutTime;
     u_int64_t m_timeoutInterval;
+    u_int64_t m_reportTime;
+    u_int64_t m_reportInterval;
+    unsigned int m_reportSent;
+    unsigned int m_rate;
+    u_int32_t m_ssrc;
+    unsigned int m_countSent;
+    unsigned int m_countReceived;
+    int m_countLost;
 };
 
 }
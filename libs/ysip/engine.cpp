@@ -32,6 +32,38 @@
 
 using namespace TelEngine;
 
+// lists in each of the transaction indexes
+#define TRANS_INDEX 1021
+
+// Entry of a transaction in one of the indexes
+class TransIndex : public String
+{
+public:
+    inline TransIndex(const String& key, SIPTransaction* trans)
+	: String(key), m_trans(trans)
+	{ }
+    SIPTransaction* m_trans;
+};
+
+// Build the key of the RFC 2543 fallback transaction index
+static inline void dialogKey(String& key, const String& callid, int cseq)
+{
+    key << callid << " " << cseq;
+}
+
+// Remove the entry of a transaction from an index
+static void unindex(HashList& index, const String& key, const SIPTransaction* trans)
+{
+    ObjList* l = index.getHashList(key);
+    for (; l; l = l->next()) {
+	const TransIndex* i = static_cast<const TransIndex*>(l->get());
+	if (i && (i->m_trans == trans)) {
+	    l->remove();
+	    return;
+	}
+    }
+}
+
 static TokenDict sip_responses[] = {
     { "Trying", 100 },
     { "Ringing", 180 },
@@ -150,9 +182,11 @@ SIPEvent::~SIPEvent()
 
 
 SIPEngine::SIPEngine(const char* userAgent)
-    : m_mutex(true),
+    : m_branches(TRANS_INDEX), m_dialogs(TRANS_INDEX), m_mutex(true),
       m_t1(500000), m_t4(5000000), m_maxForwards(70),
-      m_cseq(0), m_userAgent(userAgent), m_nonce_time(0)
+      m_cseq(0), m_userAgent(userAgent), m_nonce_time(0),
+      m_readyFirst(0), m_readyLast(0), m_readyPending(0),
+      m_timers(0), m_timerCount(0), m_timerAlloc(0)
 {
     debugName("sipengine");
     DDebug(this,DebugInfo,"SIPEngine::SIPEngine() [%p]",this);
@@ -167,6 +201,9 @@ SIPEngine::SIPEngine(const char* userAgent)
 SIPEngine::~SIPEngine()
 {
     DDebug(this,DebugInfo,"SIPEngine::~SIPEngine() [%p]",this);
+    // transactions remove themselves from the indexes so clear them first
+    TransList.clear();
+    delete[] m_timers;
 }
 
 SIPTransaction* SIPEngine::addMessage(SIPParty* ep, const char* buf, int len)
@@ -205,10 +242,38 @@ SIPTransaction* SIPEngine::addMessage(SIPMessage* message)
 	branch.clear();
     Lock lock(m_mutex);
     SIPTransaction* forked = 0;
-    ObjList* l = &TransList;
+    // only transactions with the same branch can match a RFC 3261 message...
+    ObjList* l = branch ? m_branches.getHashList(branch) : 0;
+    for (; l; l = l->next()) {
+	const TransIndex* i = static_cast<const TransIndex*>(l->get());
+	if (!i || (*i != branch))
+	    continue;
+	SIPTransaction* t = i->m_trans;
+	switch (t->processMessage(message,branch)) {
+	    case SIPTransaction::Matched:
+		return t;
+	    case SIPTransaction::NoDialog:
+		forked = t;
+		break;
+	    case SIPTransaction::NoMatch:
+	    default:
+		break;
+	}
+    }
+    // ...except the ACK to a 2xx which, like RFC 2543 messages, is
+    //  matched by Call-ID and CSeq with the transactions of any branch
+    String key;
+    l = 0;
+    if (branch.null() || message->isACK()) {
+	dialogKey(key,message->getHeaderValue("Call-ID"),message->getCSeq());
+	l = m_dialogs.getHashList(key);
+    }
     for (; l; l = l->next()) {
-	SIPTransaction* t = static_cast<SIPTransaction*>(l->get());
-	if (!t)
+	const TransIndex* i = static_cast<const TransIndex*>(l->get());
+	if (!i || (*i != key))
+	    continue;
+	SIPTransaction* t = i->m_trans;
+	if (branch && (t->getBranch() == branch))
 	    continue;
 	switch (t->processMessage(message,branch)) {
 	    case SIPTransaction::Matched:
@@ -236,6 +301,156 @@ SIPTransaction* SIPEngine::addMessage(SIPMessage* message)
     return new SIPTransaction(message,this,message->isOutgoing());
 }
 
+void SIPEngine::appendTrans(SIPTransaction* trans)
+{
+    if (!trans)
+	return;
+    Lock lock(m_mutex);
+    // order doesn't matter, messages are matched through the indexes and
+    //  events are picked up from the ready queue
+    TransList.insert(trans);
+    indexTrans(trans,true);
+    readyTrans(trans);
+    timerTrans(trans);
+}
+
+void SIPEngine::removeTrans(SIPTransaction* trans, bool delobj)
+{
+    if (!trans)
+	return;
+    Lock lock(m_mutex);
+    indexTrans(trans,false);
+    timerRemove(trans);
+    readyRemove(trans);
+    TransList.remove(trans,delobj);
+}
+
+void SIPEngine::indexTrans(SIPTransaction* trans, bool add)
+{
+    Lock lock(m_mutex);
+    String key;
+    dialogKey(key,trans->getCallID(),
+	trans->initialMessage() ? trans->initialMessage()->getCSeq() : -1);
+    const String& branch = trans->getBranch();
+    if (add) {
+	m_dialogs.append(new TransIndex(key,trans));
+	if (branch)
+	    m_branches.append(new TransIndex(branch,trans));
+    }
+    else {
+	unindex(m_dialogs,key,trans);
+	if (branch)
+	    unindex(m_branches,branch,trans);
+    }
+}
+
+void SIPEngine::readyTrans(SIPTransaction* trans, bool pending)
+{
+    Lock lock(m_mutex);
+    if (trans->getState() == SIPTransaction::Invalid)
+	return;
+    if (trans->m_ready) {
+	if (!pending || (trans->m_ready > 1))
+	    return;
+	readyRemove(trans);
+    }
+    // pending ones are kept in order before all others
+    SIPTransaction* prev = pending ? m_readyPending : m_readyLast;
+    trans->m_ready = pending ? 2 : 1;
+    trans->m_readyPrev = prev;
+    trans->m_readyNext = prev ? prev->m_readyNext : m_readyFirst;
+    if (prev)
+	prev->m_readyNext = trans;
+    else
+	m_readyFirst = trans;
+    if (trans->m_readyNext)
+	trans->m_readyNext->m_readyPrev = trans;
+    else
+	m_readyLast = trans;
+    if (pending)
+	m_readyPending = trans;
+}
+
+// Take a transaction out of the ready queue, if it's there
+void SIPEngine::readyRemove(SIPTransaction* trans)
+{
+    if (!trans->m_ready)
+	return;
+    trans->m_ready = 0;
+    if (m_readyPending == trans)
+	m_readyPending = trans->m_readyPrev;
+    if (trans->m_readyPrev)
+	trans->m_readyPrev->m_readyNext = trans->m_readyNext;
+    else
+	m_readyFirst = trans->m_readyNext;
+    if (trans->m_readyNext)
+	trans->m_readyNext->m_readyPrev = trans->m_readyPrev;
+    else
+	m_readyLast = trans->m_readyPrev;
+    trans->m_readyPrev = trans->m_readyNext = 0;
+}
+
+void SIPEngine::timerTrans(SIPTransaction* trans)
+{
+    Lock lock(m_mutex);
+    timerRemove(trans);
+    if (!trans->m_timeout || (trans->getState() == SIPTransaction::Invalid))
+	return;
+    if (m_timerCount >= m_timerAlloc) {
+	unsigned int alloc = m_timerAlloc ? 2 * m_timerAlloc : 64;
+	SIPTransaction** timers = new SIPTransaction*[alloc];
+	for (unsigned int i = 0; i < m_timerCount; i++)
+	    timers[i] = m_timers[i];
+	delete[] m_timers;
+	m_timers = timers;
+	m_timerAlloc = alloc;
+    }
+    m_timers[m_timerCount] = trans;
+    timerSift(m_timerCount++);
+}
+
+// Remove a transaction from the heap of timers, if it's there
+void SIPEngine::timerRemove(SIPTransaction* trans)
+{
+    int pos = trans->m_timerIndex;
+    if (pos < 0)
+	return;
+    trans->m_timerIndex = -1;
+    if ((unsigned int)pos >= --m_timerCount)
+	return;
+    m_timers[pos] = m_timers[m_timerCount];
+    timerSift(pos);
+}
+
+// Move the transaction at a position of the heap of timers up or down
+//  until it's earlier than its children and not earlier than its parent
+void SIPEngine::timerSift(unsigned int pos)
+{
+    SIPTransaction* trans = m_timers[pos];
+    while (pos) {
+	unsigned int up = (pos - 1) / 2;
+	if (m_timers[up]->m_timeout <= trans->m_timeout)
+	    break;
+	m_timers[pos] = m_timers[up];
+	m_timers[pos]->m_timerIndex = pos;
+	pos = up;
+    }
+    for (;;) {
+	unsigned int down = 2 * pos + 1;
+	if (down >= m_timerCount)
+	    break;
+	if ((down + 1 < m_timerCount) && (m_timers[down + 1]->m_timeout < m_timers[down]->m_timeout))
+	    down++;
+	if (trans->m_timeout <= m_timers[down]->m_timeout)
+	    break;
+	m_timers[pos] = m_timers[down];
+	m_timers[pos]->m_timerIndex = pos;
+	pos = down;
+    }
+    m_timers[pos] = trans;
+    trans->m_timerIndex = pos;
+}
+
 SIPTransaction* SIPEngine::forkInvite(SIPMessage* answer, SIPTransaction* trans)
 {
     // TODO: build new transaction or CANCEL
@@ -256,28 +471,32 @@ bool SIPEngine::process()
 SIPEvent* SIPEngine::getEvent()
 {
     Lock lock(m_mutex);
-    ObjList* l = &TransList;
-    for (; l; l = l->next()) {
-	SIPTransaction* t = static_cast<SIPTransaction*>(l->get());
-	if (t) {
-	    SIPEvent* e = t->getEvent(true);
-	    if (e) {
-		DDebug(this,DebugInfo,"Got pending event %p (state %s) from transaction %p [%p]",
-		    e,SIPTransaction::stateName(e->getState()),t,this);
-		return e;
-	    }
-	}
+    // only transactions that changed or whose timer fired can have events
+    u_int64_t now = Time::now();
+    while (m_timerCount && (m_timers[0]->m_timeout <= now)) {
+	SIPTransaction* t = m_timers[0];
+	timerRemove(t);
+	readyTrans(t);
     }
-    for (l = &TransList; l; l = l->next()) {
-	SIPTransaction* t = static_cast<SIPTransaction*>(l->get());
-	if (t) {
-	    SIPEvent* e = t->getEvent(false);
-	    if (e) {
-		DDebug(this,DebugInfo,"Got event %p (state %s) from transaction %p [%p]",
-		    e,SIPTransaction::stateName(e->getState()),t,this);
-		return e;
-	    }
+    // take each transaction out of the queue so any change made while
+    //  getting its event puts it back, the pending ones come first
+    SIPTransaction* t;
+    while ((t = m_readyFirst)) {
+#ifdef DEBUG
+	bool pending = (t->m_ready > 1);
+#endif
+	readyRemove(t);
+	SIPEvent* e = t->getEvent(false);
+	if (e) {
+	    DDebug(this,DebugInfo,"Got %sevent %p (state %s) from transaction %p [%p]",
+		pending ? "pending " : "",e,SIPTransaction::stateName(e->getState()),t,this);
+	    // it may have more to do
+	    readyTrans(t,t->isPendingEvent() || t->m_transmit);
+	    return e;
 	}
+	// nothing more to do until it changes or its timer fires
+	if (t->m_timeout && (t->m_timerIndex < 0))
+	    timerTrans(t);
     }
     return 0;
 }
@@ -376,6 +595,12 @@ u_int64_t SIPEngine::getTimer(char which, bool reliable) const
     return 0;
 }
 
+int SIPEngine::getNextCSeq()
+{
+    Lock lock(m_cseqMutex);
+    return ++m_cseq;
+}
+
 void SIPEngine::nonceGet(String& nonce)
 {
     m_nonce_mutex.lock();
@@ -294,7 +294,11 @@ void SIPMessage::complete(SIPEngine* engine, const char* user, const char* domai
 	if (tmp) {
 	    tmp = "<sip:" + tmp; 
 	    tmp << "@" << getParty()->getLocalAddr() ;
-	    tmp << ":" << getParty()->getLocalPort() << ">";
+	    tmp << ":" << getParty()->getLocalPort();
+	    // keep the dialog on the same reliable transport
+	    if (getParty()->isReliable())
+		tmp << ";transport=" << String(getParty()->getProtoName()).toLower();
+	    tmp << ">";
 	    addHeader("Contact",tmp);
 	}
     }
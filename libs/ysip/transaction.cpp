@@ -32,7 +32,8 @@ using namespace TelEngine;
 // Constructor from new message
 SIPTransaction::SIPTransaction(SIPMessage* message, SIPEngine* engine, bool outgoing)
     : m_outgoing(outgoing), m_invite(false), m_transmit(false), m_state(Invalid), m_response(0), m_timeout(0),
-      m_firstMessage(message), m_lastMessage(0), m_pending(0), m_engine(engine), m_private(0)
+      m_firstMessage(message), m_lastMessage(0), m_pending(0), m_engine(engine), m_private(0),
+      m_timerIndex(-1), m_ready(0), m_readyPrev(0), m_readyNext(0)
 {
     DDebug(getEngine(),DebugAll,"SIPTransaction::SIPTransaction(%p,%p,%d) [%p]",
 	message,engine,outgoing,this);
@@ -67,7 +68,7 @@ SIPTransaction::SIPTransaction(SIPMessage* message, SIPEngine* engine, bool outg
     }
     m_invite = (getMethod() == "INVITE");
     m_state = Initial;
-    m_engine->TransList.append(this);
+    m_engine->appendTrans(this);
 }
 
 // Constructor from original and authentication requesting answer
@@ -77,7 +78,7 @@ SIPTransaction::SIPTransaction(SIPTransaction& original, SIPMessage* answer)
       m_firstMessage(original.m_firstMessage), m_lastMessage(original.m_lastMessage),
       m_pending(0), m_engine(original.m_engine),
       m_branch(original.m_branch), m_callid(original.m_callid), m_tag(original.m_tag),
-      m_private(0)
+      m_private(0), m_timerIndex(-1), m_ready(0), m_readyPrev(0), m_readyNext(0)
 {
     DDebug(getEngine(),DebugAll,"SIPTransaction::SIPTransaction(&%p,%p) [%p]",
 	&original,answer,this);
@@ -87,6 +88,8 @@ SIPTransaction::SIPTransaction(SIPTransaction& original, SIPMessage* answer)
     m_firstMessage->setAutoAuth();
     msg->complete(m_engine);
     msg->addHeader(auth);
+    // the original gets a new branch and CSeq
+    m_engine->indexTrans(&original,false);
     const NamedString* ns = msg->getParam("Via","branch");
     if (ns)
 	original.m_branch = *ns;
@@ -99,19 +102,13 @@ SIPTransaction::SIPTransaction(SIPTransaction& original, SIPMessage* answer)
 	original.m_tag.clear();
     original.m_firstMessage = msg;
     original.m_lastMessage = 0;
+    m_engine->indexTrans(&original,true);
 
-#ifdef SIP_ACK_AFTER_NEW_INVITE
-    // if this transaction is an INVITE and we append it to the list its
-    //  ACK will be sent after the new INVITE which is legal but "unnatural"
-    // some SIP endpoints seem to assume things about transactions
-    m_engine->TransList.append(this);
-#else
-    // insert this transaction rather than appending it
-    // this way we get a chance to send one ACK before a new INVITE
+    // the ACK we are about to build is picked up as pending event so we
+    //  get a chance to send it before the new INVITE of the original
     // note that there is no guarantee because of the possibility of the
     //  packets getting lost and retransmitted or to use a different route
-    m_engine->TransList.insert(this);
-#endif
+    m_engine->appendTrans(this);
 }
 
 // Constructor from original and forked dialog tag
@@ -121,18 +118,12 @@ SIPTransaction::SIPTransaction(const SIPTransaction& original, const String& tag
       m_firstMessage(original.m_firstMessage), m_lastMessage(0),
       m_pending(0), m_engine(original.m_engine),
       m_branch(original.m_branch), m_callid(original.m_callid), m_tag(tag),
-      m_private(0)
+      m_private(0), m_timerIndex(-1), m_ready(0), m_readyPrev(0), m_readyNext(0)
 {
     if (m_firstMessage)
 	m_firstMessage->ref();
 
-#ifdef SIP_PRESERVE_TRANSACTION_ORDER
-    // new transactions at the end, preserve "natural" order
-    m_engine->TransList.append(this);
-#else
-    // put new transactions first - faster to match new messages
-    m_engine->TransList.insert(this);
-#endif
+    m_engine->appendTrans(this);
 }
 
 SIPTransaction::~SIPTransaction()
@@ -141,7 +132,7 @@ SIPTransaction::~SIPTransaction()
     Debugger debug(DebugAll,"SIPTransaction::~SIPTransaction()"," [%p]",this);
 #endif
     m_state = Invalid;
-    m_engine->TransList.remove(this,false);
+    m_engine->removeTrans(this,false);
     setPendingEvent();
     if (m_lastMessage)
 	m_lastMessage->deref();
@@ -189,9 +180,16 @@ bool SIPTransaction::changeState(int newstate)
     DDebug(getEngine(),DebugAll,"SIPTransaction state changed from %s to %s [%p]",
 	stateName(m_state),stateName(newstate),this);
     m_state = newstate;
+    m_engine->readyTrans(this);
     return true;
 }
 
+void SIPTransaction::setTransmit()
+{
+    m_transmit = true;
+    m_engine->readyTrans(this,true);
+}
+
 void SIPTransaction::setDialogTag(const char* tag)
 {
     if (null(tag)) {
@@ -234,6 +232,8 @@ void SIPTransaction::setPendingEvent(SIPEvent* event, bool replace)
 	    delete event;
     else
 	m_pending = event;
+    if (m_pending)
+	m_engine->readyTrans(this,true);
 }
 
 void SIPTransaction::setTimeout(u_int64_t delay, unsigned int count)
@@ -241,6 +241,7 @@ void SIPTransaction::setTimeout(u_int64_t delay, unsigned int count)
     m_timeouts = count;
     m_delay = delay;
     m_timeout = (count && delay) ? Time::now() + delay : 0;
+    m_engine->timerTrans(this);
 #ifdef DEBUG
     if (m_timeout)
 	Debug(getEngine(),DebugAll,"SIPTransaction new %d timeouts initially " FMT64U " usec apart [%p]",
@@ -271,6 +272,7 @@ SIPEvent* SIPTransaction::getEvent(bool pendingOnly)
 	timeout = --m_timeouts;
 	m_timeout = (m_timeouts) ? Time::now() + m_delay : 0;
 	m_delay *= 2; // exponential back-off
+	m_engine->timerTrans(this);
 	DDebug(getEngine(),DebugAll,"SIPTransaction fired timer #%d [%p]",timeout,this);
     }
 
@@ -297,7 +299,7 @@ SIPEvent* SIPTransaction::getEvent(bool pendingOnly)
 	    // make sure we don't get trough this one again
 	    changeState(Invalid);
 	    // remove from list and dereference
-	    m_engine->TransList.remove(this);
+	    m_engine->removeTrans(this);
 	    return e;
 	case Invalid:
 	    Debug(getEngine(),DebugFail,"SIPTransaction::getEvent in invalid state [%p]",this);
@@ -317,10 +319,18 @@ void SIPTransaction::setResponse(SIPMessage* message)
     setTransmit();
     if (message && (message->code >= 200)) {
 	if (isInvite()) {
-	    // we need to actively retransmit this message
-	    if (changeState(Retrans))
-		setTimeout(m_engine->getTimer('G'),6);
+	    // we need to actively retransmit this message until the ACK
+	    //  arrives, a reliable transport only has to wait for it
+	    if (changeState(Retrans)) {
+		if (isReliable())
+		    setTimeout(m_engine->getTimer('H'),1);
+		else
+		    setTimeout(m_engine->getTimer('G'),6);
+	    }
 	}
+	else if (isReliable())
+	    // no request retransmits to wait for
+	    changeState(Cleared);
 	else {
 	    // just wait and reply to retransmits
 	    if (changeState(Finish))
@@ -567,8 +577,13 @@ SIPEvent* SIPTransaction::getClientEvent(int state, int timeout)
     switch (state) {
 	case Initial:
 	    e = new SIPEvent(m_firstMessage,this);
-	    if (changeState(Trying))
-		setTimeout(m_engine->getTimer(isInvite() ? 'A' : 'E'),5);
+	    if (changeState(Trying)) {
+		// the transport retransmits for us if it is reliable
+		if (isReliable())
+		    setTimeout(m_engine->getTimer(isInvite() ? 'B' : 'F'));
+		else
+		    setTimeout(m_engine->getTimer(isInvite() ? 'A' : 'E'),5);
+	    }
 	    break;
 	case Trying:
 	    if (timeout < 0)
@@ -631,7 +646,7 @@ SIPEvent* SIPTransaction::getServerEvent(int state, int timeout)
 	    m_transmit = false;
 	    changeState(Invalid);
 	    // remove from list and dereference
-	    m_engine->TransList.remove(this);
+	    m_engine->removeTrans(this);
 	    break;
 	case Trying:
 	    e = new SIPEvent(m_firstMessage,this);
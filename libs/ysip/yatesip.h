@@ -420,6 +420,7 @@ public:
  */
 class YSIP_API SIPTransaction : public RefObject
 {
+    friend class SIPEngine;
 public:
     /**
      * Current state of the transaction
@@ -602,8 +603,7 @@ public:
      * Set the (re)transmission flag that allows the latest outgoing message
      *  to be send over the wire
      */
-    inline void setTransmit()
-	{ m_transmit = true; }
+    void setTransmit();
 
 
     /**
@@ -776,6 +776,11 @@ protected:
     String m_callid;
     String m_tag;
     void *m_private;
+private:
+    int m_timerIndex;
+    int m_ready;
+    SIPTransaction* m_readyPrev;
+    SIPTransaction* m_readyNext;
 };
 
 /**
@@ -995,10 +1000,11 @@ public:
 	{ return m_userAgent; }
 
     /**
-     * Get a CSeq value suitable for use in a new request
+     * Get a CSeq value suitable for use in a new request. Engines sharing
+     *  dialogs must return values from the same counter
+     * @return Next value of the engine's CSeq counter
      */
-    inline int getNextCSeq()
-	{ return ++m_cseq; }
+    virtual int getNextCSeq();
 
     /**
      * Get an authentication nonce
@@ -1063,6 +1069,45 @@ public:
     inline Mutex* mutex()
 	{ return &m_mutex; }
 
+    /**
+     * Add a transaction to the list and to the indexes used to match messages
+     * @param trans Transaction to add, the list will own a reference to it
+     */
+    void appendTrans(SIPTransaction* trans);
+
+    /**
+     * Remove a transaction from the list and from the indexes
+     * @param trans Transaction to remove
+     * @param delobj True to release the reference owned by the list
+     */
+    void removeTrans(SIPTransaction* trans, bool delobj = true);
+
+    /**
+     * Add or remove a transaction in the indexes only. Must be used to
+     *  remove it before changing its branch or initial message and to
+     *  add it back after the change
+     * @param trans Transaction to index
+     * @param add True to add it, false to remove it
+     */
+    void indexTrans(SIPTransaction* trans, bool add);
+
+    /**
+     * Queue a transaction that may have an event to be picked up by
+     *  @ref getEvent(). Transactions call it when they change state or
+     *  have something to transmit or report
+     * @param trans Transaction to queue, nothing happens if already queued
+     * @param pending True if it has a message to transmit or a pending
+     *  event, these are picked up before any other
+     */
+    void readyTrans(SIPTransaction* trans, bool pending = false);
+
+    /**
+     * Update the position of a transaction in the queue of timers after its
+     *  timeout was changed
+     * @param trans Transaction whose timeout changed
+     */
+    void timerTrans(SIPTransaction* trans);
+
     /**
      * TransList is the key. 
      * Is the list that holds all the transactions.
@@ -1070,17 +1115,39 @@ public:
     ObjList TransList;
 
 protected:
+    /**
+     * Transactions by their RFC 3261 branch parameter
+     */
+    HashList m_branches;
+
+    /**
+     * All transactions by their Call-ID and CSeq number
+     */
+    HashList m_dialogs;
+
     Mutex m_mutex;
     u_int64_t m_t1;
     u_int64_t m_t4;
     unsigned int m_maxForwards;
     int m_cseq;
+    Mutex m_cseqMutex;
     String m_userAgent;
     String m_allowed;
     String m_nonce;
     String m_nonce_secret;
     u_int32_t m_nonce_time;
     Mutex m_nonce_mutex;
+
+private:
+    void readyRemove(SIPTransaction* trans);
+    void timerSift(unsigned int pos);
+    void timerRemove(SIPTransaction* trans);
+    SIPTransaction* m_readyFirst;
+    SIPTransaction* m_readyLast;
+    SIPTransaction* m_readyPending;
+    SIPTransaction** m_timers;
+    unsigned int m_timerCount;
+    unsigned int m_timerAlloc;
 };
 
 }
@@ -7,12 +7,6 @@
  * Yet Another Telephony Engine - a fully featured software PBX and IVR
  * Copyright (C) 2004-2006 Null Team
  *
- * FFT routine taken from Murphy McCauley's FFT DLL based in turn on the
- *  work of Don Cross <dcross@intersrv.com>
- * See http://www.fullspectrum.com/deeth/programming/fft.html
- *  and http://www.constantthought.com/
- * Thank both for a sleek routine that doesn't even fill a floppy ;-)
- *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation; either version 2 of the License, or
@@ -39,69 +33,22 @@
 
 #include <string.h>
 #include <stdio.h>
-#include <math.h>
-
-#ifndef M_PI
-#define M_PI 3.14159265358979323846
-#endif
-
-#ifndef M_2PI
-#define M_2PI (2*M_PI)
-#endif
-
-#ifndef M_4PI
-#define M_4PI (4*M_PI)
-#endif
 
 using namespace TelEngine;
 namespace { // anonymous
 
-// Asynchronous FFT on a power of 2 sample buffer
-class AsyncFFT : public Thread
+// Spectrum computed by the engine, notifies the consumer that submitted it
+class AnalyzerJob : public SpectrumJob
 {
 public:
-    enum WinType {
-	None = 0,
-	Rectangle = None,
-	Triangle,
-	Bartlett = Triangle,
-	Hanning,
-	Hamming,
-	Blackman,
-	FlatTop
-    };
-    virtual ~AsyncFFT();
-    static AsyncFFT* create(unsigned int length, WinType window = Rectangle, Priority prio = Low);
-    inline unsigned int samples() const
-	{ return m_length; }
-    inline unsigned int length() const
-	{ return m_length >> 1; }
-    inline bool ready() const
-	{ return m_ready; }
-    double at(int index) const;
-    inline double operator[](int index) const
-	{ return at(index); }
-    bool prepare(const short* samp);
-    inline void stop()
-	{ m_notify = 0; m_stop = true; }
-    virtual void run();
-    inline void setNotify(Runnable* notified = 0)
-	{ m_notify = notified; }
+    inline AnalyzerJob(unsigned int length, Window window, Runnable* notify)
+	: SpectrumJob(length,window), m_notify(notify)
+	{ }
+    void stop();
+protected:
+    virtual void computed();
 private:
-    AsyncFFT(unsigned int length, WinType window, Priority prio);
-    void buildWindow(WinType window);
-    unsigned int revBits(unsigned int index);
-    void compute();
-    bool m_ready;
-    bool m_start;
-    bool m_stop;
     Runnable* m_notify;
-    unsigned int m_length;
-    double* m_window;
-    double* m_real;
-    double* m_imag;
-    unsigned int m_nBits;
-    const char* m_winName;
 };
 
 class AnalyzerCons : public DataConsumer, public Runnable
@@ -119,7 +66,7 @@ protected:
     unsigned long m_tsStart;
     unsigned int m_tsGapCount;
     unsigned long m_tsGapLength;
-    AsyncFFT* m_spectrum;
+    AnalyzerJob* m_spectrum;
     unsigned long m_total;
     unsigned long m_valid;
     bool m_analyze;
@@ -171,19 +118,6 @@ private:
 
 INIT_PLUGIN(AnalyzerDriver);
 
-static TokenDict dict_windows[] = {
-    { "rectangle", AsyncFFT::Rectangle },
-    { "no",        AsyncFFT::None },
-    { "none",      AsyncFFT::None },
-    { "triangle",  AsyncFFT::Triangle },
-    { "bartlett",  AsyncFFT::Bartlett },
-    { "hanning",   AsyncFFT::Hanning },
-    { "hamming",   AsyncFFT::Hamming },
-    { "blackman",  AsyncFFT::Blackman },
-    { "flattop",   AsyncFFT::FlatTop },
-    { 0,   0 }
-};
-
 static Mutex s_mutex;
 
 static int s_res = 1;
@@ -209,207 +143,27 @@ static const char* printTime(char* buf,unsigned long usec)
 }
 
 
-AsyncFFT* AsyncFFT::create(unsigned int length, WinType window, Priority prio)
-{
-    if (length < 2)
-	return 0;
-    // thanks to 'byang' for this cute power of two test!
-    if (length & (length - 1))
-	return 0;
-    AsyncFFT* fft = new AsyncFFT(length,window,prio);
-    if (fft->startup())
-	return fft;
-    delete fft;
-    return 0;
-}
-
-AsyncFFT::AsyncFFT(unsigned int length, WinType window, Priority prio)
-    : Thread("AsyncFFT",prio),
-      m_ready(false), m_start(false), m_stop(false), m_notify(0),
-      m_length(0), m_window(0), m_real(0), m_imag(0), m_nBits(0), m_winName(0)
-{
-    DDebug(&__plugin,DebugAll,"AsyncFFT::AsyncFFT(%u) [%p]",length,this);
-    for (unsigned int i = 0; i <= 256 ;i++)
-	if (length & (1 << i)) {
-	    m_nBits = i;
-	    break;
-	}
-    if (!m_nBits)
-	return;
-    m_length = length;
-    m_real = new double[m_length];
-    m_imag = new double[m_length];
-    buildWindow(window);
-}
-
-AsyncFFT::~AsyncFFT()
+// Stop notifying and wait for the engine to release the job
+void AnalyzerJob::stop()
 {
-    DDebug(&__plugin,DebugAll,"AsyncFFT::~AsyncFFT() [%p]",this);
+    s_mutex.lock();
     m_notify = 0;
-    m_ready = false;
-    m_start = false;
-    delete[] m_real;
-    delete[] m_imag;
-    delete[] m_window;
-}
-
-void AsyncFFT::buildWindow(WinType window)
-{
-    m_winName = lookup(window,dict_windows);
-    if (window == Rectangle)
-	return;
-    m_window = new double[m_length];
-    unsigned int n2 = m_length >> 1;
-    for (unsigned int i = 0; i < m_length; i++) {
-	double omega = i * M_2PI / m_length;
-	switch (window) {
-	    case Triangle:
-		{
-		    int k = i - n2;
-		    if (k > 0)
-			k = -k;
-		    k += n2;
-		    m_window[i] = k*1.0/n2;
-		}
-		break;
-	    case Hanning:
-		m_window[i] = 0.5 - 0.5 * ::cos(omega);
-		break;
-	    case Hamming:
-		m_window[i] = 0.54 - 0.46 * ::cos(omega);
-		break;
-	    case Blackman:
-		m_window[i] = 0.42 - 0.5 * ::cos(omega) + 0.08 * ::cos(2*omega);
-		break;
-	    case FlatTop:
-		m_window[i] = 0.2810639 - 0.5208972 * ::cos(omega) + 0.1980399 * ::cos(2*omega);
-		break;
-	    default:
-		m_window[i] = 1.0;
-	}
-    }
-}
-
-double AsyncFFT::at(int index) const
-{
-    if ((index < 0) || ((unsigned int)index > (m_length >> 1)))
-	return 0.0;
-    if (!m_ready)
-	return 0.0;
-    return m_real[index];
-}
-
-void AsyncFFT::run()
-{
-    DDebug(&__plugin,DebugAll,"AsyncFFT::run() [%p]",this);
-    while (!m_stop) {
-	while (!m_start) {
-	    Thread::msleep(5);
-	    if (m_stop)
-		return;
-	}
-	m_ready = false;
-	compute();
-	m_ready = true;
-	s_mutex.lock();
-	if (m_notify)
-	    m_notify->run();
-	s_mutex.unlock();
-	m_start = false;
-    }
-}
-
-bool AsyncFFT::prepare(const short* samp)
-{
-    if (m_start || m_stop || !(samp && m_real))
-	return false;
-    m_ready = false;
-    XDebug(&__plugin,DebugAll,"Preparing FFT buffer from %u samples [%p]",m_length,this);
-    unsigned int i, j;
-    for (i = 0; i < m_length; i++) {
-	j = revBits(i);
-	if (m_window)
-	    m_real[i] = m_window[j] * samp[j];
-	else
-	    m_real[i] = samp[j];
-	m_imag[i] = 0.0;
-    }
-    m_start = true;
-    return true;
+    s_mutex.unlock();
+    cancel();
 }
 
-unsigned int AsyncFFT::revBits(unsigned int index)
+void AnalyzerJob::computed()
 {
-    unsigned int i, rev;
-    for (i = rev = 0; i < m_nBits; i++) {
-	rev = (rev << 1) | (index & 1);
-	index >>= 1;
-    }
-    return rev;
-}
-
-void AsyncFFT::compute()
-{
-#ifdef XDEBUG
-    Debug(&__plugin,DebugInfo,"Computing FFT with length %u [%p]",m_length,this);
-    Time t;
-#endif
-    unsigned int i, j, n;
-    unsigned int blockEnd = 1;
-    for (unsigned int blockSize = 2; blockSize <= m_length; blockSize <<= 1) {
-	double delta_angle = M_2PI / blockSize;
-	double sm1 = ::sin(-delta_angle);
-	double sm2 = ::sin(-2 * delta_angle);
-	double cm1 = ::cos(-delta_angle);
-	double cm2 = ::cos(-2 * delta_angle);
-	double w = 2 * cm1;
-	double ar[3], ai[3];
-
-	for (i = 0; i < m_length; i += blockSize) {
-	    ar[1] = cm1;
-	    ai[1] = sm1;
-	    ar[2] = cm2;
-	    ai[2] = sm2;
-
-	    if (m_stop)
-		return;
-	    for (j = i, n = 0; n < blockEnd; j++, n++) {
-		ar[0] = w*ar[1] - ar[2];
-		ar[2] = ar[1];
-		ar[1] = ar[0];
-		ai[0] = w*ai[1] - ai[2];
-		ai[2] = ai[1];
-		ai[1] = ai[0];
-
-		unsigned int k = j + blockEnd;
-		double tr = ar[0]*m_real[k] - ai[0]*m_imag[k];
-		double ti = ar[0]*m_imag[k] + ai[0]*m_real[k];
-		m_real[k] = m_real[j] - tr;
-		m_imag[k] = m_imag[j] - ti;
-		m_real[j] += tr;
-		m_imag[j] += ti;
-	    }
-	}
-	blockEnd = blockSize;
-    }
-    n = m_length >> 1;
-    for (i = 0; i < n; i++)
-	m_real[i] = ::sqrt(m_real[i]*m_real[i] + m_imag[i]*m_imag[i]) / n;
-#ifdef XDEBUG
-    Debug(&__plugin,DebugInfo,"Computing FFT with length %u took " FMT64U " usec [%p]",
-	m_length,Time::now()-t,this);
-#endif
-
-#ifdef XDEBUG
-    for (i = 0; i < n; i++)
-	Debug(&__plugin,DebugAll,"fft[%u] = %0.2f",i,m_real[i]);
-#endif
+    s_mutex.lock();
+    if (m_notify)
+	m_notify->run();
+    s_mutex.unlock();
 }
 
 
 AnalyzerCons::AnalyzerCons(const String& type, const char* window)
     : m_timeStart(0), m_tsStart(0), m_tsGapCount(0), m_tsGapLength(0),
-      m_spectrum(false), m_total(0), m_valid(0), m_analyze(false)
+      m_spectrum(0), m_total(0), m_valid(0), m_analyze(false)
 {
     DDebug(&__plugin,DebugAll,"AnalyzerCons::AnalyzerCons('%s') [%p]",
 	type.c_str(),this);
@@ -417,8 +171,8 @@ AnalyzerCons::AnalyzerCons(const String& type, const char* window)
     if ((type == "probe") || type.startsWith("tone/probe")) {
 	len = 256;
 	m_analyze = true;
-	m_spectrum = AsyncFFT::create(len,(AsyncFFT::WinType)lookup(window,dict_windows,AsyncFFT::Rectangle));
-	m_spectrum->setNotify(this);
+	m_spectrum = new AnalyzerJob(len,
+	    (SpectrumJob::Window)lookup(window,SpectrumJob::windows(),SpectrumJob::Rectangle),this);
 	return;
     }
     else if (type == "fft1024")
@@ -431,22 +185,22 @@ AnalyzerCons::AnalyzerCons(const String& type, const char* window)
 	len = 128;
     else if (type == "fft64")
 	len = 64;
-    if (len) {
-	m_spectrum = AsyncFFT::create(len,(AsyncFFT::WinType)lookup(window,dict_windows,AsyncFFT::Triangle));
-	m_spectrum->setNotify(this);
-    }
+    if (len)
+	m_spectrum = new AnalyzerJob(len,
+	    (SpectrumJob::Window)lookup(window,SpectrumJob::windows(),SpectrumJob::Triangle),this);
 }
 
 AnalyzerCons::~AnalyzerCons()
 {
     DDebug(&__plugin,DebugAll,"AnalyzerCons::~AnalyzerCons() %p [%p]",m_spectrum,this);
     s_mutex.lock();
-    if (m_spectrum) {
-	AsyncFFT* tmp = m_spectrum;
-	m_spectrum = 0;
+    AnalyzerJob* tmp = m_spectrum;
+    m_spectrum = 0;
+    s_mutex.unlock();
+    if (tmp) {
 	tmp->stop();
+	tmp->deref();
     }
-    s_mutex.unlock();
 }
 
 void AnalyzerCons::Consume(const DataBlock& data, unsigned long tStamp)
@@ -479,7 +233,7 @@ void AnalyzerCons::Consume(const DataBlock& data, unsigned long tStamp)
 	DDebug(&__plugin,DebugInfo,"Dropping %d samples [%p]",toCut/2,this);
 	m_data.cut(-toCut);
     }
-    if (m_spectrum->prepare((const short*)m_data.data()))
+    if (m_spectrum->submit((const short*)m_data.data()))
 	m_data.cut(-(int)len);
 }
 
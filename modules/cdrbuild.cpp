@@ -125,6 +125,7 @@ static struct _params {
     { "called",     false },
     { "calledfull", false },
     { "username",   false },
+    { "rtpstats",   true },
     { 0, false },
 };
 
@@ -26,6 +26,20 @@
 
 #include <yatephone.h>
 
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define CONF_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 code is compiled for a target selected per function and used only if supported
+#if defined(CONF_SSE2) && defined(__GNUC__) && \
+    (defined(__clang__) || (__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+#define CONF_AVX2
+#include <immintrin.h>
+#endif
+
 using namespace TelEngine;
 namespace { // anonymous
 
@@ -38,6 +52,15 @@ namespace { // anonymous
 // maximum size we allow the buffer to grow
 #define MAX_BUFFER 960
 
+// period of the timer driven mixers in usec
+#define MIX_PERIOD 20000
+
+// maximum number of timer driven mixer threads
+#define MAX_MIXERS 16
+
+// maximum number of active speakers mixed in a limited room
+#define MAX_SPEAKERS 16
+
 
 // Absolute maximum possible energy (square +-32767 wave) - do not change
 #define ENERGY_MAX 1073676289
@@ -67,6 +90,8 @@ namespace { // anonymous
 class ConfConsumer;
 class ConfSource;
 class ConfChan;
+class ConfMixer;
+class ConfEncoder;
 
 // The list of conference rooms
 static ObjList s_rooms;
@@ -77,10 +102,30 @@ static Mutex s_srcMutex;
 // Hold the number of the newest allocated dynamic room
 static int s_roomAlloc = 0;
 
+// Number of timer driven mixer threads, zero mixes from received data
+static int s_mixThreads = 0;
+
+// Jitter buffer fill level to start mixing and maximum, in msec
+static int s_jitterMin = 40;
+static int s_jitterMax = 120;
+
+// Default number of active speakers mixed, zero to mix everybody
+static int s_speakers = 0;
+
+// Time in msec a quiet active speaker keeps its place in the mix
+static int s_speakerHold = 500;
+
+// Timer driven mixer threads and their rooms
+static ObjList s_mixers;
+static Mutex s_mixMutex;
+static bool s_mixExit = false;
+
 // The conference room holds a list of connected channels and does the mixing.
 // It does also act as a data source for the sum of all channels
 class ConfRoom : public DataSource
 {
+    friend class ConfConsumer;
+    friend class ConfMixer;
 public:
     virtual void destroyed();
     static ConfRoom* get(const String& name, const NamedList* params = 0);
@@ -98,7 +143,12 @@ public:
 	{ return m_record; }
     inline const String& notify() const
 	{ return m_notify; }
+    inline unsigned int speakers() const
+	{ return m_speakers; }
+    inline bool timed() const
+	{ return m_mixer != 0; }
     void mix(ConfConsumer* cons = 0);
+    void tick();
     void addChannel(ConfChan* chan, bool player = false);
     void delChannel(ConfChan* chan);
     void dropAll(const char* reason = 0);
@@ -106,7 +156,26 @@ public:
     bool setRecording(const NamedList& params);
 private:
     ConfRoom(const String& name, const NamedList& params);
+    void mixData(unsigned int len, DataBlock& data);
+    void selectSpeakers(unsigned int samples);
+    const DataBlock* sharedData(const DataFormat& format, const int16_t* shared, unsigned int samples);
     String m_name;
+    // scratch buffers reused by the mixer, protected by the room lock
+    DataBlock m_mixBuf;
+    DataBlock m_outBuf;
+    DataBlock m_ownBuf;
+    // timer driven mixer, jitter buffer limits in bytes and counters
+    ConfMixer* m_mixer;
+    unsigned int m_jitterMin;
+    unsigned int m_jitterMax;
+    unsigned int m_late;
+    unsigned int m_early;
+    // active speaker limit and how long they are kept while quiet, in samples
+    unsigned int m_speakers;
+    unsigned int m_speakerHold;
+    // full mix encoded once per format for the members that are not mixed
+    ObjList m_encoders;
+    unsigned int m_mixSerial;
     ObjList m_chans;
     String m_notify;
     String m_playerId;
@@ -122,7 +191,8 @@ class ConfChan : public Channel
 {
     YCLASS(ConfChan,Channel)
 public:
-    ConfChan(const String& name, const NamedList& params, bool counted, bool utility);
+    ConfChan(const String& name, const NamedList& params, bool counted, bool utility,
+	CallEndpoint* peer = 0);
     ConfChan(ConfRoom* room, bool voice = false);
     virtual ~ConfChan();
     virtual bool msgTone(Message& msg, const char* tone);
@@ -152,7 +222,8 @@ class ConfConsumer : public DataConsumer
     friend class ConfSource;
 public:
     ConfConsumer(ConfRoom* room, bool smart = false)
-	: m_room(room), m_src(0), m_muted(false), m_smart(smart),
+	: m_room(room), m_src(0), m_muted(false), m_smart(smart), m_hold(room && room->timed()),
+	  m_mixed(false), m_speaker(false), m_quiet(0),
 	  m_energy2(ENERGY_MIN), m_noise2(ENERGY_MIN)
 	{ }
     ~ConfConsumer()
@@ -167,14 +238,21 @@ public:
     inline bool muted() const
 	{ return m_muted; }
     inline bool hasSignal() const
-	{ return (!m_muted) && (m_buffer.length() > 1) && (m_energy2 >= m_noise2); }
+	{ return (!m_muted) && (!m_hold) && (m_buffer.length() > 1) && (m_energy2 >= m_noise2); }
 private:
-    void consumed(const int* mixed, unsigned int samples);
-    void dataForward(const int* mixed, unsigned int samples);
+    void consumed(const int* mixed, const int16_t* shared, int16_t* own, unsigned int samples);
+    void dataForward(const int* mixed, const int16_t* shared, int16_t* own, unsigned int samples);
     ConfRoom* m_room;
     ConfSource* m_src;
     bool m_muted;
     bool m_smart;
+    // jitter buffer is filling up, used only with timer driven mixing
+    bool m_hold;
+    // contributed to the current mix
+    bool m_mixed;
+    // holds an active speaker place and for how many samples it was quiet
+    bool m_speaker;
+    unsigned int m_quiet;
     unsigned int m_energy2;
     unsigned int m_noise2;
     DataBlock m_buffer;
@@ -185,10 +263,53 @@ class ConfSource : public DataSource
 {
     friend class ConfChan;
 public:
-    ConfSource(ConfConsumer* cons);
+    ConfSource(ConfConsumer* cons, const char* format = "slin");
     ~ConfSource();
+    void forwardMix(const int16_t* data, unsigned int samples);
 private:
     RefPointer<ConfConsumer> m_cons;
+    ConfEncoder* m_encoder;
+};
+
+// Encodes mixed data to another format, either collecting the result
+//  for sharing among many sources or forwarding it to a single one
+// Only stateless formats are shared, a stateful codec must see the whole
+//  stream of its own source
+class ConfEncoder : public DataConsumer
+{
+public:
+    ConfEncoder(const DataFormat& format, DataSource* target = 0);
+    virtual void destruct();
+    virtual const String& toString() const
+	{ return getFormat(); }
+    virtual void Consume(const DataBlock& data, unsigned long tStamp);
+    bool encode(const int16_t* data, unsigned int samples);
+    inline const DataBlock& data() const
+	{ return m_data; }
+    inline void clearData()
+	{ m_data.clear(false); }
+    unsigned int m_serial;
+private:
+    DataTranslator* m_trans;
+    DataSource* m_target;
+    DataBlock m_data;
+};
+
+// Thread that mixes its rooms at a fixed interval
+class ConfMixer : public Thread, public GenObject
+{
+public:
+    ConfMixer();
+    virtual ~ConfMixer();
+    virtual void run();
+    static ConfMixer* assign(ConfRoom* room);
+    void remove(ConfRoom* room);
+    static bool stopAll();
+    static void status(String& str);
+private:
+    ObjList m_rooms;
+    unsigned int m_count;
+    unsigned int m_skipped;
 };
 
 // Handler for call.conference message to join both legs of a call in conference
@@ -230,6 +351,13 @@ UNLOAD_PLUGIN(unloadNow)
     return true;
 }
 
+// Check if each sample is encoded on its own so encoders can be shared
+//  or switched without corrupting the state of the codec
+static inline bool statelessFormat(const String& format)
+{
+    return (format == "mulaw") || (format == "alaw");
+}
+
 // Count the position of the most significant 1 bit - pretty close to logarithm
 static unsigned int binLog(unsigned int x)
 {
@@ -239,6 +367,200 @@ static unsigned int binLog(unsigned int x)
     return v;
 }
 
+// Mixing primitives, selected at initialization based on CPU features
+struct MixOps {
+    const char* name;
+    // add 16 bit samples to a 32 bit mix
+    void (*add)(int* mix, const int16_t* src, unsigned int n);
+    // saturate a 32 bit mix to 16 bit samples
+    void (*sat)(int16_t* dst, const int* mix, unsigned int n);
+    // remove 16 bit samples from a 32 bit mix and saturate the result
+    void (*sub)(int16_t* dst, const int* mix, const int16_t* own, unsigned int n);
+    // update the average energy, return the minimum it reached
+    unsigned int (*energy)(unsigned int& energy2, const int16_t* src, unsigned int n);
+};
+
+// Energy decay and attack factors for the floating point implementations
+static const float s_decay = (float)DECAY_STORE / DECAY_TOTAL;
+static const float s_attack = (float)ATTACK_RATE / DECAY_TOTAL;
+
+static void addC(int* mix, const int16_t* src, unsigned int n)
+{
+    while (n--)
+	*mix++ += *src++;
+}
+
+// Saturate symmetrically so inverting a sample never overflows
+static inline int16_t satSample(int val)
+{
+    return (val < -32767) ? -32767 : ((val > 32767) ? 32767 : val);
+}
+
+static void satC(int16_t* dst, const int* mix, unsigned int n)
+{
+    while (n--)
+	*dst++ = satSample(*mix++);
+}
+
+static void subC(int16_t* dst, const int* mix, const int16_t* own, unsigned int n)
+{
+    while (n--)
+	*dst++ = satSample(*mix++ - *own++);
+}
+
+static unsigned int energyC(unsigned int& energy2, const int16_t* src, unsigned int n)
+{
+    float sum2 = (float)energy2;
+    float min2 = (float)ENERGY_MAX;
+    while (n--) {
+	float samp = *src++;
+	// use square of the energy as extracting the square root is expensive
+	sum2 = sum2 * s_decay + samp * samp * s_attack;
+	if (min2 > sum2)
+	    min2 = sum2;
+    }
+    energy2 = (unsigned int)sum2;
+    return (unsigned int)min2;
+}
+
+static const MixOps s_mixC = { "scalar", addC, satC, subC, energyC };
+
+#ifdef CONF_SSE2
+static void addSSE2(int* mix, const int16_t* src, unsigned int n)
+{
+    for (; n >= 8; n -= 8, src += 8, mix += 8) {
+	__m128i s = _mm_loadu_si128((const __m128i*)src);
+	// sign extend by placing samples in the high half then shifting down
+	__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s,s),16);
+	__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s,s),16);
+	_mm_storeu_si128((__m128i*)mix,_mm_add_epi32(_mm_loadu_si128((const __m128i*)mix),lo));
+	_mm_storeu_si128((__m128i*)(mix + 4),_mm_add_epi32(_mm_loadu_si128((const __m128i*)(mix + 4)),hi));
+    }
+    addC(mix,src,n);
+}
+
+static void satSSE2(int16_t* dst, const int* mix, unsigned int n)
+{
+    const __m128i low = _mm_set1_epi16(-32767);
+    for (; n >= 8; n -= 8, dst += 8, mix += 8) {
+	__m128i v = _mm_packs_epi32(_mm_loadu_si128((const __m128i*)mix),
+	    _mm_loadu_si128((const __m128i*)(mix + 4)));
+	_mm_storeu_si128((__m128i*)dst,_mm_max_epi16(v,low));
+    }
+    satC(dst,mix,n);
+}
+
+static void subSSE2(int16_t* dst, const int* mix, const int16_t* own, unsigned int n)
+{
+    const __m128i low = _mm_set1_epi16(-32767);
+    for (; n >= 8; n -= 8, dst += 8, mix += 8, own += 8) {
+	__m128i s = _mm_loadu_si128((const __m128i*)own);
+	__m128i lo = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)mix),
+	    _mm_srai_epi32(_mm_unpacklo_epi16(s,s),16));
+	__m128i hi = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(mix + 4)),
+	    _mm_srai_epi32(_mm_unpackhi_epi16(s,s),16));
+	_mm_storeu_si128((__m128i*)dst,_mm_max_epi16(_mm_packs_epi32(lo,hi),low));
+    }
+    subC(dst,mix,own,n);
+}
+
+// The energy average is a first order recursive filter, 4 consecutive outputs
+//  are computed at once as a weighted prefix sum of the inputs
+static unsigned int energySSE2(unsigned int& energy2, const int16_t* src, unsigned int n)
+{
+    const float d2 = s_decay * s_decay;
+    const __m128 att = _mm_set1_ps(s_attack);
+    const __m128 dec1 = _mm_set1_ps(s_decay);
+    const __m128 dec2 = _mm_set1_ps(d2);
+    const __m128 decay = _mm_setr_ps(s_decay,d2,d2 * s_decay,d2 * d2);
+    __m128 sum2 = _mm_set1_ps((float)energy2);
+    __m128 min2 = _mm_set1_ps((float)ENERGY_MAX);
+    for (; n >= 4; n -= 4, src += 4) {
+	__m128i s = _mm_loadl_epi64((const __m128i*)src);
+	__m128 x = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s,s),16));
+	x = _mm_mul_ps(_mm_mul_ps(x,x),att);
+	x = _mm_add_ps(x,_mm_mul_ps(_mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x),4)),dec1));
+	x = _mm_add_ps(x,_mm_mul_ps(_mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x),8)),dec2));
+	x = _mm_add_ps(x,_mm_mul_ps(sum2,decay));
+	min2 = _mm_min_ps(min2,x);
+	sum2 = _mm_shuffle_ps(x,x,0xff);
+    }
+    min2 = _mm_min_ps(min2,_mm_movehl_ps(min2,min2));
+    min2 = _mm_min_ss(min2,_mm_shuffle_ps(min2,min2,0x55));
+    energy2 = (unsigned int)_mm_cvtss_f32(sum2);
+    unsigned int m = (unsigned int)_mm_cvtss_f32(min2);
+    if (n) {
+	unsigned int m2 = energyC(energy2,src,n);
+	if (m > m2)
+	    m = m2;
+    }
+    return m;
+}
+
+static const MixOps s_mixSSE2 = { "sse2", addSSE2, satSSE2, subSSE2, energySSE2 };
+#endif
+
+#ifdef CONF_AVX2
+__attribute__((target("avx2")))
+static void addAVX2(int* mix, const int16_t* src, unsigned int n)
+{
+    for (; n >= 8; n -= 8, src += 8, mix += 8) {
+	__m256i s = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)src));
+	_mm256_storeu_si256((__m256i*)mix,_mm256_add_epi32(_mm256_loadu_si256((const __m256i*)mix),s));
+    }
+    addC(mix,src,n);
+}
+
+__attribute__((target("avx2")))
+static void satAVX2(int16_t* dst, const int* mix, unsigned int n)
+{
+    const __m256i low = _mm256_set1_epi16(-32767);
+    for (; n >= 16; n -= 16, dst += 16, mix += 16) {
+	// packing works within 128 bit lanes, put the quadwords back in order
+	__m256i v = _mm256_packs_epi32(_mm256_loadu_si256((const __m256i*)mix),
+	    _mm256_loadu_si256((const __m256i*)(mix + 8)));
+	v = _mm256_permute4x64_epi64(_mm256_max_epi16(v,low),0xd8);
+	_mm256_storeu_si256((__m256i*)dst,v);
+    }
+    satC(dst,mix,n);
+}
+
+__attribute__((target("avx2")))
+static void subAVX2(int16_t* dst, const int* mix, const int16_t* own, unsigned int n)
+{
+    const __m256i low = _mm256_set1_epi16(-32767);
+    for (; n >= 16; n -= 16, dst += 16, mix += 16, own += 16) {
+	__m256i lo = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)mix),
+	    _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)own)));
+	__m256i hi = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(mix + 8)),
+	    _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(own + 8))));
+	__m256i v = _mm256_permute4x64_epi64(_mm256_max_epi16(_mm256_packs_epi32(lo,hi),low),0xd8);
+	_mm256_storeu_si256((__m256i*)dst,v);
+    }
+    subC(dst,mix,own,n);
+}
+
+// The energy recursion gains nothing from wider vectors, reuse the SSE2 one
+static const MixOps s_mixAVX2 = { "avx2", addAVX2, satAVX2, subAVX2, energySSE2 };
+#endif
+
+static const MixOps* s_mixOps = &s_mixC;
+
+// Pick the best mixing primitives the CPU supports, or the requested ones
+static const MixOps* selectMixOps(const String& name)
+{
+    bool any = (name == "auto");
+#ifdef CONF_AVX2
+    if ((any || (name == s_mixAVX2.name)) && __builtin_cpu_supports("avx2"))
+	return &s_mixAVX2;
+#endif
+#ifdef CONF_SSE2
+    if (any || (name == s_mixSSE2.name))
+	return &s_mixSSE2;
+#endif
+    return &s_mixC;
+}
+
 
 // Get a pointer to a conference by name, optionally creates it with given parameters
 // If a pointer is returned it must be dereferenced by the caller
@@ -259,12 +581,25 @@ ConfRoom* ConfRoom::get(const String& name, const NamedList* params)
 
 // Private constructor, always called from ConfRoom::get() with mutex hold
 ConfRoom::ConfRoom(const String& name, const NamedList& params)
-    : m_name(name), m_lonely(false), m_record(0),
+    : m_name(name), m_mixer(0), m_jitterMin(0), m_jitterMax(0),
+      m_late(0), m_early(0), m_speakers(0), m_speakerHold(0), m_mixSerial(0),
+      m_lonely(false), m_record(0),
       m_rate(8000), m_users(0), m_maxusers(10)
 {
     DDebug(&__plugin,DebugAll,"ConfRoom::ConfRoom('%s',%p) [%p]",
 	name.c_str(),&params,this);
     m_rate = params.getIntValue("rate",m_rate);
+    if (params.getBoolValue("timer",s_mixThreads > 0)) {
+	// bytes of 16 bit samples buffered for the configured time
+	m_jitterMin = (m_rate * s_jitterMin / 1000) * sizeof(int16_t);
+	m_jitterMax = (m_rate * s_jitterMax / 1000) * sizeof(int16_t);
+	m_mixer = ConfMixer::assign(this);
+    }
+    int speakers = params.getIntValue("speakers",s_speakers);
+    if (speakers > 0) {
+	m_speakers = (speakers < MAX_SPEAKERS) ? speakers : MAX_SPEAKERS;
+	m_speakerHold = m_rate * params.getIntValue("speakerhold",s_speakerHold) / 1000;
+    }
     m_maxusers = params.getIntValue("maxusers",m_maxusers);
     m_notify = params.getValue("notify");
     m_lonely = params.getBoolValue("lonely");
@@ -293,7 +628,12 @@ void ConfRoom::destroyed()
     // plugin must be locked as the destructor is called when room is dereferenced
     Lock lock(&__plugin);
     s_rooms.remove(this,false);
+    if (m_mixer) {
+	m_mixer->remove(this);
+	m_mixer = 0;
+    }
     m_chans.clear();
+    m_encoders.clear();
     if (m_notify) {
 	Message* m = new Message("chan.notify");
 	m->addParam("targetid",m_notify);
@@ -398,6 +738,20 @@ void ConfRoom::msgStatus(Message& msg)
 	msg.retValue() << ",notify=" << m_notify;
     if (m_playerId)
 	msg.retValue() << ",player=" << m_playerId;
+    msg.retValue() << ",mixing=" << (m_mixer ? "timer" : "data");
+    if (m_mixer)
+	msg.retValue() << ",late=" << m_late << ",early=" << m_early;
+    if (m_speakers) {
+	msg.retValue() << ",speakers=" << m_speakers << ",encoders=" << m_encoders.count();
+	String active;
+	for (ObjList* l = m_chans.skipNull(); l; l = l->skipNext()) {
+	    ConfChan* ch = static_cast<ConfChan*>(l->get());
+	    ConfConsumer* co = static_cast<ConfConsumer*>(ch->getConsumer());
+	    if (co && co->m_speaker)
+		active.append(ch->id(),"|");
+	}
+	msg.retValue() << ",active=" << active;
+    }
     msg.retValue() << "\r\n";
 }
 
@@ -497,44 +851,166 @@ void ConfRoom::mix(ConfConsumer* cons)
     unsigned int chunks = len / DATA_CHUNK;
     if (!chunks)
 	return;
-    len = chunks * DATA_CHUNK / sizeof(int16_t);
-    DataBlock mixbuf(0,len*sizeof(int));
-    int* buf = (int*)mixbuf.data();
-    for (l = m_chans.skipNull(); l; l = l->skipNext()) {
+    DataBlock data;
+    mixData(chunks * DATA_CHUNK / sizeof(int16_t),data);
+    mylock.drop();
+    Forward(data);
+}
+
+// Mix one period of buffered data, called by the mixer thread
+// Members are mixed in only after their jitter buffer filled up
+void ConfRoom::tick()
+{
+    unsigned int len = (m_rate * (MIX_PERIOD / 1000) / 1000) * sizeof(int16_t);
+    Lock mylock(mutex());
+    for (ObjList* l = m_chans.skipNull(); l; l = l->skipNext()) {
+	ConfChan* ch = static_cast<ConfChan*>(l->get());
+	ConfConsumer* co = static_cast<ConfConsumer*>(ch->getConsumer());
+	if (!co || co->m_muted)
+	    continue;
+	unsigned int buffered = co->m_buffer.length();
+	if (co->m_hold) {
+	    if (buffered >= m_jitterMin)
+		co->m_hold = false;
+	}
+	else if (buffered < len) {
+	    // data did not arrive in time, wait for the buffer to fill again
+	    XDebug(ch,DebugAll,"Cons %p late, buffered %u [%p]",co,buffered,this);
+	    co->m_hold = true;
+	    m_late++;
+	}
+    }
+    DataBlock data;
+    mixData(len / sizeof(int16_t),data);
+    mylock.drop();
+    Forward(data);
+}
+
+// Mix a number of samples from members' buffers and forward it to them,
+//  the room lock must be held, returns the full mix in data
+void ConfRoom::mixData(unsigned int len, DataBlock& data)
+{
+    if (m_mixBuf.length() < len*sizeof(int)) {
+	m_mixBuf.assign(0,len*sizeof(int));
+	m_outBuf.assign(0,len*sizeof(int16_t));
+	m_ownBuf.assign(0,len*sizeof(int16_t));
+    }
+    else
+	::memset(m_mixBuf.data(),0,len*sizeof(int));
+    int* buf = (int*)m_mixBuf.data();
+    const MixOps* ops = s_mixOps;
+    m_mixSerial++;
+    if (m_speakers)
+	selectSpeakers(len);
+    ObjList* l = m_chans.skipNull();
+    for (; l; l = l->skipNext()) {
 	ConfChan* ch = static_cast<ConfChan*>(l->get());
 	ConfConsumer* co = static_cast<ConfConsumer*>(ch->getConsumer());
 	if (co) {
-	    // avoid mixing in noise
-	    if (co->hasSignal()) {
+	    // avoid mixing in noise, active speakers are mixed even when quiet
+	    if (m_speakers)
+		co->m_mixed = co->m_speaker && !(co->m_muted || co->m_hold) && (co->m_buffer.length() > 1);
+	    else
+		co->m_mixed = co->hasSignal();
+	    if (co->m_mixed) {
 		unsigned int n = co->m_buffer.length() / 2;
 		XDebug(ch,DebugAll,"Cons %p samp=%u |%s%s>",
 		    co,n,String('#',co->noise()).safe(),
 		    String('=',co->energy() - co->noise()).safe());
 		if (n > len)
 		    n = len;
-		const int16_t* p = (const int16_t*)co->m_buffer.data();
-		for (unsigned int i=0; i < n; i++)
-		    buf[i] += *p++;
+		ops->add(buf,(const int16_t*)co->m_buffer.data(),n);
 	    }
 	}
     }
+    // the full mix is what all channels that did not contribute will get
+    int16_t* shared = (int16_t*)m_outBuf.data();
+    ops->sat(shared,buf,len);
     // we finished mixing - notify consumers about it
     for (l = m_chans.skipNull(); l; l = l->skipNext()) {
 	ConfChan* ch = static_cast<ConfChan*>(l->get());
 	ConfConsumer* co = static_cast<ConfConsumer*>(ch->getConsumer());
 	if (co)
-	    co->consumed(buf,len);
+	    co->consumed(buf,shared,(int16_t*)m_ownBuf.data(),len);
+    }
+    data.assign(shared,len*sizeof(int16_t));
+}
+
+// Choose which members are mixed when the number of speakers is limited
+// Speakers keep their place while quiet for a while and are replaced only
+//  by a member that is significantly louder
+void ConfRoom::selectSpeakers(unsigned int samples)
+{
+    ConfConsumer* spk[MAX_SPEAKERS];
+    ConfConsumer* cand[MAX_SPEAKERS];
+    unsigned int ns = 0;
+    unsigned int nc = 0;
+    for (ObjList* l = m_chans.skipNull(); l; l = l->skipNext()) {
+	ConfChan* ch = static_cast<ConfChan*>(l->get());
+	ConfConsumer* co = static_cast<ConfConsumer*>(ch->getConsumer());
+	if (!co)
+	    continue;
+	if (co->m_speaker) {
+	    if (co->hasSignal())
+		co->m_quiet = 0;
+	    else
+		co->m_quiet += samples;
+	    if (co->m_muted || (co->m_quiet >= m_speakerHold) || (ns >= m_speakers))
+		co->m_speaker = false;
+	    else
+		spk[ns++] = co;
+	    continue;
+	}
+	if (!co->hasSignal())
+	    continue;
+	// keep the loudest candidates, sorted by energy
+	unsigned int i = nc;
+	if (nc < m_speakers)
+	    nc++;
+	else if (cand[--i]->m_energy2 >= co->m_energy2)
+	    continue;
+	for (; i && (cand[i-1]->m_energy2 < co->m_energy2); i--)
+	    cand[i] = cand[i-1];
+	cand[i] = co;
     }
-    DataBlock data(0,len*sizeof(int16_t));
-    int16_t* p = (int16_t*)data.data();
-    for (unsigned int i=0; i < len; i++) {
-	int val = buf[i];
-	// saturate symmetrically the result of addition
-	*p++ = (val < -32767) ? -32767 : ((val > 32767) ? 32767 : val);
+    unsigned int i = 0;
+    // fill the free places with the loudest candidates
+    for (; (i < nc) && (ns < m_speakers); i++) {
+	cand[i]->m_speaker = true;
+	cand[i]->m_quiet = 0;
+	spk[ns++] = cand[i];
     }
-    mixbuf.clear();
-    mylock.drop();
-    Forward(data);
+    // replace the weakest speakers with candidates at least twice as loud
+    for (; i < nc; i++) {
+	unsigned int w = 0;
+	for (unsigned int j = 1; j < ns; j++)
+	    if (spk[w]->m_energy2 > spk[j]->m_energy2)
+		w = j;
+	if ((cand[i]->m_energy2 >> 1) <= spk[w]->m_energy2)
+	    break;
+	XDebug(&__plugin,DebugAll,"Speaker %p replaces %p in '%s'",cand[i],spk[w],m_name.c_str());
+	spk[w]->m_speaker = false;
+	cand[i]->m_speaker = true;
+	cand[i]->m_quiet = 0;
+	spk[w] = cand[i];
+    }
+}
+
+// Get the full mix encoded in a format, each format is encoded once per mix
+const DataBlock* ConfRoom::sharedData(const DataFormat& format, const int16_t* shared, unsigned int samples)
+{
+    ConfEncoder* enc = static_cast<ConfEncoder*>(m_encoders[format]);
+    if (!enc) {
+	enc = new ConfEncoder(format);
+	m_encoders.append(enc);
+    }
+    if (enc->m_serial != m_mixSerial) {
+	enc->m_serial = m_mixSerial;
+	enc->clearData();
+	if (!enc->encode(shared,samples))
+	    return 0;
+    }
+    return &enc->data();
 }
 
 
@@ -545,18 +1021,7 @@ void ConfConsumer::Consume(const DataBlock& data, unsigned long tStamp)
 	return;
     if (m_smart) {
 	// we need to compute the average energy and take decay into account
-	int64_t sum2 = m_energy2;
-	unsigned int min2 = ENERGY_MAX;
-	unsigned int n = data.length() / 2;
-	const int16_t* p = (const int16_t*)data.data();
-	for (unsigned int i=0; i < n; i++) {
-	    int32_t samp = *p++;
-	    // use square of the energy as extracting the square root is expensive
-	    sum2 = (sum2 * DECAY_STORE + (int64_t)(samp*samp) * ATTACK_RATE) / DECAY_TOTAL;
-	    if (min2 > sum2)
-		min2 = (unsigned int)sum2;
-	}
-	m_energy2 = (unsigned int)sum2;
+	unsigned int min2 = s_mixOps->energy(m_energy2,(const int16_t*)data.data(),data.length() / 2);
 	// TODO: find a better algorithm to adjust the noise threshold
 	min2 += min2 >> SHIFT_LEVEL;
 	// try to keep noise threshold slightly above minimum energy
@@ -576,6 +1041,21 @@ void ConfConsumer::Consume(const DataBlock& data, unsigned long tStamp)
 	m_muted = true;
 	return;
     }
+    if (m_room->timed()) {
+	// the mixer thread takes data out, drop the oldest if we got too much
+	unsigned int len = m_buffer.length() + data.length();
+	if (len > m_room->m_jitterMax) {
+	    len -= m_room->m_jitterMax;
+	    if (len < m_buffer.length())
+		m_buffer.cut(-(int)len);
+	    else
+		m_buffer.clear();
+	    m_room->m_early++;
+	}
+	m_buffer += data;
+	m_room->mutex()->unlock();
+	return;
+    }
     if (m_buffer.length()+data.length() <= MAX_BUFFER)
 	m_buffer += data;
     m_room->mutex()->unlock();
@@ -585,11 +1065,14 @@ void ConfConsumer::Consume(const DataBlock& data, unsigned long tStamp)
 
 // Take out of the buffer the samples mixed in or skipped
 //  this method is called with the room locked
-void ConfConsumer::consumed(const int* mixed, unsigned int samples)
+void ConfConsumer::consumed(const int* mixed, const int16_t* shared, int16_t* own, unsigned int samples)
 {
     if (!samples)
 	return;
-    dataForward(mixed,samples);
+    dataForward(mixed,shared,own,samples);
+    // keep filling the jitter buffer
+    if (m_hold)
+	return;
     unsigned int n = m_buffer.length() / 2;
     if (samples > n) {
 	// buffer underflowed
@@ -609,7 +1092,8 @@ void ConfConsumer::consumed(const int* mixed, unsigned int samples)
 }
 
 // Substract our own data from the mix and send it on the no-echo source
-void ConfConsumer::dataForward(const int* mixed, unsigned int samples)
+// Channels that did not contribute get the shared mix without any copy
+void ConfConsumer::dataForward(const int* mixed, const int16_t* shared, int16_t* own, unsigned int samples)
 {
     if (!(m_src && mixed))
 	return;
@@ -620,19 +1104,25 @@ void ConfConsumer::dataForward(const int* mixed, unsigned int samples)
     if (!src)
 	return;
 
-    int16_t* d = (int16_t*)m_buffer.data();
-    unsigned int n = m_buffer.length() / 2;
-    DataBlock data(0,samples*sizeof(int16_t));
-    int16_t* p = (int16_t*)data.data();
-    for (unsigned int i=0; i < samples; i++) {
-	int val = *mixed++;
-	// substract our own data if we contributed - only as much as we have
-	if ((i < n) && hasSignal())
-	    val -= d[i];
-	// saturate symmetrically the result of additions and substraction
-	*p++ = (val < -32767) ? -32767 : ((val > 32767) ? 32767 : val);
+    const int16_t* out = shared;
+    if (!m_mixed && statelessFormat(src->getFormat())) {
+	// not mixed in so the full mix encoded once is good for us too
+	const DataBlock* data = m_room->sharedData(src->getFormat(),shared,samples);
+	if (data && data->length())
+	    src->Forward(*data);
+	return;
     }
-    src->Forward(data);
+    if (m_mixed) {
+	// substract our own data since we contributed - only as much as we have
+	unsigned int n = m_buffer.length() / 2;
+	if (n > samples)
+	    n = samples;
+	s_mixOps->sub(own,mixed,(const int16_t*)m_buffer.data(),n);
+	if (n < samples)
+	    ::memcpy(own + n,shared + n,(samples - n)*sizeof(int16_t));
+	out = own;
+    }
+    src->forwardMix(out,samples);
 }
 
 unsigned int ConfConsumer::energy() const
@@ -646,11 +1136,13 @@ unsigned int ConfConsumer::noise() const
 }
 
 
-ConfSource::ConfSource(ConfConsumer* cons)
-    : m_cons(cons)
+ConfSource::ConfSource(ConfConsumer* cons, const char* format)
+    : DataSource(format), m_cons(cons), m_encoder(0)
 {
     if (m_cons)
 	m_cons->m_src = this;
+    if (getFormat() != "slin")
+	m_encoder = new ConfEncoder(getFormat(),this);
 }
 
 ConfSource::~ConfSource()
@@ -660,12 +1152,175 @@ ConfSource::~ConfSource()
 	m_cons->m_src = 0;
 	s_srcMutex.unlock();
     }
+    TelEngine::destruct(m_encoder);
+}
+
+// Forward mixed signed linear data, encode it first if needed
+void ConfSource::forwardMix(const int16_t* data, unsigned int samples)
+{
+    if (m_encoder) {
+	m_encoder->encode(data,samples);
+	return;
+    }
+    DataBlock block((void*)data,samples*sizeof(int16_t),false);
+    Forward(block);
+    block.clear(false);
+}
+
+
+ConfEncoder::ConfEncoder(const DataFormat& format, DataSource* target)
+    : DataConsumer(format), m_serial(0), m_trans(0), m_target(target)
+{
+    m_trans = DataTranslator::create("slin",format);
+    if (m_trans)
+	m_trans->getTransSource()->attach(this);
+    else
+	Debug(&__plugin,DebugWarn,"Cannot encode conference data to '%s'",format.c_str());
+}
+
+// Break the reference loop with the translator before releasing
+void ConfEncoder::destruct()
+{
+    if (m_trans) {
+	m_trans->getTransSource()->detach(this);
+	TelEngine::destruct(m_trans);
+    }
+    DataConsumer::destruct();
+}
+
+// Receive the encoded data from the translator
+void ConfEncoder::Consume(const DataBlock& data, unsigned long tStamp)
+{
+    if (m_target)
+	m_target->Forward(data);
+    else
+	m_data += data;
+}
+
+bool ConfEncoder::encode(const int16_t* data, unsigned int samples)
+{
+    if (!m_trans)
+	return false;
+    DataBlock block((void*)data,samples*sizeof(int16_t),false);
+    m_trans->Consume(block,invalidStamp());
+    block.clear(false);
+    return true;
+}
+
+
+ConfMixer::ConfMixer()
+    : Thread("ConfMixer",Thread::High), m_count(0), m_skipped(0)
+{
+    DDebug(&__plugin,DebugAll,"ConfMixer::ConfMixer() [%p]",this);
+    s_mixers.append(this)->setDelete(false);
+}
+
+ConfMixer::~ConfMixer()
+{
+    DDebug(&__plugin,DebugAll,"ConfMixer::~ConfMixer() skipped=%u [%p]",m_skipped,this);
+    Lock lock(s_mixMutex);
+    s_mixers.remove(this,false);
+    // rooms left behind will mix from received data from now on
+    for (ObjList* l = m_rooms.skipNull(); l; l = l->skipNext())
+	static_cast<ConfRoom*>(l->get())->m_mixer = 0;
+}
+
+// Assign a room to the least loaded mixer, start a new mixer if allowed
+// Called from the room constructor with the plugin locked
+ConfMixer* ConfMixer::assign(ConfRoom* room)
+{
+    Lock lock(s_mixMutex);
+    if (s_mixExit)
+	return 0;
+    ConfMixer* mixer = 0;
+    int count = 0;
+    for (ObjList* l = s_mixers.skipNull(); l; l = l->skipNext(), count++) {
+	ConfMixer* m = static_cast<ConfMixer*>(l->get());
+	if (!mixer || (mixer->m_count > m->m_count))
+	    mixer = m;
+    }
+    if ((count < s_mixThreads) && !(mixer && !mixer->m_count)) {
+	ConfMixer* m = new ConfMixer;
+	if (m->startup())
+	    mixer = m;
+	else {
+	    Debug(&__plugin,DebugGoOn,"Error starting conference mixer thread %p",m);
+	    delete m;
+	}
+    }
+    if (!mixer)
+	return 0;
+    mixer->m_rooms.append(room)->setDelete(false);
+    mixer->m_count++;
+    return mixer;
+}
+
+// Remove a room from the mixer, called when the room is destroyed
+void ConfMixer::remove(ConfRoom* room)
+{
+    Lock lock(s_mixMutex);
+    if (m_rooms.remove(room,false))
+	m_count--;
+}
+
+void ConfMixer::run()
+{
+    u_int64_t tick = Time::now();
+    ObjList rooms;
+    while (!s_mixExit) {
+	tick += MIX_PERIOD;
+	int64_t dly = tick - Time::now();
+	if (dly > 0)
+	    Thread::usleep((unsigned long)dly,true);
+	else if (dly < -5 * MIX_PERIOD) {
+	    // too much behind, start over and let jitter buffers recover
+	    Debug(&__plugin,DebugMild,"Mixer %p late by " FMT64 " usec",this,-dly);
+	    tick = Time::now();
+	    m_skipped++;
+	}
+	// keep rooms referenced while mixing, they can be destroyed at any time
+	s_mixMutex.lock();
+	for (ObjList* l = m_rooms.skipNull(); l; l = l->skipNext()) {
+	    ConfRoom* room = static_cast<ConfRoom*>(l->get());
+	    if (room->ref())
+		rooms.append(room);
+	}
+	s_mixMutex.unlock();
+	for (ObjList* l = rooms.skipNull(); l; l = l->skipNext())
+	    static_cast<ConfRoom*>(l->get())->tick();
+	rooms.clear();
+    }
+}
+
+// Stop all mixer threads, returns true if they all finished
+bool ConfMixer::stopAll()
+{
+    s_mixMutex.lock();
+    s_mixExit = true;
+    s_mixMutex.unlock();
+    for (int i = 0; i < 50; i++) {
+	s_mixMutex.lock();
+	bool done = (s_mixers.skipNull() == 0);
+	s_mixMutex.unlock();
+	if (done)
+	    return true;
+	Thread::msleep(10);
+    }
+    s_mixExit = false;
+    return false;
+}
+
+void ConfMixer::status(String& str)
+{
+    Lock lock(s_mixMutex);
+    str << ",mixers=" << s_mixers.count();
 }
 
 
 // Constructor of a new conference leg, creates or attaches to an existing
 //  conference room; noise and echo suppression are also set here
-ConfChan::ConfChan(const String& name, const NamedList& params, bool counted, bool utility)
+ConfChan::ConfChan(const String& name, const NamedList& params, bool counted, bool utility,
+    CallEndpoint* peer)
     : Channel(__plugin,0,true),
       m_counted(counted), m_utility(utility), m_billing(false), m_keepTarget(true)
 {
@@ -695,7 +1350,14 @@ ConfChan::ConfChan(const String& name, const NamedList& params, bool counted, bo
 	if (echo || !cons)
 	    setSource(m_room);
 	else {
-	    ConfSource* src = new ConfSource(cons);
+	    // in speaker limited rooms send data in the format the peer wants
+	    //  so the mix of members not speaking can be encoded only once
+	    String format = "slin";
+	    DataConsumer* pc = peer ? peer->getConsumer() : 0;
+	    if (pc && m_room->speakers() && (m_room->rate() == 8000) &&
+		(pc->getFormat() != "slin") && DataTranslator::canConvert(pc->getFormat()))
+		format = pc->getFormat();
+	    ConfSource* src = new ConfSource(cons,format);
 	    setSource(src);
 	    src->deref();
 	}
@@ -842,14 +1504,14 @@ bool ConfHandler::received(Message& msg)
     }
 
     // create a conference leg or even a room for the caller
-    ConfChan *c = new ConfChan(room,msg,counted,utility);
+    ConfChan *c = new ConfChan(room,msg,counted,utility,chan);
     if (chan->connect(c,reason,false)) {
 	msg.setParam("peerid",c->id());
 	c->deref();
 	msg.setParam("room",__plugin.prefix()+room);
 	if (peer) {
 	    // create a conference leg for the old peer too
-	    ConfChan *p = new ConfChan(room,msg,counted,utility);
+	    ConfChan *p = new ConfChan(room,msg,counted,utility,peer);
 	    peer->connect(p,reason,false);
 	    p->deref();
 	}
@@ -932,7 +1594,7 @@ bool ConferenceDriver::msgExecute(Message& msg, String& dest)
 	return false;
     CallEndpoint* ch = static_cast<CallEndpoint*>(msg.userData());
     if (ch) {
-	ConfChan *c = new ConfChan(dest,msg,counted,utility);
+	ConfChan *c = new ConfChan(dest,msg,counted,utility,ch);
 	if (ch->connect(c)) {
 	    c->callConnect(msg);
 	    msg.setParam("peerid",c->id());
@@ -977,6 +1639,8 @@ bool ConferenceDriver::unload()
 	return false;
     if (isBusy() || s_rooms.count())
 	return false;
+    if (!ConfMixer::stopAll())
+	return false;
     uninstallRelays();
     Engine::uninstall(m_handler);
     m_handler = 0;
@@ -1017,7 +1681,8 @@ bool ConferenceDriver::commandComplete(Message& msg, const String& partLine, con
 void ConferenceDriver::statusParams(String& str)
 {
     Driver::statusParams(str);
-    str.append("rooms=",",") << s_rooms.count();
+    str.append("rooms=",",") << s_rooms.count() << ",mixer=" << s_mixOps->name;
+    ConfMixer::status(str);
 }
 
 void ConferenceDriver::initialize()
@@ -1027,6 +1692,19 @@ void ConferenceDriver::initialize()
     installRelay(Tone,75);
     installRelay(Text,75);
     setup();
+    Configuration cfg(Engine::configFile("conference"));
+    s_mixOps = selectMixOps(cfg.getValue("general","simd","auto"));
+    int mixers = cfg.getIntValue("general","mixers",0);
+    s_mixThreads = (mixers > 0) ? ((mixers < MAX_MIXERS) ? mixers : MAX_MIXERS) : 0;
+    s_jitterMin = cfg.getIntValue("general","jitterbuf",40);
+    if (s_jitterMin < 20)
+	s_jitterMin = 20;
+    s_speakers = cfg.getIntValue("general","speakers",0);
+    s_speakerHold = cfg.getIntValue("general","speakerhold",500);
+    s_jitterMax = cfg.getIntValue("general","jittermax",120);
+    if (s_jitterMax < s_jitterMin + 40)
+	s_jitterMax = s_jitterMin + 40;
+    Debug(this,DebugInfo,"Mixing with %s code",s_mixOps->name);
     if (m_handler)
 	return;
     m_handler = new ConfHandler(150);
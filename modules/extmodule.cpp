@@ -76,10 +76,13 @@ public:
     ExtModSource(Stream* str, ExtModChan* chan);
     ~ExtModSource();
     virtual void run();
+    virtual bool tick(u_int64_t when);
 private:
     Stream* m_str;
     unsigned m_brate;
     unsigned m_total;
+    unsigned m_fill;
+    char m_frame[320];
     ExtModChan* m_chan;
 };
 
@@ -358,12 +361,16 @@ static bool runProgram(const char *script, const char *args)
 
 
 ExtModSource::ExtModSource(Stream* str, ExtModChan* chan)
-    : m_str(str), m_brate(16000), m_total(0), m_chan(chan)
+    : m_str(str), m_brate(16000), m_total(0), m_fill(0), m_chan(chan)
 {
     Debug(DebugAll,"ExtModSource::ExtModSource(%p) [%p]",str,this);
     if (m_str) {
 	chan->setRunning(true);
-	start("ExtModSource");
+	// use the shared media clock if the pipe can be read without blocking
+	if (m_str->setBlocking(false))
+	    startClock(20000,"ExtModSource");
+	else
+	    start("ExtModSource");
     }
 }
 
@@ -414,6 +421,40 @@ void ExtModSource::run()
     m_chan->setRunning(false);
 }
 
+bool ExtModSource::tick(u_int64_t when)
+{
+    // collect a whole frame, short reads are kept for the next tick
+    while (m_fill < sizeof(m_frame)) {
+	int r = m_str ? m_str->readData(m_frame + m_fill,sizeof(m_frame) - m_fill) : 0;
+	if (r < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (m_str->canRetry())
+		return true;
+	}
+	if (r <= 0) {
+	    if (m_fill) {
+		// deliver the partial frame left over at the end of data
+		DataBlock buf(m_frame,m_fill,false);
+		Forward(buf,m_total/2);
+		buf.clear(false);
+		m_total += m_fill;
+		m_fill = 0;
+	    }
+	    Debug(DebugAll,"ExtModSource [%p] end of data total=%u",this,m_total);
+	    m_chan->setRunning(false);
+	    return false;
+	}
+	m_fill += r;
+    }
+    DataBlock buf(m_frame,m_fill,false);
+    Forward(buf,m_total/2);
+    buf.clear(false);
+    m_total += m_fill;
+    m_fill = 0;
+    return true;
+}
+
 
 ExtModConsumer::ExtModConsumer(Stream* str)
     : m_str(str), m_total(0)
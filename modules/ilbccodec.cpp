@@ -26,10 +26,12 @@
 
 #include <yatephone.h>
 #include <stdlib.h>
+#include <string.h>
 
 extern "C" {
 #include "../libs/ilbc/iLBC_encode.h"
 #include "../libs/ilbc/iLBC_decode.h"
+#include "../libs/ilbc/simdfun.h"
 }
 
 using namespace TelEngine;
@@ -82,15 +84,21 @@ public:
     ~iLBCCodec();
     virtual void Consume(const DataBlock& data, unsigned long timeDelta);
 private:
+    void encode(unsigned char* out, const short* in);
+    void decode(short* out, const unsigned char* in);
     bool m_encoding;
-    DataBlock m_data;
+    // partial frame left over from the previous data block
+    short m_buffer[BLOCKL_MAX];
+    unsigned int m_buffered;
+    // output buffer, reused while the block size does not change
+    DataBlock m_out;
     iLBC_Enc_Inst_t m_enc;
     iLBC_Dec_Inst_t m_dec;
     int m_mode;
 };
 
 iLBCCodec::iLBCCodec(const char* sFormat, const char* dFormat, bool encoding, int msec)
-    : DataTranslator(sFormat,dFormat), m_encoding(encoding), m_mode(msec)
+    : DataTranslator(sFormat,dFormat), m_encoding(encoding), m_buffered(0), m_mode(msec)
 {
     Debug(DebugAll,"iLBCCodec::iLBCCodec(\"%s\",\"%s\",%scoding,%d) [%p]",
 	sFormat,dFormat, m_encoding ? "en" : "de",msec,this);
@@ -116,6 +124,24 @@ iLBCCodec::~iLBCCodec()
     s_cmutex.unlock();
 }
 
+// Encode one frame from 16 bit signed linear
+void iLBCCodec::encode(unsigned char* out, const short* in)
+{
+    float buffer[BLOCKL_MAX];
+    for (int j = 0; j < m_enc.blockl; j++)
+	buffer[j] = in[j];
+    ::iLBC_encode(out,buffer,&m_enc);
+}
+
+// Decode one frame to 16 bit signed linear
+void iLBCCodec::decode(short* out, const unsigned char* in)
+{
+    float buffer[BLOCKL_MAX];
+    ::iLBC_decode(buffer,const_cast<unsigned char*>(in),&m_dec,1);
+    for (int j = 0; j < m_dec.blockl; j++)
+	out[j] = (short)(buffer[j]);
+}
+
 void iLBCCodec::Consume(const DataBlock& data, unsigned long tStamp)
 {
     // block size in samples per frame, no_bytes frame length in bytes
@@ -131,61 +157,53 @@ void iLBCCodec::Consume(const DataBlock& data, unsigned long tStamp)
     if (!getTransSource())
 	return;
     ref();
-    m_data += data;
-    DataBlock outdata;
-    int frames,consumed;
-    if (m_encoding) {
-	frames = m_data.length() / (2 * block);
-	consumed = frames * 2 * block;
-	if (frames) {
-	    outdata.assign(0,frames*no_bytes);
-	    unsigned char* d = (unsigned char*)outdata.data();
-	    const short* s = (const short*)m_data.data();
-	    for (int i=0; i<frames; i++) {
-		// convert one frame data from 16 bit signed linear to float
-		float buffer[BLOCKL_MAX];
-		for (int j=0; j<block; j++)
-		    buffer[j] = *s++;
-		// and now do the actual encoding directly to outdata
-		::iLBC_encode(d,buffer,&m_enc);
-		d += no_bytes;
+    unsigned int inLen = m_encoding ? 2 * block : no_bytes;
+    unsigned int outLen = m_encoding ? no_bytes : 2 * block;
+    // process whole frames straight from the data, only a partial frame
+    //  is copied so no memory is allocated unless the block size changes
+    const unsigned char* s = (const unsigned char*)data.data();
+    unsigned int len = data.length();
+    int frames = (m_buffered + len) / inLen;
+    if (frames) {
+	if (m_out.length() != frames * outLen)
+	    m_out.assign(0,frames * outLen);
+	unsigned char* d = (unsigned char*)m_out.data();
+	for (int i=0; i<frames; i++) {
+	    const unsigned char* frame = s;
+	    unsigned int used = inLen;
+	    if (m_buffered) {
+		used -= m_buffered;
+		::memcpy(m_buffered + (unsigned char*)m_buffer,s,used);
+		m_buffered = 0;
+		frame = (const unsigned char*)m_buffer;
 	    }
+	    if (m_encoding)
+		encode(d,(const short*)frame);
+	    else
+		decode((short*)d,frame);
+	    d += outLen;
+	    s += used;
+	    len -= used;
 	}
     }
-    else {
-	frames = m_data.length() / no_bytes;
-	consumed = frames * no_bytes;
-	if (frames) {
-	    outdata.assign(0,frames * 2 * block);
-	    short* d = (short*)outdata.data();
-	    unsigned char* s = (unsigned char*)m_data.data();
-	    for (int i=0; i<frames; i++) {
-		// decode to a float values buffer
-		float buffer[BLOCKL_MAX];
-		::iLBC_decode(buffer,s,&m_dec,1);
-		s += no_bytes;
-		// convert the buffer back to 16 bit integer
-		for (int j=0; j<block; j++)
-		    *d++ = (short)(buffer[j]);
-	    }
-	}
+    if (len) {
+	::memcpy(m_buffered + (unsigned char*)m_buffer,s,len);
+	m_buffered += len;
     }
     if (!tStamp)
 	tStamp = timeStamp() + (frames * block);
 
-    XDebug("iLBCCodec",DebugAll,"%scoding %d frames of %d input bytes (consumed %d) in %d output bytes",
-	m_encoding ? "en" : "de",frames,m_data.length(),consumed,outdata.length());
-    if (frames) {
-	m_data.cut(-consumed);
-	getTransSource()->Forward(outdata,tStamp);
-    }
+    XDebug("iLBCCodec",DebugAll,"%scoding %d frames of %u input bytes (buffered %u) in %u output bytes",
+	m_encoding ? "en" : "de",frames,data.length(),m_buffered,frames * outLen);
+    if (frames)
+	getTransSource()->Forward(m_out,tStamp);
     deref();
 }
 
 iLBCPlugin::iLBCPlugin()
     : m_ilbc20(0), m_ilbc30(0)
 {
-    Output("Loaded module iLBC - based on iLBC library");
+    Output("Loaded module iLBC - based on iLBC library, %s kernels",simdName());
     const FormatInfo* f = FormatRepository::addFormat("ilbc20",NO_OF_BYTES_20MS,20000);
     s_caps20[0].src = s_caps20[1].dest = f;
     s_caps20[0].dest = s_caps20[1].src = FormatRepository::getFormat("slin");
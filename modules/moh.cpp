@@ -56,7 +56,7 @@ class MOHSource : public ThreadedSource
 {
 public:
     ~MOHSource();
-    virtual void run();
+    virtual bool tick(u_int64_t when);
     virtual void destroyed();
     inline const String &name()
 	{ return m_name; }
@@ -67,6 +67,7 @@ private:
     String m_command_line;
     bool create();
     DataBlock m_data;
+    unsigned int m_fill;
     pid_t m_pid;
     int m_in;
     bool m_swap;
@@ -123,7 +124,8 @@ private:
 
 MOHSource::MOHSource(const String &name, const String &command_line)
     : ThreadedSource("slin"),
-      m_name(name), m_command_line(command_line), m_swap(false), m_brate(16000)
+      m_name(name), m_command_line(command_line), m_fill(0), m_pid(0), m_in(-1),
+      m_swap(false), m_brate(16000), m_time(0)
 {
     Debug(DebugAll,"MOHSource::MOHSource(\"%s\", \"%s\") [%p]", name.c_str(), command_line.c_str(), this);
 }
@@ -163,11 +165,12 @@ MOHSource *MOHSource::getSource(const String &name)
     cmd = s_cfg.getValue("mohs", name);
     if (cmd) {
 	MOHSource *s = new MOHSource(name, cmd);
-	if (s->start("MOHSource")) {
+	if (s->create() && s->startClock(20000,"MOHSource")) {
 	    sources.append(s);
 	    return s;
-	} else
-	    return (MOHSource *) NULL;
+	}
+	s->deref();
+	return (MOHSource *) NULL;
     } else 
 	return (MOHSource *) NULL;
 }
@@ -217,53 +220,51 @@ bool MOHSource::create()
     }
     Debug(DebugInfo,"Launched External Script %s, pid: %d", m_command_line.c_str(), pid);
     m_in = ext2yate[0];
+    /* we are paced by the media clock so never block reading */
+    ::fcntl(m_in,F_SETFL,::fcntl(m_in,F_GETFL) | O_NONBLOCK);
 
     /* close what we're not using in the parent */
     close(ext2yate[1]);
 
     m_pid = pid;
+    m_data.assign(0,(m_brate*20)/1000);
     return true;
 }
 
-void MOHSource::run()
+bool MOHSource::tick(u_int64_t when)
 {
-    if (!create()) {
-	m_pid = 0;
-	return;
-    }
-
-    m_data.assign(0,(m_brate*20)/1000);
-    int r = 0;
-    u_int64_t tpos = Time::now();
-    m_time = tpos;
-
-    do {
-	r = (m_in >= 0) ? ::read(m_in,m_data.data(),m_data.length()) : m_data.length();
-
+    if (!m_time)
+	m_time = when;
+    if (m_in < 0)
+	m_fill = m_data.length();
+    // collect a whole frame, short reads are kept for the next tick
+    while (m_fill < m_data.length()) {
+	int r = ::read(m_in,m_fill + (char*)m_data.data(),m_data.length() - m_fill);
 	if (r < 0) {
-	    if (errno == EINTR) {
-		r = 1;
+	    if (errno == EINTR)
 		continue;
+	    // the external process is late, try again on next tick
+	    if (errno == EAGAIN) {
+		XDebug("MOH",DebugAll,"Have %u of %u bytes from '%s' [%p]",
+		    m_fill,m_data.length(),m_name.c_str(),this);
+		return true;
 	    }
-	    break;
-	}
-	if (r < (int)m_data.length())
-	    m_data.assign(m_data.data(),r);
-	if (m_swap) {
-	    uint16_t* p = (uint16_t*)m_data.data();
-	    for (int i = 0; i < r; i+= 2) {
-		*p = ntohs(*p);
-		++p;
-	    }
+	    return false;
 	}
-	int64_t dly = tpos - Time::now();
-	if (dly > 0) {
-	    XDebug("MOH",DebugAll,"Sleeping for " FMT64 " usec",dly);
-	    Thread::usleep((unsigned long)dly);
+	if (!r)
+	    return false;
+	m_fill += r;
+    }
+    m_fill = 0;
+    if (m_swap) {
+	uint16_t* p = (uint16_t*)m_data.data();
+	for (unsigned int i = 0; i < m_data.length(); i += 2) {
+	    *p = ntohs(*p);
+	    ++p;
 	}
-	Forward(m_data);
-	tpos += (r*1000000ULL/m_brate);
-    } while (r > 0);
+    }
+    Forward(m_data);
+    return true;
 }
 
 
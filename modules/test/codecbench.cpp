@@ -0,0 +1,614 @@
+/**
+ * codecbench.cpp
+ * Standalone codec throughput benchmark
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2006 Null Team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Usage: codecbench [-c channels] [-s seconds] [-m moduledir] [-f formats] [-i file] [module ...]
+ *        codecbench -t [-m moduledir] [module ...]
+ *
+ * Loads the codec modules (by default all the *codec.yate ones we know of)
+ *  then for every format that can be converted to and from slin builds
+ *  translator chains with DataTranslator::create() and pushes a speech-like
+ *  signal, or the raw slin file given with -i, through them, encoding and
+ *  decoding separately.
+ * Results are printed one line per format and direction as key=value pairs,
+ *  a frame is always 20 msec of input audio. The out_hash of the first
+ *  channel allows checking that two builds of a codec produce the same output.
+ *
+ * With -t a set of generated test vectors is encoded and decoded by one
+ *  channel and the output hashes are compared with those of the reference
+ *  codec libraries. The exit code is non zero if any of them differs.
+ * The hashes are valid only for builds doing floating point math in SSE
+ *  registers, as x86-64 always does; x87 math rounds differently.
+ */
+
+#include <yatephone.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <errno.h>
+
+#ifdef _WINDOWS
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#define COUNT_ALLOCS
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+using namespace TelEngine;
+
+#ifdef COUNT_ALLOCS
+// Count allocations of the whole process, the executable's definitions
+//  take precedence over the C library for all shared objects
+
+extern "C" {
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t align, size_t size);
+extern void __libc_free(void* ptr);
+}
+
+static volatile long s_allocs = 0;
+static volatile long s_live = 0;
+
+static inline void* counted(void* ptr)
+{
+    if (ptr) {
+	__sync_add_and_fetch(&s_allocs,1);
+	__sync_add_and_fetch(&s_live,(long)::malloc_usable_size(ptr));
+    }
+    return ptr;
+}
+
+static inline void uncounted(void* ptr)
+{
+    if (ptr)
+	__sync_sub_and_fetch(&s_live,(long)::malloc_usable_size(ptr));
+}
+
+extern "C" {
+
+void* malloc(size_t size)
+{
+    return counted(__libc_malloc(size));
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+    return counted(__libc_calloc(nmemb,size));
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    uncounted(ptr);
+    return counted(__libc_realloc(ptr,size));
+}
+
+void* memalign(size_t align, size_t size)
+{
+    return counted(__libc_memalign(align,size));
+}
+
+int posix_memalign(void** ptr, size_t align, size_t size)
+{
+    *ptr = counted(__libc_memalign(align,size));
+    return *ptr ? 0 : ENOMEM;
+}
+
+void free(void* ptr)
+{
+    uncounted(ptr);
+    __libc_free(ptr);
+}
+
+}; // extern "C"
+
+static inline long allocCount()
+    { return s_allocs; }
+static inline long liveBytes()
+    { return s_live; }
+#else
+static inline long allocCount()
+    { return -1; }
+static inline long liveBytes()
+    { return -1; }
+#endif
+
+static const char* s_modules[] = {
+    "gsmcodec", "ilbccodec", "speexcodec", "amrnbcodec", 0
+};
+
+// Consumer that keeps and hashes the packets it receives if asked to
+class BenchSink : public DataConsumer
+{
+public:
+    inline BenchSink(const char* format, ObjList* keep = 0, bool hash = false)
+	: DataConsumer(format), m_keep(keep), m_hash(hash), m_bytes(0), m_fnv(2166136261U)
+	{ }
+    virtual void Consume(const DataBlock& data, unsigned long tStamp)
+	{
+	    m_bytes += data.length();
+	    if (m_keep)
+		m_keep->append(new DataBlock(data));
+	    if (m_hash) {
+		// FNV-1a of everything received
+		const unsigned char* p = (const unsigned char*)data.data();
+		for (unsigned int i = 0; i < data.length(); i++)
+		    m_fnv = (m_fnv ^ p[i]) * 16777619U;
+	    }
+	}
+    inline u_int64_t bytes() const
+	{ return m_bytes; }
+    inline u_int32_t hash() const
+	{ return m_fnv; }
+private:
+    ObjList* m_keep;
+    bool m_hash;
+    u_int64_t m_bytes;
+    u_int32_t m_fnv;
+};
+
+// Translator chain fed from a source of its own
+class BenchChain : public GenObject
+{
+public:
+    BenchChain(const String& sFmt, const String& dFmt, ObjList* keep = 0, bool hash = false);
+    virtual ~BenchChain();
+    inline bool valid() const
+	{ return m_sink != 0; }
+    inline void forward(const DataBlock& data, unsigned long tStamp)
+	{ m_source->Forward(data,tStamp); }
+    inline u_int64_t bytes() const
+	{ return m_sink ? m_sink->bytes() : 0; }
+    inline u_int32_t hash() const
+	{ return m_sink ? m_sink->hash() : 0; }
+private:
+    DataSource* m_source;
+    BenchSink* m_sink;
+};
+
+// Build a speech-like slin test signal: a few drifting harmonics with syllable envelope
+static void makeSignal(DataBlock& buf, int rate, unsigned int samples)
+{
+    buf.assign(0,2 * samples);
+    short* d = (short*)buf.data();
+    for (unsigned int i = 0; i < samples; i++) {
+	double t = (double)i / rate;
+	double f0 = 140.0 + 30.0 * ::sin(2.0 * M_PI * 3.0 * t);
+	double env = 0.5 + 0.5 * ::sin(2.0 * M_PI * 4.0 * t);
+	double v = 0.0;
+	for (int h = 1; h <= 8; h++)
+	    v += ::sin(2.0 * M_PI * f0 * h * t) / h;
+	d[i] = (short)(6000.0 * env * v);
+    }
+}
+
+// Names of the generated test vectors
+static const char* s_vectors[] = {
+    "speech", "noise", "quiet", "silence", "dtmf",
+    "chirp", "impulses", "square", "bursts", "harmonics", 0
+};
+
+// Expected hashes of the test vectors and of their encoding and decoding
+struct CheckHash {
+    int vector;
+    const char* format;
+    u_int32_t input;
+    u_int32_t encode;
+    u_int32_t decode;
+};
+
+static const CheckHash s_hashes[] = {
+    { 0, "ilbc20", 0xeeca1b2b, 0xfafdc71d, 0x8f21b6b2 },
+    { 1, "ilbc20", 0xcc16311a, 0x0d4a9d6c, 0x7801606f },
+    { 2, "ilbc20", 0xc7c00a6e, 0xac6de1e1, 0x0d8843c9 },
+    { 3, "ilbc20", 0x1cd091c5, 0x780f0d0d, 0x7f86b06b },
+    { 4, "ilbc20", 0x80d343ca, 0xc32b3b09, 0x68d0b990 },
+    { 5, "ilbc20", 0x1f7d264b, 0x02234aa2, 0x23c09f05 },
+    { 6, "ilbc20", 0xc9f08b45, 0xff53d5b9, 0x034ef589 },
+    { 7, "ilbc20", 0xf45bb3fb, 0x606fc39b, 0x5cb09401 },
+    { 8, "ilbc20", 0x1db88591, 0xaa7fe97f, 0xab4503ff },
+    { 9, "ilbc20", 0xfe0a914d, 0x7d1ba1f5, 0x10551a3f },
+    { 0, "ilbc30", 0xeeca1b2b, 0xd1ff997c, 0x2c15bb33 },
+    { 1, "ilbc30", 0xcc16311a, 0x1216176d, 0x6d433112 },
+    { 2, "ilbc30", 0xc7c00a6e, 0xb715f098, 0x40a7555a },
+    { 3, "ilbc30", 0x1cd091c5, 0xd0755633, 0xd8a29bd4 },
+    { 4, "ilbc30", 0x80d343ca, 0xc539e2e5, 0x39bdcf5e },
+    { 5, "ilbc30", 0x1f7d264b, 0x5cc2f55b, 0x409a5dcf },
+    { 6, "ilbc30", 0xc9f08b45, 0x94803845, 0x1b028d67 },
+    { 7, "ilbc30", 0xf45bb3fb, 0xd37380f2, 0xebd08418 },
+    { 8, "ilbc30", 0x1db88591, 0xabf1806e, 0x74701606 },
+    { 9, "ilbc30", 0xfe0a914d, 0xb4b3ae18, 0x2ee5e340 },
+    { -1, 0, 0, 0, 0 }
+};
+
+static unsigned int s_seed = 1;
+
+// Same generator on every platform, uniform in -1.0 .. +1.0
+static double noise()
+{
+    s_seed = s_seed * 1103515245 + 12345;
+    return ((s_seed >> 8) & 0xffff) / 32768.0 - 1.0;
+}
+
+// Build 10 seconds of one of the 8 kHz slin test vectors
+static void makeVector(DataBlock& buf, int vec)
+{
+    const unsigned int samples = 80000;
+    buf.assign(0,2 * samples);
+    short* d = (short*)buf.data();
+    s_seed = vec * 7919 + 1;
+    for (unsigned int i = 0; i < samples; i++) {
+	double t = i / 8000.0;
+	double v = 0.0;
+	switch (vec) {
+	    case 0:
+		{
+		    double f0 = 140 + 30 * ::sin(2 * M_PI * 3 * t);
+		    double env = 0.5 + 0.5 * ::sin(2 * M_PI * 4 * t);
+		    for (int h = 1; h <= 8; h++)
+			v += ::sin(2 * M_PI * f0 * h * t) / h;
+		    v *= 6000 * env;
+		}
+		break;
+	    case 1:
+		v = 20000 * noise();
+		break;
+	    case 2:
+		v = 30 * noise();
+		break;
+	    case 3:
+		// silence
+		break;
+	    case 4:
+		v = 8000 * (::sin(2 * M_PI * 697 * t) + ::sin(2 * M_PI * 1209 * t));
+		break;
+	    case 5:
+		v = 12000 * ::sin(2 * M_PI * (100 + 3000 * t / 10) * t);
+		break;
+	    case 6:
+		v = (i % 80) ? 0 : 30000;
+		break;
+	    case 7:
+		v = (::sin(2 * M_PI * 200 * t) > 0) ? 32000 : -32000;
+		break;
+	    case 8:
+		v = ((i / 4000) % 2) ? 15000 * noise() : 1;
+		break;
+	    case 9:
+		{
+		    double f0 = 220 * (1 + 0.3 * ::sin(2 * M_PI * 0.7 * t));
+		    for (int h = 1; h <= 20; h++)
+			v += ::sin(2 * M_PI * f0 * h * t + h) / (h * h);
+		    v *= 20000 * (0.2 + 0.8 * ::fabs(::sin(2 * M_PI * 2.5 * t)));
+		    v += 300 * noise();
+		}
+		break;
+	}
+	if (v > 32767)
+	    v = 32767;
+	else if (v < -32768)
+	    v = -32768;
+	d[i] = (short)v;
+    }
+}
+
+// FNV-1a hash of a block, same as the sinks compute
+static u_int32_t hashData(const DataBlock& data)
+{
+    u_int32_t fnv = 2166136261U;
+    const unsigned char* p = (const unsigned char*)data.data();
+    for (unsigned int i = 0; i < data.length(); i++)
+	fnv = (fnv ^ p[i]) * 16777619U;
+    return fnv;
+}
+
+// Load a raw slin file, at least one frame long
+static bool loadSignal(DataBlock& buf, const String& file)
+{
+    File f;
+    unsigned int len = f.openPath(file) ? f.length() : 0;
+    if (len < 320) {
+	::fprintf(stderr,"# cannot use input %s\n",file.c_str());
+	return false;
+    }
+    buf.assign(0,len);
+    if (f.readData(buf.data(),len) != (int)len) {
+	::fprintf(stderr,"# cannot read input %s\n",file.c_str());
+	return false;
+    }
+    return true;
+}
+
+static bool loadModule(const String& file)
+{
+#ifdef _WINDOWS
+    return ::LoadLibraryA(file.c_str()) != 0;
+#else
+    if (::dlopen(file.c_str(),RTLD_NOW | RTLD_GLOBAL))
+	return true;
+    ::fprintf(stderr,"# cannot load %s: %s\n",file.c_str(),::dlerror());
+    return false;
+#endif
+}
+
+
+BenchChain::BenchChain(const String& sFmt, const String& dFmt, ObjList* keep, bool hash)
+    : m_source(0), m_sink(0)
+{
+    DataTranslator* trans = DataTranslator::create(sFmt,dFmt);
+    if (!trans)
+	return;
+    // the created reference belongs to the head of the chain
+    DataTranslator* first = trans->getFirstTranslator();
+    m_source = new DataSource(sFmt);
+    m_source->attach(first);
+    first->deref();
+    m_sink = new BenchSink(dFmt,keep,hash);
+    trans->getTransSource()->attach(m_sink);
+}
+
+BenchChain::~BenchChain()
+{
+    if (m_sink) {
+	DataSource* src = m_sink->getConnSource();
+	if (src)
+	    src->detach(m_sink);
+	m_sink->deref();
+    }
+    if (m_source) {
+	m_source->clear();
+	m_source->deref();
+    }
+}
+
+
+// Run one direction of a codec on many channels and print the results
+// Returns the hash of the first channel's output
+static u_int32_t runChains(const String& name, const char* dir, const String& sFmt, const String& dFmt,
+    unsigned int chans, const ObjList& input, unsigned int inFrames, ObjList* keep = 0, bool report = true)
+{
+    long mem = liveBytes();
+    ObjList chains;
+    for (unsigned int i = 0; i < chans; i++) {
+	BenchChain* c = new BenchChain(sFmt,dFmt,i ? 0 : keep,!i);
+	if (!c->valid()) {
+	    delete c;
+	    ::printf("codec=%s dir=%s error=nochain\n",name.c_str(),dir);
+	    return 0;
+	}
+	chains.append(c);
+    }
+    mem = liveBytes() - mem;
+    unsigned int blocks = input.count();
+    long allocs = allocCount();
+    double cpu = SysUsage::runTime(SysUsage::UserTime) + SysUsage::runTime(SysUsage::KernelTime);
+    u_int64_t start = Time::now();
+    unsigned long ts = 0;
+    for (const ObjList* l = input.skipNull(); l; l = l->skipNext()) {
+	const DataBlock* d = static_cast<const DataBlock*>(l->get());
+	for (ObjList* c = chains.skipNull(); c; c = c->skipNext())
+	    static_cast<BenchChain*>(c->get())->forward(*d,ts);
+	ts += 160;
+    }
+    u_int64_t used = Time::now() - start;
+    cpu = SysUsage::runTime(SysUsage::UserTime) + SysUsage::runTime(SysUsage::KernelTime) - cpu;
+    allocs = allocCount() - allocs;
+    u_int64_t out = 0;
+    u_int32_t hash = 0;
+    for (ObjList* c = chains.skipNull(); c; c = c->skipNext()) {
+	const BenchChain* chain = static_cast<BenchChain*>(c->get());
+	if (!out)
+	    hash = chain->hash();
+	out += chain->bytes();
+    }
+    chains.clear();
+    if (!report)
+	return hash;
+    double frames = (double)chans * inFrames;
+    double usec = frames ? (used / frames) : 0.0;
+    ::printf("codec=%s dir=%s cost=%d channels=%u frames=%.0f blocks=%u elapsed_us=" FMT64U
+	" cpu_s=%.3f usec_frame=%.3f frames_s_core=%.0f channels_core=%.0f"
+	" allocs_frame=%.2f mem_channel=%ld out_bytes=" FMT64U " out_hash=%08x\n",
+	name.c_str(),dir,DataTranslator::cost(sFmt,dFmt),chans,frames,blocks,used,cpu,usec,
+	usec ? (1000000.0 / usec) : 0.0,usec ? (20000.0 / usec) : 0.0,
+	(allocs >= 0 && frames) ? (allocs / frames) : -1.0,
+	(mem >= 0 && chans) ? (mem / (long)chans) : -1L,out,hash);
+    ::fflush(stdout);
+    return hash;
+}
+
+// Encode and decode one format
+static void benchFormat(const String& fmt, unsigned int chans, unsigned int secs, const DataBlock& sig)
+{
+    unsigned int frames = secs * 50;
+    // the signal repeated as needed, cut in 20 msec frames
+    ObjList slin;
+    const unsigned char* p = (const unsigned char*)sig.data();
+    unsigned int sigFrames = sig.length() / 320;
+    for (unsigned int f = 0; f < frames; f++)
+	slin.append(new DataBlock((void*)(p + (f % sigFrames) * 320),320));
+    // the first encoder keeps its output to feed the decoders
+    ObjList encoded;
+    runChains(fmt,"encode","slin",fmt,chans,slin,frames,&encoded);
+    if (encoded.skipNull())
+	runChains(fmt,"decode",fmt,"slin",chans,encoded,frames);
+}
+
+// Compare one result with the expected hash, returns true if it matches
+static bool checkHash(const CheckHash& h, const char* dir, u_int32_t hash, u_int32_t expected)
+{
+    bool ok = (hash == expected);
+    ::printf("check vector=%s codec=%s dir=%s hash=%08x expected=%08x result=%s\n",
+	s_vectors[h.vector],h.format,dir,hash,expected,(ok ? "ok" : "FAILED"));
+    return ok;
+}
+
+// Encode and decode the test vectors, returns the number of failed checks
+static unsigned int checkVectors()
+{
+    unsigned int failed = 0;
+    unsigned int checked = 0;
+    for (const CheckHash* h = s_hashes; h->format; h++) {
+	if (!(DataTranslator::canConvert("slin",h->format) && DataTranslator::canConvert(h->format,"slin"))) {
+	    ::printf("check vector=%s codec=%s result=skipped\n",s_vectors[h->vector],h->format);
+	    continue;
+	}
+	DataBlock sig;
+	makeVector(sig,h->vector);
+	checked++;
+	if (!checkHash(*h,"input",hashData(sig),h->input)) {
+	    // the math library generated different samples, can't compare
+	    failed++;
+	    continue;
+	}
+	ObjList slin;
+	const unsigned char* p = (const unsigned char*)sig.data();
+	unsigned int frames = sig.length() / 320;
+	for (unsigned int f = 0; f < frames; f++)
+	    slin.append(new DataBlock((void*)(p + f * 320),320));
+	ObjList encoded;
+	u_int32_t hash = runChains(h->format,"encode","slin",h->format,1,slin,frames,&encoded,false);
+	if (!checkHash(*h,"encode",hash,h->encode))
+	    failed++;
+	hash = runChains(h->format,"decode",h->format,"slin",1,encoded,frames,0,false);
+	if (!checkHash(*h,"decode",hash,h->decode))
+	    failed++;
+    }
+    ::printf("# codecbench checked=%u failed=%u\n",checked,failed);
+    if (!checked)
+	failed++;
+    return failed;
+}
+
+static void usage()
+{
+    ::fprintf(stderr,
+	"Usage: codecbench [-c channels] [-s seconds] [-m moduledir] [-f fmt1,fmt2...] [-i file] [module ...]\n"
+	"       codecbench -t [-m moduledir] [module ...]\n"
+	"  -c   number of channels encoded and decoded at once (default 10)\n"
+	"  -s   seconds of audio pushed through each channel (default 10)\n"
+	"  -m   directory holding the modules (default modules)\n"
+	"  -f   formats to test (default all that convert to and from slin)\n"
+	"  -i   raw 8 kHz slin file to use as input (default a generated signal)\n"
+	"  -t   check the output of the test vectors, fails on any difference\n");
+}
+
+int main(int argc, const char** argv)
+{
+    unsigned int chans = 10;
+    unsigned int secs = 10;
+    String dir("modules");
+    String formats;
+    String input;
+    bool check = false;
+    ObjList mods;
+    for (int i = 1; i < argc; i++) {
+	String arg(argv[i]);
+	if (arg == "-t")
+	    check = true;
+	else if (arg.startsWith("-")) {
+	    if (i + 1 >= argc) {
+		usage();
+		return 1;
+	    }
+	    String val(argv[++i]);
+	    if (arg == "-c")
+		chans = val.toInteger(10);
+	    else if (arg == "-s")
+		secs = val.toInteger(10);
+	    else if (arg == "-m")
+		dir = val;
+	    else if (arg == "-f")
+		formats = val;
+	    else if (arg == "-i")
+		input = val;
+	    else {
+		usage();
+		return 1;
+	    }
+	}
+	else
+	    mods.append(new String(arg));
+    }
+    if (!chans || !secs) {
+	usage();
+	return 1;
+    }
+    Debugger::enableOutput(false);
+    if (!mods.skipNull()) {
+	for (int m = 0; s_modules[m]; m++)
+	    mods.append(new String(s_modules[m]));
+    }
+    for (ObjList* l = mods.skipNull(); l; l = l->skipNext()) {
+	String file = *static_cast<String*>(l->get());
+	if (!file.endsWith(".yate"))
+	    file << ".yate";
+	if (file.find('/') < 0)
+	    file = dir + "/" + file;
+	loadModule(file);
+    }
+    if (check)
+	return checkVectors() ? 1 : 0;
+    ObjList* fmts = 0;
+    if (formats)
+	fmts = formats.split(',',false);
+    else {
+	fmts = DataTranslator::destFormats("slin");
+	// keep only those we can also decode
+	for (ObjList* l = fmts->skipNull(); l; ) {
+	    String* f = static_cast<String*>(l->get());
+	    if ((*f == "slin") || !DataTranslator::canConvert(*f,"slin")) {
+		l->remove();
+		l = l->skipNull();
+	    }
+	    else
+		l = l->skipNext();
+	}
+    }
+    DataBlock sig;
+    if (input) {
+	if (!loadSignal(sig,input))
+	    return 1;
+    }
+    else
+	makeSignal(sig,8000,8000);
+    ::printf("# codecbench channels=%u seconds=%u allocs=%s\n",
+	chans,secs,(allocCount() >= 0) ? "counted" : "unavailable");
+    for (ObjList* l = fmts->skipNull(); l; l = l->skipNext())
+	benchFormat(*static_cast<String*>(l->get()),chans,secs,sig);
+    TelEngine::destruct(fmts);
+    return 0;
+}
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
@@ -0,0 +1,1071 @@
+/**
+ * mediabench.cpp
+ * Media processing performance test module
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2006 Null Team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <yatephone.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+using namespace TelEngine;
+namespace { // anonymous
+
+static const char s_cmds[] = "  mediabench {resamp sformat dformat [channels] [seconds]|formats [iterations]|clock sources [seconds] [thread]|conf [members] [seconds] [format] [speakers]|tones [detectors] [seconds]|fft [length] [channels]|relay [frames]}\r\n";
+
+// Codecs offered by a typical SDP
+static const char* s_sdpCodecs[] = {
+    "mulaw", "alaw", "gsm", "ilbc20", "ilbc30", "slin", "slin/16000",
+    "g729", "g723", "speex", 0
+};
+
+// Consumer that just counts what it receives
+class BenchConsumer : public DataConsumer
+{
+public:
+    inline BenchConsumer(const char* format)
+	: DataConsumer(format), m_bytes(0)
+	{ }
+    virtual void Consume(const DataBlock& data, unsigned long tStamp)
+	{ m_bytes += data.length(); }
+    inline u_int64_t bytes() const
+	{ return m_bytes; }
+private:
+    u_int64_t m_bytes;
+};
+
+// Source generating silence that records how late each tick was
+class BenchSource : public ThreadedSource
+{
+public:
+    inline BenchSource()
+	: m_data(0,320), m_ticks(0), m_late(0), m_maxLate(0)
+	{ }
+    inline bool startup(bool thread)
+	{ return thread ? start("BenchSource") : startClock(20000,"BenchSource"); }
+    inline unsigned int ticks() const
+	{ return m_ticks; }
+    inline int64_t late() const
+	{ return m_late; }
+    inline int64_t maxLate() const
+	{ return m_maxLate; }
+protected:
+    virtual bool tick(u_int64_t when)
+	{
+	    // ticks may run early by less than the clock resolution
+	    int64_t late = Time::now() - when;
+	    if (m_ticks) {
+		m_late += late;
+		if (m_maxLate < late)
+		    m_maxLate = late;
+	    }
+	    Forward(m_data,m_ticks * 160);
+	    m_ticks++;
+	    return true;
+	}
+private:
+    DataBlock m_data;
+    unsigned int m_ticks;
+    int64_t m_late;
+    int64_t m_maxLate;
+};
+
+// Call endpoint feeding a conference room and counting the mix it receives back
+class BenchEndpoint : public CallEndpoint
+{
+public:
+    inline BenchEndpoint(const String& id, const char* format = "slin")
+	: CallEndpoint(id)
+	{
+	    m_source = new DataSource("slin");
+	    setSource(m_source);
+	    m_source->deref();
+	    m_consumer = new BenchConsumer(format);
+	    setConsumer(m_consumer);
+	    m_consumer->deref();
+	}
+    inline DataSource* source() const
+	{ return m_source; }
+    inline BenchConsumer* consumer() const
+	{ return m_consumer; }
+private:
+    DataSource* m_source;
+    BenchConsumer* m_consumer;
+};
+
+// Call endpoint holding only the media of a RTP session
+class RelayEndpoint : public CallEndpoint
+{
+public:
+    inline RelayEndpoint(const String& id)
+	: CallEndpoint(id)
+	{ }
+};
+
+// Handler collecting what the tone detectors of the benchmark report
+class ToneCollector : public MessageHandler
+{
+public:
+    inline ToneCollector()
+	: MessageHandler("chan.masquerade",10), m_results("")
+	{ }
+    virtual bool received(Message& msg);
+    String result(const String& id);
+private:
+    Mutex m_mutex;
+    NamedList m_results;
+};
+
+// Spectrum job that submits the same block again until done
+class BenchJob : public SpectrumJob
+{
+public:
+    inline BenchJob(unsigned int length, const short* samp, unsigned int rounds)
+	: SpectrumJob(length,Hanning), m_samp(samp), m_left(rounds)
+	{ }
+    inline bool start()
+	{ return submit(m_samp); }
+protected:
+    virtual void computed()
+	{ if (--m_left) submit(m_samp); }
+private:
+    const short* m_samp;
+    unsigned int m_left;
+};
+
+class BenchPlugin : public Module
+{
+public:
+    BenchPlugin();
+    virtual void initialize();
+    virtual bool commandExecute(String& retVal, const String& line);
+    virtual bool commandComplete(Message& msg, const String& partLine, const String& partWord);
+private:
+    bool m_first;
+};
+
+static BenchPlugin plugin;
+static ToneCollector* s_collector = 0;
+
+// DTMF frequencies by digit
+static const char s_dtmfDigits[] = "123A456B789C*0#D";
+static const double s_dtmfLow[] = { 697.0, 770.0, 852.0, 941.0 };
+static const double s_dtmfHigh[] = { 1209.0, 1336.0, 1477.0, 1633.0 };
+
+// Test case of the tone detector corpus
+struct ToneCase {
+    const char* name;
+    const char* detector;
+    const char* expect;
+};
+
+// The corpus: what each generated signal must produce, "F" stands for a fax tone
+static const ToneCase s_toneCases[] = {
+    { "digits", "tone/dtmf", "0123456789*#ABCD" },
+    { "digits50ms", "tone/dtmf", "159#" },
+    { "digits20ms", "tone/dtmf", "" },
+    { "twist+4dB", "tone/dtmf", "2580" },
+    { "twist-4dB", "tone/dtmf", "2580" },
+    { "twist12dB", "tone/dtmf", "" },
+    { "lowlevel", "tone/dtmf", "" },
+    { "speech", "tone/*", "" },
+    { "noise", "tone/*", "" },
+    { "digitsnoise", "tone/dtmf", "3690" },
+    { "cng", "tone/fax", "F" },
+    { "ced", "tone/rfax", "F" },
+    { "cngspeech", "tone/fax", "" },
+    { 0, 0, 0 }
+};
+
+// Build a speech-like slin test signal: a few drifting harmonics with syllable envelope
+static void makeSignal(DataBlock& buf, int rate, unsigned int samples, unsigned int chans)
+{
+    buf.assign(0,2 * samples * chans);
+    short* d = (short*)buf.data();
+    for (unsigned int i = 0; i < samples; i++) {
+	double t = (double)i / rate;
+	double f0 = 140.0 + 30.0 * ::sin(2.0 * M_PI * 3.0 * t);
+	double env = 0.5 + 0.5 * ::sin(2.0 * M_PI * 4.0 * t);
+	double v = 0.0;
+	for (int h = 1; h <= 8; h++)
+	    v += ::sin(2.0 * M_PI * f0 * h * t) / h;
+	short s = (short)(6000.0 * env * v);
+	for (unsigned int c = 0; c < chans; c++)
+	    *d++ = s;
+    }
+}
+
+// Push data through many translator chains, report CPU cost per channel
+static void benchTranslate(String& retVal, const String& sFmt, const String& dFmt,
+    unsigned int chans, unsigned int secs)
+{
+    const FormatInfo* fi = FormatRepository::getFormat(sFmt);
+    if (!(fi && fi->sampleRate && fi->converter) || !FormatRepository::getFormat(dFmt)) {
+	retVal << "Unknown or non slin formats '" << sFmt << "' -> '" << dFmt << "'\r\n";
+	return;
+    }
+    if (!chans)
+	chans = 1;
+    if (!secs)
+	secs = 10;
+    unsigned int frameSamples = fi->sampleRate / 50;
+    DataBlock frame;
+    makeSignal(frame,fi->sampleRate,frameSamples,fi->numChannels);
+    ObjList sources;
+    ObjList sinks;
+    for (unsigned int i = 0; i < chans; i++) {
+	DataTranslator* trans = DataTranslator::create(sFmt,dFmt);
+	if (!trans) {
+	    retVal << "Cannot translate '" << sFmt << "' -> '" << dFmt << "'\r\n";
+	    return;
+	}
+	// the created reference belongs to the head of the chain
+	DataTranslator* first = trans->getFirstTranslator();
+	DataSource* src = new DataSource(sFmt);
+	src->attach(first);
+	first->deref();
+	sources.append(src);
+	BenchConsumer* cons = new BenchConsumer(dFmt);
+	trans->getTransSource()->attach(cons);
+	sinks.append(cons);
+    }
+    unsigned int frames = secs * 50;
+    u_int64_t start = Time::now();
+    for (unsigned int f = 0; f < frames; f++) {
+	unsigned long ts = f * frameSamples;
+	for (ObjList* l = sources.skipNull(); l; l = l->skipNext())
+	    static_cast<DataSource*>(l->get())->Forward(frame,ts);
+    }
+    u_int64_t used = Time::now() - start;
+    u_int64_t out = 0;
+    for (ObjList* l = sinks.skipNull(); l; l = l->skipNext()) {
+	BenchConsumer* cons = static_cast<BenchConsumer*>(l->get());
+	out += cons->bytes();
+	DataSource* src = cons->getConnSource();
+	if (src)
+	    src->detach(cons);
+    }
+    for (ObjList* l = sources.skipNull(); l; l = l->skipNext())
+	static_cast<DataSource*>(l->get())->clear();
+    sinks.clear();
+    sources.clear();
+    // CPU microseconds needed to process one second of audio on one channel
+    double perChan = (double)used / ((double)chans * secs);
+    char buf[256];
+    ::snprintf(buf,sizeof(buf),
+	"translate %s -> %s channels=%u audio=%us elapsed=" FMT64U "us out=" FMT64U
+	"B usec/chan/s=%.2f chans/core=%.0f\r\n",
+	sFmt.c_str(),dFmt.c_str(),chans,secs,used,out,perChan,
+	(perChan > 0.0) ? (1000000.0 / perChan) : 0.0);
+    retVal << buf;
+}
+
+// Emulate the format queries made while building and answering an SDP offer
+static void benchFormats(String& retVal, unsigned int iter)
+{
+    if (!iter)
+	iter = 10000;
+    String offer;
+    unsigned int i;
+    for (i = 0; s_sdpCodecs[i]; i++)
+	offer.append(s_sdpCodecs[i],",");
+    unsigned int usable = 0;
+    u_int64_t start = Time::now();
+    for (unsigned int n = 0; n < iter; n++) {
+	usable = 0;
+	for (i = 0; s_sdpCodecs[i]; i++) {
+	    if (!DataTranslator::canConvert(s_sdpCodecs[i]))
+		continue;
+	    usable++;
+	    DataTranslator::cost(s_sdpCodecs[i],"slin");
+	    DataTranslator::cost("slin",s_sdpCodecs[i]);
+	}
+	ObjList* lst = DataTranslator::allFormats(offer);
+	TelEngine::destruct(lst);
+	lst = DataTranslator::destFormats("slin");
+	TelEngine::destruct(lst);
+	lst = DataTranslator::srcFormats("slin");
+	TelEngine::destruct(lst);
+    }
+    u_int64_t used = Time::now() - start;
+    char buf[256];
+    ::snprintf(buf,sizeof(buf),
+	"formats codecs=%u usable=%u iterations=%u elapsed=" FMT64U "us usec/offer=%.3f\r\n",
+	i,usable,iter,used,(double)used / iter);
+    retVal << buf;
+}
+
+// Run many clock paced sources, report how well they kept the pace
+static void benchClock(String& retVal, unsigned int count, unsigned int secs, bool thread)
+{
+    if (!count)
+	count = 100;
+    if (!secs)
+	secs = 10;
+    ObjList sources;
+    u_int64_t start = Time::now();
+    double cpu = SysUsage::runTime(SysUsage::UserTime) + SysUsage::runTime(SysUsage::KernelTime);
+    for (unsigned int i = 0; i < count; i++) {
+	BenchSource* src = new BenchSource;
+	sources.append(src);
+	BenchConsumer* cons = new BenchConsumer("slin");
+	src->attach(cons);
+	cons->deref();
+	if (!src->startup(thread)) {
+	    retVal << "Cannot start source " << i << "\r\n";
+	    break;
+	}
+    }
+    Thread::sleep(secs);
+    for (ObjList* l = sources.skipNull(); l; l = l->skipNext())
+	static_cast<BenchSource*>(l->get())->stop();
+    u_int64_t used = Time::now() - start;
+    cpu = SysUsage::runTime(SysUsage::UserTime) + SysUsage::runTime(SysUsage::KernelTime) - cpu;
+    u_int64_t ticks = 0;
+    int64_t late = 0;
+    int64_t maxLate = 0;
+    for (ObjList* l = sources.skipNull(); l; l = l->skipNext()) {
+	BenchSource* src = static_cast<BenchSource*>(l->get());
+	ticks += src->ticks();
+	late += src->late();
+	if (maxLate < src->maxLate())
+	    maxLate = src->maxLate();
+	src->clear();
+    }
+    sources.clear();
+    double expected = (double)count * used / 20000.0;
+    char buf[256];
+    ::snprintf(buf,sizeof(buf),
+	"clock %s sources=%u elapsed=" FMT64U "us ticks=" FMT64U " expected=%.0f"
+	" avglate=%.0fus maxlate=" FMT64 "us cpu=%.3fs\r\n",
+	(thread ? "thread" : "shared"),count,used,ticks,expected,
+	ticks ? ((double)late / ticks) : 0.0,maxLate,cpu);
+    retVal << buf;
+}
+
+
+// Join members to a conference room and feed them all, report mixing cost per member
+static void benchConf(String& retVal, unsigned int members, unsigned int secs,
+    const String& format = "slin", unsigned int speakers = 0)
+{
+    if (!secs)
+	secs = 10;
+    // each member speaks the same signal with a different delay
+    DataBlock sig;
+    makeSignal(sig,8000,8000 + 160,1);
+    const unsigned char* sp = (const unsigned char*)sig.data();
+    String room = "mediabench-";
+    room << members;
+    ObjList eps;
+    unsigned int joined = 0;
+    for (unsigned int i = 0; i < members; i++) {
+	String id = "mediabench/";
+	id << (i + 1);
+	BenchEndpoint* ep = new BenchEndpoint(id,format);
+	eps.append(ep);
+	Message m("call.execute");
+	m.addParam("callto","conf/" + room);
+	m.addParam("maxusers",String(members));
+	// data is pushed as fast as possible so mix as soon as it arrives
+	m.addParam("timer",String::boolText(false));
+	m.addParam("speakers",String(speakers));
+	m.userData(ep);
+	if (!Engine::dispatch(m))
+	    break;
+	joined++;
+    }
+    if (joined < members) {
+	retVal << "conf members=" << members << " failed after " << joined << " joined\r\n";
+	for (ObjList* l = eps.skipNull(); l; l = l->skipNext())
+	    static_cast<BenchEndpoint*>(l->get())->disconnect();
+	return;
+    }
+    unsigned int frames = secs * 50;
+    double cpu = SysUsage::runTime(SysUsage::UserTime) + SysUsage::runTime(SysUsage::KernelTime);
+    u_int64_t start = Time::now();
+    for (unsigned int f = 0; f < frames; f++) {
+	unsigned int i = 0;
+	for (ObjList* l = eps.skipNull(); l; l = l->skipNext(), i++) {
+	    unsigned int offs = ((f + 7 * i) % 50) * 320;
+	    DataBlock d((void*)(sp + offs),320,false);
+	    static_cast<BenchEndpoint*>(l->get())->source()->Forward(d,f * 160);
+	    d.clear(false);
+	}
+    }
+    u_int64_t used = Time::now() - start;
+    cpu = SysUsage::runTime(SysUsage::UserTime) + SysUsage::runTime(SysUsage::KernelTime) - cpu;
+    u_int64_t bytes = 0;
+    for (ObjList* l = eps.skipNull(); l; l = l->skipNext()) {
+	BenchEndpoint* ep = static_cast<BenchEndpoint*>(l->get());
+	bytes += ep->consumer()->bytes();
+	ep->disconnect();
+    }
+    eps.clear();
+    char buf[256];
+    ::snprintf(buf,sizeof(buf),
+	"conf members=%u format=%s speakers=%u audio=%us elapsed=" FMT64U "us received=" FMT64U
+	" usec/member/frame=%.3f realtime=%.1fx cpu=%.3fs\r\n",
+	members,format.c_str(),speakers,secs,used,bytes,(double)used / (members * frames),
+	used ? (1000000.0 * secs / used) : 0.0,cpu);
+    retVal << buf;
+}
+
+
+// Remember the DTMFs and faxes reported for benchmark detectors
+bool ToneCollector::received(Message& msg)
+{
+    String id(msg.getValue("id"));
+    if (!id.startsWith("mediabench/tone/"))
+	return false;
+    String what(msg.getValue("message"));
+    Lock lock(m_mutex);
+    String res(m_results.getValue(id));
+    if (what == "chan.dtmf")
+	res << msg.getValue("text");
+    else
+	res << "F";
+    m_results.setParam(id,res);
+    return true;
+}
+
+String ToneCollector::result(const String& id)
+{
+    Lock lock(m_mutex);
+    return m_results.getValue(id);
+}
+
+// Add a tone or a pair of tones to a slin 8kHz buffer
+static void addTones(short* d, unsigned int samples, double f1, double a1, double f2 = 0.0, double a2 = 0.0)
+{
+    for (unsigned int i = 0; i < samples; i++) {
+	double t = i / 8000.0;
+	double v = d[i] + a1 * ::sin(2.0 * M_PI * f1 * t);
+	if (f2 > 0.0)
+	    v += a2 * ::sin(2.0 * M_PI * f2 * t);
+	d[i] = (short)v;
+    }
+}
+
+// Append a DTMF sequence with given tone and pause durations and levels
+static void addDigits(DataBlock& buf, const char* digits, unsigned int onMs, unsigned int offMs,
+    double ampLow = 6000.0, double ampHigh = 6000.0)
+{
+    for (; *digits; digits++) {
+	const char* p = ::strchr(s_dtmfDigits,*digits);
+	if (!p)
+	    continue;
+	int idx = p - s_dtmfDigits;
+	DataBlock tone(0,16 * (onMs + offMs));
+	addTones((short*)tone.data(),8 * onMs,
+	    s_dtmfLow[idx / 4],ampLow,s_dtmfHigh[idx % 4],ampHigh);
+	buf += tone;
+    }
+}
+
+// Add deterministic white noise of given amplitude
+static void addNoise(DataBlock& buf, int amp)
+{
+    short* d = (short*)buf.data();
+    unsigned int seed = 12345;
+    for (unsigned int i = 0; i < buf.length() / 2; i++) {
+	seed = seed * 1103515245 + 12345;
+	d[i] = (short)(d[i] + (int)((seed >> 16) % (2 * amp + 1)) - amp);
+    }
+}
+
+// Generate the signal of a corpus test case
+static void makeToneCase(DataBlock& buf, const String& name)
+{
+    buf.clear();
+    if (name == "digits")
+	addDigits(buf,"0123456789*#ABCD",60,60);
+    else if (name == "digits50ms")
+	addDigits(buf,"159#",50,50);
+    else if (name == "digits20ms")
+	addDigits(buf,"159#",20,80);
+    else if (name == "twist+4dB")
+	addDigits(buf,"2580",80,80,6000.0,9500.0);
+    else if (name == "twist-4dB")
+	addDigits(buf,"2580",80,80,9500.0,6000.0);
+    else if (name == "twist12dB")
+	addDigits(buf,"2580",80,80,2000.0,8000.0);
+    else if (name == "lowlevel")
+	addDigits(buf,"2580",80,80,500.0,500.0);
+    else if (name == "speech")
+	makeSignal(buf,8000,3 * 8000,1);
+    else if (name == "noise") {
+	buf.assign(0,2 * 3 * 8000);
+	addNoise(buf,8000);
+    }
+    else if (name == "digitsnoise") {
+	addDigits(buf,"3690",80,80);
+	addNoise(buf,1000);
+    }
+    else if (name == "cng" || name == "ced") {
+	// tone cadence: 0.5s on, 3s off for CNG, 2s continuous for CED
+	bool cng = (name == "cng");
+	buf.assign(0,2 * 8000 * (cng ? 4 : 2));
+	addTones((short*)buf.data(),cng ? 4000 : 16000,cng ? 1100.0 : 2100.0,8000.0);
+    }
+    else if (name == "cngspeech") {
+	// a short 1100Hz burst inside speech is not a fax
+	makeSignal(buf,8000,2 * 8000,1);
+	addTones((short*)buf.data() + 8000,160,1100.0,8000.0);
+    }
+    // some silence at the end to let detectors settle
+    DataBlock tail(0,1600);
+    buf += tail;
+}
+
+// Attach a tone detector to a data source
+static bool attachTone(DataSource* src, const String& id, const char* cons, const char* detector)
+{
+    Message m("chan.attach");
+    m.addParam("id",id);
+    m.addParam("consumer",cons);
+    m.addParam("detector",detector);
+    m.addParam("single",String::boolText(true));
+    m.userData(src);
+    return Engine::dispatch(m);
+}
+
+// Feed a slin 8kHz signal in 20ms frames
+static void feedSignal(DataSource* src, const DataBlock& sig, unsigned long& ts)
+{
+    const unsigned char* p = (const unsigned char*)sig.data();
+    for (unsigned int o = 0; o + 320 <= sig.length(); o += 320) {
+	DataBlock d((void*)(p + o),320,false);
+	src->Forward(d,ts);
+	d.clear(false);
+	ts += 160;
+    }
+}
+
+// Run the generated corpus through both tone detectors and compare what they report
+static void benchToneCorpus(String& retVal)
+{
+    static const char* engines[] = { "filter", "goertzel", 0 };
+    static unsigned int run = 0;
+    run++;
+    int i;
+    for (i = 0; s_toneCases[i].name; i++) {
+	DataBlock sig;
+	makeToneCase(sig,s_toneCases[i].name);
+	for (int e = 0; engines[e]; e++) {
+	    String id;
+	    id << "mediabench/tone/" << run << "/" << engines[e] << "/" << s_toneCases[i].name;
+	    DataSource* src = new DataSource("slin");
+	    if (attachTone(src,id,s_toneCases[i].detector,engines[e])) {
+		unsigned long ts = 0;
+		feedSignal(src,sig,ts);
+	    }
+	    else
+		retVal << "Cannot attach tone detector " << s_toneCases[i].detector << "\r\n";
+	    src->clear();
+	    src->deref();
+	}
+    }
+    // detections are enqueued, give the engine time to dispatch them
+    Thread::msleep(500);
+    unsigned int ok = 0;
+    unsigned int same = 0;
+    for (i = 0; s_toneCases[i].name; i++) {
+	String res[2];
+	for (int e = 0; engines[e]; e++) {
+	    String id;
+	    id << "mediabench/tone/" << run << "/" << engines[e] << "/" << s_toneCases[i].name;
+	    res[e] = s_collector->result(id);
+	}
+	bool good = (res[1] == s_toneCases[i].expect);
+	if (good)
+	    ok++;
+	if (res[0] == res[1])
+	    same++;
+	retVal << "tones " << s_toneCases[i].name << " expect='" << s_toneCases[i].expect
+	    << "' filter='" << res[0] << "' goertzel='" << res[1] << "' "
+	    << (good ? "ok" : "FAIL") << ((res[0] == res[1]) ? "" : " differ") << "\r\n";
+    }
+    retVal << "tones cases=" << i << " ok=" << ok << " identical=" << same << "\r\n";
+}
+
+// Feed speech to many tone detectors, report how many fit on a core
+static void benchTones(String& retVal, const char* detector, unsigned int count, unsigned int secs)
+{
+    if (!count)
+	count = 100;
+    if (!secs)
+	secs = 10;
+    DataBlock sig;
+    makeSignal(sig,8000,8000 * secs,1);
+    // all detectors listen to the same source
+    DataSource* src = new DataSource("slin");
+    unsigned int attached = 0;
+    for (; attached < count; attached++) {
+	String id;
+	id << "mediabench/tone/bench/" << attached;
+	if (!attachTone(src,id,"tone/*",detector))
+	    break;
+    }
+    u_int64_t start = Time::now();
+    unsigned long ts = 0;
+    feedSignal(src,sig,ts);
+    u_int64_t used = Time::now() - start;
+    src->clear();
+    src->deref();
+    double perDet = attached ? ((double)used / ((double)attached * secs)) : 0.0;
+    char buf[256];
+    ::snprintf(buf,sizeof(buf),
+	"tones detector=%s detectors=%u audio=%us elapsed=" FMT64U "us"
+	" usec/detector/s=%.2f detectors/core=%.0f\r\n",
+	detector,attached,secs,used,perDet,
+	(perDet > 0.0) ? (1000000.0 / perDet) : 0.0);
+    retVal << buf;
+}
+
+// Textbook complex radix-2 FFT on doubles with runtime bit reversal, the
+//  algorithm the analyzer used before, leaves magnitudes in re[]
+static void refFFT(const float* in, double* re, double* im, unsigned int len)
+{
+    unsigned int bits = 0;
+    while ((1U << bits) < len)
+	bits++;
+    unsigned int i, j, n;
+    for (i = 0; i < len; i++) {
+	unsigned int idx = i;
+	unsigned int rev = 0;
+	for (j = 0; j < bits; j++) {
+	    rev = (rev << 1) | (idx & 1);
+	    idx >>= 1;
+	}
+	re[i] = in[rev];
+	im[i] = 0.0;
+    }
+    unsigned int blockEnd = 1;
+    for (unsigned int blockSize = 2; blockSize <= len; blockSize <<= 1) {
+	double delta = 2.0 * M_PI / blockSize;
+	double sm1 = ::sin(-delta);
+	double sm2 = ::sin(-2 * delta);
+	double cm1 = ::cos(-delta);
+	double cm2 = ::cos(-2 * delta);
+	double w = 2 * cm1;
+	double ar[3], ai[3];
+	for (i = 0; i < len; i += blockSize) {
+	    ar[1] = cm1;
+	    ai[1] = sm1;
+	    ar[2] = cm2;
+	    ai[2] = sm2;
+	    for (j = i, n = 0; n < blockEnd; j++, n++) {
+		ar[0] = w*ar[1] - ar[2];
+		ar[2] = ar[1];
+		ar[1] = ar[0];
+		ai[0] = w*ai[1] - ai[2];
+		ai[2] = ai[1];
+		ai[1] = ai[0];
+		unsigned int k = j + blockEnd;
+		double tr = ar[0]*re[k] - ai[0]*im[k];
+		double ti = ar[0]*im[k] + ai[0]*re[k];
+		re[k] = re[j] - tr;
+		im[k] = im[j] - ti;
+		re[j] += tr;
+		im[j] += ti;
+	    }
+	}
+	blockEnd = blockSize;
+    }
+    n = len >> 1;
+    for (i = 0; i <= n; i++)
+	re[i] = ::sqrt(re[i]*re[i] + im[i]*im[i]) / n;
+}
+
+// Compare the engine FFT with the reference, time both and batched spectrum jobs
+static void benchFFT(String& retVal, unsigned int len, unsigned int chans)
+{
+    RealFFT fft(len);
+    if (!fft.valid()) {
+	retVal << "Invalid FFT length " << len << "\r\n";
+	return;
+    }
+    if (!chans)
+	chans = 300;
+    DataBlock sig;
+    makeSignal(sig,8000,len,1);
+    const short* sp = (const short*)sig.data();
+    float* in = new float[len];
+    float* out = new float[fft.bins()];
+    double* re = new double[len];
+    double* im = new double[len];
+    unsigned int i;
+    for (i = 0; i < len; i++)
+	in[i] = sp[i];
+    refFFT(in,re,im,len);
+    fft.magnitude(in,out);
+    double peak = 0.0;
+    double err = 0.0;
+    for (i = 0; i < fft.bins(); i++) {
+	if (peak < re[i])
+	    peak = re[i];
+	double d = ::fabs(re[i] - out[i]);
+	if (err < d)
+	    err = d;
+    }
+    // enough rounds to take a measurable time
+    unsigned int iter = 2000000 / len;
+    u_int64_t start = Time::now();
+    for (i = 0; i < iter; i++)
+	refFFT(in,re,im,len);
+    u_int64_t usedRef = Time::now() - start;
+    start = Time::now();
+    for (i = 0; i < iter; i++)
+	fft.magnitude(in,out);
+    u_int64_t usedNew = Time::now() - start;
+    delete[] in;
+    delete[] out;
+    delete[] re;
+    delete[] im;
+    // many channels submitting blocks, computed in batches by the engine
+    ObjList jobs;
+    for (i = 0; i < chans; i++)
+	jobs.append(new BenchJob(len,sp,20));
+    unsigned int done = SpectrumJob::computedCount();
+    start = Time::now();
+    for (ObjList* l = jobs.skipNull(); l; l = l->skipNext())
+	static_cast<BenchJob*>(l->get())->start();
+    for (ObjList* l = jobs.skipNull(); l; l = l->skipNext()) {
+	while (static_cast<SpectrumJob*>(l->get())->busy())
+	    Thread::msleep(1);
+    }
+    u_int64_t usedJobs = Time::now() - start;
+    done = SpectrumJob::computedCount() - done;
+    for (ObjList* l = jobs.skipNull(); l; l = l->skipNext())
+	static_cast<SpectrumJob*>(l->get())->cancel();
+    jobs.clear();
+    char buf[256];
+    ::snprintf(buf,sizeof(buf),
+	"fft length=%u maxerror=%.2e usec/fft reference=%.2f engine=%.2f speedup=%.1fx\r\n",
+	len,peak ? (err / peak) : 0.0,(double)usedRef / iter,(double)usedNew / iter,
+	usedNew ? ((double)usedRef / usedNew) : 0.0);
+    retVal << buf;
+    ::snprintf(buf,sizeof(buf),
+	"fft jobs channels=%u spectra=%u elapsed=" FMT64U "us usec/spectrum=%.2f\r\n",
+	chans,done,usedJobs,done ? ((double)usedJobs / done) : 0.0);
+    retVal << buf;
+}
+
+
+// Ask yrtpchan for a mulaw session of an endpoint, returns the local port
+static int startRtp(CallEndpoint* ep, const char* dir, int remotePort)
+{
+    Message m("chan.rtp");
+    m.addParam("direction",dir);
+    m.addParam("media","audio");
+    m.addParam("transport","RTP/AVP");
+    m.addParam("localip","127.0.0.1");
+    m.addParam("remoteip","127.0.0.1");
+    m.addParam("remoteport",String(remotePort));
+    m.addParam("format","mulaw");
+    m.userData(ep);
+    return Engine::dispatch(m) ? m.getIntValue("localport") : 0;
+}
+
+// Send one 20ms mulaw RTP packet
+static void sendRtp(Socket& sock, const SocketAddr& addr, u_int16_t seq, u_int32_t ts)
+{
+    unsigned char buf[12 + 160];
+    ::memset(buf,0,12);
+    ::memset(buf + 12,0xff,160);
+    buf[0] = 0x80;
+    buf[2] = (unsigned char)(seq >> 8);
+    buf[3] = (unsigned char)seq;
+    for (int i = 0; i < 4; i++) {
+	buf[4 + i] = (unsigned char)(ts >> (24 - 8 * i));
+	buf[8 + i] = (unsigned char)(0x4d42524cUL >> (24 - 8 * i));
+    }
+    sock.sendTo(buf,sizeof(buf),addr);
+}
+
+// Number of sessions that yrtpchan currently relays directly
+static int relaying()
+{
+    Message m("engine.status");
+    m.addParam("module","yrtp");
+    Engine::dispatch(m);
+    int pos = m.retValue().find("relaying=");
+    if (pos < 0)
+	return -1;
+    String val = m.retValue().substr(pos + 9);
+    return val.substr(0,val.find(',')).toInteger(-1);
+}
+
+// Read the packets yrtpchan sends until a given time, check their timestamps advance smoothly
+static void collectRtp(Socket& sock, u_int64_t until, unsigned int& count, u_int32_t& last,
+    long& minStep, long& maxStep)
+{
+    for (;;) {
+	int64_t left = until - Time::now();
+	if (left <= 0)
+	    break;
+	bool ok = false;
+	if (!(sock.select(&ok,0,0,left) && ok))
+	    continue;
+	unsigned char buf[1500];
+	int res;
+	while ((res = sock.recv(buf,sizeof(buf))) >= 12) {
+	    u_int32_t ts = ((u_int32_t)buf[4] << 24) | ((u_int32_t)buf[5] << 16) |
+		((u_int32_t)buf[6] << 8) | buf[7];
+	    if (count++) {
+		long step = (long)(int32_t)(ts - last);
+		if (step < minStep)
+		    minStep = step;
+		if (step > maxStep)
+		    maxStep = step;
+	    }
+	    last = ts;
+	}
+    }
+}
+
+// Switch the consumer of a RTP session from a relayed RTP source to another
+//  source and back, the timestamps it sends must not jump at either switch
+static void benchRelay(String& retVal, unsigned int frames)
+{
+    if (!frames)
+	frames = 50;
+    SocketAddr addr(AF_INET);
+    addr.host("127.0.0.1");
+    addr.port(0);
+    SocketAddr inAddr(addr);
+    SocketAddr outAddr(addr);
+    Socket in;
+    Socket out;
+    if (!(in.create(AF_INET,SOCK_DGRAM) && in.bind(inAddr) && in.getSockName(inAddr) &&
+	out.create(AF_INET,SOCK_DGRAM) && out.bind(outAddr) && out.getSockName(outAddr) &&
+	out.setBlocking(false))) {
+	retVal << "relay could not create the UDP sockets\r\n";
+	return;
+    }
+    RelayEndpoint* inEp = new RelayEndpoint("mediabench/relay-in");
+    RelayEndpoint* outEp = new RelayEndpoint("mediabench/relay-out");
+    int port = startRtp(inEp,"receive",inAddr.port());
+    bool ok = port && startRtp(outEp,"send",outAddr.port());
+    RefPointer<DataSource> rtpSource = inEp->getSource();
+    RefPointer<DataConsumer> consumer = outEp->getConsumer();
+    if (!(ok && rtpSource && consumer)) {
+	retVal << "relay could not start the RTP sessions, is yrtpchan loaded?\r\n";
+	inEp->disconnect();
+	outEp->disconnect();
+	TelEngine::destruct(inEp);
+	TelEngine::destruct(outEp);
+	return;
+    }
+    inEp->connect(outEp);
+    addr.port(port);
+    DataSource* other = new DataSource("mulaw");
+    DataBlock frame(0,160);
+    ::memset(frame.data(),0xff,frame.length());
+    u_int32_t rtpTs = 1000000;
+    u_int16_t seq = 0;
+    // consumers synchronize to where a source is, so start it before
+    unsigned long otherTs = 5000;
+    other->Forward(frame,otherTs);
+    otherTs += 160;
+    unsigned int count = 0;
+    u_int32_t last = 0;
+    long minStep = 0x7fffffff;
+    long maxStep = -0x7fffffff;
+    int relayed = 0;
+    u_int64_t tick = Time::now();
+    for (int phase = 0; phase < 3; phase++) {
+	if (phase == 1)
+	    other->attach(consumer);
+	else if (phase == 2)
+	    rtpSource->attach(consumer);
+	for (unsigned int f = 0; f < frames; f++) {
+	    // the remote keeps sending while the other source is attached
+	    sendRtp(in,addr,seq++,rtpTs);
+	    rtpTs += 160;
+	    if (phase == 1) {
+		other->Forward(frame,otherTs);
+		otherTs += 160;
+	    }
+	    tick += 20000;
+	    collectRtp(out,tick,count,last,minStep,maxStep);
+	    if ((phase != 1) && (f == frames / 2)) {
+		int n = relaying();
+		if (n > relayed)
+		    relayed = n;
+	    }
+	}
+    }
+    collectRtp(out,tick + 100000,count,last,minStep,maxStep);
+    other->clear();
+    TelEngine::destruct(other);
+    rtpSource = 0;
+    consumer = 0;
+    inEp->disconnect();
+    outEp->disconnect();
+    TelEngine::destruct(inEp);
+    TelEngine::destruct(outEp);
+    // a step of 20ms is 160 samples, allow some scheduling jitter
+    ok = (relayed > 0) && (count >= 2 * frames) && (minStep > 0) && (maxStep <= 800);
+    char buf[256];
+    ::snprintf(buf,sizeof(buf),
+	"relay frames=%u sent=%u received=%u relaying=%d minstep=%ld maxstep=%ld result=%s\r\n",
+	frames,3 * frames,count,relayed,minStep,maxStep,(ok ? "ok" : "FAILED"));
+    retVal << buf;
+}
+
+
+BenchPlugin::BenchPlugin()
+    : Module("mediabench","misc"), m_first(true)
+{
+    Output("Loaded module Media Benchmark");
+}
+
+void BenchPlugin::initialize()
+{
+    Output("Initializing module Media Benchmark");
+    if (m_first) {
+	m_first = false;
+	setup();
+	s_collector = new ToneCollector;
+	Engine::install(s_collector);
+    }
+}
+
+bool BenchPlugin::commandExecute(String& retVal, const String& line)
+{
+    String l(line);
+    if (!l.startSkip(name()))
+	return false;
+    if (l.startSkip("resamp")) {
+	ObjList* args = l.split(' ',false);
+	const String* sFmt = static_cast<const String*>((*args)[0]);
+	const String* dFmt = static_cast<const String*>((*args)[1]);
+	const String* chans = static_cast<const String*>((*args)[2]);
+	const String* secs = static_cast<const String*>((*args)[3]);
+	if (sFmt && dFmt)
+	    benchTranslate(retVal,*sFmt,*dFmt,
+		chans ? chans->toInteger(1) : 1,secs ? secs->toInteger(10) : 10);
+	else
+	    retVal << s_cmds;
+	TelEngine::destruct(args);
+	return true;
+    }
+    if (l.startSkip("clock")) {
+	ObjList* args = l.split(' ',false);
+	const String* count = static_cast<const String*>((*args)[0]);
+	const String* secs = static_cast<const String*>((*args)[1]);
+	const String* mode = static_cast<const String*>((*args)[2]);
+	benchClock(retVal,count ? count->toInteger(100) : 100,
+	    secs ? secs->toInteger(10) : 10,mode && (*mode == "thread"));
+	TelEngine::destruct(args);
+	return true;
+    }
+    if (l.startSkip("conf")) {
+	ObjList* args = l.split(' ',false);
+	const String* members = static_cast<const String*>((*args)[0]);
+	const String* secs = static_cast<const String*>((*args)[1]);
+	const String* format = static_cast<const String*>((*args)[2]);
+	const String* speakers = static_cast<const String*>((*args)[3]);
+	if (members)
+	    benchConf(retVal,members->toInteger(3),secs ? secs->toInteger(10) : 10,
+		format ? *format : String("slin"),speakers ? speakers->toInteger(0) : 0);
+	else {
+	    // typical small, medium and large rooms
+	    benchConf(retVal,3,10);
+	    benchConf(retVal,30,10);
+	    benchConf(retVal,300,10);
+	}
+	TelEngine::destruct(args);
+	return true;
+    }
+    if (l.startSkip("tones")) {
+	ObjList* args = l.split(' ',false);
+	const String* count = static_cast<const String*>((*args)[0]);
+	const String* secs = static_cast<const String*>((*args)[1]);
+	benchToneCorpus(retVal);
+	unsigned int n = count ? count->toInteger(100) : 100;
+	unsigned int s = secs ? secs->toInteger(10) : 10;
+	benchTones(retVal,"filter",n,s);
+	benchTones(retVal,"goertzel",n,s);
+	TelEngine::destruct(args);
+	return true;
+    }
+    if (l.startSkip("fft")) {
+	ObjList* args = l.split(' ',false);
+	const String* len = static_cast<const String*>((*args)[0]);
+	const String* chans = static_cast<const String*>((*args)[1]);
+	if (len)
+	    benchFFT(retVal,len->toInteger(256),chans ? chans->toInteger(300) : 300);
+	else {
+	    // the analyzer probe and spectrum sizes
+	    benchFFT(retVal,256,300);
+	    benchFFT(retVal,1024,300);
+	}
+	TelEngine::destruct(args);
+	return true;
+    }
+    if (l.startSkip("formats")) {
+	benchFormats(retVal,l.toInteger(10000));
+	return true;
+    }
+    if (l.startSkip("relay")) {
+	benchRelay(retVal,l.toInteger(50));
+	return true;
+    }
+    retVal << s_cmds;
+    return true;
+}
+
+bool BenchPlugin::commandComplete(Message& msg, const String& partLine, const String& partWord)
+{
+    if (partLine.null() || (partLine == "help")) {
+	if (name().startsWith(partWord))
+	    msg.retValue().append(name(),"\t");
+    }
+    else if (partLine == name()) {
+	if (String("resamp").startsWith(partWord))
+	    msg.retValue().append("resamp","\t");
+	if (String("formats").startsWith(partWord))
+	    msg.retValue().append("formats","\t");
+	if (String("clock").startsWith(partWord))
+	    msg.retValue().append("clock","\t");
+	if (String("conf").startsWith(partWord))
+	    msg.retValue().append("conf","\t");
+	if (String("tones").startsWith(partWord))
+	    msg.retValue().append("tones","\t");
+	if (String("fft").startsWith(partWord))
+	    msg.retValue().append("fft","\t");
+	if (String("relay").startsWith(partWord))
+	    msg.retValue().append("relay","\t");
+	return true;
+    }
+    return Module::commandComplete(msg,partLine,partWord);
+}
+
+}; // anonymous namespace
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
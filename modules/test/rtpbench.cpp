@@ -0,0 +1,371 @@
+/**
+ * rtpbench.cpp
+ * Standalone RTP media path benchmark
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2006 Null Team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Usage: rtpbench [-c pairs] [-s seconds] [-l bytes] [-g groups] [-j maxjitter] [-r relay]
+ *
+ * Creates pairs of RTP sessions talking to each other over the loopback
+ *  interface and sends one packet every 20 msec on each session, the way
+ *  yrtpchan does, with the received payload forwarded to a DataSource.
+ * With a relay mode each pair is bridged by two more sessions that send
+ *  what they receive to the other end, either through a DataSource and
+ *  consumer like two bridged yrtpchan calls or directly like its relay.
+ * Allocations and payload sized memory copies made by the whole process
+ *  are counted while the media flows and printed per received packet as
+ *  key=value pairs. The copies done by the kernel are not included.
+ */
+
+#include <yatephone.h>
+#include <yatertp.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#define COUNT_ALLOCS
+#endif
+
+// copies shorter than this are not payload
+#define COPY_MIN 64
+
+using namespace TelEngine;
+
+#ifdef COUNT_ALLOCS
+// Count allocations and copies of the whole process, the executable's
+//  definitions take precedence over the C library for all shared objects
+
+extern "C" {
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t align, size_t size);
+extern void __libc_free(void* ptr);
+}
+
+static volatile long s_allocs = 0;
+static volatile long s_copies = 0;
+static volatile long s_copied = 0;
+
+static inline void* counted(void* ptr)
+{
+    if (ptr)
+	__sync_add_and_fetch(&s_allocs,1);
+    return ptr;
+}
+
+extern "C" {
+
+void* malloc(size_t size)
+{
+    return counted(__libc_malloc(size));
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+    return counted(__libc_calloc(nmemb,size));
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    return counted(__libc_realloc(ptr,size));
+}
+
+void* memalign(size_t align, size_t size)
+{
+    return counted(__libc_memalign(align,size));
+}
+
+int posix_memalign(void** ptr, size_t align, size_t size)
+{
+    *ptr = counted(__libc_memalign(align,size));
+    return *ptr ? 0 : ENOMEM;
+}
+
+void free(void* ptr)
+{
+    __libc_free(ptr);
+}
+
+void* memcpy(void* dest, const void* src, size_t n)
+{
+    if (n >= COPY_MIN) {
+	__sync_add_and_fetch(&s_copies,1);
+	__sync_add_and_fetch(&s_copied,(long)n);
+    }
+    return ::memmove(dest,src,n);
+}
+
+}; // extern "C"
+
+static inline long allocCount()
+    { return s_allocs; }
+static inline long copyCount()
+    { return s_copies; }
+static inline long copyBytes()
+    { return s_copied; }
+#else
+static inline long allocCount()
+    { return -1; }
+static inline long copyCount()
+    { return -1; }
+static inline long copyBytes()
+    { return -1; }
+#endif
+
+static volatile long s_packets = 0;
+static volatile long s_relayed = 0;
+
+// Consumer that only counts what it receives
+class BenchSink : public DataConsumer
+{
+public:
+    inline BenchSink()
+	: DataConsumer("mulaw")
+	{ }
+    virtual void Consume(const DataBlock& data, unsigned long tStamp)
+	{ __sync_add_and_fetch(&s_packets,1); }
+};
+
+// Session that forwards received payloads like the one in yrtpchan
+class BenchSession : public RTPSession
+{
+public:
+    BenchSession();
+    virtual ~BenchSession();
+    virtual bool rtpRecvData(bool marker, unsigned int timestamp,
+	const void* data, int len);
+    void relay(BenchSession* peer, bool direct);
+private:
+    DataSource* m_source;
+    DataConsumer* m_sink;
+    BenchSession* m_relay;
+};
+
+// Consumer that sends what it receives on another session
+class BenchRelay : public DataConsumer
+{
+public:
+    inline BenchRelay(BenchSession* peer)
+	: DataConsumer("mulaw"), m_peer(peer)
+	{ }
+    virtual void Consume(const DataBlock& data, unsigned long tStamp)
+	{
+	    __sync_add_and_fetch(&s_relayed,1);
+	    m_peer->rtpSendData(false,tStamp,data.data(),data.length());
+	}
+private:
+    BenchSession* m_peer;
+};
+
+
+BenchSession::BenchSession()
+    : m_relay(0)
+{
+    m_source = new DataSource("mulaw");
+    m_sink = new BenchSink;
+    m_source->attach(m_sink);
+}
+
+BenchSession::~BenchSession()
+{
+    // stop the group from calling us before we go away
+    group(0);
+    transport(0);
+    m_source->detach(m_sink);
+    m_sink->deref();
+    m_source->deref();
+}
+
+void BenchSession::relay(BenchSession* peer, bool direct)
+{
+    if (direct) {
+	m_relay = peer;
+	return;
+    }
+    m_source->detach(m_sink);
+    m_sink->deref();
+    m_sink = new BenchRelay(peer);
+    m_source->attach(m_sink);
+}
+
+bool BenchSession::rtpRecvData(bool marker, unsigned int timestamp, const void* data, int len)
+{
+    if (m_relay) {
+	__sync_add_and_fetch(&s_relayed,1);
+	m_relay->rtpSendData(marker,timestamp,data,len);
+	return true;
+    }
+    DataBlock block;
+    block.assign((void*)data,len,false);
+    m_source->Forward(block,timestamp);
+    block.clear(false);
+    return true;
+}
+
+
+static void usage()
+{
+    ::fprintf(stderr,
+	"Usage: rtpbench [-c pairs] [-s seconds] [-l bytes] [-g groups] [-j maxjitter] [-r relay]\n"
+	"  -c   number of session pairs exchanging media (default 50)\n"
+	"  -s   seconds of media measured after one second of warmup (default 5)\n"
+	"  -l   payload length of each packet (default 160)\n"
+	"  -g   shared RTP groups, 0 for one per CPU, -1 for one per session (default 0)\n"
+	"  -j   maximum dejitter delay in msec, 0 to disable (default 0)\n"
+	"  -r   bridge each pair, 1 through the data path, 2 directly (default 0)\n");
+}
+
+int main(int argc, const char** argv)
+{
+    unsigned int pairs = 50;
+    unsigned int secs = 5;
+    int len = 160;
+    int groups = 0;
+    int jitter = 0;
+    int relay = 0;
+    for (int i = 1; i < argc; i++) {
+	String arg(argv[i]);
+	if ((i + 1 >= argc) || !arg.startsWith("-")) {
+	    usage();
+	    return 1;
+	}
+	String val(argv[++i]);
+	if (arg == "-c")
+	    pairs = val.toInteger(50);
+	else if (arg == "-s")
+	    secs = val.toInteger(5);
+	else if (arg == "-l")
+	    len = val.toInteger(160);
+	else if (arg == "-g")
+	    groups = val.toInteger(0);
+	else if (arg == "-j")
+	    jitter = val.toInteger(0);
+	else if (arg == "-r")
+	    relay = val.toInteger(0);
+	else {
+	    usage();
+	    return 1;
+	}
+    }
+    if (!pairs || !secs || (len < 1) || (len > 1400) || (relay < 0) || (relay > 2)) {
+	usage();
+	return 1;
+    }
+    Debugger::enableOutput(false);
+    RTPGroup::setShared(groups);
+
+    // with relay each pair is made of sessions 0 and 3 of a group of 4
+    unsigned int count = (relay ? 4 : 2) * pairs;
+    BenchSession** sess = new BenchSession*[count];
+    SocketAddr addr(AF_INET);
+    addr.host("127.0.0.1");
+    for (unsigned int i = 0; i < count; i++) {
+	sess[i] = new BenchSession;
+	sess[i]->initTransport();
+	addr.port(0);
+	if (!sess[i]->localAddr(addr,false)) {
+	    ::fprintf(stderr,"# cannot bind session %u\n",i);
+	    return 1;
+	}
+    }
+    for (unsigned int i = 0; i < count; i++) {
+	// each session sends to its pair
+	SocketAddr remote(sess[i ^ 1]->transport()->localAddr());
+	sess[i]->remoteAddr(remote);
+	sess[i]->initGroup(5);
+	sess[i]->direction(RTPSession::SendRecv);
+	sess[i]->dataPayload(0);
+	if (jitter > 0)
+	    sess[i]->setDejitter(0,jitter * 1000);
+	// the middle sessions of a group send to each other what they receive
+	if (relay && ((i & 3) == 1))
+	    sess[i]->relay(sess[i + 1],(relay == 2));
+	else if (relay && ((i & 3) == 2))
+	    sess[i]->relay(sess[i - 1],(relay == 2));
+    }
+
+    char* payload = new char[len];
+    ::memset(payload,0xff,len);
+    unsigned int total = 50 * (secs + 1);
+    unsigned int warm = 50;
+    long allocs = 0;
+    long copies = 0;
+    long copied = 0;
+    long packets = 0;
+    long relayed = 0;
+    double cpu = 0.0;
+    u_int64_t start = Time::now();
+    for (unsigned int n = 0; n <= total; n++) {
+	if (n == warm) {
+	    allocs = allocCount();
+	    copies = copyCount();
+	    copied = copyBytes();
+	    packets = s_packets;
+	    relayed = s_relayed;
+	    cpu = SysUsage::runTime(SysUsage::UserTime) + SysUsage::runTime(SysUsage::KernelTime);
+	}
+	if (n == total)
+	    break;
+	for (unsigned int i = 0; i < count; i++) {
+	    // the middle sessions of a group only relay
+	    if (relay && (((i & 3) == 1) || ((i & 3) == 2)))
+		continue;
+	    sess[i]->rtpSendData(false,n * len,payload,len);
+	}
+	u_int64_t next = start + 20000 * (u_int64_t)(n + 1);
+	u_int64_t now = Time::now();
+	if (next > now)
+	    Thread::usleep(next - now);
+    }
+    // let the last packets and any dejitter delay drain
+    Thread::msleep(100 + jitter);
+    cpu = SysUsage::runTime(SysUsage::UserTime) + SysUsage::runTime(SysUsage::KernelTime) - cpu;
+    allocs = allocCount() - allocs;
+    copies = copyCount() - copies;
+    copied = copyBytes() - copied;
+    packets = s_packets - packets;
+    relayed = s_relayed - relayed;
+    unsigned long sent = 2 * pairs * (total - warm);
+
+    ::printf("# rtpbench pairs=%u seconds=%u payload=%d groups=%d maxjitter=%d relay=%d allocs=%s\n",
+	pairs,secs,len,groups,jitter,relay,(allocCount() >= 0) ? "counted" : "unavailable");
+    ::printf("sent=%lu received=%ld relayed=%ld cpu_s=%.3f usec_packet=%.2f relayed_cpu_s=%.0f"
+	" allocs_packet=%.2f copies_packet=%.2f copied_bytes_packet=%.1f\n",
+	sent,packets,relayed,cpu,packets ? (1000000.0 * cpu / packets) : 0.0,
+	(cpu > 0.0) ? (relayed / cpu) : 0.0,
+	(allocs >= 0 && packets) ? ((double)allocs / packets) : -1.0,
+	(copies >= 0 && packets) ? ((double)copies / packets) : -1.0,
+	(copied >= 0 && packets) ? ((double)copied / packets) : -1.0);
+    ::fflush(stdout);
+
+    for (unsigned int i = 0; i < count; i++)
+	sess[i]->destruct();
+    delete[] sess;
+    delete[] payload;
+    return 0;
+}
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
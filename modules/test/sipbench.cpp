@@ -0,0 +1,287 @@
+/**
+ * sipbench.cpp
+ * Standalone SIP request rate benchmark
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2006 Null Team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Usage: sipbench [-m method] [-a addr] [-p port] [-w window] [-s seconds] [-t timeout]
+ *
+ * Sends REGISTER or INVITE requests over UDP to a SIP server, each one with
+ *  a new Call-ID, keeping a window of requests waiting for a final answer.
+ * Final answers to INVITE are acknowledged so route the requests to an
+ *  error (like "^bench=-;error=busy" in regexroute.conf) to avoid setting
+ *  up calls. Requests not answered in time are counted and replaced.
+ * The number of answered requests per second is printed as key=value pairs,
+ *  run it against ysipchan with different values of its workers setting.
+ */
+
+#include <yateclass.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace TelEngine;
+
+// One request waiting for its final answer
+struct BenchSlot
+{
+    String callid;
+    String branch;
+    String tag;
+    u_int64_t sent;
+};
+
+static Socket s_sock;
+static SocketAddr s_remote(AF_INET);
+static String s_local;
+static int s_port = 0;
+static String s_method("REGISTER");
+static String s_host;
+
+static String hexId()
+{
+    char buf[20];
+    ::snprintf(buf,sizeof(buf),"%08lx%08lx",::random() & 0xffffffffL,::random() & 0xffffffffL);
+    return buf;
+}
+
+static void sendText(const String& text)
+{
+    s_sock.sendTo(text.c_str(),text.length(),s_remote);
+}
+
+// Start a new request in a slot, the Call-ID starts with the slot number
+static void sendRequest(BenchSlot& slot, unsigned int index)
+{
+    slot.callid = "";
+    slot.callid << index << "-" << hexId() << "@" << s_local;
+    slot.branch = "z9hG4bK" + hexId();
+    slot.tag = hexId();
+    slot.sent = Time::now();
+    String uri;
+    if (s_method == "REGISTER")
+	uri << "sip:" << s_host;
+    else
+	uri << "sip:bench@" << s_host;
+    String msg;
+    msg << s_method << " " << uri << " SIP/2.0\r\n";
+    msg << "Via: SIP/2.0/UDP " << s_local << ":" << s_port << ";branch=" << slot.branch << ";rport\r\n";
+    msg << "From: <sip:bench@" << s_host << ">;tag=" << slot.tag << "\r\n";
+    msg << "To: <sip:bench@" << s_host << ">\r\n";
+    msg << "Call-ID: " << slot.callid << "\r\n";
+    msg << "CSeq: 1 " << s_method << "\r\n";
+    msg << "Contact: <sip:bench@" << s_local << ":" << s_port << ">\r\n";
+    msg << "Max-Forwards: 70\r\n";
+    if (s_method == "REGISTER")
+	msg << "Expires: 600\r\n";
+    msg << "Content-Length: 0\r\n\r\n";
+    sendText(msg);
+}
+
+// Acknowledge a final answer to INVITE, the To tag is copied from the answer
+static void sendAck(const BenchSlot& slot, const String& to)
+{
+    String msg;
+    msg << "ACK sip:bench@" << s_host << " SIP/2.0\r\n";
+    msg << "Via: SIP/2.0/UDP " << s_local << ":" << s_port << ";branch=" << slot.branch << ";rport\r\n";
+    msg << "From: <sip:bench@" << s_host << ">;tag=" << slot.tag << "\r\n";
+    msg << "To: " << to << "\r\n";
+    msg << "Call-ID: " << slot.callid << "\r\n";
+    msg << "CSeq: 1 ACK\r\n";
+    msg << "Max-Forwards: 70\r\n";
+    msg << "Content-Length: 0\r\n\r\n";
+    sendText(msg);
+}
+
+// Get the value of a header from a raw answer
+static bool getHeader(const char* buf, const char* name, const char* compact, String& value)
+{
+    int nlen = ::strlen(name);
+    int clen = ::strlen(compact);
+    for (const char* line = ::strstr(buf,"\r\n"); line; line = ::strstr(line,"\r\n")) {
+	line += 2;
+	const char* val = 0;
+	if (!::strncasecmp(line,name,nlen) && (line[nlen] == ':'))
+	    val = line + nlen + 1;
+	else if (!::strncasecmp(line,compact,clen) && (line[clen] == ':'))
+	    val = line + clen + 1;
+	if (!val)
+	    continue;
+	const char* end = ::strstr(val,"\r\n");
+	value.assign(val,end ? (int)(end - val) : -1);
+	value.trimBlanks();
+	return true;
+    }
+    return false;
+}
+
+static void usage()
+{
+    ::fprintf(stderr,
+	"Usage: sipbench [-m method] [-a addr] [-p port] [-w window] [-s seconds] [-t timeout]\n"
+	"  -m   REGISTER or INVITE (default REGISTER)\n"
+	"  -a   address of the SIP server (default 127.0.0.1)\n"
+	"  -p   port of the SIP server (default 5060)\n"
+	"  -w   requests waiting for an answer at any time (default 50)\n"
+	"  -s   seconds of requests measured after one second of warmup (default 5)\n"
+	"  -t   msec to wait for a final answer before giving up (default 4000)\n");
+}
+
+int main(int argc, const char** argv)
+{
+    String addr("127.0.0.1");
+    int port = 5060;
+    unsigned int window = 50;
+    unsigned int secs = 5;
+    int timeout = 4000;
+    for (int i = 1; i < argc; i++) {
+	String arg(argv[i]);
+	if ((i + 1 >= argc) || !arg.startsWith("-")) {
+	    usage();
+	    return 1;
+	}
+	String val(argv[++i]);
+	if (arg == "-m")
+	    s_method = val.toUpper();
+	else if (arg == "-a")
+	    addr = val;
+	else if (arg == "-p")
+	    port = val.toInteger(5060);
+	else if (arg == "-w")
+	    window = val.toInteger(50);
+	else if (arg == "-s")
+	    secs = val.toInteger(5);
+	else if (arg == "-t")
+	    timeout = val.toInteger(4000);
+	else {
+	    usage();
+	    return 1;
+	}
+    }
+    if (!window || !secs || (timeout <= 0) || (port <= 0) ||
+	!((s_method == "REGISTER") || (s_method == "INVITE"))) {
+	usage();
+	return 1;
+    }
+    Debugger::enableOutput(false);
+    ::srandom(Time::now() & 0xffffffff);
+
+    s_remote.host(addr);
+    s_remote.port(port);
+    s_host << addr << ":" << port;
+    SocketAddr local(AF_INET);
+    local.host(addr);
+    local.port(0);
+    if (!(s_sock.create(AF_INET,SOCK_DGRAM) && s_sock.bind(local) &&
+	s_sock.getSockName(local) && s_sock.setBlocking(false))) {
+	::fprintf(stderr,"# cannot create the UDP socket\n");
+	return 1;
+    }
+    int buflen = 1 << 20;
+    s_sock.setOption(SOL_SOCKET,SO_RCVBUF,&buflen,sizeof(buflen));
+    s_local = local.host();
+    s_port = local.port();
+
+    BenchSlot* slots = new BenchSlot[window];
+    for (unsigned int i = 0; i < window; i++)
+	sendRequest(slots[i],i);
+
+    char buf[4096];
+    SocketAddr from;
+    unsigned long answered = 0;
+    unsigned long timeouts = 0;
+    unsigned long provisional = 0;
+    unsigned long failed = 0;
+    unsigned long startAnswered = 0;
+    unsigned long startTimeouts = 0;
+    unsigned long startProvisional = 0;
+    unsigned long startFailed = 0;
+    u_int64_t start = Time::now();
+    u_int64_t warm = start + 1000000;
+    u_int64_t stop = warm + 1000000 * (u_int64_t)secs;
+    bool warming = true;
+    for (;;) {
+	u_int64_t now = Time::now();
+	if (warming && (now >= warm)) {
+	    warming = false;
+	    startAnswered = answered;
+	    startTimeouts = timeouts;
+	    startProvisional = provisional;
+	    startFailed = failed;
+	}
+	if (now >= stop)
+	    break;
+	bool ok = false;
+	struct timeval tv;
+	tv.tv_sec = 0;
+	tv.tv_usec = 10000;
+	if (s_sock.select(&ok,0,0,&tv) && ok) {
+	    int res;
+	    while ((res = s_sock.recvFrom(buf,sizeof(buf) - 1,from)) > 0) {
+		buf[res] = 0;
+		int code = 0;
+		if (::sscanf(buf,"SIP/2.0 %d",&code) != 1)
+		    continue;
+		if (code < 200) {
+		    provisional++;
+		    continue;
+		}
+		String callid;
+		if (!getHeader(buf,"Call-ID","i",callid))
+		    continue;
+		unsigned int index = callid.substr(0,callid.find('-')).toInteger(-1);
+		if ((index >= window) || (callid != slots[index].callid))
+		    continue;
+		if (s_method == "INVITE") {
+		    String to;
+		    if (getHeader(buf,"To","t",to))
+			sendAck(slots[index],to);
+		}
+		if (code >= 500)
+		    failed++;
+		answered++;
+		sendRequest(slots[index],index);
+	    }
+	}
+	now = Time::now();
+	for (unsigned int i = 0; i < window; i++) {
+	    if (now - slots[i].sent < 1000 * (u_int64_t)timeout)
+		continue;
+	    timeouts++;
+	    sendRequest(slots[i],i);
+	}
+    }
+    answered -= startAnswered;
+    timeouts -= startTimeouts;
+    provisional -= startProvisional;
+    failed -= startFailed;
+
+    ::printf("# sipbench method=%s server=%s window=%u seconds=%u timeout=%d\n",
+	s_method.c_str(),s_host.c_str(),window,secs,timeout);
+    ::printf("answered=%lu timeouts=%lu provisional=%lu failed=%lu cps=%.1f\n",
+	answered,timeouts,provisional,failed,(double)answered / secs);
+    ::fflush(stdout);
+    delete[] slots;
+    return 0;
+}
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
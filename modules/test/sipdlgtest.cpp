@@ -0,0 +1,373 @@
+/**
+ * sipdlgtest.cpp
+ * Standalone SIP dialog CSeq ordering test
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2006 Null Team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Usage: sipdlgtest [-a addr] [-r port] [-n calls] [-t timeout]
+ *
+ * Asks yate through rmanager to place calls from tone/ring to a SIP user
+ *  agent run by this program over UDP, answers them and drops the tone
+ *  channels once all are set up so yate sends BYE in each dialog.
+ * The CSeq of every request in a dialog must be higher than the one of the
+ *  request before it. With the ysipchan workers setting above 1 the BYE is
+ *  sent by the worker that owns the Call-ID while the INVITE is not.
+ * One line per call and a summary are printed as key=value pairs, the exit
+ *  code is non zero if any call failed or did not finish in time.
+ */
+
+#include <yateclass.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace TelEngine;
+
+// One dialog set up by yate towards us
+class DlgCall : public String
+{
+public:
+    inline DlgCall(const String& callid)
+	: String(callid), m_cseq(-1), m_invite(-1), m_answered(false),
+	  m_bye(false), m_ordered(true)
+	{ }
+    String m_tag;
+    String m_answer;
+    int m_cseq;
+    int m_invite;
+    bool m_answered;
+    bool m_bye;
+    bool m_ordered;
+};
+
+static Socket s_sock;
+static Socket s_media;
+static Socket s_manager;
+static SocketAddr s_remote(AF_INET);
+static String s_local;
+static int s_port = 0;
+static int s_mediaPort = 0;
+static ObjList s_calls;
+
+static String hexId()
+{
+    char buf[20];
+    ::snprintf(buf,sizeof(buf),"%08lx%08lx",::random() & 0xffffffffL,::random() & 0xffffffffL);
+    return buf;
+}
+
+// Get the value of a header from a raw message
+static bool getHeader(const char* buf, const char* name, const char* compact, String& value)
+{
+    int nlen = ::strlen(name);
+    int clen = ::strlen(compact);
+    for (const char* line = ::strstr(buf,"\r\n"); line; line = ::strstr(line,"\r\n")) {
+	line += 2;
+	if (!::strncmp(line,"\r\n",2))
+	    break;
+	const char* val = 0;
+	if (!::strncasecmp(line,name,nlen) && (line[nlen] == ':'))
+	    val = line + nlen + 1;
+	else if (!::strncasecmp(line,compact,clen) && (line[clen] == ':'))
+	    val = line + clen + 1;
+	if (!val)
+	    continue;
+	const char* end = ::strstr(val,"\r\n");
+	value.assign(val,end ? (int)(end - val) : -1);
+	value.trimBlanks();
+	return true;
+    }
+    return false;
+}
+
+// Copy all the header lines of a name from a raw message
+static void copyHeaders(String& dest, const char* buf, const char* name, const char* compact)
+{
+    int nlen = ::strlen(name);
+    int clen = ::strlen(compact);
+    for (const char* line = ::strstr(buf,"\r\n"); line; line = ::strstr(line,"\r\n")) {
+	line += 2;
+	if (!::strncmp(line,"\r\n",2))
+	    break;
+	if (!((!::strncasecmp(line,name,nlen) && (line[nlen] == ':')) ||
+	    (!::strncasecmp(line,compact,clen) && (line[clen] == ':'))))
+	    continue;
+	const char* end = ::strstr(line,"\r\n");
+	if (!end)
+	    break;
+	dest += String(line,end - line + 2);
+    }
+}
+
+// Build an answer to a request, the To tag is added if given
+static String answer(const char* buf, int code, const char* reason, const String& tag,
+    const String& sdp = String::empty())
+{
+    String msg;
+    msg << "SIP/2.0 " << code << " " << reason << "\r\n";
+    copyHeaders(msg,buf,"Via","v");
+    copyHeaders(msg,buf,"From","f");
+    String to;
+    getHeader(buf,"To","t",to);
+    if (tag && (to.find(";tag=") < 0))
+	to << ";tag=" << tag;
+    msg << "To: " << to << "\r\n";
+    copyHeaders(msg,buf,"Call-ID","i");
+    copyHeaders(msg,buf,"CSeq","");
+    if (code < 300)
+	msg << "Contact: <sip:dlgtest@" << s_local << ":" << s_port << ">\r\n";
+    if (sdp)
+	msg << "Content-Type: application/sdp\r\n";
+    msg << "Content-Length: " << sdp.length() << "\r\n\r\n" << sdp;
+    return msg;
+}
+
+// Handle one request received from yate
+static void request(const char* buf, const SocketAddr& from)
+{
+    String method(buf,::strcspn(buf," "));
+    String callid;
+    String cseq;
+    if (!(getHeader(buf,"Call-ID","i",callid) && getHeader(buf,"CSeq","",cseq)))
+	return;
+    DlgCall* call = static_cast<DlgCall*>(s_calls[callid]);
+    if (!call) {
+	if (method != "INVITE")
+	    return;
+	call = new DlgCall(callid);
+	call->m_tag = hexId();
+	s_calls.append(call);
+    }
+    int seq = cseq.substr(0,cseq.find(' ')).toInteger(-1);
+    if (seq < 0)
+	return;
+    if (method == "ACK") {
+	if (seq == call->m_invite)
+	    call->m_answered = true;
+	return;
+    }
+    if (method == "CANCEL") {
+	// has the CSeq of the INVITE, too late to cancel anything
+	String text = answer(buf,200,"OK",call->m_tag);
+	s_sock.sendTo(text.c_str(),text.length(),from);
+	return;
+    }
+    String text;
+    if ((method == "INVITE") && (seq == call->m_invite))
+	// a retransmission, send the same answer
+	text = call->m_answer;
+    else {
+	if (seq <= call->m_cseq) {
+	    ::printf("callid=%s method=%s cseq=%d previous=%d result=FAILED\n",
+		callid.c_str(),method.c_str(),seq,call->m_cseq);
+	    call->m_ordered = false;
+	}
+	if (seq > call->m_cseq)
+	    call->m_cseq = seq;
+	if ((method == "INVITE") && (call->m_invite < 0)) {
+	    call->m_invite = seq;
+	    String sdp;
+	    sdp << "v=0\r\n";
+	    sdp << "o=sipdlgtest " << (int)::random() << " 1 IN IP4 " << s_local << "\r\n";
+	    sdp << "s=sipdlgtest\r\n";
+	    sdp << "c=IN IP4 " << s_local << "\r\n";
+	    sdp << "t=0 0\r\n";
+	    sdp << "m=audio " << s_mediaPort << " RTP/AVP 0\r\n";
+	    text = answer(buf,200,"OK",call->m_tag,sdp);
+	    call->m_answer = text;
+	}
+	else {
+	    text = answer(buf,200,"OK",call->m_tag);
+	    if (method == "BYE")
+		call->m_bye = true;
+	}
+    }
+    s_sock.sendTo(text.c_str(),text.length(),from);
+}
+
+// Read the SIP messages waiting on the socket
+static void readSip(long usec)
+{
+    bool ok = false;
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = usec;
+    if (!(s_sock.select(&ok,0,0,&tv) && ok))
+	return;
+    char buf[4096];
+    SocketAddr from;
+    int res;
+    while ((res = s_sock.recvFrom(buf,sizeof(buf) - 1,from)) > 0) {
+	buf[res] = 0;
+	if (::strncmp(buf,"SIP/2.0 ",8))
+	    request(buf,from);
+    }
+}
+
+// Read what rmanager answered, collect the ids of the channels it called from
+static void readManager(String& input, ObjList& chans)
+{
+    bool ok = false;
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    if (!(s_manager.select(&ok,0,0,&tv) && ok))
+	return;
+    char buf[1024];
+    int res = s_manager.readData(buf,sizeof(buf));
+    if (res <= 0)
+	return;
+    input += String(buf,res);
+    for (;;) {
+	int eol = input.find('\n');
+	if (eol < 0)
+	    break;
+	// the first answer comes after the telnet option negotiation
+	int pos = input.find("Calling '");
+	String line = ((pos >= 0) && (pos < eol)) ? input.substr(pos + 9,eol - pos - 9) : String::empty();
+	input = input.substr(eol + 1);
+	int end = line.find('\'');
+	if (end > 0)
+	    chans.append(new String(line.substr(0,end)));
+    }
+}
+
+static void command(const String& cmd)
+{
+    String text = cmd + "\r\n";
+    s_manager.writeData(text.c_str(),text.length());
+}
+
+static unsigned int countCalls(bool bye)
+{
+    unsigned int n = 0;
+    for (ObjList* l = s_calls.skipNull(); l; l = l->skipNext()) {
+	const DlgCall* call = static_cast<const DlgCall*>(l->get());
+	if (bye ? call->m_bye : call->m_answered)
+	    n++;
+    }
+    return n;
+}
+
+static void usage()
+{
+    ::fprintf(stderr,
+	"Usage: sipdlgtest [-a addr] [-r port] [-n calls] [-t timeout]\n"
+	"  -a   address of yate, SIP is received on it too (default 127.0.0.1)\n"
+	"  -r   port of the rmanager module (default 5038)\n"
+	"  -n   number of calls, each gets a new Call-ID (default 16)\n"
+	"  -t   msec to wait for the calls to set up and then to end (default 5000)\n");
+}
+
+int main(int argc, const char** argv)
+{
+    String addr("127.0.0.1");
+    int rport = 5038;
+    unsigned int calls = 16;
+    int timeout = 5000;
+    for (int i = 1; i < argc; i++) {
+	String arg(argv[i]);
+	if ((i + 1 >= argc) || !arg.startsWith("-")) {
+	    usage();
+	    return 1;
+	}
+	String val(argv[++i]);
+	if (arg == "-a")
+	    addr = val;
+	else if (arg == "-r")
+	    rport = val.toInteger(5038);
+	else if (arg == "-n")
+	    calls = val.toInteger(16);
+	else if (arg == "-t")
+	    timeout = val.toInteger(5000);
+	else {
+	    usage();
+	    return 1;
+	}
+    }
+    if (!calls || (timeout <= 0) || (rport <= 0)) {
+	usage();
+	return 1;
+    }
+    Debugger::enableOutput(false);
+    ::srandom(Time::now() & 0xffffffff);
+
+    SocketAddr local(AF_INET);
+    local.host(addr);
+    local.port(0);
+    SocketAddr media(local);
+    if (!(s_sock.create(AF_INET,SOCK_DGRAM) && s_sock.bind(local) &&
+	s_sock.getSockName(local) && s_sock.setBlocking(false) &&
+	s_media.create(AF_INET,SOCK_DGRAM) && s_media.bind(media) &&
+	s_media.getSockName(media))) {
+	::fprintf(stderr,"# cannot create the UDP sockets\n");
+	return 1;
+    }
+    s_local = local.host();
+    s_port = local.port();
+    s_mediaPort = media.port();
+    s_remote.host(addr);
+    s_remote.port(rport);
+    if (!(s_manager.create(AF_INET,SOCK_STREAM) && s_manager.connect(s_remote))) {
+	::fprintf(stderr,"# cannot connect to rmanager on %s:%d\n",addr.c_str(),rport);
+	return 1;
+    }
+    ::printf("# sipdlgtest local=%s:%d calls=%u timeout=%d\n",s_local.c_str(),s_port,calls,timeout);
+    ::fflush(stdout);
+
+    String cmd;
+    cmd << "call tone/ring sip/sip:dlgtest@" << s_local << ":" << s_port;
+    for (unsigned int i = 0; i < calls; i++)
+	command(cmd);
+    String input;
+    ObjList chans;
+    u_int64_t stop = Time::now() + 1000 * (u_int64_t)timeout;
+    while ((Time::now() < stop) && (countCalls(false) < calls)) {
+	readSip(10000);
+	readManager(input,chans);
+    }
+    // hang up from the yate side so it sends BYE in each dialog
+    for (ObjList* l = chans.skipNull(); l; l = l->skipNext())
+	command("drop " + *static_cast<const String*>(l->get()));
+    stop = Time::now() + 1000 * (u_int64_t)timeout;
+    while ((Time::now() < stop) && (countCalls(true) < s_calls.count()))
+	readSip(10000);
+    command("quit");
+
+    unsigned int failed = 0;
+    for (ObjList* l = s_calls.skipNull(); l; l = l->skipNext()) {
+	const DlgCall* call = static_cast<const DlgCall*>(l->get());
+	bool ok = call->m_answered && call->m_bye && call->m_ordered;
+	if (!ok)
+	    failed++;
+	::printf("callid=%s invite=%d last=%d answered=%s bye=%s result=%s\n",
+	    call->c_str(),call->m_invite,call->m_cseq,String::boolText(call->m_answered),
+	    String::boolText(call->m_bye),(ok ? "ok" : "FAILED"));
+    }
+    if (s_calls.count() < calls)
+	failed += calls - s_calls.count();
+    ::printf("# sipdlgtest calls=%u dialogs=%u failed=%u\n",calls,s_calls.count(),failed);
+    ::fflush(stdout);
+    return failed ? 1 : 0;
+}
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
@@ -0,0 +1,316 @@
+/**
+ * siptcptest.cpp
+ * Standalone SIP over TCP message framing test
+ * This file is part of the YATE Project http://YATE.null.ro
+ *
+ * Yet Another Telephony Engine - a fully featured software PBX and IVR
+ * Copyright (C) 2004-2006 Null Team
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Usage: siptcptest [-a addr] [-p port] [-t timeout]
+ *
+ * Connects to a SIP server over TCP and sends OPTIONS requests framed in
+ *  ways a stream may deliver them: split in small pieces, several of them
+ *  pipelined in one write with keepalives between them, with a large body.
+ *  Each of these must get its final answer on the same connection.
+ * Requests with an oversized, overflowing or malformed Content-Length and
+ *  headers that never end must get the connection closed without answer.
+ * An INVITE to sip:siptcptest@ must get a single final answer, TCP does not
+ *  need it retransmitted while the server waits for the ACK.
+ * Results are printed one line per case as key=value pairs, the exit code
+ *  is non zero if any case failed. Run it against ysipchan with tcp=enable
+ *  and no route for siptcptest.
+ */
+
+#include <yateclass.h>
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+
+using namespace TelEngine;
+
+static SocketAddr s_remote(AF_INET);
+static String s_host;
+static int s_timeout = 2000;
+static unsigned int s_seq = 0;
+
+// Build an OPTIONS request with a given Content-Length and body
+static String request(const char* length, const String& body = String::empty())
+{
+    s_seq++;
+    String msg;
+    msg << "OPTIONS sip:test@" << s_host << " SIP/2.0\r\n";
+    msg << "Via: SIP/2.0/TCP 127.0.0.1:9;branch=z9hG4bKtcp" << s_seq << "x" << (int)::random() << "\r\n";
+    msg << "From: <sip:siptcptest@" << s_host << ">;tag=" << (int)::random() << "\r\n";
+    msg << "To: <sip:test@" << s_host << ">\r\n";
+    msg << "Call-ID: " << s_seq << "-" << (int)::random() << "@siptcptest\r\n";
+    msg << "CSeq: " << s_seq << " OPTIONS\r\n";
+    msg << "Max-Forwards: 70\r\n";
+    if (body)
+	msg << "Content-Type: text/plain\r\n";
+    msg << "Content-Length: " << (length ? length : String(body.length()).c_str()) << "\r\n\r\n";
+    msg << body;
+    return msg;
+}
+
+// Connection to the server that collects the final answers
+class TestConn
+{
+public:
+    TestConn();
+    inline bool valid() const
+	{ return m_sock.valid(); }
+    bool send(const String& text, unsigned int chunk = 0);
+    bool wait(unsigned int finals);
+    inline unsigned int finals() const
+	{ return m_finals; }
+    inline bool closed() const
+	{ return m_closed; }
+    inline const String& to() const
+	{ return m_to; }
+private:
+    void count();
+    Socket m_sock;
+    String m_input;
+    String m_to;
+    unsigned int m_finals;
+    bool m_closed;
+};
+
+TestConn::TestConn()
+    : m_finals(0), m_closed(false)
+{
+    if (!(m_sock.create(AF_INET,SOCK_STREAM) && m_sock.connect(s_remote)))
+	m_sock.terminate();
+}
+
+// Send all the text, in small pieces with a pause between them if asked
+bool TestConn::send(const String& text, unsigned int chunk)
+{
+    const char* buf = text.c_str();
+    unsigned int len = text.length();
+    if (!chunk)
+	chunk = len;
+    while (len) {
+	int n = m_sock.writeData(buf,(len < chunk) ? len : chunk);
+	if (n <= 0)
+	    return false;
+	buf += n;
+	len -= n;
+	if (len && (chunk < text.length()))
+	    Thread::msleep(2);
+    }
+    return true;
+}
+
+// Count the final answers received so far, keep the last To header
+void TestConn::count()
+{
+    int pos = 0;
+    for (;;) {
+	int eol = m_input.find("\r\n",pos);
+	if (eol < 0)
+	    break;
+	String line = m_input.substr(pos,eol - pos);
+	int code = 0;
+	if (line.startsWith("SIP/2.0 "))
+	    code = line.substr(8,3).toInteger(0);
+	else if (line.startSkip("To:",false,true))
+	    m_to = line.trimBlanks();
+	if (code >= 200)
+	    m_finals++;
+	pos = eol + 2;
+    }
+    m_input = m_input.substr(pos);
+}
+
+// Read until enough final answers arrived, the connection closed or timeout
+bool TestConn::wait(unsigned int finals)
+{
+    u_int64_t stop = Time::now() + 1000 * (u_int64_t)s_timeout;
+    char buf[4096];
+    while (!m_closed && (m_finals < finals)) {
+	int64_t left = stop - Time::now();
+	if (left <= 0)
+	    break;
+	bool ok = false;
+	if (!(m_sock.select(&ok,0,0,left) && ok))
+	    continue;
+	int n = m_sock.readData(buf,sizeof(buf));
+	if (n <= 0) {
+	    m_closed = true;
+	    break;
+	}
+	m_input += String(buf,n);
+	count();
+    }
+    return m_finals >= finals;
+}
+
+static unsigned int s_failed = 0;
+
+static void result(const char* name, bool ok, const TestConn& conn)
+{
+    if (!ok)
+	s_failed++;
+    ::printf("case=%s finals=%u closed=%s result=%s\n",name,conn.finals(),
+	String::boolText(conn.closed()),(ok ? "ok" : "FAILED"));
+    ::fflush(stdout);
+}
+
+// Requests that must all be answered on the connection
+static void testAnswered(const char* name, const String& text, unsigned int finals, unsigned int chunk = 0)
+{
+    TestConn conn;
+    bool ok = conn.valid() && conn.send(text,chunk) && conn.wait(finals);
+    result(name,ok && (conn.finals() == finals),conn);
+}
+
+// Requests that must get the connection closed without any answer
+static void testRejected(const char* name, const String& text)
+{
+    TestConn conn;
+    bool ok = conn.valid();
+    if (ok) {
+	// the server may close while we are still sending
+	conn.send(text);
+	conn.wait(1);
+	ok = conn.closed() && !conn.finals();
+    }
+    result(name,ok,conn);
+}
+
+// An INVITE nobody answers, the final error answer must come only once
+static void testInvite()
+{
+    s_seq++;
+    String hdrs;
+    hdrs << "Via: SIP/2.0/TCP 127.0.0.1:9;branch=z9hG4bKinv" << s_seq << "x" << (int)::random() << "\r\n";
+    hdrs << "From: <sip:siptcptest@" << s_host << ">;tag=" << (int)::random() << "\r\n";
+    String callid;
+    callid << "Call-ID: " << s_seq << "-" << (int)::random() << "@siptcptest\r\n";
+    String text;
+    text << "INVITE sip:siptcptest@" << s_host << " SIP/2.0\r\n" << hdrs;
+    text << "To: <sip:siptcptest@" << s_host << ">\r\n" << callid;
+    text << "CSeq: " << s_seq << " INVITE\r\n";
+    text << "Contact: <sip:siptcptest@127.0.0.1:9;transport=tcp>\r\n";
+    text << "Max-Forwards: 70\r\nContent-Length: 0\r\n\r\n";
+    TestConn conn;
+    bool ok = conn.valid() && conn.send(text) && conn.wait(1);
+    if (ok) {
+	// over UDP timer G would repeat the answer after 500 msec
+	conn.wait(2);
+	ok = (conn.finals() == 1) && !conn.closed();
+	text.clear();
+	text << "ACK sip:siptcptest@" << s_host << " SIP/2.0\r\n" << hdrs;
+	text << "To: " << conn.to() << "\r\n" << callid;
+	text << "CSeq: " << s_seq << " ACK\r\n";
+	text << "Max-Forwards: 70\r\nContent-Length: 0\r\n\r\n";
+	conn.send(text);
+    }
+    result("invite",ok,conn);
+}
+
+static void usage()
+{
+    ::fprintf(stderr,
+	"Usage: siptcptest [-a addr] [-p port] [-t timeout]\n"
+	"  -a   address of the SIP server (default 127.0.0.1)\n"
+	"  -p   port of the SIP server (default 5060)\n"
+	"  -t   msec to wait for each answer or close (default 2000)\n");
+}
+
+int main(int argc, const char** argv)
+{
+    String addr("127.0.0.1");
+    int port = 5060;
+    for (int i = 1; i < argc; i++) {
+	String arg(argv[i]);
+	if ((i + 1 >= argc) || !arg.startsWith("-")) {
+	    usage();
+	    return 1;
+	}
+	String val(argv[++i]);
+	if (arg == "-a")
+	    addr = val;
+	else if (arg == "-p")
+	    port = val.toInteger(5060);
+	else if (arg == "-t")
+	    s_timeout = val.toInteger(2000);
+	else {
+	    usage();
+	    return 1;
+	}
+    }
+    if ((port <= 0) || (s_timeout <= 0)) {
+	usage();
+	return 1;
+    }
+    Debugger::enableOutput(false);
+#ifndef _WINDOWS
+    ::signal(SIGPIPE,SIG_IGN);
+#endif
+    ::srandom(Time::now() & 0xffffffff);
+    s_remote.host(addr);
+    s_remote.port(port);
+    s_host << addr << ":" << port;
+    ::printf("# siptcptest server=%s timeout=%d\n",s_host.c_str(),s_timeout);
+
+    String body;
+    for (int i = 0; i < 30000; i++)
+	body << (char)('a' + (i % 26));
+
+    // one request split in small pieces, the headers end in the middle of one
+    testAnswered("split",request(0),1,7);
+    // the body arriving in pieces after the headers
+    testAnswered("splitbody",request(0,body),1,1000);
+    // keepalives and several requests in one write, one with a large body
+    String text("\r\n\r\n");
+    text << request(0) << "\r\n" << request(0,body) << request(0);
+    testAnswered("pipelined",text,3);
+    // a complete request followed by the start of the next in the same write
+    text = request(0);
+    String next = request(0);
+    text << next.substr(0,next.length() / 2);
+    TestConn conn;
+    bool ok = conn.valid() && conn.send(text) && conn.wait(1) &&
+	conn.send(next.substr(next.length() / 2)) && conn.wait(2);
+    result("straddled",ok && (conn.finals() == 2),conn);
+    // final answers to INVITE are not retransmitted over TCP
+    testInvite();
+
+    // bodies that could never fit in a message
+    testRejected("oversized",request("999999"));
+    testRejected("overflow",request("2147483600"));
+    testRejected("toolong",request("99999999999999999999"));
+    // lengths that are not plain decimal numbers
+    testRejected("negative",request("-5"));
+    testRejected("malformed",request("12abc"));
+    // headers that never end
+    text = "OPTIONS sip:test@" + s_host + " SIP/2.0\r\nX-Filler: ";
+    while (text.length() < 70000)
+	text << "0123456789abcdef";
+    testRejected("noheaderend",text);
+
+    ::printf("# siptcptest failed=%u\n",s_failed);
+    return s_failed ? 1 : 0;
+}
+
+/* vi: set ts=8 sw=4 sts=4 noet: */
@@ -26,6 +26,15 @@
 
 #include <math.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define TONE_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
 using namespace TelEngine;
 
 namespace { // anonymous
@@ -48,6 +57,15 @@ namespace { // anonymous
 // minimum DTMF detect time
 #define DETECT_DTMF_MSEC 32
 
+// block detector: samples and duration of one Goertzel block
+#define BLOCK_SAMPLES 80
+#define BLOCK_MSEC 10
+// frequencies evaluated together: 8 DTMF, the fax tone, padding to a multiple of 4
+#define BLOCK_LANES 12
+#define BLOCK_FAX 8
+// consecutive blocks needed to accept a fax tone
+#define DETECT_FAX_BLOCKS 3
+
 // 2-pole filter parameters
 typedef struct
 {
@@ -84,6 +102,32 @@ private:
     double m_y[3];
 };
 
+// Goertzel detector computing all DTMF frequencies and the fax tone on blocks
+class ToneGoertzel
+{
+public:
+    inline ToneGoertzel()
+	: m_pwr(0.0), m_fill(0)
+	{ setFax(1100.0); }
+    void setFax(double freq);
+    inline void init()
+	{ m_fill = 0; }
+    // Add one sample, return true if a block is complete and must be processed
+    inline bool push(int sample)
+	{ m_buf[m_fill++] = (float)sample; return m_fill >= BLOCK_SAMPLES; }
+    void process();
+    inline const double* values() const
+	{ return m_val; }
+    inline double power() const
+	{ return m_pwr; }
+private:
+    float m_coef[BLOCK_LANES];
+    float m_buf[BLOCK_SAMPLES];
+    double m_val[BLOCK_LANES];
+    double m_pwr;
+    unsigned int m_fill;
+};
+
 class ToneConsumer : public DataConsumer
 {
     YCLASS(ToneConsumer,DataConsumer)
@@ -94,7 +138,7 @@ public:
 	Right,
 	Mixed
     };
-    ToneConsumer(const String& id, const String& name);
+    ToneConsumer(const String& id, const String& name, const char* detector = 0);
     virtual ~ToneConsumer(); 
     virtual void Consume(const DataBlock& data, unsigned long tStamp);
     virtual const String& toString() const
@@ -104,8 +148,9 @@ public:
     void setDivert(const Message& msg);
     void init();
 private:
-    void checkDtmf();
-    void checkFax();
+    void checkDtmf(const double* lo, const double* hi, double pwr);
+    void checkFax(double fax, double pwr);
+    void checkBlock();
     String m_id;
     String m_name;
     String m_divert;
@@ -117,13 +162,18 @@ private:
     bool m_detFax;
     bool m_detDtmf;
     bool m_detDnis;
+    bool m_block;
     char m_dtmfTone;
     int m_dtmfCount;
+    int m_dtmfChecks;
+    int m_faxCount;
+    int m_faxChecks;
     double m_xv[3];
     double m_pwr;
     Tone2PoleFilter m_fax;
     Tone2PoleFilter m_dtmfL[4];
     Tone2PoleFilter m_dtmfH[4];
+    ToneGoertzel m_goertzel;
 };
 
 class AttachHandler : public MessageHandler
@@ -153,6 +203,7 @@ private:
 
 static Mutex s_mutex;
 static int s_count = 0;
+static bool s_block = true;
 
 static ToneDetectorModule plugin;
 
@@ -185,6 +236,11 @@ static Params2Pole s_paramsDtmfH[] = {
     { 7.896493565e+01, -0.9746723483, 0.5613790789 }, // 1633Hz
 };
 
+// frequencies of the block detector lanes, fax tone is set separately
+static const double s_freqDtmf[8] = {
+    697.0, 770.0, 852.0, 941.0, 1209.0, 1336.0, 1477.0, 1633.0
+};
+
 // DTMF table using low, high indexes
 static char s_tableDtmf[][5] = {
     "123A", "456B", "789C", "*0#D"
@@ -207,13 +263,94 @@ void Tone2PoleFilter::update(double xd)
 }
 
 
-ToneConsumer::ToneConsumer(const String& id, const String& name)
+void ToneGoertzel::setFax(double freq)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+	m_coef[i] = (float)(2.0 * ::cos(2.0 * M_PI * s_freqDtmf[i] / 8000.0));
+    m_coef[BLOCK_FAX] = (float)(2.0 * ::cos(2.0 * M_PI * freq / 8000.0));
+    for (i = BLOCK_FAX + 1; i < BLOCK_LANES; i++)
+	m_coef[i] = 0.0;
+}
+
+// Run the Goertzel recurrence over a full block for all frequencies at once
+void ToneGoertzel::process()
+{
+    float s1[BLOCK_LANES];
+    float s2[BLOCK_LANES];
+    float pwr = 0.0;
+    unsigned int n;
+#ifdef TONE_SSE2
+// one sample broadcast to all lanes, s0 = x + coef * s1 - s2 with "a" = s1, "b" = s2
+#define GOERTZEL_STEP(sel) { \
+	    __m128 x = _mm_shuffle_ps(x4,x4,sel); \
+	    __m128 t0 = _mm_sub_ps(_mm_add_ps(x,_mm_mul_ps(c0,a0)),b0); \
+	    __m128 t1 = _mm_sub_ps(_mm_add_ps(x,_mm_mul_ps(c1,a1)),b1); \
+	    __m128 t2 = _mm_sub_ps(_mm_add_ps(x,_mm_mul_ps(c2,a2)),b2); \
+	    b0 = a0; b1 = a1; b2 = a2; \
+	    a0 = t0; a1 = t1; a2 = t2; }
+    __m128 c0 = _mm_loadu_ps(m_coef);
+    __m128 c1 = _mm_loadu_ps(m_coef + 4);
+    __m128 c2 = _mm_loadu_ps(m_coef + 8);
+    __m128 a0 = _mm_setzero_ps(), a1 = a0, a2 = a0;
+    __m128 b0 = a0, b1 = a0, b2 = a0;
+    __m128 p = a0;
+    for (n = 0; n < BLOCK_SAMPLES; n += 4) {
+	__m128 x4 = _mm_loadu_ps(m_buf + n);
+	p = _mm_add_ps(p,_mm_mul_ps(x4,x4));
+	GOERTZEL_STEP(0x00);
+	GOERTZEL_STEP(0x55);
+	GOERTZEL_STEP(0xaa);
+	GOERTZEL_STEP(0xff);
+    }
+    _mm_storeu_ps(s1,a0);
+    _mm_storeu_ps(s1 + 4,a1);
+    _mm_storeu_ps(s1 + 8,a2);
+    _mm_storeu_ps(s2,b0);
+    _mm_storeu_ps(s2 + 4,b1);
+    _mm_storeu_ps(s2 + 8,b2);
+    float pp[4];
+    _mm_storeu_ps(pp,p);
+    pwr = (pp[0] + pp[1]) + (pp[2] + pp[3]);
+#undef GOERTZEL_STEP
+#else
+    int i;
+    for (i = 0; i < BLOCK_LANES; i++)
+	s1[i] = s2[i] = 0.0;
+    for (n = 0; n < BLOCK_SAMPLES; n++) {
+	float x = m_buf[n];
+	pwr += x * x;
+	for (i = 0; i < BLOCK_LANES; i++) {
+	    float s0 = x + m_coef[i] * s1[i] - s2[i];
+	    s2[i] = s1[i];
+	    s1[i] = s0;
+	}
+    }
+#endif
+    m_fill = 0;
+    // scale so a pure tone gives the same power as the moving averages
+    static const double scale = 2.0 / ((double)BLOCK_SAMPLES * BLOCK_SAMPLES);
+    for (int j = 0; j < BLOCK_LANES; j++) {
+	double a = s1[j];
+	double b = s2[j];
+	m_val[j] = scale * (a*a + b*b - m_coef[j]*a*b);
+    }
+    m_pwr = (double)pwr / BLOCK_SAMPLES;
+}
+
+
+ToneConsumer::ToneConsumer(const String& id, const String& name, const char* detector)
     : m_id(id), m_name(name), m_mode(Mono),
-      m_detFax(true), m_detDtmf(true), m_detDnis(false),
+      m_detFax(true), m_detDtmf(true), m_detDnis(false), m_block(s_block),
       m_fax(s_paramsCNG)
 { 
-    Debug(&plugin,DebugAll,"ToneConsumer::ToneConsumer(%s,'%s') [%p]",
-	id.c_str(),name.c_str(),this);
+    if (!null(detector))
+	m_block = (String(detector) != "filter");
+    // the block detector checks every block, the filters every millisecond
+    m_dtmfChecks = m_block ? (DETECT_DTMF_MSEC / BLOCK_MSEC - 1) : DETECT_DTMF_MSEC;
+    m_faxChecks = m_block ? DETECT_FAX_BLOCKS : 1;
+    Debug(&plugin,DebugAll,"ToneConsumer::ToneConsumer(%s,'%s',%s) [%p]",
+	id.c_str(),name.c_str(),(m_block ? "goertzel" : "filter"),this);
     for (int i = 0; i < 4; i++) {
 	m_dtmfL[i].assign(s_paramsDtmfL[i]);
 	m_dtmfH[i].assign(s_paramsDtmfH[i]);
@@ -243,6 +380,7 @@ ToneConsumer::ToneConsumer(const String& id, const String& name)
 	    if (*s == "rfax") {
 		// detection of receiving Fax requested
 		m_fax.assign(s_paramsCED);
+		m_goertzel.setFax(2100.0);
 		m_detFax = true;
 	    }
 	    else if (*s == "callsetup") {
@@ -275,33 +413,35 @@ void ToneConsumer::init()
 	m_dtmfL[i].init();
 	m_dtmfH[i].init();
     }
+    m_goertzel.init();
     m_dtmfTone = '\0';
     m_dtmfCount = 0;
+    m_faxCount = 0;
 }
 
 // Check if we detected a DTMF
-void ToneConsumer::checkDtmf()
+void ToneConsumer::checkDtmf(const double* lo, const double* hi, double pwr)
 {
     int i;
     char c = m_dtmfTone;
     m_dtmfTone = '\0';
     int l = 0;
-    double maxL = m_dtmfL[0].value();
+    double maxL = lo[0];
     for (i = 1; i < 4; i++) {
-	if (maxL < m_dtmfL[i].value()) {
-	    maxL = m_dtmfL[i].value();
+	if (maxL < lo[i]) {
+	    maxL = lo[i];
 	    l = i;
 	}
     }
     int h = 0;
-    double maxH = m_dtmfH[0].value();
+    double maxH = hi[0];
     for (i = 1; i < 4; i++) {
-	if (maxH < m_dtmfH[i].value()) {
-	    maxH = m_dtmfH[i].value();
+	if (maxH < hi[i]) {
+	    maxH = hi[i];
 	    h = i;
 	}
     }
-    double limitAll = m_pwr*THRESHOLD2_REL_ALL;
+    double limitAll = pwr*THRESHOLD2_REL_ALL;
     double limitOne = limitAll*THRESHOLD2_REL_DTMF;
     if (c) {
 	limitAll *= THRESHOLD2_REL_HIST;
@@ -313,7 +453,7 @@ void ToneConsumer::checkDtmf()
 #ifdef DEBUG
 	if (c)
 	    Debug(&plugin,DebugInfo,"Giving up DTMF '%c' lo=%0.1f, hi=%0.1f, total=%0.1f",
-		c,maxL,maxH,m_pwr);
+		c,maxL,maxH,pwr);
 #endif
 	return;
     }
@@ -322,18 +462,18 @@ void ToneConsumer::checkDtmf()
     buf[1] = '\0';
     if (buf[0] != c) {
 	DDebug(&plugin,DebugInfo,"DTMF '%s' new candidate on %s, lo=%0.1f, hi=%0.1f, total=%0.1f",
-	    buf,m_id.c_str(),maxL,maxH,m_pwr);
+	    buf,m_id.c_str(),maxL,maxH,pwr);
 	m_dtmfTone = buf[0];
 	m_dtmfCount = 1;
 	return;
     }
     m_dtmfTone = c;
     XDebug(&plugin,DebugAll,"DTMF '%s' candidate %d on %s, lo=%0.1f, hi=%0.1f, total=%0.1f",
-	buf,m_dtmfCount,m_id.c_str(),maxL,maxH,m_pwr);
-    if (m_dtmfCount++ == DETECT_DTMF_MSEC) {
+	buf,m_dtmfCount,m_id.c_str(),maxL,maxH,pwr);
+    if (m_dtmfCount++ == m_dtmfChecks) {
 	DDebug(&plugin,DebugNote,"%sDTMF '%s' detected on %s, lo=%0.1f, hi=%0.1f, total=%0.1f",
 	    (m_detDnis ? "DNIS/" : ""),
-	    buf,m_id.c_str(),maxL,maxH,m_pwr);
+	    buf,m_id.c_str(),maxL,maxH,pwr);
 	if (m_detDnis) {
 	    static Regexp r("^\\*\\([0-9#]*\\)\\*\\([0-9#]*\\)\\*$");
 	    m_dnis += buf;
@@ -360,18 +500,23 @@ void ToneConsumer::checkDtmf()
 }
 
 // Check if we detected a Fax CNG tone
-void ToneConsumer::checkFax()
+void ToneConsumer::checkFax(double fax, double pwr)
 {
-    if (m_fax.value() < m_pwr*THRESHOLD2_REL_FAX)
+    if (fax < pwr*THRESHOLD2_REL_FAX) {
+	m_faxCount = 0;
 	return;
-    if (m_fax.value() > m_pwr) {
+    }
+    // a block transform has no ringing, only the filters can overshoot
+    if (!m_block && (fax > pwr)) {
 	DDebug(&plugin,DebugNote,"Overshoot on %s, signal=%0.2f, total=%0.2f",
-	    m_id.c_str(),m_fax.value(),m_pwr);
+	    m_id.c_str(),fax,pwr);
 	init();
 	return;
     }
+    if (++m_faxCount < m_faxChecks)
+	return;
     DDebug(&plugin,DebugInfo,"Fax detected on %s, signal=%0.1f, total=%0.1f",
-	m_id.c_str(),m_fax.value(),m_pwr);
+	m_id.c_str(),fax,pwr);
     // prepare for new detection
     init();
     m_detFax = false;
@@ -389,6 +534,51 @@ void ToneConsumer::checkFax()
     Engine::enqueue(m);
 }
 
+// Check the results of a complete Goertzel block
+void ToneConsumer::checkBlock()
+{
+    double pwr = m_goertzel.power();
+    // is it enough total power to accept a signal?
+    if (pwr >= THRESHOLD2_ABS) {
+	const double* val = m_goertzel.values();
+	if (m_detDtmf || m_detDnis)
+	    checkDtmf(val,val + 4,pwr);
+	if (m_detFax)
+	    checkFax(val[BLOCK_FAX],pwr);
+    }
+    else {
+	m_dtmfTone = '\0';
+	m_dtmfCount = 0;
+	m_faxCount = 0;
+    }
+}
+
+// Extract one sample according to the channel mode
+static inline int getSample(const int16_t*& s, ToneConsumer::Mode mode)
+{
+    int x;
+    switch (mode) {
+	case ToneConsumer::Left:
+	    // use 1st sample, skip 2nd
+	    x = *s++;
+	    s++;
+	    break;
+	case ToneConsumer::Right:
+	    // skip 1st sample, use 2nd
+	    s++;
+	    x = *s++;
+	    break;
+	case ToneConsumer::Mixed:
+	    // add together samples
+	    x = s[0]+(int)s[1];
+	    s+=2;
+	    break;
+	default:
+	    x = *s++;
+    }
+    return x;
+}
+
 // Feed samples to the filter(s)
 void ToneConsumer::Consume(const DataBlock& data, unsigned long timeDelta)
 {
@@ -400,27 +590,18 @@ void ToneConsumer::Consume(const DataBlock& data, unsigned long timeDelta)
     const int16_t* s = (const int16_t*)data.data();
     if (!s)
 	return;
+    if (m_block) {
+	while (samp--) {
+	    if (m_goertzel.push(getSample(s,m_mode))) {
+		m_goertzel.process();
+		checkBlock();
+	    }
+	}
+	return;
+    }
     while (samp--) {
 	m_xv[0] = m_xv[1]; m_xv[1] = m_xv[2];
-	switch (m_mode) {
-	    case Left:
-		// use 1st sample, skip 2nd
-		m_xv[2] = *s++;
-		s++;
-		break;
-	    case Right:
-		// skip 1st sample, use 2nd
-		s++;
-		m_xv[2] = *s++;
-		break;
-	    case Mixed:
-		// add together samples
-		m_xv[2] = s[0]+(int)s[1];
-		s+=2;
-		break;
-	    default:
-		m_xv[2] = *s++;
-	}
+	m_xv[2] = getSample(s,m_mode);
 	double dx = m_xv[2] - m_xv[0];
 	updatePwr(m_pwr,m_xv[2]);
 
@@ -438,10 +619,17 @@ void ToneConsumer::Consume(const DataBlock& data, unsigned long timeDelta)
 	    continue;
 	// is it enough total power to accept a signal?
 	if (m_pwr >= THRESHOLD2_ABS) {
-	    if (m_detDtmf || m_detDnis)
-		checkDtmf();
+	    if (m_detDtmf || m_detDnis) {
+		double lo[4];
+		double hi[4];
+		for (int j = 0; j < 4; j++) {
+		    lo[j] = m_dtmfL[j].value();
+		    hi[j] = m_dtmfH[j].value();
+		}
+		checkDtmf(lo,hi,m_pwr);
+	    }
 	    if (m_detFax)
-		checkFax();
+		checkFax(m_fax.value(),m_pwr);
 	}
 	else {
 	    m_dtmfTone = '\0';
@@ -488,7 +676,7 @@ bool AttachHandler::received(Message& msg)
     DataSource* ds = static_cast<DataSource *>(msg.userObject("DataSource"));
     if (ch) {
 	if (cons) {
-	    ToneConsumer* c = new ToneConsumer(ch->id(),cons);
+	    ToneConsumer* c = new ToneConsumer(ch->id(),cons,msg.getValue("detector"));
 	    c->setDivert(msg);
 	    ch->setConsumer(c);
 	    c->deref();
@@ -502,7 +690,7 @@ bool AttachHandler::received(Message& msg)
 		c->setDivert(msg);
 	    }
 	    else {
-		c = new ToneConsumer(ch->id(),snif);
+		c = new ToneConsumer(ch->id(),snif,msg.getValue("detector"));
 		c->setDivert(msg);
 		de->addSniffer(c);
 		c->deref();
@@ -511,7 +699,7 @@ bool AttachHandler::received(Message& msg)
 	return msg.getBoolValue("single");
     }
     else if (ds && cons) {
-	ToneConsumer* c = new ToneConsumer(msg.getValue("id"),cons);
+	ToneConsumer* c = new ToneConsumer(msg.getValue("id"),cons,msg.getValue("detector"));
 	c->setDivert(msg);
 	bool ok = DataTranslator::attachChain(ds,c);
 	if (ok)
@@ -542,7 +730,7 @@ bool RecordHandler::received(Message& msg)
 	    de = ch->setEndpoint();
     }
     if (de) {
-	ToneConsumer* c = new ToneConsumer(id,src);
+	ToneConsumer* c = new ToneConsumer(id,src,msg.getValue("detector"));
 	c->setDivert(msg);
 	de->setCallRecord(c);
 	c->deref();
@@ -568,12 +756,15 @@ ToneDetectorModule::~ToneDetectorModule()
 void ToneDetectorModule::statusParams(String& str)
 {
     str.append("count=",",") << s_count;
+    str << ",detector=" << (s_block ? "goertzel" : "filter");
 }
 
 void ToneDetectorModule::initialize()
 {
     Output("Initializing module ToneDetector");
     setup();
+    Configuration cfg(Engine::configFile("tonedetect"));
+    s_block = (String(cfg.getValue("general","detector","goertzel")) != "filter");
     if (m_first) {
 	m_first = false;
 	Engine::install(new AttachHandler);
@@ -36,11 +36,18 @@
 #define DTMF_LEN 960
 #define DTMF_GAP 320
 
+// longest looping cadence we try to render without a phase jump, in samples
+#define MAX_LOOP 240000
+// how many cadence restarts we remember while looking for the loop point
+#define MAX_RESTARTS 64
+
 using namespace TelEngine;
 namespace { // anonymous
 
 static ObjList tones;
 static ObjList datas;
+static ObjList buffers;
+static Mutex s_bufMutex;
 
 typedef struct {
     int nsamples;
@@ -87,27 +94,71 @@ private:
     const short* m_data;
 };
 
+// A cadence rendered once in one format, shared by all sources playing it
+class ToneBuffer : public RefObject
+{
+public:
+    virtual ~ToneBuffer();
+    virtual const String& toString() const
+	{ return m_name; }
+    inline const unsigned char* data() const
+	{ return (const unsigned char*)m_data.data(); }
+    inline unsigned int frame() const
+	{ return m_frame; }
+    inline unsigned int sampleBytes() const
+	{ return m_sampleBytes; }
+    inline unsigned int loop() const
+	{ return m_loop; }
+    inline unsigned int end() const
+	{ return m_end; }
+    inline bool looping() const
+	{ return m_looping; }
+    static ToneBuffer* get(const Tone* tone, int repeat, const String& format);
+private:
+    ToneBuffer(const String& name);
+    bool render(const Tone* tone, int repeat, const String& format);
+    String m_name;
+    DataBlock m_data;
+    unsigned int m_frame;
+    unsigned int m_sampleBytes;
+    unsigned int m_loop;
+    unsigned int m_end;
+    bool m_looping;
+};
+
+// Consumer collecting the output of a translator while rendering tones
+class ToneCollector : public DataConsumer
+{
+public:
+    inline ToneCollector(const String& format)
+	: DataConsumer(format)
+	{ }
+    virtual void Consume(const DataBlock& data, unsigned long tStamp)
+	{ m_data += data; }
+    DataBlock m_data;
+};
+
 class ToneSource : public ThreadedSource
 {
 public:
     virtual void destroyed();
-    virtual void run();
     inline const String& name()
 	{ return m_name; }
     bool startup();
-    static ToneSource* getTone(String& tone);
+    static ToneSource* getTone(String& tone, const String& format = "slin");
     static const ToneDesc* getBlock(String& tone);
     static Tone* buildCadence(const String& desc);
     static Tone* buildDtmf(const String& dtmf, int len = DTMF_LEN, int gap = DTMF_GAP);
 protected:
-    ToneSource(const ToneDesc* tone = 0);
+    ToneSource(const ToneDesc* tone = 0, const char* format = "slin");
     virtual void zeroRefs();
+    virtual bool tick(u_int64_t when);
     String m_name;
     const Tone* m_tone;
     int m_repeat;
 private:
-    DataBlock m_data;
-    unsigned m_brate;
+    ToneBuffer* m_buffer;
+    unsigned int m_pos;
     unsigned m_total;
     u_int64_t m_time;
 };
@@ -115,7 +166,7 @@ private:
 class TempSource : public ToneSource
 {
 public:
-    TempSource(String& desc, DataBlock* rawdata);
+    TempSource(String& desc, DataBlock* rawdata, const char* format = "slin");
     virtual ~TempSource();
 protected:
     virtual void cleanup();
@@ -127,7 +178,7 @@ private:
 class ToneChan : public Channel
 {
 public:
-    ToneChan(String& tone);
+    ToneChan(String& tone, const String& format);
     ~ToneChan();
 };
 
@@ -299,6 +350,107 @@ static unsigned int byteRate(u_int64_t time, unsigned int bytes)
     return (unsigned int)((bytes*(u_int64_t)1000000 + time/2) / time);
 }
 
+// Pick a format we can render in that needs no translation for the consumer
+static String toneFormat(const DataConsumer* cons)
+{
+    if (cons) {
+	const String& fmt = cons->getFormat();
+	if ((fmt == "alaw") || (fmt == "mulaw"))
+	    return fmt;
+    }
+    return "slin";
+}
+
+// Run the cadence state machine, store samples in out if not NULL
+// Returns the number of samples up to the end or to the loop point
+static unsigned int renderTone(const Tone* tone, int repeat, short* out, int& loop)
+{
+    const Tone* start = tone;
+    const Tone* play = tone;
+    int nsam = play->nsamples;
+    if (nsam < 0)
+	nsam = -nsam;
+    int samp = 0;
+    int dpos = 1;
+    unsigned int n = 0;
+    // cadence restarts seen so far, a repeated one closes the loop
+    unsigned int rPos[MAX_RESTARTS];
+    const Tone* rTone[MAX_RESTARTS];
+    int rDpos[MAX_RESTARTS];
+    unsigned int restarts = 0;
+    if (!repeat) {
+	// the initial state is the first restart point
+	rPos[0] = 0;
+	rTone[0] = tone;
+	rDpos[0] = 1;
+	restarts = 1;
+    }
+    loop = -1;
+    for (;;) {
+	if (samp >= nsam) {
+	    // go to the start of the next tone
+	    samp = 0;
+	    const Tone* otone = play;
+	    play++;
+	    bool wrap = false;
+	    if (!play->nsamples) {
+		if ((repeat > 0) && !(--repeat))
+		    start = 0;
+		play = start;
+		wrap = true;
+	    }
+	    if (!play)
+		break;
+	    nsam = play->nsamples;
+	    if (nsam < 0) {
+		nsam = -nsam;
+		// reset repeat point here
+		start = play;
+	    }
+	    if (play != otone)
+		dpos = 1;
+	    if (wrap && !repeat) {
+		if (!(play->data && (dpos <= play->data[0])))
+		    dpos = 1;
+		bool full = (n >= MAX_LOOP) || (restarts >= MAX_RESTARTS);
+		for (unsigned int i = 0; i < restarts; i++) {
+		    // when out of room accept a phase jump at the loop point
+		    if ((rTone[i] == play) && (full || (rDpos[i] == dpos))) {
+			loop = rPos[i];
+			break;
+		    }
+		}
+		if (loop >= 0)
+		    break;
+		if (full) {
+		    // no earlier start of this element, loop just this cycle
+		    loop = rPos[restarts - 1];
+		    break;
+		}
+		rPos[restarts] = n;
+		rTone[restarts] = play;
+		rDpos[restarts] = dpos;
+		restarts++;
+	    }
+	}
+	if (out) {
+	    if (play->data) {
+		if (dpos > play->data[0])
+		    dpos = 1;
+		out[n] = play->data[dpos];
+	    }
+	    else
+		out[n] = 0;
+	}
+	else if (play->data && (dpos > play->data[0]))
+	    dpos = 1;
+	n++;
+	samp++;
+	dpos++;
+    }
+    return n;
+}
+
 
 ToneData::ToneData(const char* desc)
     : m_f1(0), m_f2(0), m_mod(false), m_data(0)
@@ -426,16 +578,123 @@ ToneData* ToneData::getData(const char* desc)
 }
 
 
-ToneSource::ToneSource(const ToneDesc* tone)
-    : m_tone(0), m_repeat(tone == 0),
-      m_data(0,320), m_brate(16000), m_total(0), m_time(0)
+ToneBuffer::ToneBuffer(const String& name)
+    : m_name(name), m_frame(0), m_sampleBytes(0), m_loop(0), m_end(0), m_looping(false)
+{
+    DDebug(&__plugin,DebugAll,"ToneBuffer::ToneBuffer(\"%s\") [%p]",name.c_str(),this);
+}
+
+ToneBuffer::~ToneBuffer()
+{
+    DDebug(&__plugin,DebugAll,"ToneBuffer::~ToneBuffer() '%s' [%p]",m_name.c_str(),this);
+}
+
+// Render a cadence in slin, convert to the requested format
+bool ToneBuffer::render(const Tone* tone, int repeat, const String& format)
+{
+    const FormatInfo* fi = FormatRepository::getFormat(format);
+    // tone data is made for 8kHz mono
+    if (!(fi && (fi->sampleRate == 8000) && (fi->numChannels == 1)))
+	return false;
+    m_sampleBytes = fi->dataRate() / fi->sampleRate;
+    if (!m_sampleBytes || (fi->dataRate() % fi->sampleRate))
+	return false;
+    // frames are 20ms long
+    unsigned int fSamples = fi->sampleRate / 50;
+    int loop = -1;
+    unsigned int end = renderTone(tone,repeat,0,loop);
+    if (!end)
+	return false;
+    // a looping buffer gets one frame from the loop start appended after the
+    //  end so any frame can be sent as one slice, a finite one is padded
+    m_looping = (loop >= 0);
+    unsigned int total = m_looping ? (end + fSamples) :
+	(((end + fSamples - 1) / fSamples) * fSamples);
+    DataBlock lin(0,total * sizeof(short));
+    short* d = (short*)lin.data();
+    renderTone(tone,repeat,d,loop);
+    if (m_looping) {
+	for (unsigned int i = end; i < total; i++)
+	    d[i] = d[loop + (i - end) % (end - loop)];
+    }
+    else
+	loop = end = total;
+    if (format == "slin")
+	m_data = lin;
+    else {
+	DataTranslator* trans = DataTranslator::create("slin",format);
+	if (!trans)
+	    return false;
+	DataSource* src = new DataSource("slin");
+	DataTranslator* first = trans->getFirstTranslator();
+	src->attach(first);
+	first->deref();
+	ToneCollector* col = new ToneCollector(format);
+	trans->getTransSource()->attach(col);
+	src->Forward(lin);
+	m_data = col->m_data;
+	trans->getTransSource()->detach(col);
+	col->deref();
+	src->clear();
+	src->deref();
+	if (m_data.length() != total * m_sampleBytes) {
+	    Debug(&__plugin,DebugWarn,"Rendering '%s' produced %u bytes instead of %u [%p]",
+		m_name.c_str(),m_data.length(),total * m_sampleBytes,this);
+	    return false;
+	}
+    }
+    m_frame = fSamples * m_sampleBytes;
+    m_loop = loop * m_sampleBytes;
+    m_end = end * m_sampleBytes;
+    Debug(&__plugin,DebugAll,"Rendered tone '%s' %u bytes, loop %d-%u [%p]",
+	m_name.c_str(),m_data.length(),(m_looping ? (int)m_loop : -1),m_end,this);
+    return true;
+}
+
+// Get a referenced buffer for a cadence, shared if it is a named tone
+ToneBuffer* ToneBuffer::get(const Tone* tone, int repeat, const String& format)
+{
+    if (!tone)
+	return 0;
+    String name;
+    if ((repeat == 0) || (repeat == 1)) {
+	for (const ToneDesc* d = s_desc; d->tone; d++) {
+	    if (d->tone == tone) {
+		name << d->name << "/" << format;
+		if (repeat)
+		    name << "/once";
+		break;
+	    }
+	}
+    }
+    Lock lock(s_bufMutex);
+    if (name) {
+	ToneBuffer* buf = static_cast<ToneBuffer*>(buffers[name]);
+	if (buf && buf->ref())
+	    return buf;
+    }
+    ToneBuffer* buf = new ToneBuffer(name);
+    if (!buf->render(tone,repeat,format)) {
+	buf->deref();
+	return 0;
+    }
+    if (name && buf->ref())
+	buffers.append(buf);
+    return buf;
+}
+
+
+ToneSource::ToneSource(const ToneDesc* tone, const char* format)
+    : ThreadedSource(format),
+      m_tone(0), m_repeat(tone == 0),
+      m_buffer(0), m_pos(0), m_total(0), m_time(0)
 {
     if (tone) {
 	m_tone = tone->tone;
 	m_name = tone->name;
     }
-    Debug(&__plugin,DebugAll,"ToneSource::ToneSource(%p) '%s' [%p]",
-	tone,m_name.c_str(),this);
+    Debug(&__plugin,DebugAll,"ToneSource::ToneSource(%p,\"%s\") '%s' [%p]",
+	tone,format,m_name.c_str(),this);
     asyncDelete(true);
 }
 
@@ -444,6 +703,7 @@ void ToneSource::destroyed()
     Debug(&__plugin,DebugAll,"ToneSource::destroyed() '%s' [%p] total=%u stamp=%lu",
 	m_name.c_str(),this,m_total,timeStamp());
     ThreadedSource::destroyed();
+    TelEngine::destruct(m_buffer);
     if (m_time)
 	Debug(&__plugin,DebugInfo,"ToneSource rate=%u b/s",byteRate(m_time,m_total));
 }
@@ -460,7 +720,15 @@ void ToneSource::zeroRefs()
 bool ToneSource::startup()
 {
     DDebug(&__plugin,DebugAll,"ToneSource::startup(\"%s\") tone=%p",m_name.c_str(),m_tone);
-    return m_tone && start("ToneSource");
+    if (!m_tone)
+	return false;
+    if (!m_buffer)
+	m_buffer = ToneBuffer::get(m_tone,m_repeat,getFormat());
+    if (!m_buffer)
+	return false;
+    m_time = Time::now();
+    // all tones are paced by the shared media clock
+    return startClock(20000,"ToneSource");
 }
 
 const ToneDesc* ToneSource::getBlock(String& tone)
@@ -526,83 +794,48 @@ Tone* ToneSource::buildDtmf(const String& dtmf, int len, int gap)
     return tmp;
 }
 
-ToneSource* ToneSource::getTone(String& tone)
+ToneSource* ToneSource::getTone(String& tone, const String& format)
 {
     const ToneDesc* td = ToneSource::getBlock(tone);
     // tone name is now canonical
     ObjList* l = &tones;
     for (; l; l = l->next()) {
 	ToneSource* t = static_cast<ToneSource*>(l->get());
-	if (t && (t->name() == tone) && t->ref())
+	if (t && (t->name() == tone) && (t->getFormat() == format) && t->ref())
 	    return t;
     }
-    ToneSource* t = new ToneSource(td);
+    ToneSource* t = new ToneSource(td,format);
     tones.append(t);
     t->startup();
     return t;
 }
 
-void ToneSource::run()
+bool ToneSource::tick(u_int64_t when)
 {
-    Debug(&__plugin,DebugAll,"ToneSource::run() [%p]",this);
-    u_int64_t tpos = Time::now();
-    m_time = tpos;
-    int samp = 0; // sample number
-    int dpos = 1; // position in data
-    const Tone* tone = m_tone;
-    int nsam = tone->nsamples;
-    if (nsam < 0)
-	nsam = -nsam;
-    while (alive() && m_tone) {
-	Thread::check();
-	short *d = (short *) m_data.data();
-	for (unsigned int i = m_data.length()/2; i--; samp++,dpos++) {
-	    if (samp >= nsam) {
-		// go to the start of the next tone
-		samp = 0;
-		const Tone *otone = tone;
-		tone++;
-		if (!tone->nsamples) {
-		    if ((m_repeat > 0) && !(--m_repeat))
-			m_tone = 0;
-		    tone = m_tone;
-		}
-		nsam = tone ? tone->nsamples : 32000;
-		if (nsam < 0) {
-		    nsam = -nsam;
-		    // reset repeat point here
-		    m_tone = tone;
-		}
-		if (tone != otone)
-		    dpos = 1;
-	    }
-	    if (tone && tone->data) {
-		if (dpos > tone->data[0])
-		    dpos = 1;
-		*d++ = tone->data[dpos];
-	    }
-	    else
-		*d++ = 0;
-	}
-	int64_t dly = tpos - Time::now();
-	if (dly > 0) {
-	    XDebug(&__plugin,DebugAll,"ToneSource sleeping for " FMT64 " usec",dly);
-	    Thread::usleep((unsigned long)dly);
+    if (m_pos >= m_buffer->end()) {
+	if (!m_buffer->looping()) {
+	    Debug(&__plugin,DebugAll,"ToneSource [%p] end, total=%u (%u b/s)",
+		this,m_total,byteRate(m_time,m_total));
+	    m_time = 0;
+	    return false;
 	}
-	Forward(m_data,m_total/2);
-	m_total += m_data.length();
-	tpos += (m_data.length()*(u_int64_t)1000000/m_brate);
+	m_pos -= m_buffer->end() - m_buffer->loop();
     }
-    Debug(&__plugin,DebugAll,"ToneSource [%p] end, total=%u (%u b/s)",
-	this,m_total,byteRate(m_time,m_total));
-    m_time = 0;
+    // send a slice of the shared buffer, it is never modified
+    DataBlock data((void*)(m_buffer->data() + m_pos),m_buffer->frame(),false);
+    Forward(data,m_total / m_buffer->sampleBytes());
+    data.clear(false);
+    m_pos += m_buffer->frame();
+    m_total += m_buffer->frame();
+    return true;
 }
 
 
-TempSource::TempSource(String& desc, DataBlock* rawdata)
-    : m_single(0), m_rawdata(rawdata)
+TempSource::TempSource(String& desc, DataBlock* rawdata, const char* format)
+    : ToneSource(0,format),
+      m_single(0), m_rawdata(rawdata)
 {
-    Debug(&__plugin,DebugAll,"TempSource::TempSource(\"%s\") [%p]",desc.c_str(),this);
+    Debug(&__plugin,DebugAll,"TempSource::TempSource(\"%s\",\"%s\") [%p]",desc.c_str(),format,this);
     if (desc.null())
 	return;
     if (desc.startSkip("*",false))
@@ -668,13 +901,14 @@ void TempSource::cleanup()
 }
 
 
-ToneChan::ToneChan(String& tone)
+ToneChan::ToneChan(String& tone, const String& format)
     : Channel(__plugin)
 {
-    Debug(this,DebugAll,"ToneChan::ToneChan(\"%s\") [%p]",tone.c_str(),this);
+    Debug(this,DebugAll,"ToneChan::ToneChan(\"%s\",\"%s\") [%p]",
+	tone.c_str(),format.c_str(),this);
     // protect the list while the new tone source is added to it
     __plugin.lock();
-    ToneSource* t = ToneSource::getTone(tone);
+    ToneSource* t = ToneSource::getTone(tone,format);
     __plugin.unlock();
     if (t) {
 	setSource(t);
@@ -736,7 +970,7 @@ bool AttachHandler::received(Message& msg)
 
     Lock lock(__plugin);
     if (src) {
-	ToneSource* t = ToneSource::getTone(src);
+	ToneSource* t = ToneSource::getTone(src,toneFormat(de->getConsumer()));
 	if (t) {
 	    de->setSource(t);
 	    t->deref();
@@ -750,7 +984,7 @@ bool AttachHandler::received(Message& msg)
     if (ovr) {
 	DataConsumer* c = de->getConsumer();
 	if (c) {
-	    TempSource* t = new TempSource(ovr,getRawData(msg));
+	    TempSource* t = new TempSource(ovr,getRawData(msg),toneFormat(c));
 	    if (DataTranslator::attachChain(t,c,true) && t->startup())
 		msg.clearParam("override");
 	    else {
@@ -766,7 +1000,7 @@ bool AttachHandler::received(Message& msg)
     if (repl) {
 	DataConsumer* c = de->getConsumer();
 	if (c) {
-	    TempSource* t = new TempSource(repl,getRawData(msg));
+	    TempSource* t = new TempSource(repl,getRawData(msg),toneFormat(c));
 	    if (DataTranslator::attachChain(t,c,false) && t->startup())
 		msg.clearParam("replace");
 	    else {
@@ -787,7 +1021,8 @@ bool ToneGenDriver::msgExecute(Message& msg, String& dest)
 {
     CallEndpoint* ch = static_cast<CallEndpoint*>(msg.userData());
     if (ch) {
-	ToneChan *tc = new ToneChan(dest);
+	DataEndpoint* de = ch->getEndpoint();
+	ToneChan *tc = new ToneChan(dest,toneFormat(de ? de->getConsumer() : 0));
 	if (ch->connect(tc,msg.getValue("reason"))) {
 	    tc->callConnect(msg);
 	    msg.setParam("peerid",tc->id());
@@ -827,7 +1062,7 @@ bool ToneGenDriver::msgExecute(Message& msg, String& dest)
 	}
 	m = "call.execute";
 	m.setParam("callto",callto);
-	ToneChan *tc = new ToneChan(dest);
+	ToneChan *tc = new ToneChan(dest,"slin");
 	m.setParam("id",tc->id());
 	m.userData(tc);
 	if (Engine::dispatch(m)) {
@@ -849,7 +1084,8 @@ void ToneGenDriver::statusModule(String& str)
 
 void ToneGenDriver::statusParams(String& str)
 {
-    str << "tones=" << tones.count() << ",chans=" << channels().count();
+    str << "tones=" << tones.count() << ",buffers=" << buffers.count()
+	<< ",chans=" << channels().count();
 }
 
 ToneGenDriver::ToneGenDriver()
@@ -873,6 +1109,9 @@ ToneGenDriver::~ToneGenDriver()
     channels().clear();
     tones.clear();
     unlock();
+    s_bufMutex.lock();
+    buffers.clear();
+    s_bufMutex.unlock();
 }
 
 void ToneGenDriver::initialize()
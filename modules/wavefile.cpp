@@ -27,18 +27,107 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <stdlib.h>
 #include <fcntl.h>
+
+#ifndef _WINDOWS
+#include <sys/uio.h>
+#endif
 #include <errno.h>
 
 using namespace TelEngine;
 namespace { // anonymous
 
+// A prompt file loaded in memory, header stripped and byte swapped once
+class WavePrompt : public RefObject
+{
+public:
+    virtual ~WavePrompt();
+    virtual const String& toString() const
+	{ return m_file; }
+    inline const unsigned char* data() const
+	{ return (const unsigned char*)m_data.data(); }
+    inline unsigned int length() const
+	{ return m_data.length(); }
+    inline const String& format() const
+	{ return m_format; }
+    inline unsigned int rate() const
+	{ return m_brate; }
+    static WavePrompt* find(const String& file);
+    static WavePrompt* load(const String& file, int fd, const String& format,
+	unsigned int brate, bool swap);
+    static void status(String& str);
+    static void clear();
+private:
+    WavePrompt(const String& file, const String& format, unsigned int brate);
+    bool read(int fd, off_t offs, off_t len, bool swap);
+    String m_file;
+    String m_format;
+    unsigned int m_brate;
+    time_t m_mtime;
+    off_t m_size;
+    DataBlock m_data;
+};
+
+// A recorded file buffered in memory and written out by the writer threads
+class WaveWriter : public RefObject
+{
+public:
+    virtual ~WaveWriter();
+    virtual const String& toString() const
+	{ return m_file; }
+    bool put(const void* data, unsigned int len, bool swap = false);
+    void close(unsigned int auHeader = 0);
+    bool service(bool force = false);
+    static WaveWriter* create(int fd, const String& file);
+    static void status(String& str);
+    static void flushAll();
+    inline unsigned int drops()
+	{ Lock lock(m_mutex); return m_drops; }
+    inline unsigned int fill()
+	{ Lock lock(m_mutex); return m_fill; }
+    // claimed by a writer thread, protected by the list mutex
+    bool m_busy;
+private:
+    WaveWriter(int fd, const String& file, unsigned int size);
+    void write(unsigned int len);
+    void finish();
+    String m_file;
+    Mutex m_mutex;
+    int m_fd;
+    unsigned char* m_buf;
+    unsigned int m_size;
+    unsigned int m_head;
+    unsigned int m_tail;
+    unsigned int m_fill;
+    u_int64_t m_first;
+    u_int64_t m_offset;
+    u_int64_t m_advised;
+    unsigned int m_auHeader;
+    bool m_closing;
+    bool m_failed;
+    unsigned int m_drops;
+};
+
+// Thread that drains the buffers of recorded files
+class WaveWriterThread : public Thread
+{
+public:
+    inline WaveWriterThread()
+	: Thread("WaveWriter"), m_counted(true)
+	{ }
+    virtual void run();
+    virtual void cleanup();
+private:
+    bool m_counted;
+};
+
 class WaveSource : public ThreadedSource
 {
 public:
     static WaveSource* create(const String& file, CallEndpoint* chan, bool autoclose = true, bool autorepeat = false);
     ~WaveSource();
-    virtual void run();
+    virtual bool tick(u_int64_t when);
     virtual void cleanup();
     virtual bool zeroRefsTest();
     void setNotify(const String& id);
@@ -64,7 +153,10 @@ private:
     bool m_autoclean;
     bool m_nodata;
     bool m_insert;
+    bool m_done;
     volatile bool m_derefOk;
+    WavePrompt* m_prompt;
+    unsigned int m_pos;
 };
 
 class WaveConsumer : public DataConsumer
@@ -82,10 +174,14 @@ public:
     inline void setNotify(const String& id)
 	{ m_id = id; }
 private:
-    void writeIlbcHeader() const;
+    void writeIlbcHeader();
     void writeAuHeader();
+    void writeData(const void* data, unsigned int len, bool swap = false);
+    void closeFile();
     CallEndpoint* m_chan;
     int m_fd;
+    WaveWriter* m_writer;
+    unsigned int m_auHeader;
     bool m_swap;
     bool m_locked;
     Header m_header;
@@ -134,8 +230,12 @@ class WaveFileDriver : public Driver
 {
 public:
     WaveFileDriver();
+    virtual ~WaveFileDriver();
     virtual void initialize();
     virtual bool msgExecute(Message& msg, String& dest);
+protected:
+    virtual bool received(Message& msg, int id);
+    virtual void statusParams(String& str);
 private:
     AttachHandler* m_handler;
 };
@@ -144,6 +244,47 @@ bool s_asyncDelete = true;
 bool s_dataPadding = true;
 bool s_pubReadable = false;
 
+// prompt cache limits in bytes, a zero size disables the cache
+static unsigned int s_cacheSize = 0;
+static unsigned int s_cacheFile = 0;
+// prompts kept in memory, most recently used first
+static ObjList s_prompts;
+static unsigned int s_cacheUsed = 0;
+static unsigned int s_cacheHits = 0;
+static unsigned int s_cacheMiss = 0;
+static Mutex s_cacheMutex;
+
+// recording writer threads, with none files are written by the media thread
+static int s_recThreads = 1;
+static int s_recRunning = 0;
+// per file buffer, largest single write and age of data kept in memory
+static unsigned int s_recBuffer = 131072;
+static unsigned int s_recBatch = 65536;
+static u_int64_t s_recFlush = 1000000;
+static int s_recSync = 0;
+static bool s_recAdvise = true;
+// files being recorded through the writer threads
+static ObjList s_writers;
+static unsigned int s_writerCount = 0;
+static unsigned int s_recDrops = 0;
+static unsigned int s_recErrors = 0;
+static bool s_recStop = false;
+static Mutex s_writeMutex;
+
+// when to flush recorded data to the disk
+enum {
+    SyncNone = 0,
+    SyncClose,
+    SyncWrite,
+};
+
+static const TokenDict s_syncModes[] = {
+    { "none", SyncNone },
+    { "close", SyncClose },
+    { "write", SyncWrite },
+    { 0, 0 }
+};
+
 #if defined (S_IRGRP) && defined(S_IROTH)
 #define CREATE_MODE (S_IRUSR|S_IWUSR|(s_pubReadable?(S_IRGRP|S_IROTH):0))
 #else
@@ -165,6 +306,488 @@ typedef struct {
 #define ILBC_HEADER_LEN 9
 
 
+WavePrompt::WavePrompt(const String& file, const String& format, unsigned int brate)
+    : m_file(file), m_format(format), m_brate(brate), m_mtime(0), m_size(0)
+{
+    DDebug(&__plugin,DebugAll,"WavePrompt::WavePrompt(\"%s\",\"%s\") [%p]",
+	file.c_str(),format.c_str(),this);
+}
+
+WavePrompt::~WavePrompt()
+{
+    DDebug(&__plugin,DebugAll,"WavePrompt::~WavePrompt() '%s' [%p]",m_file.c_str(),this);
+}
+
+// Copy the data part of an open file, a mapping would fault if truncated
+bool WavePrompt::read(int fd, off_t offs, off_t len, bool swap)
+{
+    if (len <= 0)
+	return false;
+    m_data.assign(0,(unsigned int)len);
+    if (::lseek(fd,offs,SEEK_SET) != offs)
+	return false;
+    unsigned char* d = (unsigned char*)m_data.data();
+    unsigned int got = 0;
+    while (got < m_data.length()) {
+	int r = ::read(fd,d + got,m_data.length() - got);
+	if (r < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return false;
+	}
+	if (!r)
+	    break;
+	got += r;
+    }
+    if (!got)
+	return false;
+    if (got < m_data.length())
+	m_data.assign(d,got);
+    if (swap) {
+	uint16_t* p = (uint16_t*)m_data.data();
+	for (unsigned int i = 0; i < got; i += 2) {
+	    *p = ntohs(*p);
+	    ++p;
+	}
+    }
+    return true;
+}
+
+// Find a cached prompt that is still current, returns a new reference
+WavePrompt* WavePrompt::find(const String& file)
+{
+    if (!s_cacheSize)
+	return 0;
+    Lock lock(s_cacheMutex);
+    ObjList* l = s_prompts.find(file);
+    if (!l) {
+	s_cacheMiss++;
+	return 0;
+    }
+    WavePrompt* p = static_cast<WavePrompt*>(l->get());
+    struct stat st;
+    if (::stat(file.safe(),&st) || (st.st_mtime != p->m_mtime) || (st.st_size != p->m_size)) {
+	Debug(&__plugin,DebugInfo,"Prompt '%s' changed on disk, dropping from cache",file.c_str());
+	s_cacheUsed -= p->length();
+	s_cacheMiss++;
+	l->remove();
+	return 0;
+    }
+    // move to the head of the list as most recently used
+    if (l != s_prompts.skipNull()) {
+	l->remove(false);
+	s_prompts.insert(p);
+    }
+    s_cacheHits++;
+    return p->ref() ? p : 0;
+}
+
+// Load the rest of an open file in a new prompt, cache it if it fits
+WavePrompt* WavePrompt::load(const String& file, int fd, const String& format,
+    unsigned int brate, bool swap)
+{
+    if (!s_cacheSize)
+	return 0;
+    struct stat st;
+    if (::fstat(fd,&st))
+	return 0;
+    off_t offs = ::lseek(fd,0,SEEK_CUR);
+    off_t len = st.st_size - offs;
+    // big files are streamed from disk
+    if ((offs < 0) || (len <= 0) || (len > (off_t)s_cacheFile) || (len > (off_t)s_cacheSize))
+	return 0;
+    WavePrompt* p = new WavePrompt(file,format,brate);
+    p->m_mtime = st.st_mtime;
+    p->m_size = st.st_size;
+    if (!p->read(fd,offs,len,swap)) {
+	Debug(&__plugin,DebugMild,"Could not load prompt '%s' in memory",file.c_str());
+	p->deref();
+	::lseek(fd,offs,SEEK_SET);
+	return 0;
+    }
+    Lock lock(s_cacheMutex);
+    // another caller may have loaded it in the meantime
+    ObjList* l = s_prompts.find(file);
+    if (l) {
+	s_cacheUsed -= static_cast<WavePrompt*>(l->get())->length();
+	l->remove();
+    }
+    // evict the least recently used prompts to make room
+    while (s_cacheUsed + p->length() > s_cacheSize) {
+	ObjList* last = 0;
+	for (l = s_prompts.skipNull(); l; l = l->skipNext())
+	    last = l;
+	if (!last)
+	    break;
+	WavePrompt* old = static_cast<WavePrompt*>(last->get());
+	DDebug(&__plugin,DebugAll,"Evicting prompt '%s' from cache",old->toString().c_str());
+	s_cacheUsed -= old->length();
+	last->remove();
+    }
+    if (p->ref()) {
+	s_prompts.insert(p);
+	s_cacheUsed += p->length();
+    }
+    return p;
+}
+
+void WavePrompt::status(String& str)
+{
+    Lock lock(s_cacheMutex);
+    str << ",prompts=" << s_prompts.count() << ",cachekb=" << (s_cacheUsed / 1024);
+    str << ",hits=" << s_cacheHits << ",misses=" << s_cacheMiss;
+}
+
+void WavePrompt::clear()
+{
+    Lock lock(s_cacheMutex);
+    s_prompts.clear();
+    s_cacheUsed = 0;
+}
+
+
+// Copy recorded data, optionally converting 16 bit samples to network order
+static void copyData(unsigned char* dest, const unsigned char* src, unsigned int len, bool swap)
+{
+    if (!swap) {
+	::memcpy(dest,src,len);
+	return;
+    }
+    const uint16_t* s = (const uint16_t*)src;
+    uint16_t* d = (uint16_t*)dest;
+    for (len /= 2; len; len--)
+	*d++ = ntohs(*s++);
+}
+
+// Fill in the data length of an .au file header that was written as unknown
+static void finishAuHeader(int fd, unsigned int hdrLen)
+{
+    off_t end = ::lseek(fd,0,SEEK_END);
+    if ((end < (off_t)hdrLen) || (::lseek(fd,8,SEEK_SET) != 8))
+	return;
+    uint32_t len = htonl((uint32_t)(end - hdrLen));
+    ::write(fd,&len,sizeof(len));
+}
+
+static void syncFile(int fd)
+{
+#ifndef _WINDOWS
+#if defined(_POSIX_SYNCHRONIZED_IO) && (_POSIX_SYNCHRONIZED_IO > 0)
+    ::fdatasync(fd);
+#else
+    ::fsync(fd);
+#endif
+#endif
+}
+
+
+WaveWriter::WaveWriter(int fd, const String& file, unsigned int size)
+    : m_busy(false), m_file(file), m_fd(fd), m_buf(0), m_size(size),
+      m_head(0), m_tail(0), m_fill(0), m_first(0), m_offset(0), m_advised(0),
+      m_auHeader(0), m_closing(false), m_failed(false), m_drops(0)
+{
+    DDebug(&__plugin,DebugAll,"WaveWriter::WaveWriter(%d,\"%s\",%u) [%p]",
+	fd,file.c_str(),size,this);
+    m_buf = (unsigned char*)::malloc(m_size);
+}
+
+WaveWriter::~WaveWriter()
+{
+    DDebug(&__plugin,DebugAll,"WaveWriter::~WaveWriter() '%s' written=" FMT64U " drops=%u [%p]",
+	m_file.c_str(),m_offset,m_drops,this);
+    if (m_fd >= 0) {
+	// data queued after the writer threads let go of it
+	if (m_fill)
+	    write(m_fill);
+	finish();
+    }
+    if (m_buf)
+	::free(m_buf);
+}
+
+// Create a writer and hand it to the writer threads, returns a new reference
+WaveWriter* WaveWriter::create(int fd, const String& file)
+{
+    Lock lock(s_writeMutex);
+    if (s_recStop || (s_recThreads <= 0))
+	return 0;
+    WaveWriter* w = new WaveWriter(fd,file,s_recBuffer);
+    if (!w->m_buf) {
+	Debug(&__plugin,DebugWarn,"Could not allocate %u bytes to record '%s'",
+	    s_recBuffer,file.c_str());
+	w->m_fd = -1;
+	w->deref();
+	return 0;
+    }
+    // the list keeps the initial reference, the caller gets another one
+    w->ref();
+    s_writers.append(w);
+    s_writerCount++;
+    while (s_recRunning < s_recThreads) {
+	WaveWriterThread* t = new WaveWriterThread;
+	if (t->error() || !t->startup()) {
+	    Debug(&__plugin,DebugGoOn,"Error starting recording writer thread %p",t);
+	    delete t;
+	    break;
+	}
+	s_recRunning++;
+    }
+    return w;
+}
+
+// Queue data for writing, never blocks on the disk, called from the media thread
+bool WaveWriter::put(const void* data, unsigned int len, bool swap)
+{
+    if (!len)
+	return true;
+    Lock lock(m_mutex);
+    if (m_closing)
+	return false;
+    if (m_failed || (m_fill + len > m_size)) {
+	// the disk can't keep up or failed, drop the data but keep the call going
+	if (!m_drops++)
+	    Debug(&__plugin,DebugMild,"Recording '%s' buffer full, dropping data",m_file.c_str());
+	return false;
+    }
+    if (!m_fill)
+	m_first = Time::now();
+    const unsigned char* src = (const unsigned char*)data;
+    unsigned int n = m_size - m_head;
+    if (n > len)
+	n = len;
+    copyData(m_buf + m_head,src,n,swap);
+    if (n < len)
+	copyData(m_buf,src + n,len - n,swap);
+    m_head = (m_head + len) % m_size;
+    m_fill += len;
+    return true;
+}
+
+// Stop accepting data, the file is finished once the buffer is drained
+void WaveWriter::close(unsigned int auHeader)
+{
+    Lock lock(m_mutex);
+    m_auHeader = auHeader;
+    m_closing = true;
+}
+
+// Write out buffered data if enough is queued or it got old enough
+// Returns false once the file was closed and the writer can be released
+bool WaveWriter::service(bool force)
+{
+    m_mutex.lock();
+    unsigned int fill = m_fill;
+    bool closing = m_closing;
+    u_int64_t first = m_first;
+    m_mutex.unlock();
+    if (fill && (force || closing || (fill >= s_recBatch) || (Time::now() - first >= s_recFlush)))
+	write(fill);
+    if (!closing)
+	return true;
+    finish();
+    return false;
+}
+
+// Write buffered data in large blocks, only the producer index moves meanwhile
+void WaveWriter::write(unsigned int len)
+{
+    u_int64_t start = m_offset;
+    while (len) {
+	unsigned int n = (len < s_recBatch) ? len : s_recBatch;
+	unsigned int first = m_size - m_tail;
+	int w = -1;
+	if (m_failed)
+	    w = n;
+	else {
+#ifdef _WINDOWS
+	    if (n > first)
+		n = first;
+	    w = ::write(m_fd,m_buf + m_tail,n);
+#else
+	    struct iovec iov[2];
+	    int cnt = 1;
+	    iov[0].iov_base = m_buf + m_tail;
+	    iov[0].iov_len = n;
+	    if (n > first) {
+		// the data wraps around the end of the buffer
+		iov[0].iov_len = first;
+		iov[1].iov_base = m_buf;
+		iov[1].iov_len = n - first;
+		cnt = 2;
+	    }
+	    w = ::writev(m_fd,iov,cnt);
+#endif
+	    if (w < 0) {
+		if (errno == EINTR)
+		    continue;
+		Debug(&__plugin,DebugWarn,"Writing '%s' error %d: %s",
+		    m_file.c_str(),errno,::strerror(errno));
+		s_writeMutex.lock();
+		s_recErrors++;
+		s_writeMutex.unlock();
+		// discard what is buffered, further data is dropped
+		m_failed = true;
+		w = n;
+	    }
+	    else
+		m_offset += w;
+	}
+	m_tail = (m_tail + w) % m_size;
+	len -= w;
+	m_mutex.lock();
+	m_fill -= w;
+	m_mutex.unlock();
+    }
+    if (m_failed || (m_offset == start))
+	return;
+    if (s_recSync == SyncWrite)
+	syncFile(m_fd);
+#ifdef POSIX_FADV_DONTNEED
+    // drop from the page cache what was written in previous passes, it's
+    //  most likely clean by now and will not be read back
+    if (s_recAdvise && (start > m_advised)) {
+	::posix_fadvise(m_fd,m_advised,start - m_advised,POSIX_FADV_DONTNEED);
+	m_advised = start;
+    }
+#endif
+}
+
+// Finalize the header and close the file
+void WaveWriter::finish()
+{
+    if (m_fd < 0)
+	return;
+    if (m_auHeader && !m_failed)
+	finishAuHeader(m_fd,m_auHeader);
+    if (s_recSync != SyncNone)
+	syncFile(m_fd);
+#ifdef POSIX_FADV_DONTNEED
+    if (s_recAdvise)
+	::posix_fadvise(m_fd,0,0,POSIX_FADV_DONTNEED);
+#endif
+    ::close(m_fd);
+    m_fd = -1;
+}
+
+void WaveWriter::status(String& str)
+{
+    Lock lock(s_writeMutex);
+    unsigned int queued = 0;
+    unsigned int drops = s_recDrops;
+    for (ObjList* l = s_writers.skipNull(); l; l = l->skipNext()) {
+	WaveWriter* w = static_cast<WaveWriter*>(l->get());
+	queued += w->fill();
+	drops += w->drops();
+    }
+    str << ",recordings=" << s_writerCount << ",recqueuedkb=" << (queued / 1024);
+    str << ",recdrops=" << drops << ",recerrors=" << s_recErrors;
+}
+
+// Stop the writer threads and write out everything still buffered,
+//  used when the module is unloaded
+void WaveWriter::flushAll()
+{
+    s_writeMutex.lock();
+    s_recStop = true;
+    s_writeMutex.unlock();
+    bool stopped = false;
+    for (int t = 0; t < 1000; t++) {
+	s_writeMutex.lock();
+	stopped = (s_recRunning <= 0);
+	s_writeMutex.unlock();
+	if (stopped)
+	    break;
+	Thread::msleep(5,false);
+    }
+    if (!stopped)
+	Debug(&__plugin,DebugGoOn,"Recording writer threads did not stop");
+    for (;;) {
+	s_writeMutex.lock();
+	ObjList* l = s_writers.skipNull();
+	// a writer still claimed by a stuck thread can't be touched safely
+	while (l && static_cast<WaveWriter*>(l->get())->m_busy)
+	    l = l->skipNext();
+	WaveWriter* w = l ? static_cast<WaveWriter*>(l->remove(false)) : 0;
+	if (w)
+	    s_writerCount--;
+	s_writeMutex.unlock();
+	if (!w)
+	    break;
+	// the file is closed when the last reference is gone
+	w->service(true);
+	s_writeMutex.lock();
+	s_recDrops += w->drops();
+	s_writeMutex.unlock();
+	w->deref();
+    }
+}
+
+
+void WaveWriterThread::run()
+{
+    DDebug(&__plugin,DebugAll,"WaveWriterThread::run() [%p]",this);
+    WaveWriter* work[16];
+    for (;;) {
+	unsigned int n = 0;
+	s_writeMutex.lock();
+	if (s_recStop) {
+	    s_recRunning--;
+	    m_counted = false;
+	    s_writeMutex.unlock();
+	    break;
+	}
+	if ((s_recRunning > s_recThreads) && ((s_recRunning > 1) || !s_writerCount)) {
+	    // configuration lowered the number of threads
+	    s_recRunning--;
+	    m_counted = false;
+	    s_writeMutex.unlock();
+	    break;
+	}
+	// claim a share of the files so other writer threads can help
+	unsigned int share = s_writerCount / s_recRunning + 1;
+	if (share > 16)
+	    share = 16;
+	for (ObjList* l = s_writers.skipNull(); l && (n < share); l = l->skipNext()) {
+	    WaveWriter* w = static_cast<WaveWriter*>(l->get());
+	    if (w->m_busy)
+		continue;
+	    w->m_busy = true;
+	    work[n++] = w;
+	}
+	s_writeMutex.unlock();
+	bool done[16];
+	for (unsigned int i = 0; i < n; i++)
+	    done[i] = !work[i]->service();
+	s_writeMutex.lock();
+	for (unsigned int i = 0; i < n; i++) {
+	    WaveWriter* w = work[i];
+	    w->m_busy = false;
+	    if (done[i]) {
+		s_recDrops += w->drops();
+		s_writerCount--;
+		s_writers.remove(w);
+	    }
+	    else if (n == share) {
+		// move to the end so the files after it get their turn
+		s_writers.remove(w,false);
+		s_writers.append(w);
+	    }
+	}
+	s_writeMutex.unlock();
+	Thread::msleep(10,true);
+    }
+}
+
+void WaveWriterThread::cleanup()
+{
+    if (!m_counted)
+	return;
+    Lock lock(s_writeMutex);
+    s_recRunning--;
+    m_counted = false;
+}
+
+
 WaveSource* WaveSource::create(const String& file, CallEndpoint* chan, bool autoclose, bool autorepeat)
 {
     WaveSource* tmp = new WaveSource(file,chan,autoclose);
@@ -177,7 +800,17 @@ void WaveSource::init(const String& file, bool autorepeat)
     if (file == "-") {
 	m_nodata = true;
 	m_brate = 8000;
-	start("WaveSource");
+	startClock(20000,"WaveSource");
+	return;
+    }
+    m_prompt = WavePrompt::find(file);
+    if (m_prompt) {
+	m_format = m_prompt->format();
+	m_brate = m_prompt->rate();
+	if (autorepeat)
+	    m_repeatPos = 0;
+	asyncDelete(s_asyncDelete);
+	startClock(20000,"WaveSource");
 	return;
     }
     m_fd = ::open(file.safe(),O_RDONLY|O_NOCTTY|O_BINARY);
@@ -213,10 +846,19 @@ void WaveSource::init(const String& file, bool autorepeat)
     else if (!file.endsWith(".slin"))
 	Debug(DebugMild,"Unknown format for playback file '%s', assuming signed linear",file.c_str());
     if (computeDataRate()) {
-	if (autorepeat)
+	m_prompt = WavePrompt::load(file,m_fd,m_format,m_brate,m_swap);
+	if (m_prompt) {
+	    // data is now in memory and already swapped
+	    ::close(m_fd);
+	    m_fd = -1;
+	    m_swap = false;
+	    if (autorepeat)
+		m_repeatPos = 0;
+	}
+	else if (autorepeat)
 	    m_repeatPos = ::lseek(m_fd,0,SEEK_CUR);
 	asyncDelete(s_asyncDelete);
-	start("WaveSource");
+	startClock(20000,"WaveSource");
     }
     else {
 	Debug(DebugWarn,"Unable to compute data rate for file '%s'",file.c_str());
@@ -227,7 +869,8 @@ void WaveSource::init(const String& file, bool autorepeat)
 WaveSource::WaveSource(const char* file, CallEndpoint* chan, bool autoclose)
     : m_chan(chan), m_fd(-1), m_swap(false), m_brate(0), m_repeatPos(-1),
       m_total(0), m_time(0), m_autoclose(autoclose), m_autoclean(false),
-      m_nodata(false), m_insert(false), m_derefOk(true)
+      m_nodata(false), m_insert(false), m_done(false), m_derefOk(true),
+      m_prompt(0), m_pos(0)
 {
     Debug(&__plugin,DebugAll,"WaveSource::WaveSource(\"%s\",%p) [%p]",file,chan,this);
     if (m_chan)
@@ -249,6 +892,7 @@ WaveSource::~WaveSource()
 	::close(m_fd);
 	m_fd = -1;
     }
+    TelEngine::destruct(m_prompt);
 }
 
 void WaveSource::detectAuFormat()
@@ -319,49 +963,68 @@ bool WaveSource::computeDataRate()
     return (m_brate != 0);
 }
 
-void WaveSource::run()
+bool WaveSource::tick(u_int64_t when)
 {
-    unsigned long ts = 0;
-    int r = 0;
-    // wait until at least one consumer is attached
-    while (!r) {
+    if (!alive()) {
+	m_done = true;
+	notify(0,"replaced");
+	return false;
+    }
+    if (!m_data.length()) {
+	// wait until at least one consumer is attached
 	m_mutex.lock();
-	r = m_consumers.count();
+	int n = m_consumers.count();
 	m_mutex.unlock();
-	Thread::yield();
-	if (!alive()) {
-	    notify(0,"replaced");
-	    return;
-	}
+	if (!n)
+	    return true;
+	DDebug(&__plugin,DebugAll,"Consumer found, starting to play data with rate %d [%p]",m_brate,this);
     }
     unsigned int blen = (m_brate*20)/1000;
-    DDebug(&__plugin,DebugAll,"Consumer found, starting to play data with rate %d [%p]",m_brate,this);
-    m_data.assign(0,blen);
-    u_int64_t tpos = 0;
-    m_time = tpos;
-    do {
+    if (m_data.length() != blen)
+	m_data.assign(0,blen);
+    int r = 0;
+    if (m_prompt) {
+	if ((m_pos >= m_prompt->length()) && (m_repeatPos >= 0)) {
+	    DDebug(&__plugin,DebugAll,"Autorepeating from offset %ld [%p]",
+		m_repeatPos,this);
+	    m_pos = m_repeatPos;
+	}
+	r = m_prompt->length() - m_pos;
+	if (r >= (int)blen) {
+	    // full frame, send a slice of the shared prompt data
+	    if (!m_time)
+		m_time = Time::now();
+	    DataBlock data((void*)(m_prompt->data() + m_pos),blen,false);
+	    Forward(data,(unsigned long)(m_total*(u_int64_t)8000/m_brate));
+	    data.clear(false);
+	    m_pos += blen;
+	    m_total += blen;
+	    return true;
+	}
+	// last partial frame is handled as if read from file
+	if (r > 0) {
+	    ::memcpy(m_data.data(),m_prompt->data() + m_pos,r);
+	    m_pos += r;
+	}
+    }
+    else for (int tries = 0; tries < 2; ) {
 	r = (m_fd >= 0) ? ::read(m_fd,m_data.data(),m_data.length()) : m_data.length();
 	if (r < 0) {
-	    if (errno == EINTR) {
-		r = 1;
+	    if (errno == EINTR)
 		continue;
-	    }
 	    break;
 	}
-	// start counting time after the first successful read
-	if (!tpos)
-	    m_time = tpos = Time::now();
-	if (!r) {
-	    if (m_repeatPos >= 0) {
-		DDebug(&__plugin,DebugAll,"Autorepeating from offset %ld [%p]",
-		    m_repeatPos,this);
-		::lseek(m_fd,m_repeatPos,SEEK_SET);
-		m_data.assign(0,blen);
-		r = 1;
-		continue;
-	    }
+	tries++;
+	if (r || (m_repeatPos < 0))
 	    break;
-	}
+	DDebug(&__plugin,DebugAll,"Autorepeating from offset %ld [%p]",
+	    m_repeatPos,this);
+	::lseek(m_fd,m_repeatPos,SEEK_SET);
+    }
+    if (r > 0) {
+	// start counting time after the first successful read
+	if (!m_time)
+	    m_time = Time::now();
 	if (r < (int)m_data.length()) {
 	    // if desired and possible extend last byte to fill buffer
 	    if (s_dataPadding && ((m_format == "mulaw") || (m_format == "alaw"))) {
@@ -380,24 +1043,15 @@ void WaveSource::run()
 		++p;
 	    }
 	}
-	int64_t dly = tpos - Time::now();
-	if (dly > 0) {
-	    XDebug(&__plugin,DebugAll,"WaveSource sleeping for " FMT64 " usec",dly);
-	    Thread::usleep((unsigned long)dly);
-	}
-	if (!alive()) {
-	    notify(0,"replaced");
-	    return;
-	}
-	Forward(m_data,ts);
-	ts += m_data.length()*8000/m_brate;
+	Forward(m_data,(unsigned long)(m_total*(u_int64_t)8000/m_brate));
 	m_total += r;
-	tpos += (r*(u_int64_t)1000000/m_brate);
-    } while (r > 0);
+	return true;
+    }
+    m_done = true;
     Debug(&__plugin,DebugAll,"WaveSource '%s' end of data (%u played) chan=%p [%p]",m_id.c_str(),m_total,m_chan,this);
     if (!ref()) {
 	notify(0,"replaced");
-	return;
+	return false;
     }
     // prevent disconnector thread from succeeding before notify returns
     m_derefOk = false;
@@ -405,6 +1059,7 @@ void WaveSource::run()
     m_autoclean = !notify(this,"eof");
     if (!deref())
 	m_derefOk = m_autoclean;
+    return false;
 }
 
 void WaveSource::cleanup()
@@ -413,6 +1068,11 @@ void WaveSource::cleanup()
     Debug(&__plugin,DebugAll,"WaveSource cleanup, total=%u, alive=%s, autoclean=%s chan=%p [%p]",
 	m_total,String::boolText(alive()),String::boolText(m_autoclean),m_chan,this);
     clearThread();
+    // the clock dropped us after we lost all references
+    if (!m_done) {
+	m_done = true;
+	notify(0,"replaced");
+    }
     if (m_autoclean) {
 	asyncDelete(false);
 	if (m_insert) {
@@ -433,7 +1093,7 @@ bool WaveSource::zeroRefsTest()
 {
     DDebug(&__plugin,DebugAll,"WaveSource::zeroRefsTest() chan=%p%s%s%s [%p]",
 	m_chan,
-	(thread() ? " thread" : ""),
+	((thread() || clocked()) ? " thread" : ""),
 	(m_autoclose ? " close" : ""),
 	(m_autoclean ? " clean" : ""),
 	this);
@@ -447,7 +1107,7 @@ bool WaveSource::zeroRefsTest()
 void WaveSource::setNotify(const String& id)
 {
     m_id = id;
-    if ((m_fd < 0) && !m_nodata)
+    if ((m_fd < 0) && !(m_nodata || m_prompt))
 	notify(this);
 }
 
@@ -487,7 +1147,8 @@ bool WaveSource::notify(WaveSource* source, const char* reason)
 
 
 WaveConsumer::WaveConsumer(const String& file, CallEndpoint* chan, unsigned maxlen, const char* format)
-    : m_chan(chan), m_fd(-1), m_swap(false), m_locked(false), m_header(None),
+    : m_chan(chan), m_fd(-1), m_writer(0), m_auHeader(0),
+      m_swap(false), m_locked(false), m_header(None),
       m_total(0), m_maxlen(maxlen), m_time(0)
 {
     Debug(&__plugin,DebugAll,"WaveConsumer::WaveConsumer(\"%s\",%p,%u,\"%s\") [%p]",
@@ -524,6 +1185,8 @@ WaveConsumer::WaveConsumer(const String& file, CallEndpoint* chan, unsigned maxl
     if (m_fd < 0)
 	Debug(DebugWarn,"Creating '%s': error %d: %s",
 	    file.c_str(), errno, ::strerror(errno));
+    else
+	m_writer = WaveWriter::create(m_fd,file);
 }
 
 WaveConsumer::~WaveConsumer()
@@ -536,18 +1199,46 @@ WaveConsumer::~WaveConsumer()
 	    Debug(&__plugin,DebugInfo,"WaveConsumer rate=" FMT64U " b/s",m_time);
 	}
     }
-    if (m_fd >= 0) {
+    closeFile();
+}
+
+// Queue data to the writer threads or write it directly
+void WaveConsumer::writeData(const void* data, unsigned int len, bool swap)
+{
+    if (m_writer) {
+	m_writer->put(data,len,swap);
+	return;
+    }
+    if (swap) {
+	DataBlock swapped(0,len);
+	copyData((unsigned char*)swapped.data(),(const unsigned char*)data,len,true);
+	::write(m_fd,swapped.data(),swapped.length());
+    }
+    else
+	::write(m_fd,data,len);
+}
+
+void WaveConsumer::closeFile()
+{
+    if (m_writer) {
+	// the file descriptor belongs to the writer now
+	m_writer->close(m_auHeader);
+	TelEngine::destruct(m_writer);
+    }
+    else if (m_fd >= 0) {
+	if (m_auHeader)
+	    finishAuHeader(m_fd,m_auHeader);
 	::close(m_fd);
-	m_fd = -1;
     }
+    m_fd = -1;
 }
 
-void WaveConsumer::writeIlbcHeader() const
+void WaveConsumer::writeIlbcHeader()
 {
     if (m_format == "ilbc20")
-	::write(m_fd,"#!iLBC20\n",ILBC_HEADER_LEN);
+	writeData("#!iLBC20\n",ILBC_HEADER_LEN);
     else if (m_format == "ilbc30")
-	::write(m_fd,"#!iLBC30\n",ILBC_HEADER_LEN);
+	writeData("#!iLBC30\n",ILBC_HEADER_LEN);
     else
 	Debug(DebugMild,"Invalid iLBC format '%s', not writing header",m_format.c_str());
 }
@@ -582,8 +1273,10 @@ void WaveConsumer::writeAuHeader()
     header.offs = htonl(sizeof(header));
     header.freq = ntohl(rate);
     header.chan = ntohl(chans);
-    header.len = 0;
-    ::write(m_fd,&header,sizeof(header));
+    // length is unknown for now, it gets filled in when the file is closed
+    header.len = htonl(0xffffffff);
+    writeData(&header,sizeof(header));
+    m_auHeader = sizeof(header);
 }
 
 bool WaveConsumer::setFormat(const DataFormat& format)
@@ -629,25 +1322,12 @@ void WaveConsumer::Consume(const DataBlock& data, unsigned long tStamp)
 		    break;
 	    }
 	    m_header = None;
-	    if (m_swap) {
-		unsigned int n = data.length();
-		DataBlock swapped(0,n);
-		const uint16_t* s = (const uint16_t*)data.data();
-		uint16_t* d = (uint16_t*)swapped.data();
-		for (unsigned int i = 0; i < n; i+= 2)
-		    *d++ = ntohs(*s++);
-		::write(m_fd,swapped.data(),swapped.length());
-	    }
-	    else
-		::write(m_fd,data.data(),data.length());
+	    writeData(data.data(),data.length(),m_swap);
 	}
 	m_total += data.length();
 	if (m_maxlen && (m_total >= m_maxlen)) {
 	    m_maxlen = 0;
-	    if (m_fd >= 0) {
-		::close(m_fd);
-		m_fd = -1;
-	    }
+	    closeFile();
 	    if (m_chan) {
 		DDebug(&__plugin,DebugInfo,"Preparing 'maxlen' disconnector for '%s' chan %p '%s' in consumer [%p]",
 		    m_id.c_str(),m_chan,(m_chan ? m_chan->id().c_str() : ""),this);
@@ -1068,6 +1748,27 @@ WaveFileDriver::WaveFileDriver()
     Output("Loaded module WaveFile");
 }
 
+WaveFileDriver::~WaveFileDriver()
+{
+    WaveWriter::flushAll();
+}
+
+bool WaveFileDriver::received(Message& msg, int id)
+{
+    bool ok = Driver::received(msg,id);
+    // the writer threads must finish before the engine kills all threads
+    if (id == Halt)
+	WaveWriter::flushAll();
+    return ok;
+}
+
+void WaveFileDriver::statusParams(String& str)
+{
+    Driver::statusParams(str);
+    WavePrompt::status(str);
+    WaveWriter::status(str);
+}
+
 void WaveFileDriver::initialize()
 {
     Output("Initializing module WaveFile");
@@ -1075,10 +1776,40 @@ void WaveFileDriver::initialize()
     s_asyncDelete = Engine::config().getBoolValue("hacks","asyncdelete",true);
     s_dataPadding = Engine::config().getBoolValue("hacks","datapadding",true);
     s_pubReadable = Engine::config().getBoolValue("hacks","wavepubread",false);
+    Configuration cfg(Engine::configFile("wavefile"));
+    int size = cfg.getIntValue("general","cachesize",32768);
+    int file = cfg.getIntValue("general","cachefile",1024);
+    s_cacheMutex.lock();
+    s_cacheSize = (size > 0) ? 1024 * size : 0;
+    s_cacheFile = (file > 0) ? 1024 * file : 0;
+    s_cacheMutex.unlock();
+    // drop what was cached, limits or contents may have changed
+    WavePrompt::clear();
+    int writers = cfg.getIntValue("general","writers",1);
+    int buffer = cfg.getIntValue("general","writebuffer",128);
+    int batch = cfg.getIntValue("general","writebatch",64);
+    int flush = cfg.getIntValue("general","writeflush",1000);
+    if (buffer < 4)
+	buffer = 4;
+    if (batch < 1)
+	batch = 1;
+    else if (batch > buffer)
+	batch = buffer;
+    if (flush < 20)
+	flush = 20;
+    s_writeMutex.lock();
+    s_recThreads = (writers > 0) ? ((writers < 16) ? writers : 16) : 0;
+    s_recBuffer = 1024 * buffer;
+    s_recBatch = 1024 * batch;
+    s_recFlush = 1000 * (u_int64_t)flush;
+    s_recSync = cfg.getIntValue("general","writesync",s_syncModes,SyncNone);
+    s_recAdvise = cfg.getBoolValue("general","writeadvise",true);
+    s_writeMutex.unlock();
     if (!m_handler) {
 	m_handler = new AttachHandler;
 	Engine::install(m_handler);
 	Engine::install(new RecordHandler);
+	installRelay(Halt);
     }
 }
 
@@ -28,11 +28,32 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 #define MIN_PORT 16384
 #define MAX_PORT 32768
 #define BUF_SIZE 240
 #define BUF_PREF 160
+// how long statistics of finished sessions wait for the channel hangup
+#define STATS_KEEP 10000000
+// port pairs tried before giving up on binding a new session
+#define BIND_ATTEMPTS 10
+// independently locked parts of the wrapper indexes
+#define INDEX_SHARDS 16
+// hash lists in each part, prime so they don't follow the part number
+#define INDEX_SIZE 127
+
+#ifdef _WINDOWS
+#define PORT_CAS(x,o,n) (::InterlockedCompareExchange((LONG volatile*)&(x),(LONG)(n),(LONG)(o)) == (LONG)(o))
+#define PORT_INC(x) ::InterlockedIncrement((LONG volatile*)&(x))
+#define PORT_DEC(x) ::InterlockedDecrement((LONG volatile*)&(x))
+#define RELAY_INC(x) ::InterlockedIncrement((LONG volatile*)&(x))
+#else
+#define PORT_CAS(x,o,n) __sync_bool_compare_and_swap(&(x),(o),(n))
+#define PORT_INC(x) __sync_add_and_fetch(&(x),1)
+#define PORT_DEC(x) __sync_sub_and_fetch(&(x),1)
+#define RELAY_INC(x) __sync_add_and_fetch(&(x),1)
+#endif
 
 using namespace TelEngine;
 namespace { // anonymous
@@ -82,6 +103,7 @@ static TokenDict dict_tos[] = {
 
 static int s_minport = MIN_PORT;
 static int s_maxport = MAX_PORT;
+static int s_quarantine = 5000;
 static int s_bufsize = BUF_SIZE;
 static int s_padding = 0;
 static String s_tos;
@@ -92,17 +114,55 @@ static bool s_anyssrc   = false;
 static bool s_warnLater = false;
 static bool s_rtcp  = true;
 static bool s_drill = false;
+static bool s_relay = true;
 
 static Thread::Priority s_priority = Thread::Normal;
 static int s_sleep   = 5;
 static int s_timeout = 0;
 static int s_minjitter = 0;
 static int s_maxjitter = 0;
+static int s_rtcpInterval = 5000;
 
 class YRTPSource;
 class YRTPConsumer;
 class YRTPSession;
 
+// Pool of the RTP/RTCP port pairs of one local address
+// A bit is set in the map for each pair in use, taken and released without locking
+class YRTPPorts : public RefObject
+{
+public:
+    YRTPPorts(const String& addr, int minport, int maxport);
+    virtual ~YRTPPorts();
+    virtual const String& toString() const
+	{ return m_addr; }
+    int alloc();
+    void release(int pair, bool failed = false);
+    inline int port(int pair) const
+	{ return m_first + 2 * pair; }
+    inline unsigned int count() const
+	{ return m_count; }
+    inline unsigned int used() const
+	{ return m_used; }
+    inline unsigned int failed() const
+	{ return m_failed; }
+    static YRTPPorts* get(const String& addr);
+private:
+    int alloc(u_int32_t now, bool quarantine);
+    inline u_int32_t msecNow() const
+	{ return (u_int32_t)((Time::now() - m_start) / 1000); }
+    String m_addr;
+    int m_first;
+    unsigned int m_count;
+    unsigned int m_words;
+    volatile u_int32_t* m_bits;
+    volatile u_int32_t* m_reuse;
+    volatile unsigned int m_next;
+    volatile long m_used;
+    volatile long m_failed;
+    u_int64_t m_start;
+};
+
 class YRTPWrapper : public RefObject
 {
     friend class YRTPSource;
@@ -136,21 +196,30 @@ public:
 	{ return m_bufsize; }
     inline unsigned int port() const
 	{ return m_port; }
-    inline void setMaster(const char* master)
-	{ if (master) m_master = master; }
+    void setMaster(const char* master);
     inline bool isAudio() const
 	{ return m_audio; }
+    bool relaying() const;
     YRTPSource* getSource();
     YRTPConsumer* getConsumer();
     void addDirection(RTPSession::Direction direction);
+    void jitterStats(NamedList& params) const;
+    void rtpStats(String& str) const;
+    void quality(String& str) const;
+    const char* statsParam() const;
     static YRTPWrapper* find(const CallEndpoint* conn, const String& media);
     static YRTPWrapper* find(const String& id);
+    static void hangupStats(Message& msg, const String& callId);
     static void guessLocal(const char* remoteip, String& localip);
 private:
     void setTimeout(const Message& msg, int timeOut);
+    void index(int kind, const String& key, bool add);
     YRTPSession* m_rtp;
+    YRTPPorts* m_ports;
+    int m_pair;
     RTPSession::Direction m_dir;
     CallEndpoint* m_conn;
+    unsigned int m_relayed;
     YRTPSource* m_source;
     YRTPConsumer* m_consumer;
     String m_id;
@@ -162,6 +231,34 @@ private:
     bool m_audio;
 };
 
+// Keys by which wrappers are indexed
+enum {
+    IndexId,
+    IndexConn,
+    IndexMaster
+};
+
+// Entry of a wrapper in one of the indexes
+class YRTPIndex : public String
+{
+public:
+    inline YRTPIndex(const String& key, int kind, YRTPWrapper* wrap)
+	: String(key), m_kind(kind), m_wrap(wrap)
+	{ }
+    int m_kind;
+    YRTPWrapper* m_wrap;
+};
+
+// Part of the wrapper indexes holding the keys with the same hash remainder
+class YRTPShard : public Mutex
+{
+public:
+    inline YRTPShard()
+	: Mutex(false), m_index(INDEX_SIZE)
+	{ }
+    HashList m_index;
+};
+
 class YRTPSession : public RTPSession
 {
     friend class RTPSession;
@@ -194,25 +291,39 @@ class YRTPSource : public DataSource
 public:
     YRTPSource(YRTPWrapper* wrap);
     ~YRTPSource();
+    virtual void attached(bool added);
+    bool relay(bool marker, unsigned long tStamp, const void* data, int len);
     inline void busy(bool isBusy)
 	{ m_busy = isBusy; }
+    inline bool relaying() const
+	{ return m_relay != 0; }
 private:
+    void setRelay(YRTPConsumer* relay);
     YRTPWrapper* m_wrap;
     volatile bool m_busy;
+    // referenced consumer, held under the relay mutex while sending to it
+    YRTPConsumer* m_relay;
+    Mutex m_relayMutex;
+    unsigned int m_relayGen;
 };
 
 class YRTPConsumer : public DataConsumer
 {
     friend class YRTPWrapper;
+    friend class YRTPSource;
 public:
     YRTPConsumer(YRTPWrapper* wrap);
     ~YRTPConsumer();
+    YCLASS(YRTPConsumer,DataConsumer)
     virtual void Consume(const DataBlock &data, unsigned long tStamp);
+    virtual void attached(bool added);
+    bool relay(YRTPSource* source, bool marker, unsigned long tStamp, const void* data, int len);
     inline void setSplitable()
 	{ m_splitable = (m_format == "alaw") || (m_format == "mulaw"); }
 private:
     YRTPWrapper* m_wrap;
     bool m_splitable;
+    unsigned int m_relayed;
 };
 
 class AttachHandler : public MessageHandler
@@ -236,26 +347,173 @@ public:
     virtual bool received(Message &msg);
 };
 
+// Runs before cdrbuild to put the RTP statistics in the CDR
+class HangupHandler : public MessageHandler
+{
+public:
+    HangupHandler() : MessageHandler("chan.hangup",20) { }
+    virtual bool received(Message &msg);
+};
+
+// Statistics of a finished wrapper kept until its channel hangup is handled
+class YRTPStats : public NamedString
+{
+public:
+    inline YRTPStats(const char* id, const char* param)
+	: NamedString(id), m_param(param), m_expire(Time::now() + STATS_KEEP)
+	{ }
+    String m_param;
+    u_int64_t m_expire;
+};
+
 class YRTPPlugin : public Module
 {
 public:
     YRTPPlugin();
     virtual ~YRTPPlugin();
     virtual void initialize();
+    virtual void statusModule(String& str);
     virtual void statusParams(String& str);
     virtual void statusDetail(String& str);
 private:
     bool m_first;
 };
 
-static YRTPPlugin splugin;
-static ObjList s_calls;
+static HashList s_stats(INDEX_SIZE);
+static ObjList s_ports;
 static Mutex s_mutex;
+static YRTPShard s_shards[INDEX_SHARDS];
 static Mutex s_srcMutex;
+// changed each time a RTP source or consumer is attached or detached
+static volatile unsigned int s_relayGen = 1;
+// defined after the lists so it is destroyed first and can clear them
+static YRTPPlugin splugin;
+
+static inline YRTPShard& shard(const String& key)
+{
+    return s_shards[key.hash() % INDEX_SHARDS];
+}
+
+// Index key of the wrappers of an endpoint, its id can change
+static inline String connKey(const CallEndpoint* conn)
+{
+    return String((unsigned int)((unsigned long)conn >> 3));
+}
+
+
+YRTPPorts::YRTPPorts(const String& addr, int minport, int maxport)
+    : m_addr(addr), m_next(0), m_used(0), m_failed(0), m_start(Time::now())
+{
+    if (minport > maxport) {
+	int tmp = maxport;
+	maxport = minport;
+	minport = tmp;
+    }
+    // RTP uses the even ports, RTCP the odd one following each
+    m_first = (minport + 1) & 0xfffe;
+    int count = (maxport - m_first + 1) / 2;
+    if (count < 1)
+	count = 1;
+    m_count = count;
+    m_words = (m_count + 31) / 32;
+    m_bits = new u_int32_t[m_words];
+    m_reuse = new u_int32_t[m_count];
+    for (unsigned int i = 0; i < m_words; i++)
+	m_bits[i] = 0;
+    for (unsigned int i = 0; i < m_count; i++)
+	m_reuse[i] = 0;
+    // do not make the ports of the first calls easy to guess
+    m_next = ::random() % m_words;
+    Debug(&splugin,DebugInfo,"Port pool '%s' holds %u pairs from %d [%p]",
+	m_addr.c_str(),m_count,m_first,this);
+}
+
+YRTPPorts::~YRTPPorts()
+{
+    delete[] m_bits;
+    delete[] m_reuse;
+}
+
+// Reserve a free pair, one that was released recently only if nothing else is left
+int YRTPPorts::alloc()
+{
+    u_int32_t now = msecNow();
+    int pair = alloc(now,true);
+    if (pair < 0)
+	pair = alloc(now,false);
+    if (pair >= 0)
+	PORT_INC(m_used);
+    return pair;
+}
+
+int YRTPPorts::alloc(u_int32_t now, bool quarantine)
+{
+    unsigned int start = m_next;
+    for (unsigned int n = 0; n < m_words; n++) {
+	unsigned int k = (start + n) % m_words;
+	u_int32_t busy = m_bits[k];
+	if (busy == 0xffffffff)
+	    continue;
+	for (unsigned int b = 0; b < 32; b++) {
+	    u_int32_t bit = 1U << b;
+	    if (busy & bit)
+		continue;
+	    unsigned int i = 32 * k + b;
+	    if (i >= m_count)
+		break;
+	    // a reuse time far in the future was left from a clock wrap
+	    int wait = (int)(m_reuse[i] - now);
+	    if (quarantine && (wait > 0) && (wait <= s_quarantine))
+		continue;
+	    for (;;) {
+		u_int32_t old = m_bits[k];
+		if (old & bit)
+		    break;
+		if (PORT_CAS(m_bits[k],old,old | bit)) {
+		    m_next = k;
+		    return i;
+		}
+	    }
+	}
+    }
+    return -1;
+}
+
+// Return a pair to the pool, it will not be reused during the quarantine
+void YRTPPorts::release(int pair, bool failed)
+{
+    if ((pair < 0) || ((unsigned int)pair >= m_count))
+	return;
+    if (failed)
+	PORT_INC(m_failed);
+    // set the reuse time before the pair can be seen as free
+    m_reuse[pair] = msecNow() + s_quarantine;
+    volatile u_int32_t& word = m_bits[pair / 32];
+    u_int32_t bit = 1U << (pair % 32);
+    for (;;) {
+	u_int32_t old = word;
+	if (PORT_CAS(word,old,old & ~bit))
+	    break;
+    }
+    PORT_DEC(m_used);
+}
+
+// Find or create the pool of a local address
+YRTPPorts* YRTPPorts::get(const String& addr)
+{
+    Lock lock(s_mutex);
+    YRTPPorts* ports = static_cast<YRTPPorts*>(s_ports[addr]);
+    if (!ports) {
+	ports = new YRTPPorts(addr,s_minport,s_maxport);
+	s_ports.append(ports);
+    }
+    ports->ref();
+    return ports;
+}
 
 
 YRTPWrapper::YRTPWrapper(const char* localip, CallEndpoint* conn, const char* media, RTPSession::Direction direction, bool rtcp)
-    : m_rtp(0), m_dir(direction), m_conn(conn),
+    : m_rtp(0), m_ports(0), m_pair(-1), m_dir(direction), m_conn(conn), m_relayed(0),
       m_source(0), m_consumer(0), m_media(media),
       m_bufsize(0), m_port(0)
 {
@@ -266,24 +524,55 @@ YRTPWrapper::YRTPWrapper(const char* localip, CallEndpoint* conn, const char* me
     if (conn)
 	m_master = conn->id();
     m_audio = (m_media == "audio");
-    s_mutex.lock();
-    s_calls.append(this);
     setupRTP(localip,rtcp);
-    s_mutex.unlock();
+    index(IndexId,m_id,true);
+    if (m_conn)
+	index(IndexConn,connKey(m_conn),true);
+    index(IndexMaster,m_master,true);
 }
 
 YRTPWrapper::~YRTPWrapper()
 {
     Debug(&splugin,DebugAll,"YRTPWrapper::~YRTPWrapper() %s '%s' [%p]",
 	lookup(m_dir,dict_yrtp_dir),m_media.c_str(),this);
+    const RTPDejitter* dj = m_rtp ? m_rtp->dejitter() : 0;
+    if (dj)
+	Debug(&splugin,DebugInfo,"Dejitter late=%u lost=%u reordered=%u delay=%ums [%p]",
+	    dj->late(),dj->lost(),dj->reordered(),dj->delay() / 1000,this);
+    if (m_relayed)
+	Debug(&splugin,DebugInfo,"Relayed %u packets [%p]",m_relayed,this);
+    index(IndexId,m_id,false);
+    if (m_conn)
+	index(IndexConn,connKey(m_conn),false);
+    index(IndexMaster,m_master,false);
     s_mutex.lock();
-    s_calls.remove(this,false);
+    // the hangup of the channel is usually handled after we are gone
+    if (m_rtp && m_bufsize && m_master) {
+	// entries never claimed expire when another lands in the same list
+	u_int64_t now = Time::now();
+	ObjList* l = s_stats.getHashList(m_master);
+	while (l) {
+	    YRTPStats* st = static_cast<YRTPStats*>(l->get());
+	    if (st && (st->m_expire < now))
+		l->remove();
+	    else
+		l = l->next();
+	}
+	YRTPStats* st = new YRTPStats(m_master,statsParam());
+	rtpStats(*st);
+	s_stats.append(st);
+    }
     if (m_rtp) {
 	Debug(DebugAll,"Cleaning up RTP %p",m_rtp);
 	YRTPSession* tmp = m_rtp;
 	m_rtp = 0;
 	tmp->destruct();
     }
+    // the sockets are closed so the ports can go back to the pool
+    if (m_ports) {
+	m_ports->release(m_pair);
+	TelEngine::destruct(m_ports);
+    }
     if (m_source) {
 	Debug(&splugin,DebugGoOn,"There is still a RTP source %p [%p]",m_source,this);
 	TelEngine::destruct(m_source);
@@ -304,63 +593,115 @@ void* YRTPWrapper::getObject(const String &name) const
 
 YRTPWrapper* YRTPWrapper::find(const CallEndpoint* conn, const String& media)
 {
-    Lock lock(s_mutex);
-    ObjList* l = &s_calls;
+    if (!conn)
+	return 0;
+    String key(connKey(conn));
+    YRTPShard& sh = shard(key);
+    Lock lock(sh);
+    ObjList* l = sh.m_index.getHashList(key);
     for (; l; l=l->next()) {
-	const YRTPWrapper *p = static_cast<const YRTPWrapper *>(l->get());
-	if (p && (p->conn() == conn) && (p->media() == media))
-	    return const_cast<YRTPWrapper *>(p);
+	const YRTPIndex* i = static_cast<const YRTPIndex*>(l->get());
+	if (i && (i->m_kind == IndexConn) && (i->m_wrap->conn() == conn) && (i->m_wrap->media() == media))
+	    return i->m_wrap;
     }
     return 0;
 }
 
 YRTPWrapper* YRTPWrapper::find(const String& id)
 {
-    Lock lock(s_mutex);
-    ObjList* l = &s_calls;
+    if (id.null())
+	return 0;
+    YRTPShard& sh = shard(id);
+    Lock lock(sh);
+    ObjList* l = sh.m_index.getHashList(id);
     for (; l; l=l->next()) {
-	const YRTPWrapper *p = static_cast<const YRTPWrapper *>(l->get());
-	if (p && (p->id() == id))
-	    return const_cast<YRTPWrapper *>(p);
+	const YRTPIndex* i = static_cast<const YRTPIndex*>(l->get());
+	if (i && (i->m_kind == IndexId) && (*i == id))
+	    return i->m_wrap;
     }
     return 0;
 }
 
+// Add the statistics of the live wrappers of a channel to its hangup message
+void YRTPWrapper::hangupStats(Message& msg, const String& callId)
+{
+    YRTPShard& sh = shard(callId);
+    Lock lock(sh);
+    ObjList* l = sh.m_index.getHashList(callId);
+    for (; l; l=l->next()) {
+	const YRTPIndex* i = static_cast<const YRTPIndex*>(l->get());
+	if (!(i && (i->m_kind == IndexMaster) && (*i == callId)))
+	    continue;
+	const YRTPWrapper* w = i->m_wrap;
+	if (w->rtp() && w->bufSize()) {
+	    String stats;
+	    w->rtpStats(stats);
+	    msg.setParam(w->statsParam(),stats);
+	}
+    }
+}
+
+// Add or remove an entry of this wrapper in the index of a key
+void YRTPWrapper::index(int kind, const String& key, bool add)
+{
+    if (key.null())
+	return;
+    YRTPShard& sh = shard(key);
+    Lock lock(sh);
+    if (add) {
+	sh.m_index.append(new YRTPIndex(key,kind,this));
+	return;
+    }
+    ObjList* l = sh.m_index.getHashList(key);
+    for (; l; l=l->next()) {
+	const YRTPIndex* i = static_cast<const YRTPIndex*>(l->get());
+	if (i && (i->m_wrap == this) && (i->m_kind == kind)) {
+	    l->remove();
+	    return;
+	}
+    }
+}
+
+void YRTPWrapper::setMaster(const char* master)
+{
+    if (!master || (m_master == master))
+	return;
+    index(IndexMaster,m_master,false);
+    m_master = master;
+    index(IndexMaster,m_master,true);
+}
+
 void YRTPWrapper::setupRTP(const char* localip, bool rtcp)
 {
     Debug(&splugin,DebugAll,"YRTPWrapper::setupRTP(\"%s\",%s) [%p]",
 	localip,String::boolText(rtcp),this);
     m_rtp = new YRTPSession(this);
     m_rtp->initTransport();
-    int minport = s_minport;
-    int maxport = s_maxport;
-    int attempt = 10;
-    if (minport > maxport) {
-	int tmp = maxport;
-	maxport = minport;
-	minport = tmp;
-    }
-    else if (minport == maxport) {
-	maxport++;
-	attempt = 1;
-    }
     SocketAddr addr(AF_INET);
     if (!addr.host(localip)) {
 	Debug(&splugin,DebugWarn,"Wrapper could not parse address '%s' [%p]",localip,this);
 	return;
     }
-    for (; attempt; attempt--) {
-	int lport = (minport + (::random() % (maxport - minport))) & 0xfffe;
+    m_ports = YRTPPorts::get(addr.host());
+    for (int attempt = BIND_ATTEMPTS; attempt; attempt--) {
+	int pair = m_ports->alloc();
+	if (pair < 0)
+	    break;
+	int lport = m_ports->port(pair);
 	addr.port(lport);
 	if (m_rtp->localAddr(addr,rtcp)) {
+	    m_pair = pair;
 	    m_host = addr.host();
 	    m_port = lport;
 	    Debug(&splugin,DebugInfo,"Session %p bound to %s:%u%s [%p]",
 		m_rtp,localip,m_port,(rtcp ? " +RTCP" : ""),this);
 	    return;
 	}
+	// probably used by someone else, keep away from it for a while
+	m_ports->release(pair,true);
     }
-    Debug(&splugin,DebugWarn,"YRTPWrapper [%p] RTP bind failed in range %d-%d",this,minport,maxport);
+    Debug(&splugin,DebugWarn,"YRTPWrapper [%p] RTP bind failed, %u of %u port pairs in use from %d",
+	this,m_ports->used(),m_ports->count(),m_ports->port(0));
 }
 
 bool YRTPWrapper::setRemote(const char* raddr, unsigned int rport, const Message& msg)
@@ -481,8 +822,11 @@ bool YRTPWrapper::startRTP(const char* raddr, unsigned int rport, const Message&
 	    (ok ? "opened" : "failed to open"),this);
     }
     setTimeout(msg,s_timeout);
-//    if (maxJitter > 0)
-//	m_rtp->setDejitter(minJitter*1000,maxJitter*1000);
+    m_rtp->setReports(msg.getIntValue("rtcpinterval",s_rtcpInterval));
+    const FormatInfo* info = FormatRepository::getFormat(format);
+    m_rtp->clockRate(info ? info->sampleRate : 8000);
+    if (maxJitter > 0)
+	m_rtp->setDejitter(minJitter*1000,maxJitter*1000,m_rtp->clockRate());
     m_bufsize = s_bufsize;
     return true;
 }
@@ -561,6 +905,12 @@ YRTPConsumer* YRTPWrapper::getConsumer()
     return new YRTPConsumer(this);
 }
 
+bool YRTPWrapper::relaying() const
+{
+    Lock lock(s_srcMutex);
+    return m_source && m_source->relaying();
+}
+
 void YRTPWrapper::addDirection(RTPSession::Direction direction)
 {
     m_dir = (RTPSession::Direction)(m_dir | direction);
@@ -568,6 +918,54 @@ void YRTPWrapper::addDirection(RTPSession::Direction direction)
 	m_rtp->direction(m_dir);
 }
 
+void YRTPWrapper::jitterStats(NamedList& params) const
+{
+    const RTPDejitter* dj = m_rtp ? m_rtp->dejitter() : 0;
+    if (!dj)
+	return;
+    params.setParam("jitter_late",String(dj->late()));
+    params.setParam("jitter_lost",String(dj->lost()));
+    params.setParam("jitter_reordered",String(dj->reordered()));
+    params.setParam("jitter_depth",String(dj->depth()));
+    params.setParam("jitter_delay",String(dj->delay() / 1000));
+    params.setParam("jitter_mean",String(dj->jitter() / 1000));
+}
+
+// Statistics for the CDR, jitter and round trip times in milliseconds
+void YRTPWrapper::rtpStats(String& str) const
+{
+    const RTPSender* s = m_rtp ? m_rtp->sender() : 0;
+    const RTPReceiver* r = m_rtp ? m_rtp->receiver() : 0;
+    unsigned int rate = m_rtp ? m_rtp->clockRate() : 8000;
+    str << "sent=" << (s ? s->packets() : 0);
+    str << ",received=" << (r ? r->packets() : 0);
+    str << ",lost=" << (r ? r->lost() : 0);
+    str << ",jitter=" << (r ? r->jitter() * 1000 / rate : 0);
+    str << ",remotelost=" << (s ? s->remoteLost() : 0);
+    str << ",remotejitter=" << (s ? s->remoteJitter() * 1000 / rate : 0);
+    str << ",rtt=" << (s ? s->rtt() / 1000 : 0);
+}
+
+// Reception quality in the format of the module status details
+void YRTPWrapper::quality(String& str) const
+{
+    const RTPSender* s = m_rtp ? m_rtp->sender() : 0;
+    const RTPReceiver* r = m_rtp ? m_rtp->receiver() : 0;
+    unsigned int rate = m_rtp ? m_rtp->clockRate() : 8000;
+    str << (r ? r->packets() : 0) << "|" << (r ? r->lost() : 0) << "|";
+    str << (r ? r->jitter() * 1000 / rate : 0) << "|" << (s ? s->rtt() / 1000 : 0);
+}
+
+// Name of the hangup parameter that holds the statistics of this wrapper
+const char* YRTPWrapper::statsParam() const
+{
+    if (m_audio)
+	return "rtpstats";
+    if (m_media == "video")
+	return "rtpstats_video";
+    return "rtpstats_other";
+}
+
 
 YRTPSession::~YRTPSession()
 {
@@ -593,6 +991,10 @@ bool YRTPSession::rtpRecvData(bool marker, unsigned int timestamp, const void* d
     if (!source)
 	return false;
     // the source will not be destroyed until we reset the busy flag
+    if (s_relay && source->relay(marker,timestamp,data,len)) {
+	source->busy(false);
+	return true;
+    }
     DataBlock block;
     block.assign((void*)data, len, false);
     source->Forward(block,timestamp);
@@ -636,7 +1038,7 @@ void YRTPSession::timeout(bool initial)
 
 
 YRTPSource::YRTPSource(YRTPWrapper* wrap)
-    : m_wrap(wrap), m_busy(false)
+    : m_wrap(wrap), m_busy(false), m_relay(0), m_relayGen(0)
 {
     Debug(&splugin,DebugAll,"YRTPSource::YRTPSource(%p) [%p]",wrap,this);
     m_format.clear();
@@ -664,11 +1066,65 @@ YRTPSource::~YRTPSource()
 	    Thread::yield();
 	tmp->deref();
     }
+    setRelay(0);
+}
+
+// Called with our mutex locked
+void YRTPSource::attached(bool added)
+{
+    RELAY_INC(s_relayGen);
+    // the detached consumer may be released as soon as we return
+    if (!added)
+	setRelay(0);
+}
+
+// Replace the relay target, the old one is released once no packet is sent to it
+void YRTPSource::setRelay(YRTPConsumer* relay)
+{
+    if (relay && !relay->ref())
+	relay = 0;
+    m_relayMutex.lock();
+    YRTPConsumer* old = m_relay;
+    m_relay = relay;
+    m_relayMutex.unlock();
+    if (old)
+	old->deref();
+}
+
+// Send a packet directly to the consumer if it's the only one and of the same format
+// Called only from YRTPSession::rtpRecvData() with the busy flag set
+bool YRTPSource::relay(bool marker, unsigned long tStamp, const void* data, int len)
+{
+    unsigned int gen = s_relayGen;
+    // never wait for our mutex, it may be held while data is forwarded
+    if ((gen != m_relayGen) && m_mutex.lock(0)) {
+	m_relayGen = gen;
+	YRTPConsumer* relay = 0;
+	ObjList* l = m_consumers.skipNull();
+	if (l && !l->skipNext()) {
+	    relay = YOBJECT(YRTPConsumer,l->get());
+	    // no sniffers, overrides or format changes allowed
+	    if (relay && !(relay->getConnSource() == this && !relay->getOverSource() &&
+		relay->getFormat() == getFormat() && relay->m_wrap && relay->m_wrap->rtp()))
+		relay = 0;
+	}
+	if (relay != m_relay) {
+	    DDebug(&splugin,DebugInfo,"YRTPSource %s relay to %p [%p]",
+		(relay ? "starting" : "stopping"),relay,this);
+	    // the list still holds any old relay so it's not released here
+	    setRelay(relay);
+	}
+	m_mutex.unlock();
+    }
+    else if (gen != m_relayGen)
+	return false;
+    Lock lock(m_relayMutex);
+    return m_relay && m_relay->relay(this,marker,tStamp,data,len);
 }
 
 
 YRTPConsumer::YRTPConsumer(YRTPWrapper *wrap)
-    : m_wrap(wrap), m_splitable(false)
+    : m_wrap(wrap), m_splitable(false), m_relayed(0)
 {
     Debug(&splugin,DebugAll,"YRTPConsumer::YRTPConsumer(%p) [%p]",wrap,this);
     m_format.clear();
@@ -687,6 +1143,7 @@ YRTPConsumer::~YRTPConsumer()
 	const YRTPConsumer* c = tmp->m_consumer;
 	m_wrap = 0;
 	tmp->m_consumer = 0;
+	tmp->m_relayed += m_relayed;
 	tmp->deref();
 	if (c != this)
 	    Debug(&splugin,DebugGoOn,"Wrapper %p held consumer %p not [%p]",tmp,c,this);
@@ -720,6 +1177,33 @@ void YRTPConsumer::Consume(const DataBlock &data, unsigned long tStamp)
     }
 }
 
+// Called with the mutex of the source locked
+void YRTPConsumer::attached(bool added)
+{
+    // an override source may have been attached or detached
+    RELAY_INC(s_relayGen);
+}
+
+// Send a packet received by a bridged RTP session of the same format
+bool YRTPConsumer::relay(YRTPSource* source, bool marker, unsigned long tStamp, const void* data, int len)
+{
+    if (!(m_wrap && m_wrap->bufSize() && m_wrap->rtp()))
+	return false;
+    // let Consume() split packets larger than our buffer
+    if (m_splitable && m_wrap->isAudio() && ((unsigned int)len > m_wrap->bufSize()))
+	return false;
+    // keep the timestamps of both ends as if the packet was forwarded
+    //  so they stay continuous when switching to or from another source
+    tStamp = source->advance(len,tStamp);
+    if (!adjustStamp(tStamp,source))
+	return false;
+    u_int64_t tsTime = Time::now();
+    m_wrap->rtp()->rtpSendData(marker,tStamp,data,len);
+    consumed(tStamp,tsTime);
+    m_relayed++;
+    return true;
+}
+
 
 bool AttachHandler::received(Message &msg)
 {
@@ -789,6 +1273,7 @@ bool AttachHandler::received(Message &msg)
     msg.setParam("localip",w->host());
     msg.setParam("localport",String(w->port()));
     msg.setParam("rtpid",w->id());
+    w->jitterStats(msg);
 
     // Stop dispatching if we handled all requested
     return !more;
@@ -880,6 +1365,7 @@ bool RtpHandler::received(Message &msg)
     msg.setParam("localip",w->host());
     msg.setParam("localport",String(w->port()));
     msg.setParam("rtpid",w->id());
+    w->jitterStats(msg);
 
     if (msg.getBoolValue("getsession",!msg.userData()))
 	msg.userData(w);
@@ -907,6 +1393,28 @@ bool DTMFHandler::received(Message &msg)
 }
 
 
+bool HangupHandler::received(Message &msg)
+{
+    const String* id = msg.getParam("id");
+    if (!id || id->null())
+	return false;
+    Lock lock(s_mutex);
+    ObjList* l = s_stats.getHashList(*id);
+    while (l) {
+	YRTPStats* st = static_cast<YRTPStats*>(l->get());
+	if (st && (st->name() == *id)) {
+	    msg.setParam(st->m_param,*st);
+	    l->remove();
+	}
+	else
+	    l = l->next();
+    }
+    lock.drop();
+    YRTPWrapper::hangupStats(msg,*id);
+    return false;
+}
+
+
 YRTPPlugin::YRTPPlugin()
     : Module("yrtp","misc"), m_first(true)
 {
@@ -916,36 +1424,98 @@ YRTPPlugin::YRTPPlugin()
 YRTPPlugin::~YRTPPlugin()
 {
     Output("Unloading module YRTP");
-    s_calls.clear();
+    for (unsigned int i = 0; i < INDEX_SHARDS; i++)
+	s_shards[i].m_index.clear();
+    s_stats.clear();
+    s_ports.clear();
+}
+
+void YRTPPlugin::statusModule(String& str)
+{
+    Module::statusModule(str);
+    str.append("format=Channel|Received|Lost|Jitter|RTT",",");
 }
 
 void YRTPPlugin::statusParams(String& str)
 {
+    unsigned int chans = 0;
+    unsigned int relay = 0;
+    for (unsigned int i = 0; i < INDEX_SHARDS; i++) {
+	Lock lock(s_shards[i]);
+	for (unsigned int n = 0; n < INDEX_SIZE; n++) {
+	    ObjList* l = s_shards[i].m_index.getList(n);
+	    for (l = l ? l->skipNull() : 0; l; l = l->skipNext()) {
+		const YRTPIndex* idx = static_cast<const YRTPIndex*>(l->get());
+		if (idx->m_kind != IndexId)
+		    continue;
+		chans++;
+		if (idx->m_wrap->relaying())
+		    relay++;
+	    }
+	}
+    }
+    str.append("chans=",",") << chans;
+    str << ",relaying=" << relay;
     s_mutex.lock();
-    str.append("chans=",",") << s_calls.count();
+    unsigned int ports = 0;
+    unsigned int used = 0;
+    unsigned int failed = 0;
+    for (ObjList* l = s_ports.skipNull(); l; l = l->skipNext()) {
+	const YRTPPorts* p = static_cast<const YRTPPorts*>(l->get());
+	ports += p->count();
+	used += p->used();
+	failed += p->failed();
+    }
+    str << ",ports=" << ports << ",portsused=" << used << ",bindfailed=" << failed;
     s_mutex.unlock();
+    // packet counters aggregated by the RTP groups, updated at each report
+    u_int64_t sent = 0;
+    u_int64_t received = 0;
+    int64_t lost = 0;
+    RTPGroup::totals(sent,received,lost);
+    char buf[80];
+    ::sprintf(buf,",sent=" FMT64U ",received=" FMT64U ",lost=" FMT64,sent,received,lost);
+    str << buf;
 }
 
 void YRTPPlugin::statusDetail(String& str)
 {
-    s_mutex.lock();
-    ObjList* l = s_calls.skipNull();
-    for (; l; l=l->skipNext()) {
-	YRTPWrapper* w = static_cast<YRTPWrapper*>(l->get());
-        str.append(w->id(),",") << "=" << w->callId();
+    for (unsigned int i = 0; i < INDEX_SHARDS; i++) {
+	Lock lock(s_shards[i]);
+	for (unsigned int n = 0; n < INDEX_SIZE; n++) {
+	    ObjList* l = s_shards[i].m_index.getList(n);
+	    for (l = l ? l->skipNull() : 0; l; l = l->skipNext()) {
+		const YRTPIndex* idx = static_cast<const YRTPIndex*>(l->get());
+		if (idx->m_kind != IndexId)
+		    continue;
+		const YRTPWrapper* w = idx->m_wrap;
+		str.append(w->id(),",") << "=" << w->callId() << "|";
+		w->quality(str);
+	    }
+	}
     }
-    s_mutex.unlock();
 }
 
 void YRTPPlugin::initialize()
 {
     Output("Initializing module YRTP");
     Configuration cfg(Engine::configFile("yrtpchan"));
-    s_minport = cfg.getIntValue("general","minport",MIN_PORT);
-    s_maxport = cfg.getIntValue("general","maxport",MAX_PORT);
+    int minport = cfg.getIntValue("general","minport",MIN_PORT);
+    int maxport = cfg.getIntValue("general","maxport",MAX_PORT);
+    s_mutex.lock();
+    // sessions keep their old pool until they release the ports
+    if ((minport != s_minport) || (maxport != s_maxport))
+	s_ports.clear();
+    s_minport = minport;
+    s_maxport = maxport;
+    s_mutex.unlock();
+    s_quarantine = cfg.getIntValue("general","portquarantine",5000);
+    if (s_quarantine < 0)
+	s_quarantine = 0;
     s_bufsize = cfg.getIntValue("general","buffer",BUF_SIZE);
     s_minjitter = cfg.getIntValue("general","minjitter");
     s_maxjitter = cfg.getIntValue("general","maxjitter");
+    s_rtcpInterval = cfg.getIntValue("general","rtcpinterval",5000);
     s_tos = cfg.getValue("general","tos");
     s_localip = cfg.getValue("general","localip");
     s_autoaddr = cfg.getBoolValue("general","autoaddr",true);
@@ -953,8 +1523,10 @@ void YRTPPlugin::initialize()
     s_padding = cfg.getIntValue("general","padding",0);
     s_rtcp = cfg.getBoolValue("general","rtcp",true);
     s_drill = cfg.getBoolValue("general","drillhole",Engine::clientMode());
+    s_relay = cfg.getBoolValue("general","relay",true);
     s_sleep = cfg.getIntValue("general","defsleep",5);
     RTPGroup::setMinSleep(cfg.getIntValue("general","minsleep"));
+    RTPGroup::setShared(cfg.getIntValue("general","sharedgroups",0));
     s_priority = Thread::priority(cfg.getValue("general","thread"));
     s_timeout = cfg.getIntValue("timeouts","timeout",3000);
     s_notifyMsg = cfg.getValue("timeouts","notifymsg");
@@ -965,6 +1537,7 @@ void YRTPPlugin::initialize()
 	Engine::install(new AttachHandler);
 	Engine::install(new RtpHandler);
 	Engine::install(new DTMFHandler);
+	Engine::install(new HangupHandler);
     }
 }
 
@@ -27,6 +27,12 @@
 
 #include <string.h>
 
+#ifdef __linux__
+#define SIP_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#include <errno.h>
 
 using namespace TelEngine;
 namespace { // anonymous
@@ -35,6 +41,18 @@ namespace { // anonymous
 #define EXPIRES_DEF 600
 #define EXPIRES_MAX 3600
 
+// Messages waiting for a busy worker before new ones are dropped
+#define MAX_QUEUED 1000
+
+// Largest SIP message accepted on a TCP connection
+#define TCP_MAX_MESSAGE 65536
+// Bytes waiting to be sent on a TCP connection before it is dropped
+#define TCP_MAX_QUEUE 1048576
+// Socket events handled at once by the TCP transport
+#define TCP_EVENTS 64
+// Microseconds allowed for an outgoing TCP connection to be established
+#define TCP_CONNECT_TIMEOUT 10000000
+
 /* Yate Payloads for the AV profile */
 static TokenDict dict_payloads[] = {
     { "mulaw",         0 },
@@ -207,16 +225,98 @@ protected:
 };
 
 class YateSIPEndPoint;
+class YateTCPTransport;
+
+// A TCP connection carrying SIP messages in both directions
+class YateTCPConnection : public RefObject
+{
+    friend class YateTCPTransport;
+public:
+    YateTCPConnection(YateTCPTransport* transport, Socket* sock, const SocketAddr& addr, bool connecting);
+    ~YateTCPConnection();
+    virtual const String& toString() const
+	{ return m_key; }
+    bool send(const DataBlock& data);
+    inline const SocketAddr& addr() const
+	{ return m_addr; }
+    inline const String& localAddr() const
+	{ return m_local; }
+private:
+    bool flush();
+    bool receive(ObjList& messages);
+    YateTCPTransport* m_transport;
+    Socket* m_sock;
+    SocketAddr m_addr;
+    String m_key;
+    String m_local;
+    DataBlock m_input;
+    ObjList m_output;
+    unsigned int m_offset;
+    unsigned int m_queued;
+    u_int64_t m_active;
+    bool m_connecting;
+    bool m_writing;
+    bool m_closed;
+};
+
+// A complete message read from a TCP connection
+class YateTCPMessage : public DataBlock
+{
+public:
+    inline YateTCPMessage(const char* buf, unsigned int len, YateTCPConnection* conn)
+	: DataBlock((void*)buf,len), m_conn(conn)
+	{ }
+    RefPointer<YateTCPConnection> m_conn;
+};
+
+class YateTCPParty : public SIPParty
+{
+public:
+    YateTCPParty(YateTCPConnection* conn, int localPort);
+    ~YateTCPParty();
+    virtual void transmit(SIPEvent* event);
+    virtual const char* getProtoName() const;
+    virtual bool setParty(const URI& uri);
+protected:
+    RefPointer<YateTCPConnection> m_conn;
+    SocketAddr m_retry;
+};
+
+// Thread running the TCP listener and all connections from one event loop
+class YateTCPTransport : public Thread
+{
+public:
+    YateTCPTransport(YateSIPEndPoint* ep);
+    ~YateTCPTransport();
+    bool Init(const SocketAddr& addr);
+    void run();
+    YateTCPConnection* find(const SocketAddr& addr);
+    YateTCPConnection* connect(const SocketAddr& addr);
+    void watch(YateTCPConnection* conn, bool add = false);
+private:
+    YateTCPConnection* get(const String& key) const;
+    void add(YateTCPConnection* conn);
+    void close(YateTCPConnection* conn);
+    void wait(ObjList& messages);
+    bool process(YateTCPConnection* conn, bool readable, bool writable, ObjList& messages);
+    void acceptAll();
+    void checkIdle();
+    YateSIPEndPoint* m_ep;
+    Socket m_listener;
+    HashList m_conns;
+    int m_poll;
+};
 
 class YateSIPEngine : public SIPEngine
 {
 public:
-    YateSIPEngine(YateSIPEndPoint* ep);
+    YateSIPEngine(YateSIPEndPoint* ep, YateSIPEngine* master = 0);
     virtual bool buildParty(SIPMessage* message);
     virtual bool checkUser(const String& username, const String& realm, const String& nonce,
 	const String& method, const String& uri, const String& response,
 	const SIPMessage* message, GenObject* userData);
     virtual SIPTransaction* forkInvite(SIPMessage* answer, SIPTransaction* trans);
+    virtual int getNextCSeq();
     inline bool prack() const
 	{ return m_prack; }
     inline bool info() const
@@ -224,6 +324,7 @@ public:
 private:
     static bool copyAuthParams(NamedList* dest, const NamedList& src);
     YateSIPEndPoint* m_ep;
+    YateSIPEngine* m_master;
     bool m_prack;
     bool m_info;
     bool m_fork;
@@ -294,13 +395,48 @@ private:
     bool m_localDetect;
 };
 
+// A received message waiting for the worker that owns its dialog
+class YateSIPPacket : public String
+{
+public:
+    inline YateSIPPacket(const char* buf, int len, const SocketAddr& addr)
+	: String(buf,len), m_addr(addr)
+	{ }
+    SocketAddr m_addr;
+};
+
+// Thread running the transactions whose Call-ID hashes to its engine
+class YateSIPWorker : public Thread
+{
+public:
+    YateSIPWorker(YateSIPEndPoint* ep, YateSIPEngine* engine, unsigned int index);
+    ~YateSIPWorker();
+    bool Init();
+    void run();
+    void queue(const char* buf, int len, const SocketAddr& addr);
+private:
+    YateSIPPacket* dequeue();
+    YateSIPEndPoint* m_ep;
+    YateSIPEngine* m_engine;
+    unsigned int m_index;
+    Mutex m_mutex;
+    ObjList m_packets;
+    ObjList* m_last;
+    int m_queued;
+    Socket m_wakeRead;
+    Socket m_wakeWrite;
+};
+
 class YateSIPEndPoint : public Thread
 {
+    friend class YateSIPWorker;
+    friend class YateTCPTransport;
 public:
     YateSIPEndPoint();
     ~YateSIPEndPoint();
     bool Init(void);
     void run(void);
+    bool doEvent(YateSIPEngine* engine);
     bool incoming(SIPEvent* e, SIPTransaction* t);
     void invite(SIPEvent* e, SIPTransaction* t);
     void regreq(SIPEvent* e, SIPTransaction* t);
@@ -309,17 +445,26 @@ public:
     bool buildParty(SIPMessage* message, const char* host = 0, int port = 0, const YateSIPLine* line = 0);
     inline YateSIPEngine* engine() const
 	{ return m_engine; }
+    YateSIPEngine* engine(SIPMessage* message);
     inline int port() const
 	{ return m_port; }
     inline Socket* socket() const
 	{ return m_sock; }
+    YateTCPConnection* tcpConnect(const SocketAddr& addr);
 private:
-    void addMessage(const char* buf, int len, const SocketAddr& addr, int port);
+    void addMessage(const char* buf, int len, const SocketAddr& addr, int port,
+	YateTCPConnection* conn = 0);
+    unsigned int shard(const char* buf, int len) const;
     int m_port;
     String m_local;
     Socket* m_sock;
     SocketAddr m_addr;
     YateSIPEngine *m_engine;
+    YateSIPEngine** m_engines;
+    YateSIPWorker** m_workers;
+    unsigned int m_count;
+    YateTCPTransport* m_tcp;
+    Mutex m_mutex;
 };
 
 class YateSIPRefer : public Thread
@@ -567,6 +712,9 @@ static String s_realm = "Yate";
 static String s_audio = "alaw,mulaw";
 static String s_rtpip;
 static int s_floodEvents = 20;
+static int s_tcpIdle = 600;
+// protects the state of all TCP connections
+static Mutex s_tcpMutex;
 static int s_maxForwards = 20;
 static int s_nat_refresh = 25;
 static bool s_privacy = false;
@@ -1209,10 +1357,571 @@ bool YateUDPParty::setParty(const URI& uri)
     return true;
 }
 
-YateSIPEngine::YateSIPEngine(YateSIPEndPoint* ep)
+// Find the trimmed value of a header in a raw message without parsing it
+static bool rawHeader(const char* buf, int len, const char* name, char compact, String& value)
+{
+    int nameLen = ::strlen(name);
+    const char* end = buf + len;
+    // skip the request or status line
+    while ((buf < end) && (*buf != '\n'))
+	buf++;
+    while (++buf < end) {
+	const char* eol = buf;
+	while ((eol < end) && (*eol != '\r') && (*eol != '\n'))
+	    eol++;
+	// an empty line ends the headers
+	if (eol == buf)
+	    break;
+	const char* col = buf;
+	while ((col < eol) && (*col != ':'))
+	    col++;
+	const char* hdr = col;
+	while ((hdr > buf) && ((hdr[-1] == ' ') || (hdr[-1] == '\t')))
+	    hdr--;
+	int hdrLen = hdr - buf;
+	if ((col < eol) && (((hdrLen == nameLen) && !::strncasecmp(buf,name,nameLen)) ||
+	    ((hdrLen == 1) && ((*buf | 0x20) == compact)))) {
+	    value.assign(col + 1,eol - col - 1);
+	    value.trimBlanks();
+	    return true;
+	}
+	buf = eol;
+	if ((buf + 1 < end) && (buf[0] == '\r') && (buf[1] == '\n'))
+	    buf++;
+    }
+    return false;
+}
+
+// Length of the headers of a raw message including the empty line after them
+static int headersLength(const char* buf, unsigned int len)
+{
+    for (unsigned int i = 1; i < len; i++) {
+	if (buf[i] != '\n')
+	    continue;
+	if (buf[i-1] == '\n')
+	    return i + 1;
+	if ((i >= 3) && (buf[i-1] == '\r') && (buf[i-2] == '\n') && (buf[i-3] == '\r'))
+	    return i + 1;
+    }
+    return -1;
+}
+
+// Check if a non-blocking connect is still going on
+static bool connectPending(const Socket* sock)
+{
+#ifdef _WINDOWS
+    return (sock->error() == WSAEWOULDBLOCK);
+#else
+    return (sock->error() == EINPROGRESS);
+#endif
+}
+
+YateTCPConnection::YateTCPConnection(YateTCPTransport* transport, Socket* sock, const SocketAddr& addr, bool connecting)
+    : m_transport(transport), m_sock(sock), m_addr(addr),
+      m_offset(0), m_queued(0), m_active(Time::now()),
+      m_connecting(connecting), m_writing(connecting), m_closed(false)
+{
+    m_key << addr.host() << ":" << addr.port();
+    SocketAddr laddr;
+    if (m_sock->getSockName(laddr))
+	m_local = laddr.host();
+    DDebug(&plugin,DebugAll,"YateTCPConnection::YateTCPConnection('%s',%s) [%p]",
+	m_key.c_str(),String::boolText(connecting),this);
+}
+
+YateTCPConnection::~YateTCPConnection()
+{
+    DDebug(&plugin,DebugAll,"YateTCPConnection::~YateTCPConnection() '%s' [%p]",m_key.c_str(),this);
+    delete m_sock;
+    m_sock = 0;
+}
+
+// Queue data for sending, may be called from any thread
+bool YateTCPConnection::send(const DataBlock& data)
+{
+    Lock lock(s_tcpMutex);
+    if (m_closed)
+	return false;
+    if (m_queued + data.length() > TCP_MAX_QUEUE) {
+	Debug(&plugin,DebugWarn,"Dropping TCP connection %s with %u bytes not sent [%p]",
+	    m_key.c_str(),m_queued,this);
+	m_closed = true;
+	m_sock->shutdown(true,true);
+	return false;
+    }
+    m_output.append(new DataBlock(data));
+    m_queued += data.length();
+    if (m_connecting)
+	return true;
+    if (!flush()) {
+	// let the transport see the socket failing and remove it
+	m_sock->shutdown(true,true);
+	return false;
+    }
+    if (m_queued && !m_writing) {
+	m_writing = true;
+	m_transport->watch(this);
+    }
+    return true;
+}
+
+// Write as much of the queued data as the socket accepts, false on error
+bool YateTCPConnection::flush()
+{
+    DataBlock* data;
+    while ((data = static_cast<DataBlock*>(m_output.get())) != 0) {
+	int len = data->length() - m_offset;
+	int res = m_sock->writeData(m_offset + (char*)data->data(),len);
+	if (res < 0) {
+	    if (m_sock->canRetry())
+		return true;
+	    Debug(&plugin,DebugMild,"Error %d writing to TCP connection %s [%p]",
+		m_sock->error(),m_key.c_str(),this);
+	    m_closed = true;
+	    return false;
+	}
+	m_active = Time::now();
+	m_queued -= res;
+	if (res < len) {
+	    m_offset += res;
+	    return true;
+	}
+	m_offset = 0;
+	m_output.remove();
+    }
+    return true;
+}
+
+// Read what is available and cut complete messages, false if closed
+bool YateTCPConnection::receive(ObjList& messages)
+{
+    char buf[8192];
+    // never buffer more than a message and a read, the rest waits in the socket
+    while (m_input.length() < TCP_MAX_MESSAGE) {
+	int res = m_sock->readData(buf,sizeof(buf));
+	if (res < 0) {
+	    if (m_sock->canRetry())
+		break;
+	    Debug(&plugin,DebugMild,"Error %d reading from TCP connection %s [%p]",
+		m_sock->error(),m_key.c_str(),this);
+	    return false;
+	}
+	if (!res) {
+	    DDebug(&plugin,DebugInfo,"TCP connection %s closed by peer [%p]",m_key.c_str(),this);
+	    return false;
+	}
+	m_active = Time::now();
+	m_input.append(buf,res);
+	if (res < (int)sizeof(buf))
+	    break;
+    }
+    // messages are framed by their headers and Content-Length
+    const char* data = (const char*)m_input.data();
+    unsigned int len = m_input.length();
+    unsigned int pos = 0;
+    for (;;) {
+	// skip CRLF keepalives between messages
+	while ((pos < len) && ((data[pos] == '\r') || (data[pos] == '\n')))
+	    pos++;
+	if (pos >= len)
+	    break;
+	int hdrLen = headersLength(data + pos,len - pos);
+	if (hdrLen < 0) {
+	    // reading stops at the limit so it must be reached without headers
+	    if (len - pos < TCP_MAX_MESSAGE)
+		break;
+	    Debug(&plugin,DebugWarn,"Headers longer than %d bytes on TCP connection %s [%p]",
+		TCP_MAX_MESSAGE,m_key.c_str(),this);
+	    return false;
+	}
+	int bodyLen = 0;
+	String tmp;
+	if (rawHeader(data + pos,hdrLen,"Content-Length",'l',tmp))
+	    bodyLen = tmp.toInteger(-1,10);
+	// subtract so a length near the integer limit can't overflow
+	if ((bodyLen < 0) || (bodyLen > TCP_MAX_MESSAGE - hdrLen)) {
+	    Debug(&plugin,DebugWarn,"Invalid Content-Length '%s' on TCP connection %s [%p]",
+		tmp.c_str(),m_key.c_str(),this);
+	    return false;
+	}
+	if (len - pos < (unsigned int)(hdrLen + bodyLen))
+	    break;
+	messages.append(new YateTCPMessage(data + pos,hdrLen + bodyLen,this));
+	pos += hdrLen + bodyLen;
+    }
+    if (pos)
+	m_input.cut(-(int)pos);
+    return true;
+}
+
+
+YateTCPParty::YateTCPParty(YateTCPConnection* conn, int localPort)
+    : SIPParty(true), m_conn(conn), m_retry(conn->addr())
+{
+    m_local = conn->localAddr();
+    m_localPort = localPort;
+    m_party = conn->addr().host();
+    m_partyPort = conn->addr().port();
+    DDebug(&plugin,DebugAll,"YateTCPParty::YateTCPParty(%p) local %s:%d party %s:%d [%p]",
+	conn,m_local.c_str(),m_localPort,m_party.c_str(),m_partyPort,this);
+}
+
+YateTCPParty::~YateTCPParty()
+{
+    DDebug(&plugin,DebugAll,"YateTCPParty::~YateTCPParty() [%p]",this);
+}
+
+void YateTCPParty::transmit(SIPEvent* event)
+{
+    const SIPMessage* msg = event->getMessage();
+    if (!msg)
+	return;
+    if (plugin.debugAt(DebugInfo)) {
+	String raddr(m_conn->toString());
+	if (plugin.filterDebug(raddr)) {
+	    String tmp;
+	    if (msg->isAnswer())
+		tmp << "code " << msg->code;
+	    else
+		tmp << "'" << msg->method << " " << msg->uri << "'";
+	    String buf((char*)msg->getBuffer().data(),msg->getBuffer().length());
+	    Debug(&plugin,DebugInfo,"Sending %s %p to %s over TCP\r\n------\r\n%s------",
+		tmp.c_str(),msg,raddr.c_str(),buf.c_str());
+	}
+    }
+    if (m_conn->send(msg->getBuffer()))
+	return;
+    // the connection was lost, try to open a new one
+    YateTCPConnection* conn = plugin.ep()->tcpConnect(m_retry);
+    if (!conn) {
+	Debug(&plugin,DebugMild,"Could not send %p over TCP to %s:%d [%p]",
+	    msg,m_retry.host().c_str(),m_retry.port(),this);
+	return;
+    }
+    m_conn = conn;
+    conn->deref();
+    m_conn->send(msg->getBuffer());
+}
+
+const char* YateTCPParty::getProtoName() const
+{
+    return "TCP";
+}
+
+bool YateTCPParty::setParty(const URI& uri)
+{
+    // answers go back on the same connection, the Via address
+    //  is used only if it is lost and a new one must be opened
+    if (uri.getHost().null())
+	return true;
+    SocketAddr addr(AF_INET);
+    if (!addr.host(uri.getHost()))
+	return true;
+    int port = uri.getPort();
+    addr.port((port > 0) ? port : 5060);
+    m_retry = addr;
+    return true;
+}
+
+
+YateTCPTransport::YateTCPTransport(YateSIPEndPoint* ep)
+    : Thread("YSIP TCP"), m_ep(ep), m_conns(127), m_poll(-1)
+{
+    DDebug(&plugin,DebugAll,"YateTCPTransport::YateTCPTransport() [%p]",this);
+}
+
+YateTCPTransport::~YateTCPTransport()
+{
+    DDebug(&plugin,DebugAll,"YateTCPTransport::~YateTCPTransport() [%p]",this);
+    s_tcpMutex.lock();
+    // parties may still hold the connections, they will find them closed
+    for (unsigned int i = 0; i < m_conns.length(); i++) {
+	ObjList* l = m_conns.getList(i);
+	while (l && l->get())
+	    close(static_cast<YateTCPConnection*>(l->get()));
+    }
+    s_tcpMutex.unlock();
+#ifdef SIP_EPOLL
+    if (m_poll >= 0)
+	::close(m_poll);
+#endif
+    Lock lock(m_ep->m_mutex);
+    m_ep->m_tcp = 0;
+}
+
+bool YateTCPTransport::Init(const SocketAddr& addr)
+{
+    if (!(m_listener.create(AF_INET,SOCK_STREAM) && m_listener.setReuse() &&
+	m_listener.bind(addr) && m_listener.listen() && m_listener.setBlocking(false))) {
+	Debug(&plugin,DebugGoOn,"Unable to listen for TCP on %s:%d, error %d",
+	    addr.host().c_str(),addr.port(),m_listener.error());
+	return false;
+    }
+#ifdef SIP_EPOLL
+    m_poll = ::epoll_create(TCP_EVENTS);
+    if (m_poll >= 0) {
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	// the listener is the only socket without a connection
+	ev.data.ptr = 0;
+	if (::epoll_ctl(m_poll,EPOLL_CTL_ADD,m_listener.handle(),&ev)) {
+	    ::close(m_poll);
+	    m_poll = -1;
+	}
+    }
+    if (m_poll < 0)
+	Debug(&plugin,DebugMild,"Could not use epoll for TCP, error %d",errno);
+#endif
+    Debug(&plugin,DebugCall,"Listening for TCP on %s:%d",addr.host().c_str(),addr.port());
+    return true;
+}
+
+// Find an open connection to an address, returns it referenced
+YateTCPConnection* YateTCPTransport::find(const SocketAddr& addr)
+{
+    String key;
+    key << addr.host() << ":" << addr.port();
+    Lock lock(s_tcpMutex);
+    YateTCPConnection* conn = get(key);
+    return (conn && conn->ref()) ? conn : 0;
+}
+
+// Reuse an open connection to an address or start a new one, returns it referenced
+YateTCPConnection* YateTCPTransport::connect(const SocketAddr& addr)
+{
+    String key;
+    key << addr.host() << ":" << addr.port();
+    Lock lock(s_tcpMutex);
+    YateTCPConnection* conn = get(key);
+    if (conn)
+	return conn->ref() ? conn : 0;
+    Socket* sock = new Socket(AF_INET,SOCK_STREAM);
+    bool connected = false;
+    if (sock->valid() && sock->setBlocking(false)) {
+	connected = sock->connect(addr);
+	if (connected || connectPending(sock))
+	    conn = new YateTCPConnection(this,sock,addr,!connected);
+    }
+    if (!conn) {
+	Debug(&plugin,DebugWarn,"Could not connect TCP to %s, error %d",key.c_str(),sock->error());
+	delete sock;
+	return 0;
+    }
+    Debug(&plugin,DebugInfo,"Connecting TCP to %s [%p]",key.c_str(),conn);
+    add(conn);
+    conn->ref();
+    return conn;
+}
+
+// Update the socket events the loop waits for, call with the lock held
+void YateTCPTransport::watch(YateTCPConnection* conn, bool add)
+{
+#ifdef SIP_EPOLL
+    if (m_poll < 0)
+	return;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    if (conn->m_writing)
+	ev.events |= EPOLLOUT;
+    ev.data.ptr = conn;
+    if (::epoll_ctl(m_poll,(add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD),conn->m_sock->handle(),&ev))
+	Debug(&plugin,DebugMild,"Could not watch TCP connection %s, error %d",
+	    conn->toString().c_str(),errno);
+#endif
+}
+
+YateTCPConnection* YateTCPTransport::get(const String& key) const
+{
+    ObjList* l = m_conns.getHashList(key);
+    for (l = l ? l->skipNull() : 0; l; l = l->skipNext()) {
+	YateTCPConnection* conn = static_cast<YateTCPConnection*>(l->get());
+	if (!conn->m_closed && (conn->toString() == key))
+	    return conn;
+    }
+    return 0;
+}
+
+// Keep a new connection, the list takes over the reference
+void YateTCPTransport::add(YateTCPConnection* conn)
+{
+    m_conns.append(conn);
+    watch(conn,true);
+}
+
+void YateTCPTransport::close(YateTCPConnection* conn)
+{
+    Debug(&plugin,DebugInfo,"Closing TCP connection %s [%p]",conn->toString().c_str(),conn);
+    conn->m_closed = true;
+#ifdef SIP_EPOLL
+    if (m_poll >= 0) {
+	struct epoll_event ev;
+	::epoll_ctl(m_poll,EPOLL_CTL_DEL,conn->m_sock->handle(),&ev);
+    }
+#endif
+    conn->m_sock->terminate();
+    m_conns.remove(conn);
+}
+
+void YateTCPTransport::run()
+{
+    u_int64_t idle = Time::now() + 1000000;
+    for (;;) {
+	ObjList messages;
+	wait(messages);
+	// hand the messages to the engines without holding the TCP lock
+	for (ObjList* l = messages.skipNull(); l; l = l->skipNext()) {
+	    YateTCPMessage* msg = static_cast<YateTCPMessage*>(l->get());
+	    if (plugin.debugAt(DebugInfo)) {
+		String raddr(msg->m_conn->toString());
+		if (plugin.filterDebug(raddr)) {
+		    String buf((const char*)msg->data(),msg->length());
+		    Debug(&plugin,DebugInfo,"Received %u bytes SIP message from %s over TCP\r\n------\r\n%s------",
+			msg->length(),raddr.c_str(),buf.c_str());
+		}
+	    }
+	    m_ep->addMessage((const char*)msg->data(),msg->length(),msg->m_conn->addr(),m_ep->port(),msg->m_conn);
+	}
+	if (Time::now() >= idle) {
+	    checkIdle();
+	    idle = Time::now() + 1000000;
+	}
+    }
+}
+
+// Wait for socket events and handle them, collecting the received messages
+void YateTCPTransport::wait(ObjList& messages)
+{
+    ObjList closed;
+#ifdef SIP_EPOLL
+    if (m_poll >= 0) {
+	struct epoll_event events[TCP_EVENTS];
+	// wake up as often as the other threads to notice being cancelled
+	int n = ::epoll_wait(m_poll,events,TCP_EVENTS,5);
+	Thread::check();
+	if (n < 0) {
+	    if (errno != EINTR) {
+		Debug(&plugin,DebugWarn,"TCP epoll failed with error %d [%p]",errno,this);
+		Thread::msleep(5,true);
+	    }
+	    return;
+	}
+	Lock lock(s_tcpMutex);
+	for (int i = 0; i < n; i++) {
+	    YateTCPConnection* conn = static_cast<YateTCPConnection*>(events[i].data.ptr);
+	    if (!conn) {
+		acceptAll();
+		continue;
+	    }
+	    bool fail = (events[i].events & (EPOLLERR | EPOLLHUP)) != 0;
+	    if (!process(conn,fail || (events[i].events & EPOLLIN),
+		fail || (events[i].events & EPOLLOUT),messages))
+		closed.append(conn)->setDelete(false);
+	}
+	// connections are removed only now so the pointers above stay valid
+	for (ObjList* l = closed.skipNull(); l; l = l->skipNext())
+	    close(static_cast<YateTCPConnection*>(l->get()));
+	return;
+    }
+#endif
+    // without epoll just try all the sockets now and then
+    Thread::msleep(5,true);
+    Lock lock(s_tcpMutex);
+    acceptAll();
+    for (unsigned int i = 0; i < m_conns.length(); i++) {
+	ObjList* l = m_conns.getList(i);
+	for (l = l ? l->skipNull() : 0; l; l = l->skipNext()) {
+	    YateTCPConnection* conn = static_cast<YateTCPConnection*>(l->get());
+	    bool writable = true;
+	    if (conn->m_connecting)
+		conn->m_sock->select(0,&writable,0,(int64_t)0);
+	    if (!process(conn,true,writable,messages))
+		closed.append(conn)->setDelete(false);
+	}
+    }
+    for (ObjList* l = closed.skipNull(); l; l = l->skipNext())
+	close(static_cast<YateTCPConnection*>(l->get()));
+}
+
+// Handle the socket of a connection, false if it must be closed
+bool YateTCPTransport::process(YateTCPConnection* conn, bool readable, bool writable, ObjList& messages)
+{
+    if (conn->m_closed)
+	return false;
+    if (conn->m_connecting) {
+	if (!writable)
+	    return true;
+	int err = 0;
+	socklen_t len = sizeof(err);
+	if (!conn->m_sock->getOption(SOL_SOCKET,SO_ERROR,&err,&len) || err) {
+	    Debug(&plugin,DebugWarn,"Could not connect TCP to %s, error %d [%p]",
+		conn->toString().c_str(),err,conn);
+	    return false;
+	}
+	conn->m_connecting = false;
+	Debug(&plugin,DebugInfo,"Connected TCP to %s [%p]",conn->toString().c_str(),conn);
+    }
+    if (writable && !conn->flush())
+	return false;
+    if (readable && !conn->receive(messages))
+	return false;
+    bool writing = (conn->m_queued != 0);
+    if (writing != conn->m_writing) {
+	conn->m_writing = writing;
+	watch(conn);
+    }
+    return true;
+}
+
+void YateTCPTransport::acceptAll()
+{
+    for (;;) {
+	SocketAddr addr;
+	Socket* sock = m_listener.accept(addr);
+	if (!sock)
+	    break;
+	if (!sock->setBlocking(false)) {
+	    delete sock;
+	    continue;
+	}
+	YateTCPConnection* conn = new YateTCPConnection(this,sock,addr,false);
+	Debug(&plugin,DebugInfo,"Accepted TCP connection from %s [%p]",conn->toString().c_str(),conn);
+	add(conn);
+    }
+}
+
+// Close connections that failed, did not connect in time or stayed idle
+void YateTCPTransport::checkIdle()
+{
+    Lock lock(s_tcpMutex);
+    u_int64_t now = Time::now();
+    ObjList closed;
+    for (unsigned int i = 0; i < m_conns.length(); i++) {
+	ObjList* l = m_conns.getList(i);
+	for (l = l ? l->skipNull() : 0; l; l = l->skipNext()) {
+	    YateTCPConnection* conn = static_cast<YateTCPConnection*>(l->get());
+	    if (conn->m_connecting) {
+		if (now < conn->m_active + TCP_CONNECT_TIMEOUT)
+		    continue;
+		Debug(&plugin,DebugWarn,"Timeout connecting TCP to %s [%p]",conn->toString().c_str(),conn);
+	    }
+	    else if (!conn->m_closed && (conn->m_queued ||
+		(s_tcpIdle <= 0) || (now < conn->m_active + 1000000 * (u_int64_t)s_tcpIdle)))
+		continue;
+	    closed.append(conn)->setDelete(false);
+	}
+    }
+    for (ObjList* l = closed.skipNull(); l; l = l->skipNext())
+	close(static_cast<YateTCPConnection*>(l->get()));
+}
+
+
+YateSIPEngine::YateSIPEngine(YateSIPEndPoint* ep, YateSIPEngine* master)
     : SIPEngine(s_cfg.getValue("general","useragent")),
-      m_ep(ep), m_prack(false), m_info(false)
+      m_ep(ep), m_master(master), m_prack(false), m_info(false)
 {
+    // nonces issued by one worker must be accepted by all others
+    if (master)
+	m_nonce_secret = master->m_nonce_secret;
     addAllowed("INVITE");
     addAllowed("BYE");
     addAllowed("CANCEL");
@@ -1254,6 +1963,13 @@ SIPTransaction* YateSIPEngine::forkInvite(SIPMessage* answer, SIPTransaction* tr
     return SIPEngine::forkInvite(answer,trans);
 }
 
+// New dialogs take their CSeq from the master so all in-dialog requests,
+//  made by whichever worker owns the Call-ID, must count from there too
+int YateSIPEngine::getNextCSeq()
+{
+    return m_master ? m_master->getNextCSeq() : SIPEngine::getNextCSeq();
+}
+
 
 bool YateSIPEngine::buildParty(SIPMessage* message)
 {
@@ -1361,7 +2077,8 @@ bool YateSIPEngine::checkUser(const String& username, const String& realm, const
 }
 
 YateSIPEndPoint::YateSIPEndPoint()
-    : Thread("YSIP EndPoint"), m_sock(0), m_engine(0)
+    : Thread("YSIP EndPoint"), m_sock(0), m_engine(0),
+      m_engines(0), m_workers(0), m_count(0), m_tcp(0)
 {
     Debug(&plugin,DebugAll,"YateSIPEndPoint::YateSIPEndPoint() [%p]",this);
 }
@@ -1371,11 +2088,40 @@ YateSIPEndPoint::~YateSIPEndPoint()
     Debug(&plugin,DebugAll,"YateSIPEndPoint::~YateSIPEndPoint() [%p]",this);
     plugin.channels().clear();
     s_lines.clear();
-    if (m_engine) {
-	// send any pending events
-	while (m_engine->process())
-	    ;
-	delete m_engine;
+    // workers and the TCP thread remove themselves from here as they exit
+    m_mutex.lock();
+    for (unsigned int i = 0; m_workers && (i < m_count); i++)
+	if (m_workers[i])
+	    m_workers[i]->cancel();
+    if (m_tcp)
+	m_tcp->cancel();
+    m_mutex.unlock();
+    bool stopped = false;
+    for (int t = 0; t < 200; t++) {
+	m_mutex.lock();
+	stopped = !m_tcp;
+	for (unsigned int i = 0; m_workers && (i < m_count); i++)
+	    stopped = stopped && !m_workers[i];
+	m_mutex.unlock();
+	if (stopped)
+	    break;
+	Thread::msleep(5,false);
+    }
+    if (stopped) {
+	delete[] m_workers;
+	m_workers = 0;
+    }
+    else
+	Debug(&plugin,DebugGoOn,"SIP threads did not stop, leaking engines");
+    if (m_engines && stopped) {
+	for (unsigned int i = 0; i < m_count; i++) {
+	    // send any pending events
+	    while (m_engines[i]->process())
+		;
+	    delete m_engines[i];
+	}
+	delete[] m_engines;
+	m_engines = 0;
 	m_engine = 0;
     }
     if (m_sock) {
@@ -1420,12 +2166,42 @@ bool YateSIPEndPoint::buildParty(SIPMessage* message, const char* host, int port
 	host = m_local;
     if (port <= 0)
 	port = m_port;
+    // the TCP transport clears itself from here when it exits
+    Lock lock(m_mutex);
+    if (m_tcp) {
+	// send over TCP if asked to or if a connection is already open
+	YateTCPConnection* conn = 0;
+	String tmp(message->uri);
+	if (tmp.toLower().find(";transport=tcp") >= 0) {
+	    conn = m_tcp->connect(addr);
+	    if (!conn)
+		return false;
+	}
+	else
+	    conn = m_tcp->find(addr);
+	lock.drop();
+	if (conn) {
+	    YateTCPParty* party = new YateTCPParty(conn,m_port);
+	    conn->deref();
+	    message->setParty(party);
+	    party->deref();
+	    return true;
+	}
+    }
+    lock.drop();
     YateUDPParty* party = new YateUDPParty(m_sock,addr,port,host);
     message->setParty(party);
     party->deref();
     return true;
 }
 
+// Open a TCP connection or reuse one if the transport is running, returns it referenced
+YateTCPConnection* YateSIPEndPoint::tcpConnect(const SocketAddr& addr)
+{
+    Lock lock(m_mutex);
+    return m_tcp ? m_tcp->connect(addr) : 0;
+}
+
 bool YateSIPEndPoint::Init()
 {
     if (m_sock) {
@@ -1483,17 +2259,92 @@ bool YateSIPEndPoint::Init()
     if (addr.host() != "0.0.0.0")
 	m_local = addr.host();
     m_port = addr.port();
-    m_engine = new YateSIPEngine(this);
+    int count = s_cfg.getIntValue("general","workers",1);
+    if (count < 1)
+	count = 1;
+    else if (count > 32)
+	count = 32;
+    m_count = count;
+    m_engines = new YateSIPEngine*[m_count];
+    m_engine = m_engines[0] = new YateSIPEngine(this);
+    for (unsigned int i = 1; i < m_count; i++)
+	m_engines[i] = new YateSIPEngine(this,m_engine);
+    if (m_count > 1) {
+	m_workers = new YateSIPWorker*[m_count];
+	for (unsigned int i = 0; i < m_count; i++)
+	    m_workers[i] = new YateSIPWorker(this,m_engines[i],i);
+	for (unsigned int i = 0; i < m_count; i++) {
+	    if (!(m_workers[i]->Init() && m_workers[i]->startup())) {
+		Debug(&plugin,DebugGoOn,"Unable to start SIP worker %u",i);
+		return false;
+	    }
+	}
+	Debug(&plugin,DebugInfo,"Running SIP transactions in %u worker threads",m_count);
+    }
+    if (s_cfg.getBoolValue("general","tcp",false)) {
+	// listen for TCP on the same address and port as UDP
+	addr.host(s_cfg.getValue("general","addr","0.0.0.0"));
+	addr.port(m_port);
+	m_tcp = new YateTCPTransport(this);
+	if (!(m_tcp->Init(addr) && m_tcp->startup())) {
+	    Debug(&plugin,DebugGoOn,"Unable to start the SIP TCP transport");
+	    delete m_tcp;
+	    m_tcp = 0;
+	}
+    }
     return true;
 }
 
-void YateSIPEndPoint::addMessage(const char* buf, int len, const SocketAddr& addr, int port)
+// FNV-1a hash of a Call-ID, String::hash() keeps in its low bits only the
+//  last characters which are usually the same host in all Call-IDs
+static unsigned int callIdHash(const char* str, unsigned int len)
+{
+    unsigned int h = 2166136261U;
+    for (unsigned int i = 0; i < len; i++)
+	h = (h ^ (unsigned char)str[i]) * 16777619U;
+    return h;
+}
+
+// Pick the engine that owns the dialog of a message by its Call-ID
+YateSIPEngine* YateSIPEndPoint::engine(SIPMessage* message)
+{
+    if ((m_count <= 1) || !message)
+	return m_engine;
+    if (!message->getHeader("Call-ID"))
+	message->complete(m_engine);
+    const String& cid = message->getHeaderValue("Call-ID");
+    return m_engines[callIdHash(cid.c_str(),cid.length()) % m_count];
+}
+
+// Find the worker of a raw message from its Call-ID header
+//  without parsing, the engine is checked again after parsing
+unsigned int YateSIPEndPoint::shard(const char* buf, int len) const
+{
+    String cid;
+    if (!rawHeader(buf,len,"Call-ID",'i',cid))
+	return 0;
+    int sep = cid.find(';');
+    if (sep >= 0) {
+	cid = cid.substr(0,sep);
+	cid.trimBlanks();
+    }
+    return callIdHash(cid.c_str(),cid.length()) % m_count;
+}
+
+void YateSIPEndPoint::addMessage(const char* buf, int len, const SocketAddr& addr, int port,
+    YateTCPConnection* conn)
 {
     SIPMessage* msg = SIPMessage::fromParsing(0,buf,len);
     if (!msg)
 	return;
 
-    if (!msg->isAnswer()) {
+    if (conn && !msg->isAnswer()) {
+	// answers to requests received over TCP go back on the same connection
+	YateTCPParty* party = new YateTCPParty(conn,m_port);
+	msg->setParty(party);
+	party->deref();
+    }
+    else if (!msg->isAnswer()) {
 	URI uri(msg->uri);
 	YateSIPLine* line = plugin.findLine(addr.host(),addr.port(),uri.getUser());
 	const char* host = 0;
@@ -1509,7 +2360,7 @@ void YateSIPEndPoint::addMessage(const char* buf, int len, const SocketAddr& add
 	msg->setParty(party);
 	party->deref();
     }
-    m_engine->addMessage(msg);
+    engine(msg)->addMessage(msg);
     msg->deref();
 }
 
@@ -1555,7 +2406,15 @@ void YateSIPEndPoint::run()
 			    res,raddr.c_str(),buf);
 		}
 		// we got already the buffer and here we start to do "good" stuff
-		addMessage(buf,res,m_addr,m_port);
+		if (m_workers) {
+		    unsigned int idx = shard(buf,res);
+		    // exiting workers clear their slot, hold it while queueing
+		    Lock lock(m_mutex);
+		    if (m_workers[idx])
+			m_workers[idx]->queue(buf,res,m_addr);
+		}
+		else
+		    addMessage(buf,res,m_addr,m_port);
 		//m_engine->addMessage(new YateUDPParty(m_sock,m_addr,m_port),buf,res);
 	    }
 #ifdef DEBUG
@@ -1565,51 +2424,146 @@ void YateSIPEndPoint::run()
 	}
 	else
 	    Thread::check();
-	SIPEvent* e = m_engine->getEvent();
-	if (e)
+	if (m_workers) {
+	    // the workers handle the events, only keep reading
+	    evCount = ok ? 1 : 0;
+	    continue;
+	}
+	if (doEvent(m_engine))
 	    evCount++;
 	else
 	    evCount = 0;
-	// hack: use a loop so we can use break and continue
-	for (; e; m_engine->processEvent(e),e = 0) {
-	    if (!e->getTransaction())
-		continue;
-	    plugin.lock();
-	    GenObject* obj = static_cast<GenObject*>(e->getTransaction()->getUserData());
-	    RefPointer<YateSIPConnection> conn = YOBJECT(YateSIPConnection,obj);
-	    YateSIPLine* line = YOBJECT(YateSIPLine,obj);
-	    YateSIPGenerate* gen = YOBJECT(YateSIPGenerate,obj);
-	    plugin.unlock();
-	    if (conn) {
-		if (conn->process(e)) {
-		    delete e;
-		    break;
-		}
-		else
-		    continue;
-	    }
-	    if (line) {
-		if (line->process(e)) {
-		    delete e;
-		    break;
-		}
-		else
-		    continue;
+    }
+}
+
+// Get and process one event of an engine, return true if there was one
+bool YateSIPEndPoint::doEvent(YateSIPEngine* engine)
+{
+    SIPEvent* e = engine->getEvent();
+    if (!e)
+	return false;
+    // hack: use a loop so we can use break and continue
+    for (; e; engine->processEvent(e),e = 0) {
+	if (!e->getTransaction())
+	    continue;
+	plugin.lock();
+	GenObject* obj = static_cast<GenObject*>(e->getTransaction()->getUserData());
+	RefPointer<YateSIPConnection> conn = YOBJECT(YateSIPConnection,obj);
+	YateSIPLine* line = YOBJECT(YateSIPLine,obj);
+	YateSIPGenerate* gen = YOBJECT(YateSIPGenerate,obj);
+	plugin.unlock();
+	if (conn) {
+	    if (conn->process(e)) {
+		delete e;
+		break;
 	    }
-	    if (gen) {
-		if (gen->process(e)) {
-		    delete e;
-		    break;
-		}
-		else
-		    continue;
+	    else
+		continue;
+	}
+	if (line) {
+	    if (line->process(e)) {
+		delete e;
+		break;
 	    }
-	    if ((e->getState() == SIPTransaction::Trying) &&
-		!e->isOutgoing() && incoming(e,e->getTransaction())) {
+	    else
+		continue;
+	}
+	if (gen) {
+	    if (gen->process(e)) {
 		delete e;
 		break;
 	    }
+	    else
+		continue;
+	}
+	if ((e->getState() == SIPTransaction::Trying) &&
+	    !e->isOutgoing() && incoming(e,e->getTransaction())) {
+	    delete e;
+	    break;
+	}
+    }
+    return true;
+}
+
+
+YateSIPWorker::YateSIPWorker(YateSIPEndPoint* ep, YateSIPEngine* engine, unsigned int index)
+    : Thread("YSIP Worker"), m_ep(ep), m_engine(engine), m_index(index),
+      m_last(&m_packets), m_queued(0)
+{
+    DDebug(&plugin,DebugAll,"YateSIPWorker::YateSIPWorker(%p,%u) [%p]",engine,index,this);
+}
+
+YateSIPWorker::~YateSIPWorker()
+{
+    DDebug(&plugin,DebugAll,"YateSIPWorker::~YateSIPWorker() %u [%p]",m_index,this);
+    Lock lock(m_ep->m_mutex);
+    if (m_ep->m_workers)
+	m_ep->m_workers[m_index] = 0;
+}
+
+bool YateSIPWorker::Init()
+{
+    if (!(Socket::createPair(m_wakeRead,m_wakeWrite) &&
+	m_wakeRead.setBlocking(false) && m_wakeWrite.setBlocking(false))) {
+	Debug(&plugin,DebugGoOn,"Unable to create wakeup sockets for worker %u",m_index);
+	return false;
+    }
+    return true;
+}
+
+// Called from the reader thread, wake up the worker if it was idle
+void YateSIPWorker::queue(const char* buf, int len, const SocketAddr& addr)
+{
+    m_mutex.lock();
+    if (m_queued >= MAX_QUEUED) {
+	m_mutex.unlock();
+	Debug(&plugin,DebugMild,"Worker %u has %d queued messages, dropping one",m_index,MAX_QUEUED);
+	return;
+    }
+    bool wake = !m_queued;
+    m_last = m_last->append(new YateSIPPacket(buf,len,addr));
+    m_queued++;
+    m_mutex.unlock();
+    if (wake)
+	m_wakeWrite.writeData("",1);
+}
+
+YateSIPPacket* YateSIPWorker::dequeue()
+{
+    Lock lock(m_mutex);
+    YateSIPPacket* pkt = static_cast<YateSIPPacket*>(m_packets.remove(false));
+    if (!pkt)
+	return 0;
+    m_queued--;
+    // removing the head only deletes the tail if one packet is left
+    if (!m_packets.next())
+	m_last = &m_packets;
+    return pkt;
+}
+
+void YateSIPWorker::run()
+{
+    struct timeval tv;
+    char buf[64];
+    bool busy = false;
+    for (;;) {
+	if (!busy) {
+	    // wait up to 5000 microseconds for the reader to queue messages
+	    tv.tv_sec = 0;
+	    tv.tv_usec = 5000;
+	    bool ok = false;
+	    if (m_wakeRead.select(&ok,0,0,&tv) && ok)
+		while (m_wakeRead.readData(buf,sizeof(buf)) > 0)
+		    ;
+	}
+	Thread::check();
+	// alternate messages and events so a flood does not starve either
+	YateSIPPacket* pkt = dequeue();
+	if (pkt) {
+	    m_ep->addMessage(pkt->c_str(),pkt->length(),pkt->m_addr,m_ep->port());
+	    pkt->destruct();
 	}
+	busy = m_ep->doEvent(m_engine) || pkt;
     }
 }
 
@@ -1916,7 +2870,7 @@ void YateSIPRefer::run()
     // Send response
     String s(ok ? "SIP/2.0 200 OK\r\n" : "SIP/2.0 603 Declined\r\n");
     m_sipNotify->setBody(new MimeStringBody("message/sipfrag;version=2.0",s));
-    plugin.ep()->engine()->addMessage(m_sipNotify);
+    plugin.ep()->engine(m_sipNotify)->addMessage(m_sipNotify);
     // Notify termination to transferor
     plugin.lock();
     YateSIPConnection* conn = static_cast<YateSIPConnection*>(plugin.find(m_transferorID));
@@ -2196,7 +3150,7 @@ YateSIPConnection::YateSIPConnection(Message& msg, const String& uri, const char
     if (!sdp)
 	sdp = createRtpSDP(m_host,msg);
     m->setBody(buildSIPBody(msg,sdp));
-    m_tr = plugin.ep()->engine()->addMessage(m);
+    m_tr = plugin.ep()->engine(m)->addMessage(m);
     if (m_tr) {
 	m_tr->ref();
 	m_callid = m_tr->getCallID();
@@ -2234,7 +3188,7 @@ void YateSIPConnection::setMedia(ObjList* media)
 	for (; l; l = l->skipNext()) {
 	    NetMedia* m = static_cast<NetMedia*>(l->get());
 	    // preserve data endpoints if media didn't change
-	    if (m->sameAs(static_cast<NetMedia*>((*media)[*m])))
+	    if (media && m->sameAs(static_cast<NetMedia*>((*media)[*m])))
 		continue;
 	    clearEndpoint(*m);
 	}
@@ -2331,7 +3285,7 @@ void YateSIPConnection::hangup()
 			hl->setParam("text","\"Call completed elsewhere\"");
 			m->addHeader(hl);
 		    }
-		    plugin.ep()->engine()->addMessage(m);
+		    plugin.ep()->engine(m)->addMessage(m);
 		}
 		m->deref();
 	    }
@@ -2352,7 +3306,7 @@ void YateSIPConnection::hangup()
 		hl->setParam("text","\"" + m_reason + "\"");
 		m->addHeader(hl);
 	    }
-	    plugin.ep()->engine()->addMessage(m);
+	    plugin.ep()->engine(m)->addMessage(m);
 	    m->deref();
 	}
     }
@@ -2432,7 +3386,7 @@ bool YateSIPConnection::emitPRACK(const SIPMessage* msg)
     tmp = *rs;
     tmp << " " << *cs;
     m->addHeader("RAck",tmp);
-    plugin.ep()->engine()->addMessage(m);
+    plugin.ep()->engine(m)->addMessage(m);
     m->deref();
     return true;
 }
@@ -3530,7 +4484,7 @@ bool YateSIPConnection::msgTone(Message& msg, const char* tone)
 			String tmp;
 			tmp << "Signal=" << i << "\r\n";
 			m->setBody(new MimeStringBody("application/dtmf-relay",tmp));
-			plugin.ep()->engine()->addMessage(m);
+			plugin.ep()->engine(m)->addMessage(m);
 			m->deref();
 		    }
 		    break;
@@ -3560,7 +4514,7 @@ bool YateSIPConnection::msgText(Message& msg, const char* text)
     if (m) {
 	copySipHeaders(*m,msg);
 	m->setBody(new MimeStringBody("text/plain",text));
-	plugin.ep()->engine()->addMessage(m);
+	plugin.ep()->engine(m)->addMessage(m);
 	m->deref();
 	return true;
     }
@@ -3787,7 +4741,7 @@ bool YateSIPConnection::startClientReInvite(Message& msg)
     if (s_privacy)
 	copyPrivacy(*m,msg);
     m->setBody(sdp);
-    m_tr2 = plugin.ep()->engine()->addMessage(m);
+    m_tr2 = plugin.ep()->engine(m)->addMessage(m);
     if (m_tr2) {
 	m_tr2->ref();
 	m_tr2->setUserData(this);
@@ -4085,7 +5039,7 @@ void YateSIPLine::login()
     }
     DDebug(&plugin,DebugInfo,"YateSIPLine '%s' emiting %p [%p]",
 	c_str(),m,this);
-    m_tr = plugin.ep()->engine()->addMessage(m);
+    m_tr = plugin.ep()->engine(m)->addMessage(m);
     if (m_tr) {
 	m_tr->ref();
 	m_tr->setUserData(this);
@@ -4107,7 +5061,7 @@ void YateSIPLine::logout()
 	m_partyPort = 0;
 	if (!m)
 	    return;
-	plugin.ep()->engine()->addMessage(m);
+	plugin.ep()->engine(m)->addMessage(m);
 	m->deref();
     }
 }
@@ -4293,7 +5247,7 @@ bool YateSIPLine::update(const Message& msg)
 YateSIPGenerate::YateSIPGenerate(SIPMessage* m)
     : m_tr(0), m_code(0)
 {
-    m_tr = plugin.ep()->engine()->addMessage(m);
+    m_tr = plugin.ep()->engine(m)->addMessage(m);
     if (m_tr) {
 	m_tr->ref();
 	m_tr->setUserData(this);
@@ -4389,7 +5343,7 @@ bool SipHandler::received(Message &msg)
     sip->complete(plugin.ep()->engine(),msg.getValue("user"),msg.getValue("domain"));
     if (!msg.getBoolValue("wait")) {
 	// no answer requested - start transaction and forget
-	plugin.ep()->engine()->addMessage(sip);
+	plugin.ep()->engine(sip)->addMessage(sip);
 	return true;
     }
     YateSIPGenerate gen(sip);
@@ -4550,6 +5504,7 @@ void SIPDriver::initialize()
     s_realm = s_cfg.getValue("general","realm","Yate");
     s_maxForwards = s_cfg.getIntValue("general","maxforwards",20);
     s_floodEvents = s_cfg.getIntValue("general","floodevents",20);
+    s_tcpIdle = s_cfg.getIntValue("general","tcp_idle",600);
     s_privacy = s_cfg.getBoolValue("general","privacy");
     s_auto_nat = s_cfg.getBoolValue("general","nat",true);
     s_progress = s_cfg.getBoolValue("general","progress",false);
@@ -3286,6 +3286,7 @@ protected:
 };
 
 class MutexPrivate;
+class SemaphorePrivate;
 class ThreadPrivate;
 
 /**
@@ -3381,6 +3382,55 @@ private:
     MutexPrivate* m_private;
 };
 
+/**
+ * A semaphore counts signals passed between threads. A thread waiting for
+ *  a signal is blocked until another thread posts one or the time runs out
+ * @short Semaphore support
+ */
+class YATE_API Semaphore
+{
+public:
+    /**
+     * Construct a new semaphore with no pending signal
+     * @param maxcount Maximum number of pending signals, 1 makes a binary semaphore
+     */
+    Semaphore(unsigned int maxcount = 1);
+
+    /**
+     * Destroy the semaphore
+     */
+    ~Semaphore();
+
+    /**
+     * Wait for a signal and take it
+     * @param maxwait Time in microseconds to wait for a signal, -1 wait forever
+     * @return True if a signal was taken, false on timeout or failure
+     */
+    bool lock(long maxwait = -1);
+
+    /**
+     * Post a signal, does never wait. A signal is dropped if the maximum
+     *  count of pending signals was already reached
+     * @return True if the signal was posted or dropped, false on failure
+     */
+    bool unlock();
+
+    /**
+     * Get the maximum number of pending signals
+     * @return Maximum count of the semaphore
+     */
+    unsigned int maxcount() const;
+
+private:
+    SemaphorePrivate* m_private;
+
+    /** No copy constructor */
+    Semaphore(const Semaphore&);
+
+    /** No assignment operator */
+    Semaphore& operator=(const Semaphore&);
+};
+
 /**
  * A lock is a stack allocated (automatic) object that locks a mutex on
  *  creation and unlocks it on destruction - typically when exiting a block
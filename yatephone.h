@@ -338,6 +338,15 @@ public:
     virtual bool control(NamedList& params)
 	{ return false; }
 
+    /**
+     * Notification that this consumer was attached to or detached from a
+     *  source, or that a consumer was attached to or detached from this source.
+     * It is called with the mutex of the source locked
+     * @param added True if attached, false if detached
+     */
+    virtual void attached(bool added)
+	{ }
+
     /**
      * Get the internal representation of an invalid or unknown timestamp
      * @return Invalid timestamp - unsigned long conversion of -1
@@ -354,6 +363,9 @@ class DataSource;
 class DataTranslator;
 class TranslatorFactory;
 class ThreadedSourcePrivate;
+class MediaTicker;
+class DataFanout;
+class FFTTables;
 
 /**
  * A data consumer
@@ -421,6 +433,24 @@ protected:
      */
     virtual bool synchronize(DataSource* source);
 
+    /**
+     * Adjust the timestamp of data from a source by the offset computed when
+     *  the consumer was synchronized with it. Data from Forward() is adjusted
+     *  already, a consumer that gets data directly must call this first
+     * @param tStamp Timestamp of the data in the source, adjusted on return
+     * @param source Data source the data comes from
+     * @return True to consume the data, false if the source is not the active one
+     */
+    bool adjustStamp(unsigned long& tStamp, const DataSource* source) const;
+
+    /**
+     * Remember the position of consumed data, used for synchronizing later
+     * @param tStamp Adjusted timestamp of the data that was consumed
+     * @param tsTime Time when the data arrived
+     */
+    inline void consumed(unsigned long tStamp, u_int64_t tsTime = Time::now())
+	{ m_timestamp = tStamp; m_lastTsTime = tsTime; }
+
 private:
     void Consume(const DataBlock& data, unsigned long tStamp, DataSource* source);
     DataSource* m_source;
@@ -443,7 +473,8 @@ public:
      * @param format Name of the data format, default "slin" (Signed Linear)
      */
     inline DataSource(const char* format = "slin")
-	: DataNode(format), m_nextStamp(invalidStamp()), m_translator(0) { }
+	: DataNode(format), m_nextStamp(invalidStamp()), m_translator(0),
+	  m_fanout(0) { }
 
     /**
      * Source's destruct notification - detaches all consumers
@@ -464,6 +495,15 @@ public:
      */
     void Forward(const DataBlock& data, unsigned long tStamp = invalidStamp());
 
+    /**
+     * Advance the timestamps for data sent directly to a consumer instead
+     *  of being forwarded, like a relay of packets does
+     * @param len Length of the data in bytes
+     * @param tStamp Timestamp of data, invalid to use the next expected one
+     * @return Timestamp of the data in the source
+     */
+    unsigned long advance(unsigned int len, unsigned long tStamp = invalidStamp());
+
     /**
      * Attach a data consumer
      * @param consumer Data consumer to attach
@@ -511,6 +551,12 @@ public:
     inline unsigned long nextStamp() const
 	{ return m_nextStamp; }
 
+    /**
+     * Get the number of data packets that could not be forwarded to consumers
+     * @return Count of packets dropped by all data sources
+     */
+    static unsigned int dropped();
+
 protected:
     unsigned long m_nextStamp;
     DataTranslator* m_translator;
@@ -520,6 +566,10 @@ private:
     inline void setTranslator(DataTranslator* translator)
 	{ m_translator = translator; }
     bool detachInternal(DataConsumer* consumer);
+    unsigned long advanceInternal(unsigned int len, unsigned long tStamp);
+    void publish();
+    DataFanout* m_fanout;
+    Mutex m_fanoutMutex;
 };
 
 /**
@@ -528,6 +578,7 @@ private:
 class YATE_API ThreadedSource : public DataSource
 {
     friend class ThreadedSourcePrivate;
+    friend class MediaTicker;
 public:
     /**
      * The destruction notification, stops the thread
@@ -543,7 +594,19 @@ public:
     bool start(const char* name = "ThreadedSource", Thread::Priority prio = Thread::Normal);
 
     /**
-     * Stops and destroys the worker thread if running
+     * Starts periodic processing driven by one of the engine's shared media
+     *  clock threads instead of a private worker thread. The tick() method
+     *  is called once every period, late ticks are caught up in a burst.
+     * If the shared clock is disabled a private thread calls tick() instead.
+     * @param period Interval between ticks in microseconds, usually one frame
+     * @param name Static name of the thread used if falling back to a private one
+     * @return True if started, false if an error occured
+     */
+    bool startClock(unsigned int period = 20000, const char* name = "ThreadedSource");
+
+    /**
+     * Stops and destroys the worker thread if running, removes the source
+     *  from the media clock if it was started with startClock()
      */
     void stop();
 
@@ -554,11 +617,25 @@ public:
     Thread* thread() const;
 
     /**
-     * Check if the data thread is running
+     * Check if the data thread is running or the source is clocked
      * @return True if the data thread was started and is running
      */
     bool running() const;
 
+    /**
+     * Check if the source is paced by the shared media clock
+     * @return True if the source is scheduled on a media clock thread
+     */
+    inline bool clocked() const
+	{ return m_ticker != 0; }
+
+    /**
+     * Get the tick period of a source paced by tick()
+     * @return Interval between two calls of tick() in microseconds
+     */
+    inline unsigned int period() const
+	{ return m_period; }
+
     /**
      * Get the current status of the asynchronous deletion flag
      */
@@ -571,7 +648,7 @@ protected:
      * @param format Name of the data format, default "slin" (Signed Linear)
      */
     inline ThreadedSource(const char* format = "slin")
-	: DataSource(format), m_thread(0), m_asyncDelete(false)
+	: DataSource(format), m_thread(0), m_ticker(0), m_period(20000), m_asyncDelete(false)
 	{ }
 
     /**
@@ -582,15 +659,24 @@ protected:
 	{ m_asyncDelete = async; }
 
     /**
-     * Clear the worker thread pointer
+     * Clear the worker thread and media clock pointers
      */
     inline void clearThread()
-	{ m_thread = 0; }
+	{ m_thread = 0; m_ticker = 0; }
+
+    /**
+     * The worker method. You have to reimplement it as you need unless the
+     *  source is driven by tick(). The default calls tick() every period()
+     */
+    virtual void run();
 
     /**
-     * The worker method. You have to reimplement it as you need
+     * The periodic worker of a clock paced source. It is called from a
+     *  thread shared with many other sources so it must never block.
+     * @param when Time in microseconds at which this tick was due
+     * @return True to be called again after one period, false to stop
      */
-    virtual void run() = 0;
+    virtual bool tick(u_int64_t when);
 
     /**
      * The cleanup after thread method, deletes the source if already
@@ -607,6 +693,8 @@ protected:
 
 private:
     ThreadedSourcePrivate* m_thread;
+    MediaTicker* m_ticker;
+    unsigned int m_period;
     bool m_asyncDelete;
 };
 
@@ -851,6 +939,211 @@ public:
     virtual const FormatInfo* intermediate() const;
 };
 
+/**
+ * A fast Fourier transform of real signals with a power of 2 length.
+ * Twiddle factors and bit reversal tables are computed once for each length
+ *  and shared by all the transforms of that length. Each object holds its
+ *  own work buffers so it must be used by only one thread at a time.
+ * @short Real input Fast Fourier Transform
+ */
+class YATE_API RealFFT : public GenObject
+{
+public:
+    /**
+     * Constructor
+     * @param length Number of real samples to transform, must be a power of 2
+     *  and at least 4, the object is invalid otherwise
+     */
+    RealFFT(unsigned int length);
+
+    /**
+     * Destructor, releases the shared tables
+     */
+    virtual ~RealFFT();
+
+    /**
+     * Check if the transform was successfully set up
+     * @return True if the length was acceptable
+     */
+    inline bool valid() const
+	{ return m_tables != 0; }
+
+    /**
+     * Get the number of real samples transformed at once
+     * @return Length of the input buffer
+     */
+    inline unsigned int length() const
+	{ return m_length; }
+
+    /**
+     * Get the number of frequency bins produced, the DC to Nyquist range
+     * @return Half the length plus one
+     */
+    inline unsigned int bins() const
+	{ return (m_length >> 1) + 1; }
+
+    /**
+     * Compute the complex spectrum of a block of real samples
+     * @param input Buffer of length() samples
+     * @param real Buffer of bins() values receiving the real parts
+     * @param imag Buffer of bins() values receiving the imaginary parts
+     * @return True if the transform was computed
+     */
+    bool transform(const float* input, float* real, float* imag);
+
+    /**
+     * Compute the magnitude spectrum of a block of real samples, scaled so a
+     *  sine wave of amplitude A gives a peak of A in its bin
+     * @param input Buffer of length() samples
+     * @param output Buffer of bins() values receiving the magnitudes
+     * @return True if the transform was computed
+     */
+    bool magnitude(const float* input, float* output);
+
+private:
+    unsigned int m_length;
+    FFTTables* m_tables;
+    float* m_work;
+};
+
+/**
+ * A block of samples whose magnitude spectrum is computed asynchronously.
+ * Jobs of all the users are collected and processed in batches by a thread
+ *  shared in the engine instead of each user running a thread of its own.
+ * @short Asynchronous spectrum computation
+ */
+class YATE_API SpectrumJob : public RefObject
+{
+    friend class SpectrumWorker;
+public:
+    /**
+     * Window functions applied to the samples before the transform
+     */
+    enum Window {
+	Rectangle = 0,
+	Triangle,
+	Hanning,
+	Hamming,
+	Blackman,
+	FlatTop
+    };
+
+    /**
+     * Constructor
+     * @param length Number of samples in a block, must be a power of 2
+     * @param window Window function to apply to each block
+     */
+    SpectrumJob(unsigned int length, Window window = Rectangle);
+
+    /**
+     * Destructor
+     */
+    virtual ~SpectrumJob();
+
+    /**
+     * Check if the job can be used
+     * @return True if the length was acceptable
+     */
+    inline bool valid() const
+	{ return m_fft.valid(); }
+
+    /**
+     * Get the number of samples in a block
+     * @return Number of samples submitted at once
+     */
+    inline unsigned int samples() const
+	{ return m_fft.length(); }
+
+    /**
+     * Get the number of useful spectrum bins, DC excluded Nyquist
+     * @return Half the number of samples
+     */
+    inline unsigned int length() const
+	{ return m_fft.length() >> 1; }
+
+    /**
+     * Check if a block is waiting or being processed
+     * @return True if submit() would fail right now
+     */
+    inline bool busy() const
+	{ return m_busy; }
+
+    /**
+     * Check if a spectrum was computed and is not being updated
+     * @return True if the values returned by at() are valid
+     */
+    inline bool ready() const
+	{ return m_ready; }
+
+    /**
+     * Get the magnitude in one frequency bin of the last computed spectrum
+     * @param index Index of the bin, zero is the DC component
+     * @return Magnitude in the bin or zero if not available
+     */
+    float at(int index) const;
+
+    /**
+     * Retrieve the magnitude in one frequency bin
+     * @param index Index of the bin, zero is the DC component
+     * @return Magnitude in the bin or zero if not available
+     */
+    inline float operator[](int index) const
+	{ return at(index); }
+
+    /**
+     * Copy a block of samples and queue it for processing
+     * @param samp Pointer to samples() signed linear samples
+     * @return True if queued, false if the previous block is still busy
+     */
+    bool submit(const short* samp);
+
+    /**
+     * Remove the job from the queue, wait for it if it's being processed.
+     * No computed() notification is received after this method returns.
+     */
+    void cancel();
+
+    /**
+     * Get the name of the window function
+     * @return Name of the window as in windows() table
+     */
+    inline const char* windowName() const
+	{ return lookup(m_window,windows()); }
+
+    /**
+     * Get the table of window function names
+     * @return Pointer to a dictionary of window names and values
+     */
+    static const TokenDict* windows();
+
+    /**
+     * Get the total number of spectra computed by the engine
+     * @return Count of processed jobs since startup
+     */
+    static unsigned int computedCount();
+
+protected:
+    /**
+     * Notification called from the spectrum thread after a spectrum was
+     *  computed. The job may be resubmitted from inside this method.
+     */
+    virtual void computed();
+
+private:
+    RealFFT m_fft;
+    int m_window;
+    float* m_coefs;
+    float* m_input;
+    float* m_output;
+    volatile bool m_busy;
+    volatile bool m_ready;
+    bool m_queued;
+    // held by the spectrum thread while processing and notifying
+    Mutex m_runMutex;
+    // protects the computed spectrum
+    mutable Mutex m_mutex;
+};
+
 /**
  * The DataEndpoint holds an endpoint capable of performing unidirectional
  * or bidirectional data transfers